@@ -1,5 +1,8 @@
 section .text
 global aes_encrypt_block
+global aes_expand_key
+global aes_encrypt_blocks
+global aes_encrypt_lanes
 expand_key:
 	vpshufd xmm2, xmm2, 0xff
 	vpslldq xmm3, xmm1, 4
@@ -50,3 +53,279 @@ aes_encrypt_block:
 	vmovdqu [rbx], xmm0
 	pop rbx
 	ret
+
+; expand the key in rdi into the 11 round keys at rsi
+aes_expand_key:
+	vmovdqu xmm1, [rdi]
+	vmovdqu [rsi], xmm1
+	vaeskeygenassist xmm2, xmm1, 0x01
+	call expand_key
+	vmovdqu [rsi + 16], xmm1
+	vaeskeygenassist xmm2, xmm1, 0x02
+	call expand_key
+	vmovdqu [rsi + 32], xmm1
+	vaeskeygenassist xmm2, xmm1, 0x04
+	call expand_key
+	vmovdqu [rsi + 48], xmm1
+	vaeskeygenassist xmm2, xmm1, 0x08
+	call expand_key
+	vmovdqu [rsi + 64], xmm1
+	vaeskeygenassist xmm2, xmm1, 0x10
+	call expand_key
+	vmovdqu [rsi + 80], xmm1
+	vaeskeygenassist xmm2, xmm1, 0x20
+	call expand_key
+	vmovdqu [rsi + 96], xmm1
+	vaeskeygenassist xmm2, xmm1, 0x40
+	call expand_key
+	vmovdqu [rsi + 112], xmm1
+	vaeskeygenassist xmm2, xmm1, 0x80
+	call expand_key
+	vmovdqu [rsi + 128], xmm1
+	vaeskeygenassist xmm2, xmm1, 0x1b
+	call expand_key
+	vmovdqu [rsi + 144], xmm1
+	vaeskeygenassist xmm2, xmm1, 0x36
+	call expand_key
+	vmovdqu [rsi + 160], xmm1
+	ret
+
+; encrypt rsi blocks at rdi in place with the round keys at rdx, 8 blocks at a time
+aes_encrypt_blocks:
+.loop8:
+	cmp rsi, 8
+	jb .tail
+	vmovdqu xmm15, [rdx]
+	vmovdqu xmm0, [rdi + 0]
+	vmovdqu xmm1, [rdi + 16]
+	vmovdqu xmm2, [rdi + 32]
+	vmovdqu xmm3, [rdi + 48]
+	vmovdqu xmm4, [rdi + 64]
+	vmovdqu xmm5, [rdi + 80]
+	vmovdqu xmm6, [rdi + 96]
+	vmovdqu xmm7, [rdi + 112]
+	vpxor xmm0, xmm0, xmm15
+	vpxor xmm1, xmm1, xmm15
+	vpxor xmm2, xmm2, xmm15
+	vpxor xmm3, xmm3, xmm15
+	vpxor xmm4, xmm4, xmm15
+	vpxor xmm5, xmm5, xmm15
+	vpxor xmm6, xmm6, xmm15
+	vpxor xmm7, xmm7, xmm15
+	vmovdqu xmm15, [rdx + 16]
+	vaesenc xmm0, xmm0, xmm15
+	vaesenc xmm1, xmm1, xmm15
+	vaesenc xmm2, xmm2, xmm15
+	vaesenc xmm3, xmm3, xmm15
+	vaesenc xmm4, xmm4, xmm15
+	vaesenc xmm5, xmm5, xmm15
+	vaesenc xmm6, xmm6, xmm15
+	vaesenc xmm7, xmm7, xmm15
+	vmovdqu xmm15, [rdx + 32]
+	vaesenc xmm0, xmm0, xmm15
+	vaesenc xmm1, xmm1, xmm15
+	vaesenc xmm2, xmm2, xmm15
+	vaesenc xmm3, xmm3, xmm15
+	vaesenc xmm4, xmm4, xmm15
+	vaesenc xmm5, xmm5, xmm15
+	vaesenc xmm6, xmm6, xmm15
+	vaesenc xmm7, xmm7, xmm15
+	vmovdqu xmm15, [rdx + 48]
+	vaesenc xmm0, xmm0, xmm15
+	vaesenc xmm1, xmm1, xmm15
+	vaesenc xmm2, xmm2, xmm15
+	vaesenc xmm3, xmm3, xmm15
+	vaesenc xmm4, xmm4, xmm15
+	vaesenc xmm5, xmm5, xmm15
+	vaesenc xmm6, xmm6, xmm15
+	vaesenc xmm7, xmm7, xmm15
+	vmovdqu xmm15, [rdx + 64]
+	vaesenc xmm0, xmm0, xmm15
+	vaesenc xmm1, xmm1, xmm15
+	vaesenc xmm2, xmm2, xmm15
+	vaesenc xmm3, xmm3, xmm15
+	vaesenc xmm4, xmm4, xmm15
+	vaesenc xmm5, xmm5, xmm15
+	vaesenc xmm6, xmm6, xmm15
+	vaesenc xmm7, xmm7, xmm15
+	vmovdqu xmm15, [rdx + 80]
+	vaesenc xmm0, xmm0, xmm15
+	vaesenc xmm1, xmm1, xmm15
+	vaesenc xmm2, xmm2, xmm15
+	vaesenc xmm3, xmm3, xmm15
+	vaesenc xmm4, xmm4, xmm15
+	vaesenc xmm5, xmm5, xmm15
+	vaesenc xmm6, xmm6, xmm15
+	vaesenc xmm7, xmm7, xmm15
+	vmovdqu xmm15, [rdx + 96]
+	vaesenc xmm0, xmm0, xmm15
+	vaesenc xmm1, xmm1, xmm15
+	vaesenc xmm2, xmm2, xmm15
+	vaesenc xmm3, xmm3, xmm15
+	vaesenc xmm4, xmm4, xmm15
+	vaesenc xmm5, xmm5, xmm15
+	vaesenc xmm6, xmm6, xmm15
+	vaesenc xmm7, xmm7, xmm15
+	vmovdqu xmm15, [rdx + 112]
+	vaesenc xmm0, xmm0, xmm15
+	vaesenc xmm1, xmm1, xmm15
+	vaesenc xmm2, xmm2, xmm15
+	vaesenc xmm3, xmm3, xmm15
+	vaesenc xmm4, xmm4, xmm15
+	vaesenc xmm5, xmm5, xmm15
+	vaesenc xmm6, xmm6, xmm15
+	vaesenc xmm7, xmm7, xmm15
+	vmovdqu xmm15, [rdx + 128]
+	vaesenc xmm0, xmm0, xmm15
+	vaesenc xmm1, xmm1, xmm15
+	vaesenc xmm2, xmm2, xmm15
+	vaesenc xmm3, xmm3, xmm15
+	vaesenc xmm4, xmm4, xmm15
+	vaesenc xmm5, xmm5, xmm15
+	vaesenc xmm6, xmm6, xmm15
+	vaesenc xmm7, xmm7, xmm15
+	vmovdqu xmm15, [rdx + 144]
+	vaesenc xmm0, xmm0, xmm15
+	vaesenc xmm1, xmm1, xmm15
+	vaesenc xmm2, xmm2, xmm15
+	vaesenc xmm3, xmm3, xmm15
+	vaesenc xmm4, xmm4, xmm15
+	vaesenc xmm5, xmm5, xmm15
+	vaesenc xmm6, xmm6, xmm15
+	vaesenc xmm7, xmm7, xmm15
+	vmovdqu xmm15, [rdx + 160]
+	vaesenclast xmm0, xmm0, xmm15
+	vaesenclast xmm1, xmm1, xmm15
+	vaesenclast xmm2, xmm2, xmm15
+	vaesenclast xmm3, xmm3, xmm15
+	vaesenclast xmm4, xmm4, xmm15
+	vaesenclast xmm5, xmm5, xmm15
+	vaesenclast xmm6, xmm6, xmm15
+	vaesenclast xmm7, xmm7, xmm15
+	vmovdqu [rdi + 0], xmm0
+	vmovdqu [rdi + 16], xmm1
+	vmovdqu [rdi + 32], xmm2
+	vmovdqu [rdi + 48], xmm3
+	vmovdqu [rdi + 64], xmm4
+	vmovdqu [rdi + 80], xmm5
+	vmovdqu [rdi + 96], xmm6
+	vmovdqu [rdi + 112], xmm7
+	add rdi, 128
+	sub rsi, 8
+	jmp .loop8
+.tail:
+	test rsi, rsi
+	jz .done
+	vmovdqu xmm0, [rdi]
+	vpxor xmm0, xmm0, [rdx]
+	vaesenc xmm0, xmm0, [rdx + 16]
+	vaesenc xmm0, xmm0, [rdx + 32]
+	vaesenc xmm0, xmm0, [rdx + 48]
+	vaesenc xmm0, xmm0, [rdx + 64]
+	vaesenc xmm0, xmm0, [rdx + 80]
+	vaesenc xmm0, xmm0, [rdx + 96]
+	vaesenc xmm0, xmm0, [rdx + 112]
+	vaesenc xmm0, xmm0, [rdx + 128]
+	vaesenc xmm0, xmm0, [rdx + 144]
+	vaesenclast xmm0, xmm0, [rdx + 160]
+	vmovdqu [rdi], xmm0
+	add rdi, 16
+	dec rsi
+	jmp .tail
+.done:
+	ret
+
+; encrypt rsi groups of 4 blocks at rdi in place, block i of each group with the round keys of lane i, rdx holds the
+; round keys of the lanes interleaved (round 0 of lanes 0 to 3, then round 1...), 4 groups at a time (AVX-512 and VAES)
+aes_encrypt_lanes:
+	vmovdqu64 zmm16, [rdx]
+	vmovdqu64 zmm17, [rdx + 64]
+	vmovdqu64 zmm18, [rdx + 128]
+	vmovdqu64 zmm19, [rdx + 192]
+	vmovdqu64 zmm20, [rdx + 256]
+	vmovdqu64 zmm21, [rdx + 320]
+	vmovdqu64 zmm22, [rdx + 384]
+	vmovdqu64 zmm23, [rdx + 448]
+	vmovdqu64 zmm24, [rdx + 512]
+	vmovdqu64 zmm25, [rdx + 576]
+	vmovdqu64 zmm26, [rdx + 640]
+.loop4:
+	cmp rsi, 4
+	jb .tail
+	vmovdqu64 zmm0, [rdi + 0]
+	vmovdqu64 zmm1, [rdi + 64]
+	vmovdqu64 zmm2, [rdi + 128]
+	vmovdqu64 zmm3, [rdi + 192]
+	vpxorq zmm0, zmm0, zmm16
+	vpxorq zmm1, zmm1, zmm16
+	vpxorq zmm2, zmm2, zmm16
+	vpxorq zmm3, zmm3, zmm16
+	vaesenc zmm0, zmm0, zmm17
+	vaesenc zmm1, zmm1, zmm17
+	vaesenc zmm2, zmm2, zmm17
+	vaesenc zmm3, zmm3, zmm17
+	vaesenc zmm0, zmm0, zmm18
+	vaesenc zmm1, zmm1, zmm18
+	vaesenc zmm2, zmm2, zmm18
+	vaesenc zmm3, zmm3, zmm18
+	vaesenc zmm0, zmm0, zmm19
+	vaesenc zmm1, zmm1, zmm19
+	vaesenc zmm2, zmm2, zmm19
+	vaesenc zmm3, zmm3, zmm19
+	vaesenc zmm0, zmm0, zmm20
+	vaesenc zmm1, zmm1, zmm20
+	vaesenc zmm2, zmm2, zmm20
+	vaesenc zmm3, zmm3, zmm20
+	vaesenc zmm0, zmm0, zmm21
+	vaesenc zmm1, zmm1, zmm21
+	vaesenc zmm2, zmm2, zmm21
+	vaesenc zmm3, zmm3, zmm21
+	vaesenc zmm0, zmm0, zmm22
+	vaesenc zmm1, zmm1, zmm22
+	vaesenc zmm2, zmm2, zmm22
+	vaesenc zmm3, zmm3, zmm22
+	vaesenc zmm0, zmm0, zmm23
+	vaesenc zmm1, zmm1, zmm23
+	vaesenc zmm2, zmm2, zmm23
+	vaesenc zmm3, zmm3, zmm23
+	vaesenc zmm0, zmm0, zmm24
+	vaesenc zmm1, zmm1, zmm24
+	vaesenc zmm2, zmm2, zmm24
+	vaesenc zmm3, zmm3, zmm24
+	vaesenc zmm0, zmm0, zmm25
+	vaesenc zmm1, zmm1, zmm25
+	vaesenc zmm2, zmm2, zmm25
+	vaesenc zmm3, zmm3, zmm25
+	vaesenclast zmm0, zmm0, zmm26
+	vaesenclast zmm1, zmm1, zmm26
+	vaesenclast zmm2, zmm2, zmm26
+	vaesenclast zmm3, zmm3, zmm26
+	vmovdqu64 [rdi + 0], zmm0
+	vmovdqu64 [rdi + 64], zmm1
+	vmovdqu64 [rdi + 128], zmm2
+	vmovdqu64 [rdi + 192], zmm3
+	add rdi, 256
+	sub rsi, 4
+	jmp .loop4
+.tail:
+	test rsi, rsi
+	jz .done
+	vmovdqu64 zmm0, [rdi]
+	vpxorq zmm0, zmm0, zmm16
+	vaesenc zmm0, zmm0, zmm17
+	vaesenc zmm0, zmm0, zmm18
+	vaesenc zmm0, zmm0, zmm19
+	vaesenc zmm0, zmm0, zmm20
+	vaesenc zmm0, zmm0, zmm21
+	vaesenc zmm0, zmm0, zmm22
+	vaesenc zmm0, zmm0, zmm23
+	vaesenc zmm0, zmm0, zmm24
+	vaesenc zmm0, zmm0, zmm25
+	vaesenclast zmm0, zmm0, zmm26
+	vmovdqu64 [rdi], zmm0
+	add rdi, 64
+	dec rsi
+	jmp .tail
+.done:
+	vzeroupper
+	ret
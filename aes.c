@@ -1,65 +1,470 @@
 #include "aes.h"
 
-extern void aes_encrypt_block(uint8_t *, uint8_t *);
+extern void aes_expand_key(const uint8_t *, uint8_t *);
+extern void aes_encrypt_blocks(uint8_t *, size_t, const uint8_t *);
+extern void aes_encrypt_lanes(uint8_t *, size_t, const uint8_t *);
+
+// The prefetch threads and the chunks waiting for them
+static pthread_t *prefetch_threads = NULL;
+static int prefetch_threads_len = 0;
+static unsigned char prefetch_running = 0;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+// Signalled when the last chunk a thread was computing for a stream is done
+static pthread_cond_t prefetch_idle = PTHREAD_COND_INITIALIZER;
+static aes_chunk *prefetch_head = NULL;
+static aes_chunk *prefetch_tail = NULL;
 
 enum aes_result aes_init(aes_ctx *ctx, const uint8_t *key, const uint64_t iv[2]) {
-	// Initialize the context
-	ctx->ctr[0] = iv[0];
-	ctx->ctr[1] = iv[1];
+	// Initialize the context, the IV is a big-endian 128-bit counter
+	ctx->ctr[0] = be64toh(iv[0]);
+	ctx->ctr[1] = be64toh(iv[1]);
 	memcpy(ctx->key, key, 16);
+	aes_expand_key(ctx->key, ctx->rk);
 	ctx->residual_size = 0;
+	ctx->stream = NULL;
 	return AES_SUCCESS;
 }
 
-enum aes_result aes_encrypt_update(aes_ctx *ctx, const char *data, const size_t data_size, char *out, size_t *out_size) {
-	// Allocate memory for the ciphertext
-	*out_size = (ctx->residual_size + data_size) & (-1 << 4);
-	// Copy the residual data
-	memcpy(out, ctx->residual, ctx->residual_size);
-	// Copy the data
-	memcpy(out + ctx->residual_size, data, *out_size - ctx->residual_size);
-	// Encrypt the data
-	for (size_t i = 0; i < *out_size; i += 16) {
-		// Build the block with the counter
-		uint8_t block[16];
-		memcpy(block, &ctx->ctr, 16);
-		// Increment the counter
-		ctx->ctr[0] += (++ctx->ctr[1] == 0);
-		// Encrypt the block
-		aes_encrypt_block(block, ctx->key);
-		// XOR the block with the plaintext
-		for (int j = 0; j < 16; j++) {
-			out[i + j] ^= block[j];
+// XOR len bytes of keystream into data
+void _aes_xor(const char *data, const uint8_t *ks, size_t len, char *out) {
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t word, key;
+		memcpy(&word, data + i, 8);
+		memcpy(&key, ks + i, 8);
+		word ^= key;
+		memcpy(out + i, &word, 8);
+	}
+	for (; i < len; i++)
+		out[i] = data[i] ^ ks[i];
+}
+
+// Encrypt the counter blocks of a chunk, which start index chunks after the stream's first counter
+void _aes_chunk_fill(aes_stream *s, aes_chunk *c) {
+	uint64_t *ks = (uint64_t *)c->ks;
+	uint64_t first = c->index * AES_STREAM_BLOCKS;
+	uint64_t lo = s->base[1] + first;
+	uint64_t hi = s->base[0] + (lo < first);
+	for (size_t i = 0; i < AES_STREAM_BLOCKS; i++) {
+		ks[i * 2] = htobe64(hi);
+		ks[i * 2 + 1] = htobe64(lo);
+		hi += (++lo == 0);
+	}
+	aes_encrypt_blocks(c->ks, AES_STREAM_BLOCKS, s->rk);
+}
+
+// Put a chunk on the queue unless it is still there, with prefetch_lock held
+void _aes_prefetch_queue(aes_chunk *c) {
+	if (c->queued)
+		return;
+	c->queued = 1;
+	c->next = NULL;
+	if (prefetch_tail != NULL)
+		prefetch_tail->next = c;
+	else
+		prefetch_head = c;
+	prefetch_tail = c;
+}
+
+void *_aes_prefetch_main(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&prefetch_lock);
+	while (1) {
+		while (prefetch_running && prefetch_head == NULL)
+			pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+		if (!prefetch_running)
+			break;
+		aes_chunk *c = prefetch_head;
+		prefetch_head = c->next;
+		if (prefetch_head == NULL)
+			prefetch_tail = NULL;
+		c->queued = 0;
+		// The packet path may have got to the chunk first
+		int empty = AES_CHUNK_EMPTY;
+		if (!__atomic_compare_exchange_n(&c->state, &empty, AES_CHUNK_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			continue;
+		aes_stream *s = c->stream;
+		s->active++;
+		pthread_mutex_unlock(&prefetch_lock);
+		_aes_chunk_fill(s, c);
+		__atomic_store_n(&c->state, AES_CHUNK_READY, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&prefetch_lock);
+		if (--s->active == 0)
+			pthread_cond_broadcast(&prefetch_idle);
+	}
+	pthread_mutex_unlock(&prefetch_lock);
+	return NULL;
+}
+
+enum aes_result aes_prefetch_init(int threads) {
+	if (prefetch_running)
+		return AES_SUCCESS;
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	prefetch_threads = malloc(threads * sizeof(pthread_t));
+	if (prefetch_threads == NULL)
+		return AES_ERROR;
+	prefetch_running = 1;
+	for (int i = 0; i < threads; i++) {
+		if (pthread_create(&prefetch_threads[i], NULL, _aes_prefetch_main, NULL) != 0)
+			break;
+		prefetch_threads_len++;
+	}
+	if (prefetch_threads_len == 0) {
+		aes_prefetch_free();
+		return AES_ERROR;
+	}
+	return AES_SUCCESS;
+}
+
+void aes_prefetch_free() {
+	if (prefetch_threads == NULL)
+		return;
+	pthread_mutex_lock(&prefetch_lock);
+	prefetch_running = 0;
+	pthread_cond_broadcast(&prefetch_cond);
+	pthread_mutex_unlock(&prefetch_lock);
+	for (int i = 0; i < prefetch_threads_len; i++)
+		pthread_join(prefetch_threads[i], NULL);
+	// The streams still running compute what is left on the queue themselves
+	while (prefetch_head != NULL) {
+		prefetch_head->queued = 0;
+		prefetch_head = prefetch_head->next;
+	}
+	prefetch_tail = NULL;
+	free(prefetch_threads);
+	prefetch_threads = NULL;
+	prefetch_threads_len = 0;
+}
+
+enum aes_result aes_prefetch_start(aes_ctx *ctx) {
+	if (ctx->stream != NULL)
+		return AES_SUCCESS;
+	aes_stream *s = aligned_alloc(64, (sizeof(aes_stream) + 63) & ~(size_t)63);
+	if (s == NULL)
+		return AES_ERROR;
+	memset(s, 0, sizeof(aes_stream));
+	memcpy(s->rk, ctx->rk, sizeof(s->rk));
+	// The stream carries on from wherever the counter is
+	s->base[0] = ctx->ctr[0];
+	s->base[1] = ctx->ctr[1];
+	pthread_mutex_lock(&prefetch_lock);
+	if (!prefetch_running) {
+		pthread_mutex_unlock(&prefetch_lock);
+		free(s);
+		return AES_ERROR;
+	}
+	for (int i = 0; i < AES_STREAM_CHUNKS; i++) {
+		s->chunks[i].stream = s;
+		s->chunks[i].index = i;
+		_aes_prefetch_queue(&s->chunks[i]);
+	}
+	pthread_cond_broadcast(&prefetch_cond);
+	pthread_mutex_unlock(&prefetch_lock);
+	ctx->stream = s;
+	return AES_SUCCESS;
+}
+
+void aes_prefetch_stop(aes_ctx *ctx) {
+	aes_stream *s = ctx->stream;
+	if (s == NULL)
+		return;
+	ctx->stream = NULL;
+	pthread_mutex_lock(&prefetch_lock);
+	// Take the stream's chunks off the queue, then wait for the ones being computed
+	aes_chunk **link = &prefetch_head;
+	prefetch_tail = NULL;
+	while (*link != NULL) {
+		if ((*link)->stream == s) {
+			(*link)->queued = 0;
+			*link = (*link)->next;
+		} else {
+			prefetch_tail = *link;
+			link = &(*link)->next;
 		}
 	}
-	// Save the residual data
-	ctx->residual_size = data_size - *out_size + ctx->residual_size;
-	memcpy(ctx->residual, data + *out_size - ctx->residual_size, ctx->residual_size);
+	while (s->active)
+		pthread_cond_wait(&prefetch_idle, &prefetch_lock);
+	pthread_mutex_unlock(&prefetch_lock);
+	memset(s, 0, sizeof(aes_stream));
+	free(s);
+}
+
+// Make sure the keystream of a chunk is there
+void _aes_chunk_wait(aes_stream *s, aes_chunk *c) {
+	int state = __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+	if (state == AES_CHUNK_READY)
+		return;
+	// The threads fell behind, computing it here is sooner than waiting for one to get to it
+	if (state == AES_CHUNK_EMPTY && __atomic_compare_exchange_n(&c->state, &state, AES_CHUNK_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		_aes_chunk_fill(s, c);
+		__atomic_store_n(&c->state, AES_CHUNK_READY, __ATOMIC_RELAXED);
+		return;
+	}
+	// A thread is part way through it
+	while (__atomic_load_n(&c->state, __ATOMIC_ACQUIRE) != AES_CHUNK_READY)
+		sched_yield();
+}
+
+// Hand a used up chunk back to the threads for the counters AES_STREAM_CHUNKS chunks further on
+void _aes_chunk_recycle(aes_chunk *c) {
+	c->index += AES_STREAM_CHUNKS;
+	__atomic_store_n(&c->state, AES_CHUNK_EMPTY, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&prefetch_lock);
+	if (prefetch_running) {
+		_aes_prefetch_queue(c);
+		pthread_cond_signal(&prefetch_cond);
+	}
+	pthread_mutex_unlock(&prefetch_lock);
+}
+
+// Only XOR with keystream the threads computed, a trailing partial block uses up a whole counter as in aes_crypt
+enum aes_result _aes_stream_crypt(aes_ctx *ctx, const char *data, const size_t data_size, char *out) {
+	aes_stream *s = ctx->stream;
+	size_t done = 0;
+	while (done < data_size) {
+		aes_chunk *c = &s->chunks[(s->pos / AES_STREAM_BLOCKS) % AES_STREAM_CHUNKS];
+		size_t off = s->pos % AES_STREAM_BLOCKS;
+		_aes_chunk_wait(s, c);
+		size_t len = (AES_STREAM_BLOCKS - off) * 16;
+		if (len > data_size - done)
+			len = data_size - done;
+		_aes_xor(data + done, c->ks + off * 16, len, out + done);
+		size_t blocks = (len + 15) / 16;
+		s->pos += blocks;
+		// Keep the counter where the lockstep path would have it, for when prefetching stops
+		ctx->ctr[1] += blocks;
+		ctx->ctr[0] += ctx->ctr[1] < blocks;
+		done += len;
+		if (s->pos % AES_STREAM_BLOCKS == 0)
+			_aes_chunk_recycle(c);
+	}
+	return AES_SUCCESS;
+}
+
+// Encrypt or decrypt with the counter at ctr, which is advanced past the blocks used
+void _aes_ctr_crypt(const uint8_t *rk, uint64_t ctr[2], const char *data, const size_t data_size, char *out) {
+	uint64_t ks[AES_BATCH * 2];
+	size_t done = 0;
+	while (done < data_size) {
+		size_t blocks = (data_size - done + 15) / 16;
+		if (blocks > AES_BATCH)
+			blocks = AES_BATCH;
+		// Build the counter blocks
+		for (size_t i = 0; i < blocks; i++) {
+			ks[i * 2] = htobe64(ctr[0]);
+			ks[i * 2 + 1] = htobe64(ctr[1]);
+			ctr[0] += (++ctr[1] == 0);
+		}
+		// Encrypt them all in one call
+		aes_encrypt_blocks((uint8_t *)ks, blocks, rk);
+		// XOR the keystream with the data
+		size_t len = blocks * 16;
+		if (len > data_size - done)
+			len = data_size - done;
+		size_t i = 0;
+		for (; i + 8 <= len; i += 8) {
+			uint64_t word;
+			memcpy(&word, data + done + i, 8);
+			word ^= ks[i / 8];
+			memcpy(out + done + i, &word, 8);
+		}
+		for (; i < len; i++)
+			out[done + i] = data[done + i] ^ ((uint8_t *)ks)[i];
+		done += len;
+	}
+}
+
+enum aes_result aes_crypt(aes_ctx *ctx, const char *data, const size_t data_size, char *out) {
+	if (ctx->stream != NULL)
+		return _aes_stream_crypt(ctx, data, data_size, out);
+	_aes_ctr_crypt(ctx->rk, ctx->ctr, data, data_size, out);
+	return AES_SUCCESS;
+}
+
+enum aes_result aes_crypt_vec(aes_ctx *ctx, const struct iovec *iov, const int iovcnt) {
+	if (ctx->stream != NULL) {
+		for (int i = 0; i < iovcnt; i++)
+			_aes_stream_crypt(ctx, iov[i].iov_base, iov[i].iov_len, iov[i].iov_base);
+		return AES_SUCCESS;
+	}
+	// Every buffer uses up whole counters, like a separate aes_crypt call would
+	size_t left = 0;
+	for (int i = 0; i < iovcnt; i++)
+		left += (iov[i].iov_len + 15) / 16;
+	uint64_t ks[AES_BATCH * 2];
+	int cur = 0;
+	size_t off = 0;
+	while (left) {
+		size_t blocks = left < AES_BATCH ? left : AES_BATCH;
+		for (size_t i = 0; i < blocks; i++) {
+			ks[i * 2] = htobe64(ctx->ctr[0]);
+			ks[i * 2 + 1] = htobe64(ctx->ctr[1]);
+			ctx->ctr[0] += (++ctx->ctr[1] == 0);
+		}
+		// One kernel call for the counters of several buffers, short ones no longer leave it mostly idle
+		aes_encrypt_blocks((uint8_t *)ks, blocks, ctx->rk);
+		left -= blocks;
+		size_t used = 0;
+		while (used < blocks) {
+			// Skip the buffers that are done (and empty ones, which use no counter)
+			while (off == iov[cur].iov_len) {
+				cur++;
+				off = 0;
+			}
+			char *p = (char *)iov[cur].iov_base + off;
+			size_t len = iov[cur].iov_len - off;
+			if (len > (blocks - used) * 16)
+				len = (blocks - used) * 16;
+			_aes_xor(p, (uint8_t *)ks + used * 16, len, p);
+			off += len;
+			used += (len + 15) / 16;
+		}
+	}
+	return AES_SUCCESS;
+}
+
+void aes_mb_init(aes_mb *mb) { mb->jobs_len = 0; }
+
+enum aes_result aes_mb_submit(aes_mb *mb, aes_ctx *ctx, char *data, const size_t data_size) {
+	// Keystream the prefetch threads computed only needs the XOR, there is nothing to batch
+	if (ctx->stream != NULL)
+		return _aes_stream_crypt(ctx, data, data_size, data);
+	if (mb->jobs_len == AES_MB_JOBS)
+		aes_mb_flush(mb);
+	aes_mb_job *job = &mb->jobs[mb->jobs_len++];
+	job->rk = ctx->rk;
+	job->ctr[0] = ctx->ctr[0];
+	job->ctr[1] = ctx->ctr[1];
+	job->data = data;
+	job->len = data_size;
+	// Reserve the counters of the job, the next one on the same context starts after them
+	size_t blocks = (data_size + 15) / 16;
+	ctx->ctr[1] += blocks;
+	ctx->ctr[0] += ctx->ctr[1] < blocks;
+	return AES_SUCCESS;
+}
+
+void aes_mb_flush(aes_mb *mb) {
+	int jobs_len = mb->jobs_len;
+	mb->jobs_len = 0;
+	if (!__builtin_cpu_supports("avx512f") || !__builtin_cpu_supports("vaes")) {
+		for (int i = 0; i < jobs_len; i++)
+			_aes_ctr_crypt(mb->jobs[i].rk, mb->jobs[i].ctr, mb->jobs[i].data, mb->jobs[i].len, mb->jobs[i].data);
+		return;
+	}
+	// Round keys of the lanes interleaved as the kernel reads them, and the counter blocks laid out lane by lane
+	uint8_t rk[11 * AES_LANES * 16] __attribute__((aligned(64)));
+	uint64_t ks[AES_MB_GROUPS * AES_LANES * 2] __attribute__((aligned(64)));
+	aes_mb_job *lane[AES_LANES] = {NULL};
+	const uint8_t *keyed[AES_LANES] = {NULL};
+	int next = 0, busy = 0;
+	for (;;) {
+		// Idle lanes take the next jobs, a job never waits for another to finish
+		for (int l = 0; l < AES_LANES; l++) {
+			while (lane[l] == NULL && next < jobs_len) {
+				aes_mb_job *job = &mb->jobs[next++];
+				if (job->len == 0)
+					continue;
+				lane[l] = job;
+				busy++;
+				if (keyed[l] != job->rk) {
+					for (int r = 0; r < 11; r++)
+						memcpy(rk + (r * AES_LANES + l) * 16, job->rk + r * 16, 16);
+					keyed[l] = job->rk;
+				}
+			}
+		}
+		if (busy == 0)
+			break;
+		// The last job left would run alone in the wide kernel, the single key one is as fast for it
+		if (busy == 1) {
+			for (int l = 0; l < AES_LANES; l++)
+				if (lane[l] != NULL)
+					_aes_ctr_crypt(lane[l]->rk, lane[l]->ctr, lane[l]->data, lane[l]->len, lane[l]->data);
+			break;
+		}
+		// Run until the shortest job is done, so its lane can be refilled
+		size_t groups = AES_MB_GROUPS;
+		for (int l = 0; l < AES_LANES; l++)
+			if (lane[l] != NULL && (lane[l]->len + 15) / 16 < groups)
+				groups = (lane[l]->len + 15) / 16;
+		for (int l = 0; l < AES_LANES; l++) {
+			aes_mb_job *job = lane[l];
+			for (size_t g = 0; g < groups; g++) {
+				uint64_t *block = ks + (g * AES_LANES + l) * 2;
+				if (job == NULL) {
+					block[0] = block[1] = 0;
+					continue;
+				}
+				block[0] = htobe64(job->ctr[0]);
+				block[1] = htobe64(job->ctr[1]);
+				job->ctr[0] += (++job->ctr[1] == 0);
+			}
+		}
+		// The kernel runs 4 groups side by side, a short run is padded to that since the extra groups cost no extra time
+		size_t padded = (groups + 3) & ~(size_t)3;
+		memset(ks + groups * AES_LANES * 2, 0, (padded - groups) * AES_LANES * 16);
+		aes_encrypt_lanes((uint8_t *)ks, padded, rk);
+		for (int l = 0; l < AES_LANES; l++) {
+			aes_mb_job *job = lane[l];
+			if (job == NULL)
+				continue;
+			for (size_t g = 0; g < groups; g++) {
+				uint64_t *block = ks + (g * AES_LANES + l) * 2;
+				if (job->len < 16) {
+					_aes_xor(job->data, (uint8_t *)block, job->len, job->data);
+					job->len = 0;
+					break;
+				}
+				uint64_t word[2];
+				memcpy(word, job->data, 16);
+				word[0] ^= block[0];
+				word[1] ^= block[1];
+				memcpy(job->data, word, 16);
+				job->data += 16;
+				job->len -= 16;
+			}
+			if (job->len == 0) {
+				lane[l] = NULL;
+				busy--;
+			}
+		}
+	}
+}
+
+enum aes_result aes_encrypt_update(aes_ctx *ctx, const char *data, const size_t data_size, char *out, size_t *out_size) {
+	size_t total = ctx->residual_size + data_size;
+	// Only whole blocks are processed
+	*out_size = total & ~(size_t)15;
+	if (*out_size == 0) {
+		memcpy(ctx->residual + ctx->residual_size, data, data_size);
+		ctx->residual_size = total;
+		return AES_SUCCESS;
+	}
+	// Keep the new residual before out (which may alias data) is written
+	size_t residual_size = total - *out_size;
+	uint8_t residual[15];
+	memcpy(residual, data + data_size - residual_size, residual_size);
+	// Move the data behind the old residual and encrypt everything in place
+	memmove(out + ctx->residual_size, data, *out_size - ctx->residual_size);
+	memcpy(out, ctx->residual, ctx->residual_size);
+	aes_crypt(ctx, out, *out_size, out);
+	memcpy(ctx->residual, residual, residual_size);
+	ctx->residual_size = residual_size;
 	return AES_SUCCESS;
 }
 
 enum aes_result aes_encrypt_finalize(aes_ctx *ctx, const char *data, const size_t data_size, char *out, size_t *out_size) {
-	// Allocate memory for the ciphertext
 	*out_size = ctx->residual_size + data_size;
-	// Copy the residual data
+	// Move the data behind the residual and encrypt everything in place
+	memmove(out + ctx->residual_size, data, data_size);
 	memcpy(out, ctx->residual, ctx->residual_size);
 	ctx->residual_size = 0;
-	// Copy the data
-	memcpy(out + ctx->residual_size, data, data_size);
-	// Encrypt the data
-	for (size_t i = 0; i < *out_size; i += 16) {
-		// Build the block with the counter
-		uint8_t block[16];
-		memcpy(block, &ctx->ctr, 16);
-		// Increment the counter
-		ctx->ctr[0] += (++ctx->ctr[1] == 0);
-		// Encrypt the block
-		aes_encrypt_block(block, ctx->key);
-		// XOR the block with the plaintext
-		for (int j = 0; j + i < *out_size; j++) {
-			out[i + j] ^= block[j];
-		}
-	}
+	aes_crypt(ctx, out, *out_size, out);
 	return AES_SUCCESS;
 }
 
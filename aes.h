@@ -1,20 +1,91 @@
 #pragma once
 
+#include <endian.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 enum aes_result {
 	AES_SUCCESS = 0,
+	AES_ERROR = -1,
 };
 
+// number of counter blocks encrypted per kernel call
+#define AES_BATCH 32
+// counter blocks per chunk of keystream computed ahead (16 KiB)
+#define AES_STREAM_BLOCKS 1024
+// chunks computed ahead per direction
+#define AES_STREAM_CHUNKS 8
+// contexts the multi-buffer kernel runs side by side, one 128-bit lane of a 512-bit register each
+#define AES_LANES 4
+// counter blocks per lane and multi-buffer kernel call
+#define AES_MB_GROUPS (AES_BATCH / AES_LANES)
+// jobs collected before the multi-buffer kernel runs them
+#define AES_MB_JOBS 256
+
+enum aes_chunk_state {
+	// waiting for a prefetch thread, or for the packet path if it gets there first
+	AES_CHUNK_EMPTY = 0,
+	AES_CHUNK_BUSY = 1,
+	AES_CHUNK_READY = 2,
+};
+
+struct aes_stream;
+
+typedef struct aes_chunk {
+	uint8_t ks[AES_STREAM_BLOCKS * 16];
+	struct aes_stream *stream;
+	// which chunk of the stream this is, counted from the counter the stream started at
+	uint64_t index;
+	// an aes_chunk_state, whoever computes the keystream claims the chunk with a compare and swap
+	int state;
+	// on the queue of the prefetch threads
+	unsigned char queued;
+	struct aes_chunk *next;
+} aes_chunk;
+
+// one direction's ring of keystream, the packet path uses up chunks while the prefetch threads fill the ones after them
+typedef struct aes_stream {
+	uint8_t rk[176];
+	// the counter the stream started at, in host byte order
+	uint64_t base[2];
+	// counter blocks used up since then
+	uint64_t pos;
+	// chunks a prefetch thread is computing, the stream is only freed once there are none
+	int active;
+	aes_chunk chunks[AES_STREAM_CHUNKS];
+} aes_stream;
+
 typedef struct aes_ctx {
 	uint8_t key[16];
+	// expanded round keys, computed once in aes_init
+	uint8_t rk[176];
+	// the counter in host byte order, ctr[0] holds the high half
 	uint64_t ctr[2];
 	uint8_t residual[15];
 	uint8_t residual_size;
+	// keystream computed ahead on the prefetch threads, NULL to compute it along with the data
+	aes_stream *stream;
 } aes_ctx;
 
+// one buffer to encrypt in place with a context's key, starting at a counter reserved when it was submitted
+typedef struct aes_mb_job {
+	const uint8_t *rk;
+	uint64_t ctr[2];
+	char *data;
+	size_t len;
+} aes_mb_job;
+
+// buffers of many contexts encrypted together, so short ones no longer leave the kernel mostly idle
+typedef struct aes_mb {
+	aes_mb_job jobs[AES_MB_JOBS];
+	int jobs_len;
+} aes_mb;
+
 /**
  * @brief Initialize the AES context.
  * @param ctx AES context
@@ -24,6 +95,84 @@ typedef struct aes_ctx {
  */
 enum aes_result aes_init(aes_ctx *, const uint8_t *, const uint64_t[2]);
 
+/**
+ * @brief Start threads that compute AES-CTR keystream ahead of the data
+ * @note A single stream is then no longer bound to one core's AES rate, the packet path is left with the XOR and the MAC
+ * @param threads The number of threads, 0 for one per online CPU
+ * @return AES_SUCCESS on success, <0 on error
+ */
+enum aes_result aes_prefetch_init(int);
+
+/**
+ * @brief Stop the prefetch threads, contexts still prefetching compute the rest of their chunks themselves
+ */
+void aes_prefetch_free();
+
+/**
+ * @brief Have the prefetch threads compute the keystream of a context ahead of its data
+ * @note Each context gets AES_STREAM_CHUNKS chunks of AES_STREAM_BLOCKS counters. If the data catches up with the threads the
+ * chunk is computed on the calling thread, so the result is the same as without prefetching
+ * @param ctx AES context
+ * @return AES_SUCCESS on success, <0 if the prefetch threads are not running
+ */
+enum aes_result aes_prefetch_start(aes_ctx *);
+
+/**
+ * @brief Stop prefetching for a context, which computes its keystream along with the data again from where it left off
+ * @note Waits for the threads to finish the chunks they are computing for it, must be called before the context is
+ * initialized again or discarded
+ * @param ctx AES context
+ */
+void aes_prefetch_stop(aes_ctx *);
+
+/**
+ * @brief Encrypt or decrypt data with the AES-CTR keystream, a trailing partial block uses up a whole counter
+ * @note Data is processed AES_BATCH blocks per kernel call, in may equal out for in-place operation
+ * @param ctx AES context
+ * @param data Source buffer
+ * @param data_len Length of source buffer
+ * @param out Destination buffer
+ * @return AES_SUCCESS on success, <0 on error
+ */
+enum aes_result aes_crypt(aes_ctx *, const char *, const size_t, char *);
+
+/**
+ * @brief Encrypt or decrypt several buffers in place as one run of the keystream, each as if by its own aes_crypt call
+ * @note The counter blocks of consecutive buffers share kernel calls, so a run of short packets still fills them
+ * @param ctx AES context
+ * @param iov The buffers
+ * @param iovcnt The number of buffers
+ * @return AES_SUCCESS on success, <0 on error
+ */
+enum aes_result aes_crypt_vec(aes_ctx *, const struct iovec *, const int);
+
+/**
+ * @brief Initialize an empty multi-buffer job manager
+ * @param mb The job manager
+ */
+void aes_mb_init(aes_mb *);
+
+/**
+ * @brief Queue a buffer to be encrypted or decrypted in place by aes_mb_flush, as aes_crypt would now
+ * @note The counters of the buffer are taken from the context at once, so buffers of one context may follow each other in
+ * the queue. The data is untouched until the flush, which must happen before the context is initialized again or discarded.
+ * A context that is prefetching is served right away from its keystream, a full queue is flushed first
+ * @param mb The job manager
+ * @param ctx AES context
+ * @param data The buffer
+ * @param data_len Length of the buffer
+ * @return AES_SUCCESS on success, <0 on error
+ */
+enum aes_result aes_mb_submit(aes_mb *, aes_ctx *, char *, const size_t);
+
+/**
+ * @brief Run every queued job
+ * @note With AVX-512 and VAES, AES_LANES jobs run side by side in one kernel, each lane with its own key, and a lane whose
+ * job is done takes the next one. Otherwise the jobs run one after the other
+ * @param mb The job manager
+ */
+void aes_mb_flush(aes_mb *);
+
 /**
  * @brief Update the AES context with new data.
  * @param ctx AES context
@@ -0,0 +1,129 @@
+// Checks the batched and multi-buffer AES paths byte for byte against aes_crypt, run by ctest
+#include "aes.h"
+#include <stdio.h>
+
+// The kernels in _aes.asm, which aes.c declares the same way
+extern void aes_expand_key(const uint8_t *, uint8_t *);
+extern void aes_encrypt_blocks(uint8_t *, size_t, const uint8_t *);
+extern void aes_encrypt_lanes(uint8_t *, size_t, const uint8_t *);
+
+// Deterministic bytes for the test
+void _fill(void *p, size_t len, uint32_t seed) {
+	for (size_t i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		((uint8_t *)p)[i] = seed >> 16;
+	}
+}
+
+// The lanes kernel against the single key one, lane by lane
+int _check_lanes() {
+	uint8_t rk[AES_LANES][176], lanes_rk[11 * AES_LANES * 16] __attribute__((aligned(64)));
+	uint8_t ks[AES_MB_GROUPS * AES_LANES * 16] __attribute__((aligned(64))), ref[AES_MB_GROUPS * 16];
+	for (int l = 0; l < AES_LANES; l++) {
+		uint8_t key[16];
+		_fill(key, 16, 100 + l);
+		aes_expand_key(key, rk[l]);
+		for (int r = 0; r < 11; r++)
+			memcpy(lanes_rk + (r * AES_LANES + l) * 16, rk[l] + r * 16, 16);
+	}
+	for (size_t groups = 4; groups <= AES_MB_GROUPS; groups += 4) {
+		_fill(ks, groups * AES_LANES * 16, groups);
+		uint8_t in[AES_MB_GROUPS * AES_LANES * 16];
+		memcpy(in, ks, groups * AES_LANES * 16);
+		aes_encrypt_lanes(ks, groups, lanes_rk);
+		for (int l = 0; l < AES_LANES; l++) {
+			for (size_t g = 0; g < groups; g++)
+				memcpy(ref + g * 16, in + (g * AES_LANES + l) * 16, 16);
+			aes_encrypt_blocks(ref, groups, rk[l]);
+			for (size_t g = 0; g < groups; g++)
+				if (memcmp(ref + g * 16, ks + (g * AES_LANES + l) * 16, 16))
+					return -1;
+		}
+	}
+	return 0;
+}
+
+// aes_crypt_vec and aes_mb_flush against aes_crypt, for buffers of mixed lengths with partial blocks, 1 to 2 * AES_LANES
+// contexts in one flush and counters whose low half wraps
+int _check_batched() {
+	// Lengths around the block and batch boundaries, and an empty buffer which uses no counter
+	static const size_t lens[] = {0, 1, 15, 16, 17, 31, 33, 100, 255, 256, 511, 513, 1500, 4099};
+	const int lens_len = sizeof(lens) / sizeof(lens[0]);
+	// Every length twice, so contexts get several jobs in one flush
+	const int jobs = lens_len * 2;
+	size_t total = 0;
+	for (int j = 0; j < jobs; j++)
+		total += lens[j % lens_len];
+	char *data = malloc(total), *ref = malloc(total), *out = malloc(total);
+	if (data == NULL || ref == NULL || out == NULL) {
+		free(data);
+		free(ref);
+		free(out);
+		return -1;
+	}
+	_fill(data, total, 1);
+	int failed = 0;
+	// 1 to 8 contexts, more than the kernel has lanes, so finished lanes are refilled with another context's job
+	for (int n = 1; n <= 2 * AES_LANES && !failed; n++) {
+		aes_ctx ctx[2 * AES_LANES], vec[2 * AES_LANES], mb_ctx[2 * AES_LANES];
+		for (int c = 0; c < n; c++) {
+			uint8_t key[16];
+			_fill(key, 16, 10 * n + c);
+			// The low half of the counter wraps a few blocks in, and must carry into the high half
+			uint64_t iv[2] = {htobe64(c), htobe64(UINT64_MAX - 2 * c)};
+			aes_init(&ctx[c], key, iv);
+			vec[c] = mb_ctx[c] = ctx[c];
+		}
+		// The reference, one aes_crypt call per buffer
+		size_t off = 0;
+		for (int j = 0; j < jobs; j++) {
+			aes_crypt(&ctx[j % n], data + off, lens[j % lens_len], ref + off);
+			off += lens[j % lens_len];
+		}
+		// Each context's buffers as one vector, in the same order
+		memcpy(out, data, total);
+		for (int c = 0; c < n; c++) {
+			struct iovec iov[2 * sizeof(lens) / sizeof(lens[0])];
+			int iovcnt = 0;
+			off = 0;
+			for (int j = 0; j < jobs; j++) {
+				if (j % n == c)
+					iov[iovcnt++] = (struct iovec){out + off, lens[j % lens_len]};
+				off += lens[j % lens_len];
+			}
+			aes_crypt_vec(&vec[c], iov, iovcnt);
+		}
+		failed |= memcmp(out, ref, total) != 0;
+		// Every buffer as a job of the multi-buffer manager, flushed at once
+		memcpy(out, data, total);
+		aes_mb mb;
+		aes_mb_init(&mb);
+		off = 0;
+		for (int j = 0; j < jobs; j++) {
+			aes_mb_submit(&mb, &mb_ctx[j % n], out + off, lens[j % lens_len]);
+			off += lens[j % lens_len];
+		}
+		aes_mb_flush(&mb);
+		failed |= memcmp(out, ref, total) != 0;
+		// All three leave the counters in the same place
+		for (int c = 0; c < n; c++)
+			failed |= memcmp(vec[c].ctr, ctx[c].ctr, 16) || memcmp(mb_ctx[c].ctr, ctx[c].ctr, 16);
+	}
+	free(data);
+	free(ref);
+	free(out);
+	return failed ? -1 : 0;
+}
+
+int main() {
+	if (_check_batched()) {
+		fprintf(stderr, "aes_crypt_vec or aes_mb_flush differs from aes_crypt\n");
+		return 1;
+	}
+	// The lanes kernel needs AVX-512 and VAES, without them aes_mb_flush never calls it
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vaes") && _check_lanes()) {
+		fprintf(stderr, "aes_encrypt_lanes differs from aes_encrypt_blocks\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,95 @@
+#include "autotune.h"
+
+// the window a channel should get, growing at once and shrinking by at most a quarter per sample
+uint64_t _autotune_want(channel *ch, uint64_t share) {
+	uint64_t want = ch->bytes_in ? share : CHANNEL_WINDOW_MIN;
+	uint64_t floor = ch->local_window_max - ch->local_window_max / 4;
+	return want < floor ? floor : want;
+}
+
+void _autotune_sample(event_loop *loop, void *arg) {
+	autotune *at = arg;
+	connection *conn = at->conn;
+	at->timer = event_timer_add(loop, AUTOTUNE_INTERVAL_MS, _autotune_sample, at);
+
+	struct tcp_info info;
+	socklen_t info_len = sizeof(info);
+	if (getsockopt(conn->t->s, IPPROTO_TCP, TCP_INFO, &info, &info_len))
+		return;
+	uint64_t now = event_now();
+	uint64_t elapsed = now - at->sampled;
+	if (elapsed == 0)
+		return;
+	// the receive rate decays slowly so a short stall does not collapse the windows
+	uint64_t rate = (conn->t->rx_bytes - at->rx_bytes) * 1000 / elapsed;
+	at->rx_bytes = conn->t->rx_bytes;
+	at->sampled = now;
+	at->rate = rate > at->rate ? rate : at->rate - at->rate / 8;
+	// prefer the receiver side estimate, it is what the peer's data actually sees
+	at->rtt = info.tcpi_rcv_rtt ? info.tcpi_rcv_rtt : info.tcpi_rtt;
+	if (at->rtt == 0)
+		return;
+	uint64_t bdp = at->rate * at->rtt / 1000000;
+	// the kernel's own estimate of what the peer sends per round trip
+	if (bdp < info.tcpi_rcv_space)
+		bdp = info.tcpi_rcv_space;
+	uint64_t target = bdp * AUTOTUNE_HEADROOM;
+
+	// busy channels share the target, idle ones only keep the minimum
+	int open = 0, active = 0;
+	for (uint32_t i = 0; i < conn->channels_size; i++) {
+		channel *ch = conn->channels[i];
+		if (ch == NULL || ch->state != CHANNEL_OPEN)
+			continue;
+		open++;
+		if (ch->bytes_in)
+			active++;
+	}
+	uint64_t share = active ? target / active : target;
+	uint64_t spare = at->budget > (uint64_t)(open - active) * CHANNEL_WINDOW_MIN ? at->budget - (uint64_t)(open - active) * CHANNEL_WINDOW_MIN : 0;
+	if (active && share > spare / active)
+		share = spare / active;
+	if (share > CHANNEL_WINDOW_MAX)
+		share = CHANNEL_WINDOW_MAX;
+	if (share < CHANNEL_WINDOW_MIN)
+		share = CHANNEL_WINDOW_MIN;
+
+	// the floors of shrinking channels may add up to more than the budget, which always wins
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < conn->channels_size; i++) {
+		channel *ch = conn->channels[i];
+		if (ch != NULL && ch->state == CHANNEL_OPEN)
+			total += _autotune_want(ch, share);
+	}
+	for (uint32_t i = 0; i < conn->channels_size; i++) {
+		channel *ch = conn->channels[i];
+		if (ch == NULL || ch->state != CHANNEL_OPEN)
+			continue;
+		uint64_t want = _autotune_want(ch, share);
+		ch->bytes_in = 0;
+		if (total > at->budget)
+			want = want * at->budget / total;
+		if (want < CHANNEL_WINDOW_MIN)
+			want = CHANNEL_WINDOW_MIN;
+		if (want != ch->local_window_max)
+			channel_set_window(ch, want);
+	}
+	// new channels start at the size a busy channel would get
+	conn->window = share;
+}
+
+int autotune_init(autotune *at, connection *conn, size_t budget) {
+	memset(at, 0, sizeof(autotune));
+	at->conn = conn;
+	at->budget = budget;
+	at->rx_bytes = conn->t->rx_bytes;
+	at->sampled = event_now();
+	at->timer = event_timer_add(conn->t->loop, AUTOTUNE_INTERVAL_MS, _autotune_sample, at);
+	return at->timer == NULL ? -1 : 0;
+}
+
+void autotune_free(autotune *at) {
+	if (at->timer != NULL)
+		event_timer_cancel(at->timer);
+	at->timer = NULL;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "channel.h"
+
+// how often TCP_INFO is sampled
+#define AUTOTUNE_INTERVAL_MS 200
+// receive memory all channel windows together may use unless configured otherwise
+#define AUTOTUNE_BUDGET_DEFAULT (256 << 20)
+// windows are sized to this multiple of the bandwidth-delay product so they never become the bottleneck
+#define AUTOTUNE_HEADROOM 2
+
+typedef struct autotune {
+	connection *conn;
+	event_timer *timer;
+	// upper bound on the sum of all advertised windows
+	size_t budget;
+	// transport counters at the previous sample
+	uint64_t rx_bytes;
+	uint64_t sampled;
+	// smoothed receive rate in bytes per second and round trip time in microseconds
+	uint64_t rate;
+	uint32_t rtt;
+} autotune;
+
+/**
+ * @brief Start tuning the channel windows of a connection to its bandwidth-delay product
+ * @note Windows of busy channels grow at once to match a faster link and shrink gradually, idle channels fall back to
+ * CHANNEL_WINDOW_MIN, and together they never exceed the budget. The socket receive buffer is left to the kernel, setting
+ * SO_RCVBUF would turn its autotuning off for good
+ * @param at The tuner to initialize
+ * @param conn The connection, its transport must be on a TCP socket for the tuner to have any effect
+ * @param budget The receive memory all windows together may use
+ * @return 0 on success, -1 on error
+ */
+int autotune_init(autotune *, connection *, size_t);
+
+/**
+ * @brief Stop tuning (the windows keep their current size)
+ * @param at The tuner to stop
+ */
+void autotune_free(autotune *);
@@ -2,6 +2,20 @@
 
 #define _paddedlen(len) ((len) + 15 - (((len) + 15) & 15))
 
+// grow existing to at least len bytes, pool buffers only move when they outgrow their size class
+char *_chacha_grow(chacha_ctx *ctx, size_t len) {
+	if (ctx->existing != NULL && pool_size(ctx->existing) >= len)
+		return (char *)ctx->existing;
+	char *tmp = pool_alloc(len);
+	if (tmp == NULL)
+		return NULL;
+	if (ctx->existing != NULL) {
+		memcpy(tmp, ctx->existing, ctx->existing_len);
+		pool_free(ctx->existing);
+	}
+	return tmp;
+}
+
 extern void __inc_nonce(uint32_t *state);
 extern void __chacha_block(uint32_t state[16], char block[64]);
 extern void _poly1305_mac(const char *msg, const size_t msg_len, const char *key, char *out);
@@ -34,7 +48,7 @@ enum chacha_result chacha_ctx_init(chacha_ctx *ctx, const char key[32], const ch
 
 enum chacha_result chacha_ctx_destroy(chacha_ctx *ctx) {
 	if (ctx->existing != NULL)
-		free(ctx->existing);
+		pool_free(ctx->existing);
 	return CHACHA_SUCCESS;
 }
 
@@ -44,7 +58,7 @@ enum chacha_result chacha_encrypt_update(chacha_ctx *ctx, const char *data, cons
 		return CHACHA_ERROR_USED;
 	ctx->used = CHACHA_ENCRYPT;
 	// allocate enough space for the residual and the new data
-	char *in = malloc(ctx->residual_size + data_size);
+	char *in = pool_alloc(ctx->residual_size + data_size);
 	if (in == NULL)
 		return CHACHA_ERROR_MALLOC;
 	// copy the residual and the new data into the buffer
@@ -52,13 +66,11 @@ enum chacha_result chacha_encrypt_update(chacha_ctx *ctx, const char *data, cons
 	memcpy(in + ctx->residual_size, data, data_size);
 	// reallocate so there is enough space to append the output (cut off to a multiple of 64)
 	size_t out_size = (data_size + ctx->residual_size) & ~((size_t)63);
-	char *tmp;
-	if (ctx->existing == NULL)
-		tmp = malloc(ctx->existing_len + out_size);
-	else
-		tmp = realloc(ctx->existing, ctx->existing_len + out_size);
-	if (tmp == NULL)
+	char *tmp = _chacha_grow(ctx, ctx->existing_len + out_size);
+	if (tmp == NULL) {
+		pool_free(in);
 		return CHACHA_ERROR_MALLOC;
+	}
 	ctx->existing = tmp;
 	// the part of the plaintext that is not a multiple of 64 is the new residual
 	ctx->residual_size = (data_size + ctx->residual_size) & 63;
@@ -66,7 +78,7 @@ enum chacha_result chacha_encrypt_update(chacha_ctx *ctx, const char *data, cons
 	// append the plaintext to the end of the existing ciphertext
 	memcpy(ctx->existing + ctx->existing_len, in, out_size);
 	// plaintext is no longer needed
-	free(in);
+	pool_free(in);
 	// make a counter for the number of bytes encrypted
 	size_t encrypted = 0;
 	// while there is still enough data for a full block
@@ -101,11 +113,7 @@ enum chacha_result chacha_encrypt_finalize(chacha_ctx *ctx, const char *data, co
 	__chacha_block(ctx->state, tmp);
 	ctx->state[12]++;
 	// copy whatever was significant into existing
-	char *tmp2;
-	if (ctx->existing == NULL)
-		tmp2 = malloc(ctx->existing_len + ctx->residual_size + data_size - used);
-	else
-		tmp2 = realloc(ctx->existing, ctx->existing_len + ctx->residual_size + data_size - used);
+	char *tmp2 = _chacha_grow(ctx, ctx->existing_len + ctx->residual_size + data_size - used);
 	if (tmp2 == NULL)
 		return CHACHA_ERROR_MALLOC;
 	ctx->existing = tmp2;
@@ -127,7 +135,7 @@ enum chacha_result chacha_encrypt_finalize(chacha_ctx *ctx, const char *data, co
 	// copy the ciphertext into the output
 	memcpy(*out + _paddedlen(aad_len), ctx->existing, ctx->existing_len);
 	// free existing
-	free(ctx->existing);
+	pool_free(ctx->existing);
 	ctx->existing = NULL;
 	// copy aad_len and ciphertext_len into the output
 	memcpy(*out + _paddedlen(aad_len) + _paddedlen(ctx->existing_len), &aad_len, 8);
@@ -148,11 +156,7 @@ enum chacha_result chacha_decrypt_update(chacha_ctx *ctx, const char *data, cons
 		return CHACHA_ERROR_USED;
 	ctx->used = CHACHA_DECRYPT;
 	// append data to existing
-	char *tmp;
-	if (ctx->existing == NULL)
-		tmp = malloc(ctx->existing_len + data_size);
-	else
-		tmp = realloc(ctx->existing, ctx->existing_len + data_size);
+	char *tmp = _chacha_grow(ctx, ctx->existing_len + data_size);
 	if (tmp == NULL)
 		return CHACHA_ERROR_MALLOC;
 	ctx->existing = tmp;
@@ -200,7 +204,7 @@ enum chacha_result chacha_decrypt_finalize(chacha_ctx *ctx, const char *data, co
 	// copy the ciphertext
 	memcpy(*out, ctx->existing + _paddedlen(tmp_len), *out_size);
 	// free existing
-	free(ctx->existing);
+	pool_free(ctx->existing);
 	ctx->existing = NULL;
 	// decrypt the ciphertext
 	size_t decrypted = 0;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "pool.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -0,0 +1,922 @@
+#include "channel.h"
+
+void _sched_run(connection *);
+void _channel_wake(connection *);
+
+void _sched_drain(transport *t, void *arg) {
+	(void)t;
+	_sched_run(arg);
+}
+
+int connection_init(connection *conn, transport *t) {
+	memset(conn, 0, sizeof(connection));
+	conn->t = t;
+	conn->window = CHANNEL_WINDOW_DEFAULT;
+	conn->maxpacket = CHANNEL_PACKET_MAX;
+	conn->queue_limit = SCHED_QUEUE_LIMIT;
+	transport_set_drain(t, conn->queue_limit / 2, _sched_drain, conn);
+	return 0;
+}
+
+// take a channel off the scheduler's run lists
+void _sched_remove(channel *ch) {
+	connection *conn = ch->conn;
+	channel **head = ch->priority == CHANNEL_PRIORITY_INTERACTIVE ? &conn->prio_head : &conn->bulk_head;
+	channel **tail = ch->priority == CHANNEL_PRIORITY_INTERACTIVE ? &conn->prio_tail : &conn->bulk_tail;
+	if (!ch->scheduled)
+		return;
+	channel *prev = NULL;
+	for (channel *it = *head; it != NULL; prev = it, it = it->sched_next) {
+		if (it != ch)
+			continue;
+		if (prev == NULL)
+			*head = ch->sched_next;
+		else
+			prev->sched_next = ch->sched_next;
+		if (*tail == ch)
+			*tail = prev;
+		break;
+	}
+	ch->sched_next = NULL;
+	ch->scheduled = 0;
+	ch->deficit = 0;
+}
+
+// put a channel at the end of its run list
+void _sched_append(channel *ch) {
+	connection *conn = ch->conn;
+	channel **head = ch->priority == CHANNEL_PRIORITY_INTERACTIVE ? &conn->prio_head : &conn->bulk_head;
+	channel **tail = ch->priority == CHANNEL_PRIORITY_INTERACTIVE ? &conn->prio_tail : &conn->bulk_tail;
+	ch->sched_next = NULL;
+	if (*tail == NULL)
+		*head = ch;
+	else
+		(*tail)->sched_next = ch;
+	*tail = ch;
+	ch->scheduled = 1;
+}
+
+// drop the packets a channel has not sent
+void _channel_drop_queue(channel *ch) {
+	_sched_remove(ch);
+	while (ch->txq_len) {
+		packet_free(ch->txq[ch->txq_head].payload);
+		ch->txq_head++;
+		ch->txq_len--;
+	}
+	ch->txq_head = 0;
+	ch->txq_bytes = 0;
+}
+
+void _channel_free(channel *ch) {
+	connection *conn = ch->conn;
+	conn->channels[ch->id] = NULL;
+	conn->free_ids[conn->free_len++] = ch->id;
+	if (ch->state != CHANNEL_CLOSED)
+		conn->channels_open--;
+	_channel_drop_queue(ch);
+	free(ch->txq);
+	free(ch->out);
+	free(ch);
+}
+
+void connection_free(connection *conn) {
+	for (uint32_t i = 0; i < conn->channels_size; i++)
+		if (conn->channels[i] != NULL)
+			_channel_free(conn->channels[i]);
+	free(conn->channels);
+	conn->channels = NULL;
+	conn->channels_size = 0;
+	free(conn->free_ids);
+	conn->free_ids = NULL;
+	conn->free_len = 0;
+	free(conn->waiting);
+	conn->waiting = NULL;
+	conn->waiting_len = conn->waiting_size = 0;
+	free(conn->global);
+	conn->global = NULL;
+	conn->global_len = conn->global_size = 0;
+	transport_set_drain(conn->t, 0, NULL, NULL);
+}
+
+size_t _channel_room(channel *ch) {
+	size_t room = 0;
+	if (ch->state == CHANNEL_OPEN && !ch->out_len && !ch->eof_pending && !ch->close_pending && ch->txq_bytes < CHANNEL_BACKLOG_MAX) {
+		room = ch->remote_window;
+		if (room > CHANNEL_BACKLOG_MAX - ch->txq_bytes)
+			room = CHANNEL_BACKLOG_MAX - ch->txq_bytes;
+	}
+	return room;
+}
+
+size_t channel_writable(channel *ch) {
+	size_t room = _channel_room(ch);
+	if (room)
+		return room;
+	ch->want_writable = 1;
+	// the scheduler only looks at the channels on this list, not at every channel of the connection
+	connection *conn = ch->conn;
+	if (ch->waiting)
+		return 0;
+	if (conn->waiting_len == conn->waiting_size) {
+		uint32_t size = conn->waiting_size ? conn->waiting_size * 2 : 16;
+		uint32_t *tmp = realloc(conn->waiting, size * sizeof(uint32_t));
+		if (tmp == NULL)
+			return 0;
+		conn->waiting = tmp;
+		conn->waiting_size = size;
+	}
+	conn->waiting[conn->waiting_len++] = ch->id;
+	ch->waiting = 1;
+	return 0;
+}
+
+// tell a waiting writer that there is room again
+void _channel_notify_writable(channel *ch) {
+	if (!ch->want_writable || ch->cb == NULL)
+		return;
+	ch->want_writable = 0;
+	if (channel_writable(ch))
+		ch->cb(ch, CHANNEL_EV_WRITABLE, NULL, 0, ch->arg);
+}
+
+// notify the waiting writers that have room again, the others stay on the list
+void _channel_wake(connection *conn) {
+	// callbacks write and may run the scheduler again, the channels they add are looked at next time
+	if (conn->waking)
+		return;
+	conn->waking = 1;
+	uint32_t n = conn->waiting_len;
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t id = conn->waiting[i];
+		channel *ch = id < conn->channels_size ? conn->channels[id] : NULL;
+		// the id of a freed channel, or one listed again after it was woken by a window adjust
+		if (ch == NULL || !ch->waiting)
+			continue;
+		ch->waiting = 0;
+		if (!ch->want_writable)
+			continue;
+		if (_channel_room(ch) == 0) {
+			conn->waiting[kept++] = id;
+			ch->waiting = 1;
+			continue;
+		}
+		_channel_notify_writable(ch);
+	}
+	memmove(conn->waiting + kept, conn->waiting + n, (conn->waiting_len - n) * sizeof(uint32_t));
+	conn->waiting_len = kept + conn->waiting_len - n;
+	conn->waking = 0;
+}
+
+// send a batch of packets taken from the channels, the transport owns them from here on
+int _sched_flush(connection *conn, struct iovec *batch, int *batch_len, size_t *batch_bytes) {
+	int n = *batch_len;
+	*batch_len = 0;
+	*batch_bytes = 0;
+	return n ? send_packets_buf(conn->t, batch, n) : 0;
+}
+
+// take the next queued packet of a channel into the batch, which is sent once full
+int _sched_send(channel *ch, struct iovec *batch, int *batch_len, size_t *batch_bytes) {
+	channel_packet *pkt = &ch->txq[ch->txq_head];
+	ch->txq_head++;
+	ch->txq_len--;
+	ch->txq_bytes -= pkt->len;
+	if (ch->txq_len == 0)
+		ch->txq_head = 0;
+	batch[*batch_len].iov_base = pkt->payload;
+	batch[(*batch_len)++].iov_len = pkt->len;
+	*batch_bytes += pkt->len;
+	if (*batch_len == TRANSPORT_SEAL_BATCH)
+		return _sched_flush(ch->conn, batch, batch_len, batch_bytes);
+	return 0;
+}
+
+// move queued packets to the transport, interactive channels first, then bulk channels by deficit round robin, encrypting
+// the packets of every channel together
+void _sched_run(connection *conn) {
+	transport *t = conn->t;
+	struct iovec batch[TRANSPORT_SEAL_BATCH];
+	int batch_len = 0;
+	size_t batch_bytes = 0;
+	int urgent = 0;
+	if (conn->sched_running)
+		return;
+	conn->sched_running = 1;
+	// interactive packets are small and latency bound, they go out whatever is queued
+	while (conn->prio_head != NULL) {
+		channel *ch = conn->prio_head;
+		conn->prio_head = ch->sched_next;
+		if (conn->prio_head == NULL)
+			conn->prio_tail = NULL;
+		ch->scheduled = 0;
+		_sched_send(ch, batch, &batch_len, &batch_bytes);
+		if (ch->txq_len)
+			_sched_append(ch);
+		urgent = 1;
+	}
+	// packets in the batch count against the limit as if they were queued already
+	while (conn->bulk_head != NULL && t->sendq_bytes + batch_bytes < conn->queue_limit) {
+		channel *ch = conn->bulk_head;
+		if ((uint32_t)ch->txq[ch->txq_head].len > ch->deficit) {
+			// its turn is over, it gets another quantum when it comes round again
+			ch->deficit += SCHED_QUANTUM;
+			if (ch->sched_next != NULL) {
+				conn->bulk_head = ch->sched_next;
+				conn->bulk_tail->sched_next = ch;
+				conn->bulk_tail = ch;
+				ch->sched_next = NULL;
+			}
+			continue;
+		}
+		ch->deficit -= ch->txq[ch->txq_head].len;
+		_sched_send(ch, batch, &batch_len, &batch_bytes);
+		if (ch->txq_len == 0)
+			_sched_remove(ch);
+	}
+	_sched_flush(conn, batch, &batch_len, &batch_bytes);
+	conn->sched_running = 0;
+	if (urgent)
+		transport_push(t);
+	// writers blocked on a full backlog can continue
+	_channel_wake(conn);
+}
+
+// queue a packet for a channel, the scheduler decides when it goes out
+int _channel_queue(channel *ch, char *payload, int len) {
+	if (ch->txq_head + ch->txq_len == ch->txq_size) {
+		if (ch->txq_head > 0) {
+			memmove(ch->txq, ch->txq + ch->txq_head, ch->txq_len * sizeof(channel_packet));
+			ch->txq_head = 0;
+		} else {
+			int size = ch->txq_size ? ch->txq_size * 2 : 16;
+			channel_packet *tmp = realloc(ch->txq, size * sizeof(channel_packet));
+			if (tmp == NULL) {
+				packet_free(payload);
+				return -1;
+			}
+			ch->txq = tmp;
+			ch->txq_size = size;
+		}
+	}
+	channel_packet *pkt = &ch->txq[ch->txq_head + ch->txq_len++];
+	pkt->payload = payload;
+	pkt->len = len;
+	ch->txq_bytes += len;
+	if (ch->state != CHANNEL_OPEN)
+		return 0;
+	if (!ch->scheduled)
+		_sched_append(ch);
+	_sched_run(ch->conn);
+	return 0;
+}
+
+void channel_set_priority(channel *ch, const int priority) {
+	int scheduled = ch->scheduled;
+	_sched_remove(ch);
+	ch->priority = priority;
+	if (scheduled)
+		_sched_append(ch);
+	_sched_run(ch->conn);
+}
+
+uint32_t _clamp(uint32_t v, uint32_t min, uint32_t max) { return v < min ? min : v > max ? max : v; }
+
+void connection_set_window(connection *conn, uint32_t window, uint32_t maxpacket) {
+	conn->window = _clamp(window, CHANNEL_WINDOW_MIN, CHANNEL_WINDOW_MAX);
+	conn->maxpacket = _clamp(maxpacket, 1024, CHANNEL_PACKET_MAX);
+}
+
+// give the channel the lowest free id
+channel *_channel_new(connection *conn) {
+	if (conn->free_len == 0) {
+		uint32_t size = conn->channels_size ? conn->channels_size * 2 : 16;
+		channel **tmp = realloc(conn->channels, size * sizeof(channel *));
+		if (tmp == NULL)
+			return NULL;
+		memset(tmp + conn->channels_size, 0, (size - conn->channels_size) * sizeof(channel *));
+		conn->channels = tmp;
+		uint32_t *ids = realloc(conn->free_ids, size * sizeof(uint32_t));
+		if (ids == NULL)
+			return NULL;
+		conn->free_ids = ids;
+		// the new ids are stacked highest first, so the lowest ones are handed out first
+		for (uint32_t i = size; i > conn->channels_size; i--)
+			conn->free_ids[conn->free_len++] = i - 1;
+		conn->channels_size = size;
+	}
+	channel *ch = calloc(1, sizeof(channel));
+	if (ch == NULL)
+		return NULL;
+	uint32_t id = conn->free_ids[--conn->free_len];
+	ch->conn = conn;
+	ch->id = id;
+	ch->state = CHANNEL_OPENING;
+	ch->local_window = conn->window;
+	ch->local_window_max = conn->window;
+	ch->local_maxpacket = conn->maxpacket;
+	conn->channels[id] = ch;
+	conn->channels_open++;
+	return ch;
+}
+
+channel *channel_open(connection *conn, const char *type, const char *extra, size_t extra_len, channel_cb cb, void *arg) {
+	size_t type_len = strlen(type);
+	channel *ch = _channel_new(conn);
+	if (ch == NULL)
+		return NULL;
+	ch->cb = cb;
+	ch->arg = arg;
+	char *payload = packet_alloc(17 + type_len + extra_len);
+	if (payload == NULL) {
+		_channel_free(ch);
+		return NULL;
+	}
+	char *p = payload;
+	*p++ = SSH_MSG_CHANNEL_OPEN;
+	p = buf_put_string(p, type, type_len);
+	p = buf_put_u32(p, ch->id);
+	p = buf_put_u32(p, ch->local_window);
+	p = buf_put_u32(p, ch->local_maxpacket);
+	if (extra_len)
+		memcpy(p, extra, extra_len);
+	p += extra_len;
+	if (send_packet_buf(conn->t, payload, p - payload)) {
+		_channel_free(ch);
+		return NULL;
+	}
+	return ch;
+}
+
+int channel_request(channel *ch, const char *type, const int want_reply, const char *data, size_t len) {
+	size_t type_len = strlen(type);
+	// requests made before the confirmation wait in the queue until the peer's id is known
+	if (ch->state == CHANNEL_CLOSED || ch->close_pending || ch->close_sent)
+		return -1;
+	char *payload = packet_alloc(10 + type_len + len);
+	if (payload == NULL)
+		return -1;
+	char *p = payload;
+	*p++ = SSH_MSG_CHANNEL_REQUEST;
+	p = buf_put_u32(p, ch->peer_id);
+	p = buf_put_string(p, type, type_len);
+	*p++ = want_reply != 0;
+	if (len)
+		memcpy(p, data, len);
+	p += len;
+	return _channel_queue(ch, payload, p - payload);
+}
+
+int channel_exec(channel *ch, const char *command, const int want_reply) {
+	size_t len = strlen(command);
+	char *data = malloc(4 + len);
+	if (data == NULL)
+		return -1;
+	buf_put_string(data, command, len);
+	int ret = channel_request(ch, "exec", want_reply, data, 4 + len);
+	free(data);
+	return ret;
+}
+
+// send a message that only carries the peer's channel id
+int _channel_send_simple(channel *ch, const char type) {
+	char *payload = packet_alloc(5);
+	if (payload == NULL)
+		return -1;
+	payload[0] = type;
+	buf_put_u32(payload + 1, ch->peer_id);
+	return _channel_queue(ch, payload, 5);
+}
+
+// send as much of the gathered data as the peer's window allows, returns the number of bytes sent or -1
+ssize_t _channel_sendv(channel *ch, const struct iovec *iov, int iovcnt) {
+	size_t sent = 0;
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	// position in the iovec array of the next byte to send
+	int idx = 0;
+	size_t off = 0;
+	while (sent < len && ch->remote_window) {
+		size_t chunk = len - sent;
+		if (chunk > ch->remote_window)
+			chunk = ch->remote_window;
+		if (chunk > ch->remote_maxpacket)
+			chunk = ch->remote_maxpacket;
+		if (chunk > CHANNEL_PACKET_MAX)
+			chunk = CHANNEL_PACKET_MAX;
+		char *payload = packet_alloc(9 + chunk);
+		if (payload == NULL)
+			return -1;
+		payload[0] = SSH_MSG_CHANNEL_DATA;
+		buf_put_u32(payload + 1, ch->peer_id);
+		buf_put_u32(payload + 5, chunk);
+		for (size_t copied = 0; copied < chunk;) {
+			size_t n = iov[idx].iov_len - off;
+			if (n > chunk - copied)
+				n = chunk - copied;
+			memcpy(payload + 9 + copied, (char *)iov[idx].iov_base + off, n);
+			copied += n;
+			off += n;
+			if (off == iov[idx].iov_len) {
+				idx++;
+				off = 0;
+			}
+		}
+		if (_channel_queue(ch, payload, 9 + chunk))
+			return -1;
+		ch->remote_window -= chunk;
+		sent += chunk;
+	}
+	return sent;
+}
+
+ssize_t _channel_send(channel *ch, const char *data, size_t len) {
+	struct iovec iov = {(void *)data, len};
+	return _channel_sendv(ch, &iov, 1);
+}
+
+int channel_write_stderr(channel *ch, const char *data, size_t len) {
+	if (ch->state != CHANNEL_OPEN || ch->eof_pending || ch->close_pending || len > ch->remote_window)
+		return -1;
+	while (len) {
+		size_t chunk = len;
+		if (chunk > ch->remote_maxpacket)
+			chunk = ch->remote_maxpacket;
+		if (chunk > CHANNEL_PACKET_MAX)
+			chunk = CHANNEL_PACKET_MAX;
+		char *payload = packet_alloc(13 + chunk);
+		if (payload == NULL)
+			return -1;
+		char *p = payload;
+		*p++ = SSH_MSG_CHANNEL_EXTENDED_DATA;
+		p = buf_put_u32(p, ch->peer_id);
+		// SSH_EXTENDED_DATA_STDERR
+		p = buf_put_u32(p, 1);
+		buf_put_string(p, data, chunk);
+		if (_channel_queue(ch, payload, 13 + chunk))
+			return -1;
+		ch->remote_window -= chunk;
+		data += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+char *channel_data_alloc(channel *ch, size_t *room) {
+	*room = channel_writable(ch);
+	if (*room == 0)
+		return NULL;
+	if (*room > ch->remote_maxpacket)
+		*room = ch->remote_maxpacket;
+	if (*room > CHANNEL_PACKET_MAX)
+		*room = CHANNEL_PACKET_MAX;
+	// the data goes where channel_data_send expects it, behind the message header
+	char *payload = packet_alloc(9 + *room);
+	return payload != NULL ? payload + 9 : NULL;
+}
+
+int channel_data_send(channel *ch, char *data, size_t len) {
+	char *payload = data - 9;
+	if (len == 0) {
+		packet_free(payload);
+		return 0;
+	}
+	payload[0] = SSH_MSG_CHANNEL_DATA;
+	buf_put_u32(payload + 1, ch->peer_id);
+	buf_put_u32(payload + 5, len);
+	ch->remote_window -= len;
+	return _channel_queue(ch, payload, 9 + len);
+}
+
+// send buffered data and the pending EOF and close once the window allows it
+int _channel_flush(channel *ch) {
+	if (ch->state != CHANNEL_OPEN)
+		return 0;
+	if (ch->out_len) {
+		ssize_t sent = _channel_send(ch, ch->out, ch->out_len);
+		if (sent < 0)
+			return -1;
+		memmove(ch->out, ch->out + sent, ch->out_len - sent);
+		ch->out_len -= sent;
+		if (ch->out_len)
+			return 0;
+	}
+	if (ch->out_len == 0 && ch->eof_pending && !ch->eof_sent && !ch->close_sent) {
+		if (_channel_send_simple(ch, SSH_MSG_CHANNEL_EOF))
+			return -1;
+		ch->eof_sent = 1;
+	}
+	if (ch->out_len == 0 && ch->close_pending && !ch->close_sent) {
+		if (_channel_send_simple(ch, SSH_MSG_CHANNEL_CLOSE))
+			return -1;
+		ch->close_sent = 1;
+	}
+	return 0;
+}
+
+// append data to the buffer that waits for the peer's window
+int _channel_buffer(channel *ch, const char *data, size_t len) {
+	if (ch->out_len + len > ch->out_size) {
+		size_t size = ch->out_size ? ch->out_size : 4096;
+		while (size < ch->out_len + len)
+			size *= 2;
+		char *tmp = realloc(ch->out, size);
+		if (tmp == NULL)
+			return -1;
+		ch->out = tmp;
+		ch->out_size = size;
+	}
+	memcpy(ch->out + ch->out_len, data, len);
+	ch->out_len += len;
+	return 0;
+}
+
+int channel_write(channel *ch, const char *data, size_t len) {
+	struct iovec iov = {(void *)data, len};
+	return channel_writev(ch, &iov, 1);
+}
+
+int channel_writev(channel *ch, const struct iovec *iov, int iovcnt) {
+	if (ch->eof_pending || ch->close_pending)
+		return -1;
+	// write straight into packets while nothing is queued ahead of this data
+	size_t sent = 0;
+	if (ch->state == CHANNEL_OPEN && ch->out_len == 0) {
+		ssize_t n = _channel_sendv(ch, iov, iovcnt);
+		if (n < 0)
+			return -1;
+		sent = n;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		if (sent >= iov[i].iov_len) {
+			sent -= iov[i].iov_len;
+			continue;
+		}
+		if (_channel_buffer(ch, (char *)iov[i].iov_base + sent, iov[i].iov_len - sent))
+			return -1;
+		sent = 0;
+	}
+	return 0;
+}
+
+int channel_eof(channel *ch) {
+	ch->eof_pending = 1;
+	return _channel_flush(ch);
+}
+
+int channel_close(channel *ch) {
+	ch->close_pending = 1;
+	return _channel_flush(ch);
+}
+
+// top the peer's window back up to the configured size
+int _channel_adjust(channel *ch) {
+	if (ch->local_window >= ch->local_window_max || ch->close_sent || ch->eof_received)
+		return 0;
+	uint32_t grant = ch->local_window_max - ch->local_window;
+	char *payload = packet_alloc(9);
+	if (payload == NULL)
+		return -1;
+	payload[0] = SSH_MSG_CHANNEL_WINDOW_ADJUST;
+	buf_put_u32(payload + 1, ch->peer_id);
+	buf_put_u32(payload + 5, grant);
+	ch->local_window += grant;
+	return send_packet_buf(ch->conn->t, payload, 9);
+}
+
+void channel_set_window(channel *ch, uint32_t window) {
+	ch->local_window_max = _clamp(window, CHANNEL_WINDOW_MIN, CHANNEL_WINDOW_MAX);
+	if (ch->state == CHANNEL_OPEN && ch->local_window < ch->local_window_max && !ch->hold_window)
+		_channel_adjust(ch);
+}
+
+// whether enough of the window has been consumed to grant more
+int _channel_adjust_due(channel *ch) { return ch->local_window_max - ch->local_window >= ch->local_window_max / CHANNEL_ADJUST_DIVISOR; }
+
+void channel_hold_window(channel *ch, const int hold) {
+	ch->hold_window = hold != 0;
+	if (!ch->hold_window && ch->state == CHANNEL_OPEN && _channel_adjust_due(ch))
+		_channel_adjust(ch);
+}
+
+// the channel is gone on both sides
+void _channel_closed(channel *ch) {
+	ch->state = CHANNEL_CLOSED;
+	ch->conn->channels_open--;
+	if (ch->cb != NULL)
+		ch->cb(ch, CHANNEL_EV_CLOSE, NULL, 0, ch->arg);
+	_channel_free(ch);
+}
+
+int _dispatch_channel(connection *conn, const char type, const char *p, int len) {
+	uint32_t id;
+	if (buf_get_u32(&p, &len, &id) || id >= conn->channels_size || conn->channels[id] == NULL)
+		return -1;
+	channel *ch = conn->channels[id];
+	if (ch->state == CHANNEL_OPENING && type != SSH_MSG_CHANNEL_OPEN_CONFIRMATION && type != SSH_MSG_CHANNEL_OPEN_FAILURE)
+		return -1;
+	switch (type) {
+	case SSH_MSG_CHANNEL_OPEN_CONFIRMATION:
+		if (ch->state != CHANNEL_OPENING)
+			return -1;
+		if (buf_get_u32(&p, &len, &ch->peer_id) || buf_get_u32(&p, &len, &ch->remote_window) || buf_get_u32(&p, &len, &ch->remote_maxpacket))
+			return -1;
+		ch->state = CHANNEL_OPEN;
+		// requests queued while opening go out first, addressed to the id we just learned
+		for (int i = 0; i < ch->txq_len; i++)
+			buf_put_u32(ch->txq[ch->txq_head + i].payload + 1, ch->peer_id);
+		if (ch->txq_len) {
+			_sched_append(ch);
+			_sched_run(conn);
+		}
+		if (ch->cb != NULL)
+			ch->cb(ch, CHANNEL_EV_OPEN, NULL, 0, ch->arg);
+		// writes, EOF or close requested before the confirmation go out now
+		return conn->channels[id] == ch ? _channel_flush(ch) : 0;
+	case SSH_MSG_CHANNEL_OPEN_FAILURE:
+		if (ch->state != CHANNEL_OPENING)
+			return -1;
+		if (ch->cb != NULL)
+			ch->cb(ch, CHANNEL_EV_OPEN_FAILURE, p, len, ch->arg);
+		_channel_free(ch);
+		return 0;
+	case SSH_MSG_CHANNEL_WINDOW_ADJUST: {
+		uint32_t grant;
+		if (buf_get_u32(&p, &len, &grant))
+			return -1;
+		// the window may not exceed 2^32 - 1
+		if (grant > UINT32_MAX - ch->remote_window)
+			grant = UINT32_MAX - ch->remote_window;
+		ch->remote_window += grant;
+		if (_channel_flush(ch))
+			return -1;
+		_channel_notify_writable(ch);
+		return 0;
+	}
+	case SSH_MSG_CHANNEL_DATA:
+	case SSH_MSG_CHANNEL_EXTENDED_DATA: {
+		uint32_t code;
+		const char *data;
+		uint32_t data_len;
+		if (type == SSH_MSG_CHANNEL_EXTENDED_DATA && buf_get_u32(&p, &len, &code))
+			return -1;
+		if (buf_get_string(&p, &len, &data, &data_len))
+			return -1;
+		if (data_len > ch->local_window || data_len > ch->local_maxpacket)
+			return -1;
+		ch->local_window -= data_len;
+		ch->bytes_in += data_len;
+		if (ch->cb != NULL)
+			ch->cb(ch, type == SSH_MSG_CHANNEL_DATA ? CHANNEL_EV_DATA : CHANNEL_EV_EXTENDED_DATA, data, data_len, ch->arg);
+		// grant more before the window runs out so the peer never stalls waiting for it
+		if (conn->channels[id] == ch && !ch->hold_window && _channel_adjust_due(ch))
+			return _channel_adjust(ch);
+		return 0;
+	}
+	case SSH_MSG_CHANNEL_EOF:
+		ch->eof_received = 1;
+		if (ch->cb != NULL)
+			ch->cb(ch, CHANNEL_EV_EOF, NULL, 0, ch->arg);
+		return 0;
+	case SSH_MSG_CHANNEL_CLOSE:
+		ch->close_received = 1;
+		// answer with our own close at once, anything still buffered or queued is dropped
+		if (!ch->close_sent) {
+			ch->out_len = 0;
+			_channel_drop_queue(ch);
+			char *payload = packet_alloc(5);
+			if (payload == NULL)
+				return -1;
+			payload[0] = SSH_MSG_CHANNEL_CLOSE;
+			buf_put_u32(payload + 1, ch->peer_id);
+			if (send_packet_buf(conn->t, payload, 5))
+				return -1;
+			ch->close_sent = 1;
+		}
+		_channel_closed(ch);
+		return 0;
+	case SSH_MSG_CHANNEL_REQUEST: {
+		const char *req;
+		uint32_t req_len;
+		if (buf_get_string(&p, &len, &req, &req_len) || len < 1)
+			return -1;
+		int want_reply = *p++;
+		len--;
+		if (req_len == 11 && memcmp(req, "exit-status", 11) == 0) {
+			if (len < 4)
+				return -1;
+			if (ch->cb != NULL)
+				ch->cb(ch, CHANNEL_EV_EXIT_STATUS, p, 4, ch->arg);
+		} else if (ch->cb != NULL) {
+			ch->reply_pending = want_reply;
+			ch->cb(ch, CHANNEL_EV_REQUEST, req - 4, p + len - (req - 4), ch->arg);
+			if (conn->channels[id] != ch)
+				return 0;
+			want_reply = ch->reply_pending;
+			ch->reply_pending = 0;
+		}
+		// whatever the callback did not take is refused
+		if (want_reply && !ch->close_sent)
+			return _channel_send_simple(ch, SSH_MSG_CHANNEL_FAILURE);
+		return 0;
+	}
+	case SSH_MSG_CHANNEL_SUCCESS:
+	case SSH_MSG_CHANNEL_FAILURE:
+		if (ch->cb != NULL)
+			ch->cb(ch, type == SSH_MSG_CHANNEL_SUCCESS ? CHANNEL_EV_SUCCESS : CHANNEL_EV_FAILURE, NULL, 0, ch->arg);
+		return 0;
+	}
+	return -1;
+}
+
+int channel_reply(channel *ch, const int success) {
+	if (!ch->reply_pending)
+		return 0;
+	ch->reply_pending = 0;
+	if (ch->close_sent)
+		return 0;
+	return _channel_send_simple(ch, success ? SSH_MSG_CHANNEL_SUCCESS : SSH_MSG_CHANNEL_FAILURE);
+}
+
+// refuse a channel the peer wants to open
+int _reject_open(connection *conn, uint32_t sender, uint32_t code) {
+	const char *reason = "administratively prohibited";
+	if (code == SSH_OPEN_CONNECT_FAILED)
+		reason = "connect failed";
+	else if (code == SSH_OPEN_UNKNOWN_CHANNEL_TYPE)
+		reason = "channel type not supported";
+	else if (code == SSH_OPEN_RESOURCE_SHORTAGE)
+		reason = "resource shortage";
+	char *payload = packet_alloc(17 + strlen(reason));
+	if (payload == NULL)
+		return -1;
+	char *q = payload;
+	*q++ = SSH_MSG_CHANNEL_OPEN_FAILURE;
+	q = buf_put_u32(q, sender);
+	q = buf_put_u32(q, code);
+	q = buf_put_string(q, reason, strlen(reason));
+	q = buf_put_u32(q, 0);
+	return send_packet_buf(conn->t, payload, q - payload);
+}
+
+void connection_set_accept(connection *conn, channel_accept_cb cb, void *arg) {
+	conn->accept_cb = cb;
+	conn->accept_arg = arg;
+}
+
+// a channel the peer wants to open, handed to the accept callback
+int _accept_open(connection *conn, const char *p, int len) {
+	const char *type;
+	uint32_t type_len, sender, window, maxpacket;
+	if (buf_get_string(&p, &len, &type, &type_len) || buf_get_u32(&p, &len, &sender) || buf_get_u32(&p, &len, &window) ||
+	    buf_get_u32(&p, &len, &maxpacket))
+		return -1;
+	if (conn->accept_cb == NULL)
+		return _reject_open(conn, sender, SSH_OPEN_UNKNOWN_CHANNEL_TYPE);
+	channel *ch = _channel_new(conn);
+	if (ch == NULL)
+		return _reject_open(conn, sender, SSH_OPEN_RESOURCE_SHORTAGE);
+	ch->peer_id = sender;
+	ch->remote_window = window;
+	ch->remote_maxpacket = maxpacket;
+	int code = conn->accept_cb(conn, ch, type, type_len, p, len, conn->accept_arg);
+	if (code) {
+		_channel_free(ch);
+		return _reject_open(conn, sender, code);
+	}
+	char *payload = packet_alloc(17);
+	if (payload == NULL)
+		return -1;
+	char *q = payload;
+	*q++ = SSH_MSG_CHANNEL_OPEN_CONFIRMATION;
+	q = buf_put_u32(q, ch->peer_id);
+	q = buf_put_u32(q, ch->id);
+	q = buf_put_u32(q, ch->local_window);
+	q = buf_put_u32(q, ch->local_maxpacket);
+	if (send_packet_buf(conn->t, payload, q - payload))
+		return -1;
+	uint32_t id = ch->id;
+	ch->state = CHANNEL_OPEN;
+	if (ch->txq_len) {
+		_sched_append(ch);
+		_sched_run(conn);
+	}
+	if (ch->cb != NULL)
+		ch->cb(ch, CHANNEL_EV_OPEN, NULL, 0, ch->arg);
+	return conn->channels[id] == ch ? _channel_flush(ch) : 0;
+}
+
+int connection_global_request(connection *conn, const char *name, const char *data, size_t len, global_cb cb, void *arg) {
+	size_t name_len = strlen(name);
+	if (cb != NULL && conn->global_head + conn->global_len == conn->global_size) {
+		if (conn->global_head > 0) {
+			memmove(conn->global, conn->global + conn->global_head, conn->global_len * sizeof(global_request));
+			conn->global_head = 0;
+		} else {
+			int size = conn->global_size ? conn->global_size * 2 : 4;
+			global_request *tmp = realloc(conn->global, size * sizeof(global_request));
+			if (tmp == NULL)
+				return -1;
+			conn->global = tmp;
+			conn->global_size = size;
+		}
+	}
+	char *payload = packet_alloc(6 + name_len + len);
+	if (payload == NULL)
+		return -1;
+	char *p = payload;
+	*p++ = SSH_MSG_GLOBAL_REQUEST;
+	p = buf_put_string(p, name, name_len);
+	*p++ = cb != NULL;
+	if (len)
+		memcpy(p, data, len);
+	p += len;
+	if (send_packet_buf(conn->t, payload, p - payload))
+		return -1;
+	if (cb != NULL) {
+		conn->global[conn->global_head + conn->global_len].cb = cb;
+		conn->global[conn->global_head + conn->global_len++].arg = arg;
+	}
+	return 0;
+}
+
+void connection_set_kex(connection *conn, kex *k) { conn->kex = k; }
+
+int connection_dispatch(connection *conn, const char *payload, int len) {
+	if (len < 1)
+		return -1;
+	const char type = payload[0];
+	const char *p = payload + 1;
+	len--;
+	switch (type) {
+	case SSH_MSG_DISCONNECT:
+		conn->closed = 1;
+		return -1;
+	case SSH_MSG_IGNORE:
+	case SSH_MSG_DEBUG:
+	case SSH_MSG_UNIMPLEMENTED:
+		return 0;
+	case SSH_MSG_KEXINIT:
+	case SSH_MSG_NEWKEYS:
+		return conn->kex == NULL ? -1 : kex_dispatch(conn->kex, payload, len + 1);
+	case SSH_MSG_GLOBAL_REQUEST: {
+		const char *req;
+		uint32_t req_len;
+		if (buf_get_string(&p, &len, &req, &req_len) || len < 1)
+			return -1;
+		if (*p) {
+			char reply = SSH_MSG_REQUEST_FAILURE;
+			return send_packet(conn->t, &reply, 1);
+		}
+		return 0;
+	}
+	case SSH_MSG_REQUEST_SUCCESS:
+	case SSH_MSG_REQUEST_FAILURE: {
+		// a reply we did not ask for
+		if (conn->global_len == 0)
+			return -1;
+		global_request req = conn->global[conn->global_head++];
+		if (--conn->global_len == 0)
+			conn->global_head = 0;
+		req.cb(conn, type == SSH_MSG_REQUEST_SUCCESS, p, len, req.arg);
+		return 0;
+	}
+	case SSH_MSG_CHANNEL_OPEN:
+		return _accept_open(conn, p, len);
+	case SSH_MSG_CHANNEL_OPEN_CONFIRMATION:
+	case SSH_MSG_CHANNEL_OPEN_FAILURE:
+	case SSH_MSG_CHANNEL_WINDOW_ADJUST:
+	case SSH_MSG_CHANNEL_DATA:
+	case SSH_MSG_CHANNEL_EXTENDED_DATA:
+	case SSH_MSG_CHANNEL_EOF:
+	case SSH_MSG_CHANNEL_CLOSE:
+	case SSH_MSG_CHANNEL_REQUEST:
+	case SSH_MSG_CHANNEL_SUCCESS:
+	case SSH_MSG_CHANNEL_FAILURE:
+		return _dispatch_channel(conn, type, p, len);
+	}
+	// the key exchange method's own messages
+	if (type >= SSH_MSG_KEX_ECDH_INIT && type <= SSH_MSG_KEX_LAST && conn->kex != NULL)
+		return kex_dispatch(conn->kex, payload, len + 1);
+	return -1;
+}
+
+int connection_step(connection *conn) {
+	char *payload;
+	int len = recv_packet(conn->t, &payload);
+	if (len < 0 || connection_dispatch(conn, payload, len))
+		return -1;
+	// new keys before the current ones have protected too much data
+	if (conn->kex != NULL && kex_due(conn->kex))
+		return kex_start(conn->kex);
+	return 0;
+}
+
+int connection_run(connection *conn) {
+	while (conn->channels_open > 0)
+		if (connection_step(conn))
+			return -1;
+	return transport_drain(conn->t);
+}
@@ -0,0 +1,396 @@
+#pragma once
+
+#include "kex.h"
+#include "network.h"
+
+// receive window advertised for new channels unless configured otherwise (large enough for long fat links)
+#define CHANNEL_WINDOW_DEFAULT (16 << 20)
+// largest receive window a channel may advertise
+#define CHANNEL_WINDOW_MAX (1 << 30)
+// smallest receive window, below this the peer could not send a full packet
+#define CHANNEL_WINDOW_MIN (64 << 10)
+// largest data packet we accept, bounded by MAX_PACKET_SIZE with room for the header, padding and MAC
+#define CHANNEL_PACKET_MAX 32768
+// a window adjust is sent once this fraction (1/n) of the window has been consumed
+#define CHANNEL_ADJUST_DIVISOR 4
+// queued bytes a channel may have waiting for the scheduler before it stops reporting itself writable
+#define CHANNEL_BACKLOG_MAX (4 * CHANNEL_PACKET_MAX)
+// bytes a bulk channel may send per round of the scheduler
+#define SCHED_QUANTUM 16384
+// encrypted bytes the scheduler keeps queued ahead of the socket (interactive packets may exceed it)
+#define SCHED_QUEUE_LIMIT (256 << 10)
+
+enum ssh_msg {
+	SSH_MSG_USERAUTH_REQUEST = 50,
+	SSH_MSG_USERAUTH_FAILURE = 51,
+	SSH_MSG_USERAUTH_SUCCESS = 52,
+	SSH_MSG_USERAUTH_BANNER = 53,
+	SSH_MSG_GLOBAL_REQUEST = 80,
+	SSH_MSG_REQUEST_SUCCESS = 81,
+	SSH_MSG_REQUEST_FAILURE = 82,
+	SSH_MSG_CHANNEL_OPEN = 90,
+	SSH_MSG_CHANNEL_OPEN_CONFIRMATION = 91,
+	SSH_MSG_CHANNEL_OPEN_FAILURE = 92,
+	SSH_MSG_CHANNEL_WINDOW_ADJUST = 93,
+	SSH_MSG_CHANNEL_DATA = 94,
+	SSH_MSG_CHANNEL_EXTENDED_DATA = 95,
+	SSH_MSG_CHANNEL_EOF = 96,
+	SSH_MSG_CHANNEL_CLOSE = 97,
+	SSH_MSG_CHANNEL_REQUEST = 98,
+	SSH_MSG_CHANNEL_SUCCESS = 99,
+	SSH_MSG_CHANNEL_FAILURE = 100,
+};
+
+enum channel_state {
+	CHANNEL_OPENING,
+	CHANNEL_OPEN,
+	CHANNEL_CLOSED,
+};
+
+enum channel_priority {
+	// served by deficit round robin with the other bulk channels
+	CHANNEL_PRIORITY_BULK = 0,
+	// always sent ahead of bulk channels
+	CHANNEL_PRIORITY_INTERACTIVE = 1,
+};
+
+// reasons for refusing a channel the peer wants to open
+enum channel_open_failure {
+	SSH_OPEN_ADMINISTRATIVELY_PROHIBITED = 1,
+	SSH_OPEN_CONNECT_FAILED = 2,
+	SSH_OPEN_UNKNOWN_CHANNEL_TYPE = 3,
+	SSH_OPEN_RESOURCE_SHORTAGE = 4,
+};
+
+enum channel_event {
+	// the peer confirmed the open
+	CHANNEL_EV_OPEN,
+	// the peer refused the open, the channel is freed after the callback
+	CHANNEL_EV_OPEN_FAILURE,
+	// data arrived (extended data carries the stderr stream)
+	CHANNEL_EV_DATA,
+	CHANNEL_EV_EXTENDED_DATA,
+	CHANNEL_EV_EOF,
+	// both sides closed the channel, it is freed after the callback
+	CHANNEL_EV_CLOSE,
+	// reply to a request sent with want_reply
+	CHANNEL_EV_SUCCESS,
+	CHANNEL_EV_FAILURE,
+	// the remote command exited, data holds the status as a big-endian uint32
+	CHANNEL_EV_EXIT_STATUS,
+	// channel_writable went from 0 to non-zero
+	CHANNEL_EV_WRITABLE,
+	// the peer made a request (e.g. "exec" on a server), data holds the type as a string, want_reply and the type specific
+	// data, a request not answered with channel_reply by the callback is refused
+	CHANNEL_EV_REQUEST,
+};
+
+struct connection;
+struct channel;
+
+typedef void (*channel_cb)(struct channel *, int, const char *, size_t, void *);
+typedef int (*channel_accept_cb)(struct connection *, struct channel *, const char *, size_t, const char *, size_t, void *);
+typedef void (*global_cb)(struct connection *, int, const char *, size_t, void *);
+
+typedef struct channel_packet {
+	char *payload;
+	int len;
+} channel_packet;
+
+typedef struct channel {
+	struct connection *conn;
+	uint32_t id;
+	uint32_t peer_id;
+	int state;
+	channel_cb cb;
+	void *arg;
+	// receive side: what the peer may still send, and what we advertise when it runs low
+	uint32_t local_window;
+	uint32_t local_window_max;
+	uint32_t local_maxpacket;
+	// send side: what we may still send and the largest data packet the peer takes
+	uint32_t remote_window;
+	uint32_t remote_maxpacket;
+	// data received since the window tuner last looked
+	uint64_t bytes_in;
+	// data waiting for the peer to open its window
+	char *out;
+	size_t out_len;
+	size_t out_size;
+	// packets waiting for the scheduler, in order
+	channel_packet *txq;
+	int txq_head;
+	int txq_len;
+	int txq_size;
+	size_t txq_bytes;
+	// scheduling class, byte credit for this round and link in the connection's run list
+	int priority;
+	uint32_t deficit;
+	struct channel *sched_next;
+	unsigned char scheduled;
+	// a writer saw channel_writable return 0 and waits for CHANNEL_EV_WRITABLE
+	unsigned char want_writable;
+	// the channel's id is on the connection's list of writers waiting for room
+	unsigned char waiting;
+	// the window is not topped up while whatever the data goes to cannot take more
+	unsigned char hold_window;
+	// the request being handed to the callback wants a reply that was not sent yet
+	unsigned char reply_pending;
+	unsigned char eof_pending;
+	unsigned char close_pending;
+	unsigned char eof_sent;
+	unsigned char eof_received;
+	unsigned char close_sent;
+	unsigned char close_received;
+} channel;
+
+// a global request waiting for its reply
+typedef struct global_request {
+	global_cb cb;
+	void *arg;
+} global_request;
+
+typedef struct connection {
+	transport *t;
+	// channels indexed by local id, NULL for free ids
+	channel **channels;
+	uint32_t channels_size;
+	// free ids as a stack, so opening a channel never scans the table
+	uint32_t *free_ids;
+	uint32_t free_len;
+	int channels_open;
+	// window and packet size given to new channels
+	uint32_t window;
+	uint32_t maxpacket;
+	// channels with queued packets, interactive ones are served first
+	channel *prio_head;
+	channel *prio_tail;
+	channel *bulk_head;
+	channel *bulk_tail;
+	// encrypted bytes allowed ahead of the socket
+	size_t queue_limit;
+	// ids of channels waiting for CHANNEL_EV_WRITABLE, an id may be stale once its channel is gone
+	uint32_t *waiting;
+	uint32_t waiting_len;
+	uint32_t waiting_size;
+	// decides on channels the peer opens, they are refused if NULL
+	channel_accept_cb accept_cb;
+	void *accept_arg;
+	// global requests waiting for their replies, which come in the order the requests were sent
+	global_request *global;
+	int global_head;
+	int global_len;
+	int global_size;
+	// key exchanges after the first, NULL if the peer may not start one
+	kex *kex;
+	unsigned char waking;
+	unsigned char sched_running;
+	unsigned char closed;
+} connection;
+
+/**
+ * @brief Initialize the connection layer on top of an authenticated transport
+ * @param conn The connection to initialize
+ * @param t The transport
+ * @return 0 on success, -1 on error
+ */
+int connection_init(connection *, transport *);
+
+/**
+ * @brief Free a connection and every channel still in it
+ * @param conn The connection to free
+ */
+void connection_free(connection *);
+
+/**
+ * @brief Set the receive window and maximum packet size for channels opened from now on
+ * @note Values are clamped to CHANNEL_WINDOW_MIN..CHANNEL_WINDOW_MAX and CHANNEL_PACKET_MAX
+ * @param conn The connection
+ * @param window The initial receive window in bytes
+ * @param maxpacket The largest data packet the peer may send
+ */
+void connection_set_window(connection *, uint32_t, uint32_t);
+
+/**
+ * @brief Accept channels the peer opens (e.g. "forwarded-tcpip") instead of refusing them
+ * @note The callback gets the new channel with the peer's id, window and packet size set, it sets the channel's callback and
+ * returns 0 to accept it or an SSH_OPEN_* reason to refuse it, in which case the channel is freed
+ * @param conn The connection
+ * @param cb Called with the connection, the channel, the channel type and its length, the type specific data and its length
+ * @param arg Passed to the callback
+ */
+void connection_set_accept(connection *, channel_accept_cb, void *);
+
+/**
+ * @brief Let the connection exchange new keys when the server asks or a limit of the current keys is reached
+ * @param conn The connection
+ * @param k The key exchange state of the first exchange
+ */
+void connection_set_kex(connection *, kex *);
+
+/**
+ * @brief Send a global request (e.g. "tcpip-forward")
+ * @param conn The connection
+ * @param name The request name
+ * @param data Request specific data, may be NULL
+ * @param len The length of the request specific data
+ * @param cb Called with 1 and the reply's data on success or 0 on failure, no reply is asked for if NULL
+ * @param arg Passed to the callback
+ * @return 0 on success, -1 on error
+ */
+int connection_global_request(connection *, const char *, const char *, size_t, global_cb, void *);
+
+/**
+ * @brief Handle one connection layer packet
+ * @param conn The connection
+ * @param payload The packet payload
+ * @param len The length of the payload
+ * @return 0 on success, -1 on a protocol error or disconnect
+ */
+int connection_dispatch(connection *, const char *, int);
+
+/**
+ * @brief Receive and handle one packet, running the event loop while waiting for it
+ * @param conn The connection
+ * @return 0 on success, -1 on error
+ */
+int connection_step(connection *);
+
+/**
+ * @brief Receive and handle packets until every channel is closed
+ * @param conn The connection
+ * @return 0 when no channels are left, -1 on error
+ */
+int connection_run(connection *);
+
+/**
+ * @brief Open a channel, the callback receives CHANNEL_EV_OPEN once the peer confirms
+ * @param conn The connection
+ * @param type The channel type (e.g. "session")
+ * @param extra Type specific data appended to the open request, may be NULL
+ * @param extra_len The length of the type specific data
+ * @param cb Called with the channel's events
+ * @param arg Passed to the callback
+ * @return The channel, NULL on error
+ */
+channel *channel_open(connection *, const char *, const char *, size_t, channel_cb, void *);
+
+/**
+ * @brief Send a channel request
+ * @note Requests made while the channel is opening are sent as soon as the peer confirms it, without waiting for the caller
+ * @param ch The channel
+ * @param type The request type (e.g. "exec")
+ * @param want_reply Whether the peer should answer with CHANNEL_EV_SUCCESS or CHANNEL_EV_FAILURE
+ * @param data Type specific data, may be NULL
+ * @param len The length of the type specific data
+ * @return 0 on success, -1 on error
+ */
+int channel_request(channel *, const char *, const int, const char *, size_t);
+
+/**
+ * @brief Ask the peer to run a command on a session channel
+ * @param ch The channel
+ * @param command The command line
+ * @param want_reply Whether the peer should confirm the request
+ * @return 0 on success, -1 on error
+ */
+int channel_exec(channel *, const char *, const int);
+
+/**
+ * @brief Answer the request the callback is handling for CHANNEL_EV_REQUEST (does nothing if the peer wants no reply)
+ * @param ch The channel
+ * @param success 1 to accept the request, 0 to refuse it
+ * @return 0 on success, -1 on error
+ */
+int channel_reply(channel *, const int);
+
+/**
+ * @brief Send data, whatever does not fit the peer's window is buffered until it opens up
+ * @param ch The channel
+ * @param data The data to send
+ * @param len The length of the data
+ * @return 0 on success, -1 on error
+ */
+int channel_write(channel *, const char *, size_t);
+
+/**
+ * @brief Send data gathered from several buffers as one stream, packed into as few packets as possible
+ * @param ch The channel
+ * @param iov The buffers
+ * @param iovcnt The number of buffers
+ * @return 0 on success, -1 on error
+ */
+int channel_writev(channel *, const struct iovec *, int);
+
+/**
+ * @brief Number of bytes that can be written without being buffered or queueing up behind other channels
+ * @note After it returns 0 the channel's callback receives CHANNEL_EV_WRITABLE once there is room again
+ * @param ch The channel
+ * @return The free send window, limited by CHANNEL_BACKLOG_MAX
+ */
+size_t channel_writable(channel *);
+
+/**
+ * @brief Send extended data (the stderr stream of a command) without buffering it
+ * @param ch The channel
+ * @param data The data to send
+ * @param len The length of the data, at most what channel_writable returned
+ * @return 0 on success, -1 on error or if the data does not fit the peer's window
+ */
+int channel_write_stderr(channel *, const char *, size_t);
+
+/**
+ * @brief Get a packet buffer to read data into, so it is sent without being copied
+ * @note Nothing may be written to the channel until the buffer is passed to channel_data_send. Returns NULL when
+ * channel_writable would return 0, and the callback then receives CHANNEL_EV_WRITABLE once there is room again
+ * @param ch The channel
+ * @param room Set to how many bytes the buffer takes, at most the peer's window and packet size
+ * @return The buffer, NULL if there is no room or on error
+ */
+char *channel_data_alloc(channel *, size_t *);
+
+/**
+ * @brief Send the data read into a buffer from channel_data_alloc, the buffer is consumed
+ * @param ch The channel
+ * @param data The buffer
+ * @param len The number of bytes in it, 0 just frees the buffer
+ * @return 0 on success, -1 on error
+ */
+int channel_data_send(channel *, char *, size_t);
+
+/**
+ * @brief Stop or resume granting the peer more window as received data is consumed
+ * @note Holding the window while the data cannot be passed on makes the peer stop sending once the window runs out
+ * @param ch The channel
+ * @param hold 1 to hold the window, 0 to top it up again
+ */
+void channel_hold_window(channel *, const int);
+
+/**
+ * @brief Signal the end of our data once everything buffered has been sent
+ * @param ch The channel
+ * @return 0 on success, -1 on error
+ */
+int channel_eof(channel *);
+
+/**
+ * @brief Close the channel once everything buffered has been sent
+ * @param ch The channel
+ * @return 0 on success, -1 on error
+ */
+int channel_close(channel *);
+
+/**
+ * @brief Change how much data the peer may have in flight on this channel
+ * @note Growing the window takes effect at once, shrinking takes effect as the peer uses up what it was given
+ * @param ch The channel
+ * @param window The receive window in bytes
+ */
+void channel_set_window(channel *, uint32_t);
+
+/**
+ * @brief Choose how the channel shares the connection with other channels
+ * @param ch The channel
+ * @param priority CHANNEL_PRIORITY_BULK or CHANNEL_PRIORITY_INTERACTIVE
+ */
+void channel_set_priority(channel *, const int);
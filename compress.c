@@ -0,0 +1,108 @@
+#include "compress.h"
+
+int compress_init(compress_state *cs, const int level) {
+	memset(cs, 0, sizeof(compress_state));
+	cs->level = level < 1 ? 1 : level > 9 ? 9 : level;
+	cs->current = cs->level;
+	if (deflateInit(&cs->z, cs->current) != Z_OK)
+		return -1;
+	cs->deflating = 1;
+	cs->enabled = 1;
+	return 0;
+}
+
+int decompress_init(compress_state *cs) {
+	memset(cs, 0, sizeof(compress_state));
+	if (inflateInit(&cs->z) != Z_OK)
+		return -1;
+	cs->enabled = 1;
+	return 0;
+}
+
+void compress_free(compress_state *cs) {
+	if (!cs->enabled)
+		return;
+	if (cs->deflating)
+		deflateEnd(&cs->z);
+	else
+		inflateEnd(&cs->z);
+	free(cs->buf);
+	memset(cs, 0, sizeof(compress_state));
+}
+
+// pick the level for the next sample from how well the last one compressed
+int _compress_choose(compress_state *cs) {
+	if (cs->current == 0)
+		return cs->in >= COMPRESS_PROBE ? 1 : -1;
+	if (cs->in < COMPRESS_SAMPLE)
+		return -1;
+	if (cs->out * 100 > cs->in * COMPRESS_STORED_PERCENT)
+		return 0;
+	if (cs->out * 100 > cs->in * COMPRESS_FAST_PERCENT)
+		return 1;
+	return cs->level;
+}
+
+int compress_packet(compress_state *cs, const char *in, int len, char *out) {
+	z_stream *z = &cs->z;
+	size_t size = COMPRESS_BOUND(len);
+	z->next_out = (Bytef *)out;
+	z->avail_out = size;
+	int level = _compress_choose(cs);
+	if (level >= 0) {
+		// the switch takes effect at a block boundary, so the stream stays valid for the peer
+		if (level != cs->current && deflateParams(z, level, Z_DEFAULT_STRATEGY) != Z_OK)
+			return -1;
+		cs->current = level;
+		cs->in = 0;
+		cs->out = 0;
+	}
+	size_t before = z->avail_out;
+	z->next_in = (Bytef *)in;
+	z->avail_in = len;
+	// a partial flush ends the packet on a byte boundary without resetting the dictionary
+	if (deflate(z, Z_PARTIAL_FLUSH) != Z_OK || z->avail_in != 0)
+		return -1;
+	// with no room left deflate may still hold output back, and the peer could not decompress the packet on its own
+	if (z->avail_out == 0)
+		return -1;
+	cs->in += len;
+	cs->out += before - z->avail_out;
+	return size - z->avail_out;
+}
+
+int decompress_packet(compress_state *cs, const char *in, int len, char **out) {
+	z_stream *z = &cs->z;
+	if (cs->buf == NULL) {
+		cs->size = 1 << 16;
+		cs->buf = malloc(cs->size);
+		if (cs->buf == NULL)
+			return -1;
+	}
+	z->next_in = (Bytef *)in;
+	z->avail_in = len;
+	size_t total = 0;
+	for (;;) {
+		z->next_out = (Bytef *)cs->buf + total;
+		z->avail_out = cs->size - total;
+		int ret = inflate(z, Z_SYNC_FLUSH);
+		total = cs->size - z->avail_out;
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			return -1;
+		// done once the input is used up and inflate did not stop for lack of room
+		if (z->avail_in == 0 && z->avail_out != 0)
+			break;
+		if (ret == Z_BUF_ERROR && z->avail_out != 0)
+			return -1;
+		if (cs->size == COMPRESS_PAYLOAD_MAX)
+			return -1;
+		size_t size = cs->size * 2 < COMPRESS_PAYLOAD_MAX ? cs->size * 2 : COMPRESS_PAYLOAD_MAX;
+		char *tmp = realloc(cs->buf, size);
+		if (tmp == NULL)
+			return -1;
+		cs->buf = tmp;
+		cs->size = size;
+	}
+	*out = cs->buf;
+	return total;
+}
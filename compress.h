@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+// zlib level used unless configured otherwise (what OpenSSH uses)
+#define COMPRESS_LEVEL_DEFAULT 6
+// input bytes over which the compression ratio is measured before the level is chosen again
+#define COMPRESS_SAMPLE (256 << 10)
+// output above this percentage of the input counts as incompressible, the data is sent as stored blocks
+#define COMPRESS_STORED_PERCENT 90
+// output above this percentage only gets the cheapest level
+#define COMPRESS_FAST_PERCENT 70
+// input bytes sent as stored blocks before compressing is tried again
+#define COMPRESS_PROBE (4 << 20)
+// largest payload a compressed packet may expand to (OpenSSH limits packets to 256KB)
+#define COMPRESS_PAYLOAD_MAX (256 << 10)
+// room a compressed payload may need beyond the input (stored block headers and the flush marker)
+#define COMPRESS_BOUND(len) ((len) + (len) / 16 + 64)
+
+typedef struct compress_state {
+	z_stream z;
+	// the level asked for and the one in use, 0 while the data does not compress
+	int level;
+	int current;
+	// bytes in and out since the level was last chosen
+	uint64_t in;
+	uint64_t out;
+	// decompressed payloads, valid until the next packet
+	char *buf;
+	size_t size;
+	unsigned char deflating;
+	// set once compression has taken effect in this direction
+	unsigned char enabled;
+} compress_state;
+
+/**
+ * @brief Start compressing one direction of a connection, the stream stays open for the life of the connection
+ * @param cs The compression state to initialize
+ * @param level The zlib level (1 to 9)
+ * @return 0 on success, -1 on error
+ */
+int compress_init(compress_state *, const int);
+
+/**
+ * @brief Start decompressing one direction of a connection
+ * @param cs The compression state to initialize
+ * @return 0 on success, -1 on error
+ */
+int decompress_init(compress_state *);
+
+/**
+ * @brief Free a compression state (does nothing if it was never initialized)
+ * @param cs The compression state
+ */
+void compress_free(compress_state *);
+
+/**
+ * @brief Compress a packet payload, flushed so the peer can decompress it without waiting for more
+ * @note While recent packets did not compress the payload goes out in stored blocks, which costs a copy instead of a search
+ * @param cs The compression state
+ * @param in The payload
+ * @param len The length of the payload
+ * @param out Where to write the compressed payload, at least COMPRESS_BOUND(len) bytes
+ * @return Length of the compressed payload, -1 on error
+ */
+int compress_packet(compress_state *, const char *, int, char *);
+
+/**
+ * @brief Decompress a packet payload
+ * @param cs The compression state
+ * @param in The compressed payload
+ * @param len The length of the compressed payload
+ * @param out Set to the decompressed payload, valid until the next call
+ * @return Length of the decompressed payload, -1 on error
+ */
+int decompress_packet(compress_state *, const char *, int, char **);
@@ -2,6 +2,30 @@
 
 unsigned char ECDSA_initialized = 0;
 
+// precomputed signing nonces, only k^-1 and r are kept since k itself is never needed
+struct ECDSA_nonce {
+	mpz_t kinv;
+	mpz_t r;
+};
+
+// ring of ready nonces, consumed from head
+static struct ECDSA_nonce *pool = NULL;
+static int pool_size = 0;
+static int pool_head = 0;
+static int pool_count = 0;
+static unsigned char pool_running = 0;
+static pthread_t pool_thread;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+// overwrite the limbs of x so secrets do not outlive their use
+void _mpz_wipe(mpz_t x) {
+	size_t size = mpz_size(x);
+	if (size)
+		memset(mpz_limbs_modify(x, size), 0, size * sizeof(mp_limb_t));
+	mpz_limbs_finish(x, 0);
+}
+
 void ECDSA_init() {
 	if (ECDSA_initialized)
 		return;
@@ -39,35 +63,186 @@ void ECDSA_load_keypair(const char *privkey_filename, const char *pubkey_filenam
 
 void print_num(mpz_t x) { gmp_printf("0x%Zx\n", x); }
 
-void ECDSA_sign(ECDSA_keypair *keypair, const char *message, int len, char **signature, int *siglen) {
-	char *e, *buf_k;
-	e = malloc(32);
-	mpz_t k, r, s, n, e_mpz;
-	mpz_inits(k, r, s, n, e_mpz, NULL);
+// generate a fresh nonce k and return k^-1 mod n and r = (kG).x mod n
+void _ECDSA_make_nonce(mpz_t kinv, mpz_t r) {
+	mpz_t k, n;
+	mpz_inits(k, n, NULL);
 	EC_point G, kG;
 	EC_init_generator(&G);
 	EC_init(&kG);
 	EC_order(n);
+	int klen = (mpz_sizeinbase(n, 2) + 7) / 8;
+	char *buf_k = malloc(klen);
+	do {
+		// generate k
+		do {
+			randbytes(buf_k, klen);
+			mpz_import(k, klen, 1, 1, 0, 0, buf_k);
+		} while (mpz_cmp(k, n) >= 0 || mpz_cmp_ui(k, 0) == 0);
+		// compute kG
+		EC_mul(&kG, &G, k);
+		// r = kG.x mod n
+		mpz_mod(r, kG.x, n);
+	} while (mpz_cmp_ui(r, 0) == 0);
+	mpz_invert(kinv, k, n);
+	// k is never needed again, so do not leave it lying around
+	memset(buf_k, 0, klen);
+	free(buf_k);
+	_mpz_wipe(k);
+	mpz_clears(k, n, NULL);
+	EC_clear(&G);
+	EC_clear(&kG);
+}
+
+int _ECDSA_pool_take(mpz_t kinv, mpz_t r) {
+	pthread_mutex_lock(&pool_lock);
+	if (pool_count == 0) {
+		pthread_mutex_unlock(&pool_lock);
+		return -1;
+	}
+	// swap the entry out instead of copying it so the secret only ever exists once
+	struct ECDSA_nonce *entry = &pool[pool_head];
+	mpz_swap(kinv, entry->kinv);
+	mpz_swap(r, entry->r);
+	_mpz_wipe(entry->kinv);
+	pool_head = (pool_head + 1) % pool_size;
+	pool_count--;
+	// let the producer know there is room again
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+	return 0;
+}
+
+// put a nonce into the pool, returns -1 if the pool is full
+int _ECDSA_pool_put(mpz_t kinv, mpz_t r) {
+	if (pool_count == pool_size)
+		return -1;
+	struct ECDSA_nonce *entry = &pool[(pool_head + pool_count) % pool_size];
+	mpz_swap(kinv, entry->kinv);
+	mpz_swap(r, entry->r);
+	pool_count++;
+	return 0;
+}
+
+void *_ECDSA_pool_worker(void *arg) {
+	(void)arg;
+	mpz_t kinv, r;
+	mpz_inits(kinv, r, NULL);
+	pthread_mutex_lock(&pool_lock);
+	while (pool_running) {
+		// sleep until a signature consumes an entry
+		if (pool_count == pool_size) {
+			pthread_cond_wait(&pool_cond, &pool_lock);
+			continue;
+		}
+		// do the expensive part without holding the lock
+		pthread_mutex_unlock(&pool_lock);
+		_ECDSA_make_nonce(kinv, r);
+		pthread_mutex_lock(&pool_lock);
+		_ECDSA_pool_put(kinv, r);
+		_mpz_wipe(kinv);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	mpz_clears(kinv, r, NULL);
+	return NULL;
+}
+
+int ECDSA_pool_init(int size, int background) {
+	if (pool != NULL || size <= 0)
+		return -1;
+	ECDSA_init();
+	pool = malloc(size * sizeof(struct ECDSA_nonce));
+	if (pool == NULL)
+		return -1;
+	for (int i = 0; i < size; i++)
+		mpz_inits(pool[i].kinv, pool[i].r, NULL);
+	pool_size = size;
+	pool_head = 0;
+	pool_count = 0;
+	if (background) {
+		pool_running = 1;
+		if (pthread_create(&pool_thread, NULL, _ECDSA_pool_worker, NULL) != 0) {
+			// without a thread to refill it, signing makes its nonces inline as if there were no pool
+			pool_running = 0;
+			for (int i = 0; i < size; i++)
+				mpz_clears(pool[i].kinv, pool[i].r, NULL);
+			free(pool);
+			pool = NULL;
+			pool_size = 0;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int ECDSA_pool_fill(int max) {
+	if (pool == NULL)
+		return 0;
+	mpz_t kinv, r;
+	mpz_inits(kinv, r, NULL);
+	int added = 0;
+	while (added < max) {
+		pthread_mutex_lock(&pool_lock);
+		int full = pool_count == pool_size;
+		pthread_mutex_unlock(&pool_lock);
+		if (full)
+			break;
+		_ECDSA_make_nonce(kinv, r);
+		pthread_mutex_lock(&pool_lock);
+		// the background thread may have filled the last slot in the meantime
+		if (_ECDSA_pool_put(kinv, r) == 0)
+			added++;
+		pthread_mutex_unlock(&pool_lock);
+		_mpz_wipe(kinv);
+	}
+	mpz_clears(kinv, r, NULL);
+	return added;
+}
+
+int ECDSA_pool_available() {
+	pthread_mutex_lock(&pool_lock);
+	int count = pool == NULL ? 0 : pool_count;
+	pthread_mutex_unlock(&pool_lock);
+	return count;
+}
+
+void ECDSA_pool_free() {
+	if (pool == NULL)
+		return;
+	if (pool_running) {
+		pthread_mutex_lock(&pool_lock);
+		pool_running = 0;
+		pthread_cond_signal(&pool_cond);
+		pthread_mutex_unlock(&pool_lock);
+		pthread_join(pool_thread, NULL);
+	}
+	for (int i = 0; i < pool_size; i++) {
+		_mpz_wipe(pool[i].kinv);
+		mpz_clears(pool[i].kinv, pool[i].r, NULL);
+	}
+	free(pool);
+	pool = NULL;
+	pool_size = pool_head = pool_count = 0;
+}
+
+void ECDSA_sign(ECDSA_keypair *keypair, const char *message, int len, char **signature, int *siglen) {
+	char e[32];
+	mpz_t kinv, r, s, n, e_mpz;
+	mpz_inits(kinv, r, s, n, e_mpz, NULL);
+	EC_order(n);
 	// compute e
 	sha256_digest(message, len, e);
 	mpz_import(e_mpz, 32, 1, 1, 0, 0, e);
-	// generate k
-	buf_k = malloc((mpz_sizeinbase(n, 2) + 7) / 8);
-	do {
-		randbytes(buf_k, (mpz_sizeinbase(n, 2) + 7) / 8);
-		mpz_import(k, (mpz_sizeinbase(n, 2) + 7) / 8, 1, 1, 0, 0, buf_k);
-	} while (mpz_cmp(k, n) >= 0 || mpz_cmp_ui(k, 0) == 0);
-	// mpz_import(k, 32, 1, 1, 0, 0, "\xD1\x6B\x6A\xE8\x27\xF1\x71\x75\xE0\x40\x87\x1A\x1C\x7E\xC3\x50\x01\x92\xC4\xC9\x26\x77\x33\x6E\xC2\x53\x7A\xCA\xEE\x00\x08\xE0");
-	// compute kG
-	EC_mul(&kG, &G, k);
-	// r = kG.x
-	mpz_set(r, kG.x);
+	// take a precomputed nonce, or make one now if the pool is empty
+	if (_ECDSA_pool_take(kinv, r) != 0)
+		_ECDSA_make_nonce(kinv, r);
 	// s = (e + r * d) / k
 	mpz_mul(s, r, keypair->privkey);
 	mpz_add(s, s, e_mpz);
-	mpz_invert(k, k, n);
-	mpz_mul(s, s, k);
+	mpz_mul(s, s, kinv);
 	mpz_mod(s, s, n);
+	// the nonce is single use
+	_mpz_wipe(kinv);
 	// save r and s
 	int rlen = (mpz_sizeinbase(r, 2) + 7) / 8;
 	int slen = (mpz_sizeinbase(s, 2) + 7) / 8;
@@ -115,12 +290,7 @@ void ECDSA_sign(ECDSA_keypair *keypair, const char *message, int len, char **sig
 	// (*signature)[3] = rlen + (extra & 1);
 	// (*signature)[rlen + (extra & 1) + 4] = 0x02;
 	// (*signature)[rlen + (extra & 1) + 5] = slen + (extra >> 1);
-	// free(buf_k);
-	// free(e);
-	// mpz_clears(k, r, s, n, e_mpz, NULL);
-	// EC_clear(&G);
-	// EC_clear(&kG);
-	return 0;
+	mpz_clears(kinv, r, s, n, e_mpz, NULL);
 }
 
 int ECDSA_verify(ECDSA_keypair *keypair, const char *message, int len, const char *signature) {
@@ -4,6 +4,7 @@
 #include "ec.h"
 #include "random.h"
 #include "sha.h"
+#include <pthread.h>
 #include <stdio.h>
 
 typedef struct ECDSA_keypair {
@@ -29,6 +30,12 @@ typedef struct ECDSA_keypair {
 // S = u1*G + u2*aG
 // if S.x == r then signature is valid
 
+/**
+ * @brief Overwrite the limbs of a number so a secret does not outlive its use
+ * @param x The number, left at 0
+ */
+void _mpz_wipe(mpz_t);
+
 /**
  * @brief Initialize the ECDSA subsystem.
  */
@@ -72,6 +79,33 @@ void ECDSA_load_keypair(const char *, const char *, ECDSA_keypair *);
  */
 void ECDSA_sign(ECDSA_keypair *, const char *, int, char **, int *);
 
+/**
+ * @brief Set up the signing nonce pool
+ * @note Each entry holds k^-1 mod n and r = (kG).x, so ECDSA_sign only needs two modular multiplications
+ * @param size The number of nonces to keep ready
+ * @param background 1 to keep the pool filled from a background thread, 0 to only fill it with ECDSA_pool_fill
+ * @return 0 on success, -1 on error, in which case there is no pool and ECDSA_sign makes its nonces inline
+ */
+int ECDSA_pool_init(int, int);
+
+/**
+ * @brief Precompute nonces on the calling thread (e.g. while the event loop is idle)
+ * @param max The maximum number of nonces to add
+ * @return The number of nonces added
+ */
+int ECDSA_pool_fill(int);
+
+/**
+ * @brief Return the number of nonces ready to be used
+ * @return The number of ready nonces
+ */
+int ECDSA_pool_available();
+
+/**
+ * @brief Stop the background thread and wipe every unused nonce
+ */
+void ECDSA_pool_free();
+
 /**
  * @brief Verify a signature
  * @param keypair The keypair to verify with
@@ -0,0 +1,239 @@
+#include "event.h"
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+// number of events picked up per epoll_wait
+#define EVENT_BATCH 64
+
+uint64_t event_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int event_loop_init(event_loop *loop) {
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0)
+		return -1;
+	loop->handlers = NULL;
+	loop->handlers_size = 0;
+	loop->removed = NULL;
+	loop->dispatching = 0;
+	loop->timers = NULL;
+	loop->timers_len = 0;
+	loop->timers_size = 0;
+	loop->prepare = NULL;
+	loop->prepare_len = 0;
+	loop->running = 0;
+	return 0;
+}
+
+// free the handlers removed during a batch
+void _handlers_release(event_loop *loop) {
+	while (loop->removed != NULL) {
+		event_handler *h = loop->removed;
+		loop->removed = h->next;
+		free(h);
+	}
+}
+
+void event_loop_free(event_loop *loop) {
+	for (int i = 0; i < loop->handlers_size; i++)
+		free(loop->handlers[i]);
+	free(loop->handlers);
+	_handlers_release(loop);
+	for (int i = 0; i < loop->timers_len; i++)
+		free(loop->timers[i]);
+	free(loop->timers);
+	free(loop->prepare);
+	close(loop->epfd);
+}
+
+int event_add(event_loop *loop, int fd, uint32_t events, event_cb cb, void *arg) {
+	// grow the handler table so it can be indexed by fd
+	if (fd >= loop->handlers_size) {
+		int size = loop->handlers_size ? loop->handlers_size : 64;
+		while (size <= fd)
+			size *= 2;
+		event_handler **tmp = realloc(loop->handlers, size * sizeof(event_handler *));
+		if (tmp == NULL)
+			return -1;
+		memset(tmp + loop->handlers_size, 0, (size - loop->handlers_size) * sizeof(event_handler *));
+		loop->handlers = tmp;
+		loop->handlers_size = size;
+	}
+	if (loop->handlers[fd] != NULL)
+		return -1;
+	event_handler *h = malloc(sizeof(event_handler));
+	if (h == NULL)
+		return -1;
+	h->fd = fd;
+	h->events = events;
+	h->cb = cb;
+	h->arg = arg;
+	h->next = NULL;
+	// the event carries the handler itself, so one fetched for an fd that was closed and reused finds the old handler
+	struct epoll_event ev = {0};
+	ev.events = events | EPOLLET;
+	ev.data.ptr = h;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		free(h);
+		return -1;
+	}
+	loop->handlers[fd] = h;
+	return 0;
+}
+
+int event_mod(event_loop *loop, int fd, uint32_t events) {
+	if (fd >= loop->handlers_size || loop->handlers[fd] == NULL)
+		return -1;
+	loop->handlers[fd]->events = events;
+	struct epoll_event ev = {0};
+	ev.events = events | EPOLLET;
+	ev.data.ptr = loop->handlers[fd];
+	return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int event_del(event_loop *loop, int fd) {
+	if (fd >= loop->handlers_size || loop->handlers[fd] == NULL)
+		return -1;
+	event_handler *h = loop->handlers[fd];
+	loop->handlers[fd] = NULL;
+	// events already fetched for the handler may still be dispatched in this batch, they see it removed
+	if (loop->dispatching) {
+		h->cb = NULL;
+		h->next = loop->removed;
+		loop->removed = h;
+	} else {
+		free(h);
+	}
+	return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void _timer_swap(event_loop *loop, int a, int b) {
+	event_timer *tmp = loop->timers[a];
+	loop->timers[a] = loop->timers[b];
+	loop->timers[b] = tmp;
+}
+
+event_timer *event_timer_add(event_loop *loop, uint64_t ms, timer_cb cb, void *arg) {
+	if (loop->timers_len == loop->timers_size) {
+		int size = loop->timers_size ? loop->timers_size * 2 : 16;
+		event_timer **tmp = realloc(loop->timers, size * sizeof(event_timer *));
+		if (tmp == NULL)
+			return NULL;
+		loop->timers = tmp;
+		loop->timers_size = size;
+	}
+	event_timer *t = malloc(sizeof(event_timer));
+	if (t == NULL)
+		return NULL;
+	t->deadline = event_now() + ms;
+	t->cb = cb;
+	t->arg = arg;
+	// sift up
+	int i = loop->timers_len++;
+	loop->timers[i] = t;
+	while (i > 0 && loop->timers[(i - 1) / 2]->deadline > loop->timers[i]->deadline) {
+		_timer_swap(loop, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	return t;
+}
+
+void event_timer_cancel(event_timer *t) { t->cb = NULL; }
+
+event_timer *_timer_pop(event_loop *loop) {
+	event_timer *top = loop->timers[0];
+	loop->timers[0] = loop->timers[--loop->timers_len];
+	// sift down
+	int i = 0;
+	while (1) {
+		int min = i, l = 2 * i + 1, r = 2 * i + 2;
+		if (l < loop->timers_len && loop->timers[l]->deadline < loop->timers[min]->deadline)
+			min = l;
+		if (r < loop->timers_len && loop->timers[r]->deadline < loop->timers[min]->deadline)
+			min = r;
+		if (min == i)
+			break;
+		_timer_swap(loop, i, min);
+		i = min;
+	}
+	return top;
+}
+
+// run expired timers and return the time until the next one (or -1 if there are none)
+int _run_timers(event_loop *loop, int *dispatched) {
+	uint64_t now = event_now();
+	while (loop->timers_len) {
+		event_timer *t = loop->timers[0];
+		if (t->cb != NULL && t->deadline > now)
+			return t->deadline - now;
+		_timer_pop(loop);
+		if (t->cb != NULL) {
+			t->cb(loop, t->arg);
+			(*dispatched)++;
+		}
+		free(t);
+	}
+	return -1;
+}
+
+int event_prepare_add(event_loop *loop, prepare_cb cb, void *arg) {
+	event_prepare *tmp = realloc(loop->prepare, (loop->prepare_len + 1) * sizeof(event_prepare));
+	if (tmp == NULL)
+		return -1;
+	loop->prepare = tmp;
+	loop->prepare[loop->prepare_len].cb = cb;
+	loop->prepare[loop->prepare_len].arg = arg;
+	loop->prepare_len++;
+	return 0;
+}
+
+void event_prepare_del(event_loop *loop, prepare_cb cb, void *arg) {
+	for (int i = 0; i < loop->prepare_len; i++) {
+		if (loop->prepare[i].cb == cb && loop->prepare[i].arg == arg) {
+			loop->prepare[i] = loop->prepare[--loop->prepare_len];
+			return;
+		}
+	}
+}
+
+int event_loop_run_once(event_loop *loop, int timeout) {
+	int dispatched = 0;
+	for (int i = 0; i < loop->prepare_len; i++)
+		loop->prepare[i].cb(loop, loop->prepare[i].arg);
+	int next = _run_timers(loop, &dispatched);
+	// do not block if a timer already did some work
+	if (dispatched)
+		timeout = 0;
+	else if (next >= 0 && (timeout < 0 || next < timeout))
+		timeout = next;
+	struct epoll_event events[EVENT_BATCH];
+	int n = epoll_wait(loop->epfd, events, EVENT_BATCH, timeout);
+	if (n < 0)
+		return errno == EINTR ? dispatched : -1;
+	loop->dispatching++;
+	for (int i = 0; i < n; i++) {
+		event_handler *h = events[i].data.ptr;
+		// removed by an earlier callback in this batch
+		if (h->cb == NULL)
+			continue;
+		h->cb(loop, h->fd, events[i].events, h->arg);
+		dispatched++;
+	}
+	if (--loop->dispatching == 0)
+		_handlers_release(loop);
+	_run_timers(loop, &dispatched);
+	return dispatched;
+}
+
+void event_loop_run(event_loop *loop) {
+	loop->running = 1;
+	while (loop->running)
+		if (event_loop_run_once(loop, -1) < 0)
+			break;
+}
+
+void event_loop_stop(event_loop *loop) { loop->running = 0; }
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+struct event_loop;
+
+typedef void (*event_cb)(struct event_loop *, int, uint32_t, void *);
+typedef void (*timer_cb)(struct event_loop *, void *);
+typedef void (*prepare_cb)(struct event_loop *, void *);
+
+typedef struct event_handler {
+	int fd;
+	uint32_t events;
+	// NULL once removed, events fetched for it in the same batch are then dropped
+	event_cb cb;
+	void *arg;
+	// on the list of removed handlers freed after the batch
+	struct event_handler *next;
+} event_handler;
+
+typedef struct event_timer {
+	uint64_t deadline;
+	// NULL once cancelled, the timer is freed when it reaches the top of the heap
+	timer_cb cb;
+	void *arg;
+} event_timer;
+
+typedef struct event_prepare {
+	prepare_cb cb;
+	void *arg;
+} event_prepare;
+
+typedef struct event_loop {
+	int epfd;
+	// handlers indexed by file descriptor
+	event_handler **handlers;
+	int handlers_size;
+	// handlers removed while a batch is dispatched, kept until it is done since its events point at them
+	event_handler *removed;
+	// nesting depth of event_loop_run_once dispatching events
+	int dispatching;
+	// min-heap of timers ordered by deadline
+	event_timer **timers;
+	int timers_len;
+	int timers_size;
+	// called at the start of every iteration, before waiting
+	event_prepare *prepare;
+	int prepare_len;
+	unsigned char running;
+} event_loop;
+
+/**
+ * @brief Initialize an event loop
+ * @param loop The event loop to initialize
+ * @return 0 on success, -1 on error
+ */
+int event_loop_init(event_loop *);
+
+/**
+ * @brief Free an event loop and all registered handlers and timers
+ * @param loop The event loop to free
+ */
+void event_loop_free(event_loop *);
+
+/**
+ * @brief Register a file descriptor with the event loop (edge-triggered)
+ * @note The callback must consume the fd until EAGAIN (or a short read) before waiting on it again
+ * @param loop The event loop
+ * @param fd The file descriptor
+ * @param events EPOLLIN and/or EPOLLOUT
+ * @param cb Called with the ready events
+ * @param arg Passed to the callback
+ * @return 0 on success, -1 on error
+ */
+int event_add(event_loop *, int, uint32_t, event_cb, void *);
+
+/**
+ * @brief Change the events a file descriptor is registered for
+ * @param loop The event loop
+ * @param fd The file descriptor
+ * @param events EPOLLIN and/or EPOLLOUT
+ * @return 0 on success, -1 on error
+ */
+int event_mod(event_loop *, int, uint32_t);
+
+/**
+ * @brief Unregister a file descriptor
+ * @param loop The event loop
+ * @param fd The file descriptor
+ * @return 0 on success, -1 on error
+ */
+int event_del(event_loop *, int);
+
+/**
+ * @brief Schedule a callback to run once after a delay
+ * @param loop The event loop
+ * @param ms Delay in milliseconds
+ * @param cb The callback
+ * @param arg Passed to the callback
+ * @return The timer (for event_timer_cancel), NULL on error
+ */
+event_timer *event_timer_add(event_loop *, uint64_t, timer_cb, void *);
+
+/**
+ * @brief Cancel a timer that has not fired yet
+ * @warning The timer is freed once it fires, so callers must forget it in the callback
+ * @param timer The timer to cancel
+ */
+void event_timer_cancel(event_timer *);
+
+/**
+ * @brief Register a callback that runs at the start of every iteration (e.g. to submit batched work)
+ * @param loop The event loop
+ * @param cb The callback
+ * @param arg Passed to the callback
+ * @return 0 on success, -1 on error
+ */
+int event_prepare_add(event_loop *, prepare_cb, void *);
+
+/**
+ * @brief Remove a callback registered with event_prepare_add
+ * @param loop The event loop
+ * @param cb The callback
+ * @param arg The argument it was registered with
+ */
+void event_prepare_del(event_loop *, prepare_cb, void *);
+
+/**
+ * @brief Wait for events and dispatch them once
+ * @param loop The event loop
+ * @param timeout Maximum time to wait in milliseconds, -1 to wait until something happens
+ * @return Number of events dispatched, -1 on error
+ */
+int event_loop_run_once(event_loop *, int);
+
+/**
+ * @brief Dispatch events until event_loop_stop is called
+ * @param loop The event loop
+ */
+void event_loop_run(event_loop *);
+
+/**
+ * @brief Make event_loop_run return after the current iteration
+ * @param loop The event loop
+ */
+void event_loop_stop(event_loop *);
+
+/**
+ * @brief Return a monotonic timestamp
+ * @return Milliseconds since an arbitrary point
+ */
+uint64_t event_now();
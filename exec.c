@@ -0,0 +1,95 @@
+#include "exec.h"
+
+// append data to a growing output buffer
+int _exec_append(char **buf, size_t *len, size_t *size, const char *data, size_t data_len) {
+	if (*len + data_len > *size) {
+		size_t new_size = *size ? *size : 1024;
+		while (new_size < *len + data_len)
+			new_size *= 2;
+		char *tmp = realloc(*buf, new_size);
+		if (tmp == NULL)
+			return -1;
+		*buf = tmp;
+		*size = new_size;
+	}
+	memcpy(*buf + *len, data, data_len);
+	*len += data_len;
+	return 0;
+}
+
+void _exec_finish(exec_job *job) {
+	job->ch = NULL;
+	job->done = 1;
+	(*job->pending)--;
+	if (job->cb != NULL)
+		job->cb(job, job->arg);
+}
+
+void _exec_handler(channel *ch, int event, const char *data, size_t len, void *arg) {
+	exec_job *job = arg;
+	switch (event) {
+	case CHANNEL_EV_DATA:
+		_exec_append(&job->out, &job->out_len, &job->out_size, data, len);
+		break;
+	case CHANNEL_EV_EXTENDED_DATA:
+		_exec_append(&job->err, &job->err_len, &job->err_size, data, len);
+		break;
+	case CHANNEL_EV_EXIT_STATUS:
+		job->status = ntohl(*(uint32_t *)data);
+		break;
+	case CHANNEL_EV_EOF:
+		channel_close(ch);
+		break;
+	case CHANNEL_EV_OPEN_FAILURE:
+	case CHANNEL_EV_CLOSE:
+		_exec_finish(job);
+		break;
+	}
+}
+
+int exec_start(connection *conn, exec_job *jobs, int n, int *pending) {
+	*pending = 0;
+	int i;
+	for (i = 0; i < n; i++) {
+		exec_job *job = &jobs[i];
+		job->status = -1;
+		job->done = 0;
+		job->pending = pending;
+		job->ch = channel_open(conn, "session", NULL, 0, _exec_handler, job);
+		if (job->ch == NULL)
+			goto fail;
+		(*pending)++;
+		// a reply would cost a round trip, a refused command shows up as a close without an exit status
+		if (channel_exec(job->ch, job->command, 0) || channel_eof(job->ch))
+			goto fail;
+	}
+	return 0;
+fail:
+	// detached channels are freed once the peer confirms the close or refuses the open, without calling back into the jobs
+	for (int j = 0; j <= i; j++) {
+		if (jobs[j].ch == NULL)
+			continue;
+		jobs[j].ch->cb = NULL;
+		channel_close(jobs[j].ch);
+		jobs[j].ch = NULL;
+	}
+	*pending = 0;
+	return -1;
+}
+
+int exec_run(connection *conn, exec_job *jobs, int n) {
+	int pending;
+	if (exec_start(conn, jobs, n, &pending))
+		return -1;
+	while (pending > 0)
+		if (connection_step(conn))
+			return -1;
+	return 0;
+}
+
+void exec_job_free(exec_job *job) {
+	free(job->out);
+	free(job->err);
+	job->out = job->err = NULL;
+	job->out_len = job->out_size = job->err_len = job->err_size = 0;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "channel.h"
+
+struct exec_job;
+
+typedef void (*exec_cb)(struct exec_job *, void *);
+
+typedef struct exec_job {
+	const char *command;
+	channel *ch;
+	// exit status, -1 if the channel closed without one (e.g. the server refused the command)
+	int status;
+	// collected output
+	char *out;
+	size_t out_len;
+	size_t out_size;
+	char *err;
+	size_t err_len;
+	size_t err_size;
+	// called once the job has finished, may be NULL
+	exec_cb cb;
+	void *arg;
+	int *pending;
+	unsigned char done;
+} exec_job;
+
+/**
+ * @brief Run commands on their own channels without waiting on each other
+ * @note Every channel is opened at once and its exec request and EOF are queued behind the open, so they go out the moment the
+ * confirmation arrives and N commands take about two round trips in total instead of several each
+ * @param conn The connection
+ * @param jobs The jobs, each with command set (and optionally cb and arg)
+ * @param n The number of jobs
+ * @param pending Counts the jobs that have not finished, it reaches 0 once they all have
+ * @return 0 on success, -1 on error, in which case the channels already opened are closed and no job is pending
+ */
+int exec_start(connection *, exec_job *, int, int *);
+
+/**
+ * @brief Run commands with exec_start and wait for all of them
+ * @param conn The connection
+ * @param jobs The jobs, each with command set
+ * @param n The number of jobs
+ * @return 0 on success, -1 on error
+ */
+int exec_run(connection *, exec_job *, int);
+
+/**
+ * @brief Free the output collected by a job
+ * @param job The job
+ */
+void exec_job_free(exec_job *);
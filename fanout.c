@@ -0,0 +1,556 @@
+#include "fanout.h"
+
+// sent to every host, the same string the single connection client sends
+#define FANOUT_VERSION "SSH-2.0-PZSSH_0.1"
+
+void _fanout_step(fanout_host *);
+
+// write a whole line in one call so lines of different hosts do not interleave
+void _fanout_emit(fanout_host *h, int fd, const char *line, size_t len) {
+	struct iovec iov[4] = {
+		{h->name, strlen(h->name)},
+		{": ", 2},
+		{(char *)line, len},
+		{"\n", 1},
+	};
+	struct iovec *v = iov;
+	int count = 4;
+	while (count) {
+		ssize_t n = writev(fd, v, count);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		while (count && (size_t)n >= v->iov_len) {
+			n -= v->iov_len;
+			v++;
+			count--;
+		}
+		if (count) {
+			v->iov_base = (char *)v->iov_base + n;
+			v->iov_len -= n;
+		}
+	}
+}
+
+// print every complete line of output and keep the rest for the next packet
+void _fanout_output(fanout_host *h, int i, const char *data, size_t len) {
+	fanout_line *line = &h->c->out[i];
+	while (len) {
+		const char *nl = memchr(data, '\n', len);
+		size_t take = nl != NULL ? (size_t)(nl - data) : len;
+		if (take > sizeof(line->buf) - line->len)
+			take = sizeof(line->buf) - line->len;
+		// a line that arrived whole is printed straight from the packet
+		if (line->len == 0 && nl != NULL && data + take == nl) {
+			_fanout_emit(h, i + 1, data, take);
+		} else {
+			memcpy(line->buf + line->len, data, take);
+			line->len += take;
+			if (data + take != nl && line->len < sizeof(line->buf)) {
+				data += take;
+				len -= take;
+				continue;
+			}
+			_fanout_emit(h, i + 1, line->buf, line->len);
+			line->len = 0;
+		}
+		if (data + take == nl)
+			take++;
+		data += take;
+		len -= take;
+	}
+}
+
+void _fanout_channel(channel *ch, int event, const char *data, size_t len, void *arg) {
+	fanout_host *h = arg;
+	switch (event) {
+	case CHANNEL_EV_DATA:
+	case CHANNEL_EV_EXTENDED_DATA:
+		_fanout_output(h, event == CHANNEL_EV_EXTENDED_DATA, data, len);
+		break;
+	case CHANNEL_EV_EXIT_STATUS:
+		h->status = ntohl(*(uint32_t *)data);
+		break;
+	case CHANNEL_EV_EOF:
+		channel_close(ch);
+		break;
+	case CHANNEL_EV_OPEN_FAILURE:
+	case CHANNEL_EV_CLOSE:
+		// the channel is freed after this returns, the host is finished by _fanout_step
+		h->c->ch = NULL;
+		break;
+	}
+}
+
+// free what the host needed while it was worked on
+void _fanout_release(fanout_host *h) {
+	fanout_conn *c = h->c;
+	if (c == NULL)
+		return;
+	if (c->deadline != NULL)
+		event_timer_cancel(c->deadline);
+	if (c->t.loop != NULL) {
+		// the close reply and anything else that fits the socket still goes out
+		transport_flush(&c->t);
+		if (c->conn.t != NULL)
+			connection_free(&c->conn);
+		kex_free(&c->kex);
+		transport_free(&c->t);
+	} else if (c->s >= 0) {
+		event_del(&h->fo->loop, c->s);
+	}
+	if (c->s >= 0)
+		close(c->s);
+	if (c->addrs != NULL)
+		freeaddrinfo(c->addrs);
+	free(c);
+	h->c = NULL;
+}
+
+void _fanout_fill(fanout *);
+
+// the host is finished, report it and start the next one
+void _fanout_done(fanout_host *h, const char *error) {
+	fanout *fo = h->fo;
+	if (h->state == FANOUT_DONE)
+		return;
+	h->state = FANOUT_DONE;
+	h->error = error;
+	for (int i = 0; i < 2; i++) {
+		fanout_line *line = &h->c->out[i];
+		if (line->len)
+			_fanout_emit(h, i + 1, line->buf, line->len);
+		line->len = 0;
+	}
+	if (error != NULL)
+		_fanout_emit(h, 2, error, strlen(error));
+	else if (h->status < 0)
+		_fanout_emit(h, 2, "no exit status", 14);
+	else if (h->status != 0) {
+		char msg[64];
+		int len = snprintf(msg, sizeof(msg), "exited with status %d", h->status);
+		_fanout_emit(h, 2, msg, len);
+	}
+	// a worker may still be using the state, it is freed when the worker is done
+	if (!h->c->busy)
+		_fanout_release(h);
+	fo->active--;
+	fo->finished++;
+	_fanout_fill(fo);
+}
+
+void _fanout_timeout(event_loop *loop, void *arg) {
+	(void)loop;
+	fanout_host *h = arg;
+	h->c->deadline = NULL;
+	_fanout_done(h, "timed out");
+}
+
+void _fanout_readable(transport *t, void *arg) {
+	(void)t;
+	_fanout_step(arg);
+}
+
+void _fanout_verify(void *arg) {
+	fanout_conn *c = ((fanout_host *)arg)->c;
+	c->reply_result = kex_reply_verify(&c->kex, c->reply, c->reply_len);
+}
+
+void _fanout_verified(void *arg) {
+	fanout_host *h = arg;
+	fanout_conn *c = h->c;
+	c->busy = 0;
+	if (h->state == FANOUT_DONE) {
+		_fanout_release(h);
+		return;
+	}
+	if (c->reply_result || kex_reply_finish(&c->kex)) {
+		_fanout_done(h, "key exchange failed");
+		return;
+	}
+	// packets that arrived behind the reply are still in the receive buffer
+	_fanout_step(h);
+}
+
+// the reply stays where it is in the receive buffer, nothing more is read until the worker is done with it
+int _fanout_offload(kex *k, const char *payload, int len, void *arg) {
+	fanout_host *h = arg;
+	fanout_conn *c = h->c;
+	c->reply = payload;
+	c->reply_len = len;
+	if (worker_submit(&h->fo->inbox, _fanout_verify, _fanout_verified, h))
+		return kex_reply_verify(k, payload, len) ? -1 : kex_reply_finish(k);
+	c->busy = 1;
+	return 0;
+}
+
+// ask for user authentication with a method, the password is sent along for "password"
+int _fanout_userauth(fanout_host *h, const char *method, const char *password) {
+	size_t user_len = strlen(h->user), method_len = strlen(method);
+	size_t password_len = password != NULL ? strlen(password) : 0;
+	int len = 1 + 4 + user_len + 4 + 14 + 4 + method_len + (password != NULL ? 1 + 4 + password_len : 0);
+	char *payload = packet_alloc(len);
+	if (payload == NULL)
+		return -1;
+	char *p = payload;
+	*p++ = SSH_MSG_USERAUTH_REQUEST;
+	p = buf_put_string(p, h->user, user_len);
+	p = buf_put_string(p, "ssh-connection", 14);
+	p = buf_put_string(p, method, method_len);
+	if (password != NULL) {
+		*p++ = 0;
+		buf_put_string(p, password, password_len);
+	}
+	return send_packet_buf(&h->c->t, payload, len);
+}
+
+int _fanout_auth(fanout_host *h, const char *pkt, int len) {
+	fanout_conn *c = h->c;
+	switch (pkt[0]) {
+	case SSH_MSG_SERVICE_ACCEPT:
+	case SSH_MSG_EXT_INFO:
+	case SSH_MSG_USERAUTH_BANNER:
+		return 0;
+	case SSH_MSG_USERAUTH_SUCCESS:
+		h->state = FANOUT_SESSION;
+		c->ch = channel_open(&c->conn, "session", NULL, 0, _fanout_channel, h);
+		// the exec request and EOF go out behind the open, a refused command shows up as a close without an exit status
+		if (c->ch == NULL || channel_exec(c->ch, h->fo->command, 0) || channel_eof(c->ch))
+			return -1;
+		return 0;
+	case SSH_MSG_USERAUTH_FAILURE: {
+		const char *q = pkt + 1, *methods;
+		int left = len - 1;
+		uint32_t methods_len;
+		if (buf_get_string(&q, &left, &methods, &methods_len) || h->fo->password == NULL || c->tried_password ||
+		    !has_name(methods, methods_len, "password")) {
+			_fanout_done(h, "permission denied");
+			return 0;
+		}
+		c->tried_password = 1;
+		return _fanout_userauth(h, "password", h->fo->password);
+	}
+	}
+	// the server may exchange keys again before authentication is over
+	if (pkt[0] >= SSH_MSG_KEXINIT && pkt[0] <= SSH_MSG_KEX_LAST)
+		return kex_dispatch(&c->kex, pkt, len);
+	return -1;
+}
+
+// the identification strings are exchanged, start the key exchange and queue authentication behind it
+int _fanout_ident(fanout_host *h, const char *ident, int len) {
+	fanout_conn *c = h->c;
+	if (kex_init(&c->kex, &c->t, FANOUT_VERSION, ident, len, 0))
+		return -1;
+	kex_set_offload(&c->kex, _fanout_offload, h);
+	connection_init(&c->conn, &c->t);
+	connection_set_kex(&c->conn, &c->kex);
+	connection_set_window(&c->conn, h->fo->window, h->fo->maxpacket);
+	h->state = FANOUT_KEX;
+	if (kex_start(&c->kex))
+		return -1;
+	// held by the transport until our NEWKEYS is out, so authentication costs no round trip of its own
+	char buf[32], *p = buf;
+	*p++ = SSH_MSG_SERVICE_REQUEST;
+	p = buf_put_string(p, "ssh-userauth", 12);
+	if (send_packet(&c->t, buf, p - buf))
+		return -1;
+	return _fanout_userauth(h, "none", NULL);
+}
+
+// handle whatever has arrived, until the socket runs dry or a worker takes over
+void _fanout_step(fanout_host *h) {
+	while (h->state != FANOUT_DONE && !h->c->busy) {
+		fanout_conn *c = h->c;
+		char *pkt;
+		int len;
+		if (h->state == FANOUT_IDENT) {
+			len = recv_ident_nowait(&c->t, &pkt);
+			if (len == RECV_AGAIN)
+				break;
+			if (len < 0 || _fanout_ident(h, pkt, len)) {
+				_fanout_done(h, "expected identification string");
+				return;
+			}
+			continue;
+		}
+		len = recv_packet_nowait(&c->t, &pkt);
+		if (len == RECV_AGAIN)
+			break;
+		if (len < 1) {
+			_fanout_done(h, "connection closed");
+			return;
+		}
+		if (pkt[0] == SSH_MSG_IGNORE || pkt[0] == SSH_MSG_DEBUG)
+			continue;
+		int ret;
+		if (h->state == FANOUT_KEX) {
+			ret = kex_dispatch(&c->kex, pkt, len);
+			if (ret == 0 && c->kex.count > 0)
+				h->state = FANOUT_AUTH;
+		} else if (h->state == FANOUT_AUTH) {
+			ret = _fanout_auth(h, pkt, len);
+		} else {
+			ret = connection_dispatch(&c->conn, pkt, len);
+			if (ret == 0 && kex_due(&c->kex))
+				ret = kex_start(&c->kex);
+		}
+		if (ret) {
+			_fanout_done(h, h->state == FANOUT_KEX ? "key exchange failed" : "protocol error");
+			return;
+		}
+		if (h->state == FANOUT_SESSION && c->ch == NULL) {
+			_fanout_done(h, NULL);
+			return;
+		}
+	}
+	if (h->state != FANOUT_DONE && transport_flush(&h->c->t))
+		_fanout_done(h, "connection closed");
+}
+
+// try the resolved addresses in turn until a connect is under way
+void _fanout_connect(fanout_host *);
+
+void _fanout_connected(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)events;
+	fanout_host *h = arg;
+	fanout_conn *c = h->c;
+	int err = 0;
+	socklen_t err_len = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) || err) {
+		event_del(loop, fd);
+		close(fd);
+		c->s = -1;
+		c->next_addr = c->next_addr->ai_next;
+		_fanout_connect(h);
+		return;
+	}
+	event_del(loop, fd);
+	if (transport_init(&c->t, loop, fd)) {
+		_fanout_done(h, "out of memory");
+		return;
+	}
+	transport_set_recv(&c->t, _fanout_readable, h);
+	h->state = FANOUT_IDENT;
+	if (transport_write(&c->t, FANOUT_VERSION "\r\n", strlen(FANOUT_VERSION) + 2)) {
+		_fanout_done(h, "connection closed");
+		return;
+	}
+	_fanout_step(h);
+}
+
+void _fanout_connect(fanout_host *h) {
+	fanout_conn *c = h->c;
+	for (; c->next_addr != NULL; c->next_addr = c->next_addr->ai_next) {
+		struct addrinfo *ai = c->next_addr;
+		int s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s < 0)
+			continue;
+		fcntl(s, F_SETFD, FD_CLOEXEC);
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+		if ((connect(s, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS) &&
+		    event_add(&h->fo->loop, s, EPOLLOUT, _fanout_connected, h) == 0) {
+			c->s = s;
+			h->state = FANOUT_CONNECTING;
+			return;
+		}
+		close(s);
+	}
+	_fanout_done(h, "unable to connect");
+}
+
+void _fanout_resolve(void *arg) {
+	fanout_host *h = arg;
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(h->name, h->port, &hints, &h->c->addrs))
+		h->c->addrs = NULL;
+}
+
+void _fanout_resolved(void *arg) {
+	fanout_host *h = arg;
+	fanout_conn *c = h->c;
+	c->busy = 0;
+	if (h->state == FANOUT_DONE) {
+		_fanout_release(h);
+		return;
+	}
+	if (c->addrs == NULL) {
+		_fanout_done(h, "could not resolve hostname");
+		return;
+	}
+	c->next_addr = c->addrs;
+	_fanout_connect(h);
+}
+
+// name lookups block, so they run on the workers like the expensive parts of the key exchange
+void _fanout_start(fanout_host *h) {
+	fanout *fo = h->fo;
+	fo->active++;
+	h->c = calloc(1, sizeof(fanout_conn));
+	if (h->c == NULL) {
+		h->state = FANOUT_DONE;
+		h->error = "out of memory";
+		fo->active--;
+		fo->finished++;
+		return;
+	}
+	h->c->s = -1;
+	h->state = FANOUT_RESOLVING;
+	if (fo->timeout)
+		h->c->deadline = event_timer_add(&fo->loop, (uint64_t)fo->timeout * 1000, _fanout_timeout, h);
+	if (worker_submit(&fo->inbox, _fanout_resolve, _fanout_resolved, h)) {
+		_fanout_done(h, "out of memory");
+		return;
+	}
+	h->c->busy = 1;
+}
+
+void _fanout_fill(fanout *fo) {
+	while (fo->active < fo->parallel && fo->next < fo->hosts_len)
+		_fanout_start(&fo->hosts[fo->next++]);
+}
+
+int fanout_init(fanout *fo, const char *command, int parallel, uint32_t timeout) {
+	memset(fo, 0, sizeof(fanout));
+	if (event_loop_init(&fo->loop))
+		return -1;
+	fo->command = command;
+	fo->parallel = parallel > 0 ? parallel : FANOUT_PARALLEL_DEFAULT;
+	fo->timeout = timeout;
+	fo->window = CHANNEL_WINDOW_DEFAULT;
+	fo->maxpacket = CHANNEL_PACKET_MAX;
+	return 0;
+}
+
+int fanout_add(fanout *fo, const char *spec, const char *port, const char *user) {
+	char *copy = strdup(spec);
+	if (copy == NULL)
+		return -1;
+	char *name = copy;
+	char *at = strrchr(name, '@');
+	if (at != NULL) {
+		*at = 0;
+		user = name;
+		name = at + 1;
+	}
+	// [address]:port for IPv6, host:port otherwise, and a bare IPv6 address has more than one colon
+	char *colon = NULL;
+	if (*name == '[' && strchr(name, ']') != NULL) {
+		name++;
+		char *end = strchr(name, ']');
+		*end = 0;
+		if (end[1] == ':')
+			colon = end + 1;
+	} else if ((colon = strchr(name, ':')) != NULL && strchr(colon + 1, ':') != NULL) {
+		colon = NULL;
+	}
+	if (colon != NULL) {
+		*colon = 0;
+		port = colon + 1;
+	}
+	if (*name == 0 || user == NULL || *port == 0) {
+		free(copy);
+		return -1;
+	}
+	if (fo->hosts_len == fo->hosts_size) {
+		int size = fo->hosts_size ? fo->hosts_size * 2 : 64;
+		fanout_host *tmp = realloc(fo->hosts, size * sizeof(fanout_host));
+		if (tmp == NULL) {
+			free(copy);
+			return -1;
+		}
+		fo->hosts = tmp;
+		fo->hosts_size = size;
+	}
+	fanout_host *h = &fo->hosts[fo->hosts_len];
+	memset(h, 0, sizeof(fanout_host));
+	h->fo = fo;
+	h->name = strdup(name);
+	h->port = strdup(port);
+	h->user = strdup(user);
+	free(copy);
+	if (h->name == NULL || h->port == NULL || h->user == NULL) {
+		free(h->name);
+		free(h->port);
+		free(h->user);
+		return -1;
+	}
+	h->status = -1;
+	fo->hosts_len++;
+	return 0;
+}
+
+int fanout_load(fanout *fo, const char *path, const char *port, const char *user) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	char line[1024];
+	int ret = 0;
+	while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+		char *p = line + strspn(line, " \t");
+		p[strcspn(p, " \t\r\n")] = 0;
+		if (*p == 0 || *p == '#')
+			continue;
+		ret = fanout_add(fo, p, port, user);
+	}
+	fclose(f);
+	return ret;
+}
+
+void fanout_set_password(fanout *fo, const char *password) { fo->password = password; }
+
+void fanout_set_window(fanout *fo, uint32_t window, uint32_t maxpacket) {
+	fo->window = window;
+	fo->maxpacket = maxpacket;
+}
+
+int fanout_run(fanout *fo) {
+	// every host in flight holds a socket, take as many descriptors as we are allowed
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		getrlimit(RLIMIT_NOFILE, &rl);
+		if (rl.rlim_cur != RLIM_INFINITY && (rlim_t)fo->parallel + 32 > rl.rlim_cur)
+			fo->parallel = rl.rlim_cur > 33 ? rl.rlim_cur - 32 : 1;
+	}
+	// the loop is not pinned, so neither are the workers
+	if (worker_pool_init(&fo->workers, 0, NULL))
+		return 255;
+	if (worker_inbox_init(&fo->inbox, &fo->workers, &fo->loop, -1)) {
+		worker_pool_free(&fo->workers);
+		return 255;
+	}
+	_fanout_fill(fo);
+	while (fo->finished < fo->hosts_len || fo->inbox.pending)
+		if (event_loop_run_once(&fo->loop, -1) < 0)
+			break;
+	worker_pool_free(&fo->workers);
+	worker_inbox_free(&fo->inbox);
+	int failed = 0, unreachable = 0;
+	for (int i = 0; i < fo->hosts_len; i++) {
+		fanout_host *h = &fo->hosts[i];
+		if (h->error != NULL || h->state != FANOUT_DONE)
+			unreachable++;
+		else if (h->status != 0)
+			failed++;
+	}
+	if (failed + unreachable)
+		fprintf(stderr, "%d of %d hosts failed\n", failed + unreachable, fo->hosts_len);
+	return unreachable ? 255 : failed ? 1 : 0;
+}
+
+void fanout_free(fanout *fo) {
+	for (int i = 0; i < fo->hosts_len; i++) {
+		_fanout_release(&fo->hosts[i]);
+		free(fo->hosts[i].name);
+		free(fo->hosts[i].port);
+		free(fo->hosts[i].user);
+	}
+	free(fo->hosts);
+	event_loop_free(&fo->loop);
+	memset(fo, 0, sizeof(fanout));
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "channel.h"
+#include "kex.h"
+#include "worker.h"
+#include <netdb.h>
+#include <stdio.h>
+#include <sys/resource.h>
+
+// hosts connected to at once unless -j says otherwise
+#define FANOUT_PARALLEL_DEFAULT 64
+// seconds a host gets from the start of its connect to the exit of its command
+#define FANOUT_TIMEOUT_DEFAULT 60
+// longest output line, a longer one is cut and printed in pieces
+#define FANOUT_LINE_MAX 4096
+
+enum fanout_state {
+	FANOUT_WAITING = 0,
+	FANOUT_RESOLVING = 1,
+	FANOUT_CONNECTING = 2,
+	FANOUT_IDENT = 3,
+	FANOUT_KEX = 4,
+	FANOUT_AUTH = 5,
+	FANOUT_SESSION = 6,
+	FANOUT_DONE = 7,
+};
+
+struct fanout;
+
+// an output stream of a host, printed a whole line at a time with the host in front
+typedef struct fanout_line {
+	char buf[FANOUT_LINE_MAX];
+	size_t len;
+} fanout_line;
+
+// what a host needs while it is being worked on, freed once it is done
+typedef struct fanout_conn {
+	struct addrinfo *addrs;
+	struct addrinfo *next_addr;
+	int s;
+	transport t;
+	kex kex;
+	connection conn;
+	channel *ch;
+	event_timer *deadline;
+	// a worker thread is resolving the name or checking a reply, nothing else may touch the state meanwhile
+	unsigned char busy;
+	// the ECDH_REPLY handed to the worker, left in the receive buffer until the worker is done with it
+	const char *reply;
+	int reply_len;
+	int reply_result;
+	// the password was already tried
+	unsigned char tried_password;
+	fanout_line out[2];
+} fanout_conn;
+
+typedef struct fanout_host {
+	struct fanout *fo;
+	char *name;
+	char *port;
+	char *user;
+	unsigned char state;
+	// exit status of the command, -1 if it never reported one
+	int status;
+	// why the host failed, NULL if the command ran
+	const char *error;
+	fanout_conn *c;
+} fanout_host;
+
+typedef struct fanout {
+	event_loop loop;
+	worker_pool workers;
+	// where the workers hand back resolved names and checked replies
+	worker_inbox inbox;
+	fanout_host *hosts;
+	int hosts_len;
+	int hosts_size;
+	// first host not started yet
+	int next;
+	int active;
+	int finished;
+	int parallel;
+	uint32_t timeout;
+	const char *command;
+	// tried on hosts that refuse "none", NULL to give up on them
+	const char *password;
+	uint32_t window;
+	uint32_t maxpacket;
+} fanout;
+
+/**
+ * @brief Set up a run of one command on many hosts from a single event loop
+ * @note Resolving names and checking the server's key exchange reply (three point multiplies) run on a pool of worker threads,
+ * so the loop only moves packets between thousands of connections
+ * @param fo The fan-out state to initialize
+ * @param command The command to run on every host
+ * @param parallel How many hosts are worked on at once
+ * @param timeout Seconds each host gets to finish, 0 for no limit
+ * @return 0 on success, -1 on error
+ */
+int fanout_init(fanout *, const char *, int, uint32_t);
+
+/**
+ * @brief Add a host
+ * @param fo The fan-out state
+ * @param spec [user@]host[:port]
+ * @param port The port used unless spec has one
+ * @param user The user used unless spec has one
+ * @return 0 on success, -1 on error
+ */
+int fanout_add(fanout *, const char *, const char *, const char *);
+
+/**
+ * @brief Add the hosts listed in a file, one per line, skipping empty lines and lines starting with #
+ * @param fo The fan-out state
+ * @param path The file
+ * @param port The port used unless a line has one
+ * @param user The user used unless a line has one
+ * @return 0 on success, -1 on error
+ */
+int fanout_load(fanout *, const char *, const char *, const char *);
+
+/**
+ * @brief Set the password tried on hosts that do not accept "none"
+ * @param fo The fan-out state
+ * @param password The password, NULL for none
+ */
+void fanout_set_password(fanout *, const char *);
+
+/**
+ * @brief Set the receive window and maximum packet size of the sessions
+ * @param fo The fan-out state
+ * @param window The initial receive window in bytes
+ * @param maxpacket The largest data packet a server may send
+ */
+void fanout_set_window(fanout *, uint32_t, uint32_t);
+
+/**
+ * @brief Run the command on every host, printing each line of output as "host: line" as soon as it is complete
+ * @param fo The fan-out state
+ * @return 0 if the command exited with 0 everywhere, 1 if it failed somewhere, 255 if a host could not be reached
+ */
+int fanout_run(fanout *);
+
+/**
+ * @brief Free the fan-out state
+ * @param fo The fan-out state to free
+ */
+void fanout_free(fanout *);
@@ -0,0 +1,548 @@
+#include "forward.h"
+
+tunnel *_tunnel_new(forward *fwd, int fd) {
+	tunnel *tn = calloc(1, sizeof(tunnel));
+	if (tn == NULL)
+		return NULL;
+	tn->fwd = fwd;
+	tn->fd = fd;
+	tn->next = fwd->tunnels;
+	if (fwd->tunnels != NULL)
+		fwd->tunnels->prev = tn;
+	fwd->tunnels = tn;
+	return tn;
+}
+
+void _tunnel_free(tunnel *tn) {
+	forward *fwd = tn->fwd;
+	if (tn->prev != NULL)
+		tn->prev->next = tn->next;
+	else
+		fwd->tunnels = tn->next;
+	if (tn->next != NULL)
+		tn->next->prev = tn->prev;
+	if (tn->lookup != NULL)
+		tn->lookup->tn = NULL;
+	if (tn->fd >= 0) {
+		event_del(fwd->loop, tn->fd);
+		close(tn->fd);
+	}
+	free(tn->out);
+	free(tn);
+}
+
+// the socket failed, the tunnel goes away with its channel
+void _tunnel_abort(tunnel *tn) {
+	tn->read_eof = 1;
+	tn->write_eof = 1;
+	tn->out_len = 0;
+	channel_close(tn->ch);
+}
+
+// close the channel once both directions are done
+void _tunnel_check(tunnel *tn) {
+	if (tn->read_eof && tn->write_eof && tn->out_len == 0)
+		channel_close(tn->ch);
+}
+
+// read from the socket straight into packet buffers while the channel has window for it
+void _tunnel_pump(tunnel *tn) {
+	while (!tn->read_eof && !tn->connecting) {
+		size_t room;
+		char *buf = channel_data_alloc(tn->ch, &room);
+		// CHANNEL_EV_WRITABLE brings us back here, until then the socket fills up and the sender is held off by TCP
+		if (buf == NULL)
+			return;
+		ssize_t n = read(tn->fd, buf, room);
+		channel_data_send(tn->ch, buf, n > 0 ? n : 0);
+		if (n > 0)
+			continue;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n < 0) {
+			_tunnel_abort(tn);
+			return;
+		}
+		tn->read_eof = 1;
+		channel_eof(tn->ch);
+		_tunnel_check(tn);
+	}
+}
+
+// write data to the socket, returns the number of bytes written or -1 if the socket failed
+ssize_t _tunnel_write(tunnel *tn, const char *data, size_t len) {
+	size_t written = 0;
+	while (written < len) {
+		// a closed socket must not raise SIGPIPE, it only ends its own tunnel
+		ssize_t n = send(tn->fd, data + written, len - written, MSG_NOSIGNAL);
+		if (n > 0) {
+			written += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+		return -1;
+	}
+	return written;
+}
+
+// keep what the socket did not take, the peer is not granted more window until it has been written
+int _tunnel_buffer(tunnel *tn, const char *data, size_t len) {
+	if (tn->out_off && tn->out_off + tn->out_len + len > tn->out_size) {
+		memmove(tn->out, tn->out + tn->out_off, tn->out_len);
+		tn->out_off = 0;
+	}
+	if (tn->out_off + tn->out_len + len > tn->out_size) {
+		size_t size = tn->out_size ? tn->out_size : 16384;
+		while (size < tn->out_len + len)
+			size *= 2;
+		char *tmp = realloc(tn->out, size);
+		if (tmp == NULL)
+			return -1;
+		tn->out = tmp;
+		tn->out_size = size;
+	}
+	memcpy(tn->out + tn->out_off + tn->out_len, data, len);
+	tn->out_len += len;
+	channel_hold_window(tn->ch, 1);
+	return 0;
+}
+
+// write out what was buffered once the socket takes more
+void _tunnel_flush(tunnel *tn) {
+	if (tn->connecting)
+		return;
+	if (tn->out_len) {
+		ssize_t n = _tunnel_write(tn, tn->out + tn->out_off, tn->out_len);
+		if (n < 0) {
+			_tunnel_abort(tn);
+			return;
+		}
+		tn->out_off += n;
+		tn->out_len -= n;
+		if (tn->out_len)
+			return;
+		tn->out_off = 0;
+		channel_hold_window(tn->ch, 0);
+	}
+	if (tn->write_eof && !tn->shut) {
+		shutdown(tn->fd, SHUT_WR);
+		tn->shut = 1;
+	}
+	_tunnel_check(tn);
+}
+
+void _tunnel_handler(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)loop;
+	tunnel *tn = arg;
+	if (tn->connecting) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+			_tunnel_abort(tn);
+			return;
+		}
+		if (!(events & EPOLLOUT))
+			return;
+		tn->connecting = 0;
+	}
+	if (events & EPOLLOUT)
+		_tunnel_flush(tn);
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		_tunnel_pump(tn);
+}
+
+void _tunnel_channel(channel *ch, int event, const char *data, size_t len, void *arg) {
+	tunnel *tn = arg;
+	switch (event) {
+	case CHANNEL_EV_OPEN:
+	case CHANNEL_EV_WRITABLE:
+		_tunnel_pump(tn);
+		break;
+	case CHANNEL_EV_OPEN_FAILURE: {
+		uint32_t code = 0;
+		const char *msg = "";
+		uint32_t msg_len = 0;
+		int n = len;
+		if (buf_get_u32(&data, &n, &code) == 0)
+			buf_get_string(&data, &n, &msg, &msg_len);
+		fprintf(stderr, "channel %u: open failed: %.*s (%u)\n", ch->id, (int)msg_len, msg, code);
+		_tunnel_free(tn);
+		break;
+	}
+	case CHANNEL_EV_DATA:
+		if (tn->read_eof && tn->write_eof)
+			break;
+		// straight from the decrypted packet to the socket unless earlier data is still waiting
+		if (tn->out_len == 0 && !tn->connecting) {
+			ssize_t n = _tunnel_write(tn, data, len);
+			if (n < 0) {
+				_tunnel_abort(tn);
+				break;
+			}
+			data += n;
+			len -= n;
+		}
+		if (len && _tunnel_buffer(tn, data, len))
+			_tunnel_abort(tn);
+		break;
+	case CHANNEL_EV_EOF:
+		tn->write_eof = 1;
+		_tunnel_flush(tn);
+		break;
+	case CHANNEL_EV_CLOSE:
+		_tunnel_free(tn);
+		break;
+	}
+}
+
+// make a tunnel for an accepted or connecting socket and poll it
+tunnel *_tunnel_start(forward *fwd, int fd) {
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	tunnel *tn = _tunnel_new(fwd, fd);
+	if (tn == NULL) {
+		close(fd);
+		return NULL;
+	}
+	// edge-triggered, so EPOLLOUT only reports the socket becoming writable again
+	if (event_add(fwd->loop, fd, EPOLLIN | EPOLLOUT, _tunnel_handler, tn)) {
+		close(fd);
+		tn->fd = -1;
+	}
+	return tn;
+}
+
+// open a "direct-tcpip" channel for every new connection to a local forward
+void _forward_accept(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)loop;
+	(void)events;
+	local_forward *l = arg;
+	for (;;) {
+		struct sockaddr_storage addr;
+		socklen_t addr_len = sizeof(addr);
+		int s = accept(fd, (struct sockaddr *)&addr, &addr_len);
+		if (s < 0 && errno == EINTR)
+			continue;
+		if (s < 0)
+			return;
+		fcntl(s, F_SETFD, FD_CLOEXEC);
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+		char orig[NI_MAXHOST] = "", orig_port[NI_MAXSERV] = "0";
+		getnameinfo((struct sockaddr *)&addr, addr_len, orig, sizeof(orig), orig_port, sizeof(orig_port), NI_NUMERICHOST | NI_NUMERICSERV);
+		size_t host_len = strlen(l->host), orig_len = strlen(orig);
+		char extra[16 + NI_MAXHOST + NI_MAXHOST];
+		char *p = extra;
+		p = buf_put_string(p, l->host, host_len);
+		p = buf_put_u32(p, l->port);
+		p = buf_put_string(p, orig, orig_len);
+		p = buf_put_u32(p, atoi(orig_port));
+		tunnel *tn = _tunnel_start(l->fwd, s);
+		if (tn == NULL)
+			continue;
+		tn->ch = channel_open(l->fwd->conn, "direct-tcpip", extra, p - extra, _tunnel_channel, tn);
+		if (tn->ch == NULL)
+			_tunnel_free(tn);
+		else if (tn->fd < 0)
+			_tunnel_abort(tn);
+	}
+}
+
+// start connecting a tunnel that has no socket yet, 0 if the connection is under way or an SSH_OPEN_* reason
+int _tunnel_connect(tunnel *tn, const struct sockaddr *addr, socklen_t addr_len) {
+	int s = socket(addr->sa_family, SOCK_STREAM, 0);
+	if (s < 0)
+		return SSH_OPEN_RESOURCE_SHORTAGE;
+	fcntl(s, F_SETFD, FD_CLOEXEC);
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	// the channel is confirmed without waiting for the connection, data that arrives meanwhile is buffered
+	int connecting = 0;
+	if (connect(s, addr, addr_len)) {
+		if (errno != EINPROGRESS) {
+			close(s);
+			return SSH_OPEN_CONNECT_FAILED;
+		}
+		connecting = 1;
+	}
+	int one = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	// edge-triggered, so EPOLLOUT only reports the socket becoming writable again
+	if (event_add(tn->fwd->loop, s, EPOLLIN | EPOLLOUT, _tunnel_handler, tn)) {
+		close(s);
+		return SSH_OPEN_RESOURCE_SHORTAGE;
+	}
+	tn->fd = s;
+	tn->connecting = connecting;
+	return 0;
+}
+
+// connect a channel the peer opened to a target, 0 if the tunnel is under way or an SSH_OPEN_* reason
+int _forward_connect(forward *fwd, channel *ch, const struct sockaddr *addr, socklen_t addr_len) {
+	tunnel *tn = _tunnel_new(fwd, -1);
+	if (tn == NULL)
+		return SSH_OPEN_RESOURCE_SHORTAGE;
+	int code = _tunnel_connect(tn, addr, addr_len);
+	if (code) {
+		_tunnel_free(tn);
+		return code;
+	}
+	tn->ch = ch;
+	ch->cb = _tunnel_channel;
+	ch->arg = tn;
+	return 0;
+}
+
+// runs on a worker thread
+void _forward_resolve(void *arg) {
+	tunnel_lookup *lk = arg;
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	lk->err = getaddrinfo(lk->name, lk->service, &hints, &lk->res);
+}
+
+// back on the loop, the tunnel connects like one whose target was numeric, or closes its channel if there is none
+void _forward_resolved(void *arg) {
+	tunnel_lookup *lk = arg;
+	tunnel *tn = lk->tn;
+	if (tn != NULL) {
+		tn->lookup = NULL;
+		if (lk->err || _tunnel_connect(tn, lk->res->ai_addr, lk->res->ai_addrlen))
+			_tunnel_abort(tn);
+	}
+	if (lk->err == 0)
+		freeaddrinfo(lk->res);
+	free(lk);
+}
+
+// accept the channel now and connect it once a worker has resolved the name, 0 or an SSH_OPEN_* reason
+int _forward_lookup(forward *fwd, channel *ch, const char *name, const char *service) {
+	tunnel_lookup *lk = calloc(1, sizeof(tunnel_lookup));
+	tunnel *tn = lk != NULL ? _tunnel_new(fwd, -1) : NULL;
+	if (tn == NULL) {
+		free(lk);
+		return SSH_OPEN_RESOURCE_SHORTAGE;
+	}
+	snprintf(lk->name, sizeof(lk->name), "%s", name);
+	snprintf(lk->service, sizeof(lk->service), "%s", service);
+	lk->tn = tn;
+	tn->lookup = lk;
+	tn->connecting = 1;
+	if (worker_submit(fwd->resolver, _forward_resolve, _forward_resolved, lk)) {
+		_tunnel_free(tn);
+		free(lk);
+		return SSH_OPEN_RESOURCE_SHORTAGE;
+	}
+	tn->ch = ch;
+	ch->cb = _tunnel_channel;
+	ch->arg = tn;
+	return 0;
+}
+
+// connect a channel the server opened for a remote forward to its target
+int _forward_open(connection *conn, channel *ch, const char *type, size_t type_len, const char *data, size_t len, void *arg) {
+	(void)conn;
+	forward *fwd = arg;
+	if (type_len != 15 || memcmp(type, "forwarded-tcpip", 15))
+		return SSH_OPEN_UNKNOWN_CHANNEL_TYPE;
+	const char *addr;
+	uint32_t addr_len, port;
+	int n = len;
+	if (buf_get_string(&data, &n, &addr, &addr_len) || buf_get_u32(&data, &n, &port))
+		return SSH_OPEN_CONNECT_FAILED;
+	remote_forward *r = fwd->remotes;
+	while (r != NULL && (!r->active || r->bound != port))
+		r = r->next;
+	if (r == NULL)
+		return SSH_OPEN_ADMINISTRATIVELY_PROHIBITED;
+	return _forward_connect(fwd, ch, (struct sockaddr *)&r->addr, r->addr_len);
+}
+
+int forward_direct(forward *fwd, channel *ch, const char *data, size_t len) {
+	const char *host;
+	uint32_t host_len, port;
+	int n = len;
+	if (buf_get_string(&data, &n, &host, &host_len) || buf_get_u32(&data, &n, &port) || host_len >= NI_MAXHOST || port > 65535)
+		return SSH_OPEN_CONNECT_FAILED;
+	char name[NI_MAXHOST], service[8];
+	memcpy(name, host, host_len);
+	name[host_len] = 0;
+	snprintf(service, sizeof(service), "%u", port);
+	struct addrinfo hints = {0}, *res;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV | AI_NUMERICHOST;
+	// a numeric address needs no lookup, anything else may wait on DNS and goes to a worker if there is one
+	int err = getaddrinfo(name, service, &hints, &res);
+	if (err == EAI_NONAME && fwd->resolver != NULL)
+		return _forward_lookup(fwd, ch, name, service);
+	if (err == EAI_NONAME) {
+		hints.ai_flags = AI_NUMERICSERV;
+		err = getaddrinfo(name, service, &hints, &res);
+	}
+	if (err)
+		return SSH_OPEN_CONNECT_FAILED;
+	int code = _forward_connect(fwd, ch, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+	return code;
+}
+
+void forward_init(forward *fwd, connection *conn, event_loop *loop) {
+	memset(fwd, 0, sizeof(forward));
+	fwd->conn = conn;
+	fwd->loop = loop;
+	connection_set_accept(conn, _forward_open, fwd);
+}
+
+void forward_set_resolver(forward *fwd, worker_inbox *in) { fwd->resolver = in; }
+
+int forward_local(forward *fwd, const char *addr, const char *port, const char *host, uint32_t host_port) {
+	struct addrinfo hints = {0}, *res;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (addr == NULL)
+		addr = "localhost";
+	if (getaddrinfo(strcmp(addr, "*") ? addr : NULL, port, &hints, &res)) {
+		fprintf(stderr, "Could not resolve %s\n", addr);
+		return -1;
+	}
+	// listen on every address the name has (localhost is usually both 127.0.0.1 and ::1)
+	int listening = 0;
+	for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+		int s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s < 0)
+			continue;
+		fcntl(s, F_SETFD, FD_CLOEXEC);
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+		int one = 1;
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (ai->ai_family == AF_INET6)
+			setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+		local_forward *l = calloc(1, sizeof(local_forward));
+		if (l == NULL || (l->host = strdup(host)) == NULL || bind(s, ai->ai_addr, ai->ai_addrlen) || listen(s, SOMAXCONN)) {
+			if (l != NULL)
+				free(l->host);
+			free(l);
+			close(s);
+			continue;
+		}
+		l->fwd = fwd;
+		l->fd = s;
+		l->port = host_port;
+		if (event_add(fwd->loop, s, EPOLLIN, _forward_accept, l)) {
+			free(l->host);
+			free(l);
+			close(s);
+			continue;
+		}
+		l->next = fwd->listeners;
+		fwd->listeners = l;
+		listening++;
+	}
+	freeaddrinfo(res);
+	if (listening == 0) {
+		fprintf(stderr, "Could not listen on port %s: %s\n", port, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+void _forward_reply(connection *conn, int success, const char *data, size_t len, void *arg) {
+	(void)conn;
+	remote_forward *r = arg;
+	r->fwd->pending--;
+	if (!success) {
+		fprintf(stderr, "Warning: remote port forwarding failed for listen port %u\n", r->port);
+		return;
+	}
+	// asked for port 0, the reply carries the one the server chose
+	uint32_t port;
+	int n = len;
+	if (r->port == 0 && buf_get_u32(&data, &n, &port) == 0) {
+		r->bound = port;
+		fprintf(stderr, "Allocated port %u for remote forward to %s\n", port, r->target);
+	}
+	r->active = 1;
+	r->fwd->remotes_active++;
+}
+
+int forward_remote(forward *fwd, const char *addr, uint32_t port, const char *host, const char *host_port) {
+	struct addrinfo hints = {0}, *res;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, host_port, &hints, &res)) {
+		fprintf(stderr, "Could not resolve %s\n", host);
+		return -1;
+	}
+	remote_forward *r = calloc(1, sizeof(remote_forward));
+	if (r == NULL) {
+		freeaddrinfo(res);
+		return -1;
+	}
+	memcpy(&r->addr, res->ai_addr, res->ai_addrlen);
+	r->addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	r->fwd = fwd;
+	r->port = r->bound = port;
+	r->bind = strdup(addr != NULL ? addr : "localhost");
+	r->target = malloc(strlen(host) + strlen(host_port) + 2);
+	if (r->bind == NULL || r->target == NULL) {
+		free(r->bind);
+		free(r->target);
+		free(r);
+		return -1;
+	}
+	sprintf(r->target, "%s:%s", host, host_port);
+	r->next = fwd->remotes;
+	fwd->remotes = r;
+	size_t bind_len = strlen(r->bind);
+	char *data = malloc(8 + bind_len);
+	if (data == NULL)
+		return -1;
+	char *p = buf_put_string(data, r->bind, bind_len);
+	p = buf_put_u32(p, port);
+	int ret = connection_global_request(fwd->conn, "tcpip-forward", data, p - data, _forward_reply, r);
+	free(data);
+	if (ret == 0)
+		fwd->pending++;
+	return ret;
+}
+
+int forward_run(forward *fwd) {
+	while (fwd->listeners != NULL || fwd->remotes_active || fwd->pending || fwd->tunnels != NULL)
+		if (connection_step(fwd->conn))
+			return -1;
+	return 0;
+}
+
+void forward_free(forward *fwd) {
+	while (fwd->listeners != NULL) {
+		local_forward *l = fwd->listeners;
+		fwd->listeners = l->next;
+		event_del(fwd->loop, l->fd);
+		close(l->fd);
+		free(l->host);
+		free(l);
+	}
+	while (fwd->remotes != NULL) {
+		remote_forward *r = fwd->remotes;
+		fwd->remotes = r->next;
+		free(r->bind);
+		free(r->target);
+		free(r);
+	}
+	// the channels stay with the connection, they just stop calling back
+	while (fwd->tunnels != NULL) {
+		tunnel *tn = fwd->tunnels;
+		if (tn->ch != NULL)
+			tn->ch->cb = NULL;
+		_tunnel_free(tn);
+	}
+	connection_set_accept(fwd->conn, NULL, NULL);
+}
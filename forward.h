@@ -0,0 +1,140 @@
+#pragma once
+
+#include "channel.h"
+#include "worker.h"
+#include <netdb.h>
+#include <stdio.h>
+
+struct forward;
+struct tunnel_lookup;
+
+// one forwarded TCP connection and the channel carrying it
+typedef struct tunnel {
+	struct forward *fwd;
+	channel *ch;
+	int fd;
+	// channel data the socket has not taken yet, the channel's window is held while there is any
+	char *out;
+	size_t out_len;
+	size_t out_off;
+	size_t out_size;
+	struct tunnel *prev;
+	struct tunnel *next;
+	// the target's name is being resolved on a worker thread
+	struct tunnel_lookup *lookup;
+	// the connection to the target is being made (or its name resolved)
+	unsigned char connecting;
+	// the socket reached EOF and the channel's EOF was sent
+	unsigned char read_eof;
+	// the channel reached EOF, the socket is shut down for writing once the buffer is written
+	unsigned char write_eof;
+	unsigned char shut;
+} tunnel;
+
+// a "direct-tcpip" target resolved off the loop, the tunnel lets go of it if it goes first
+typedef struct tunnel_lookup {
+	tunnel *tn;
+	char name[NI_MAXHOST];
+	char service[8];
+	struct addrinfo *res;
+	int err;
+} tunnel_lookup;
+
+// a local socket listening for connections to forward through the server (-L)
+typedef struct local_forward {
+	struct forward *fwd;
+	int fd;
+	char *host;
+	uint32_t port;
+	struct local_forward *next;
+} local_forward;
+
+// a port the server listens on for us and where its connections go (-R)
+typedef struct remote_forward {
+	struct forward *fwd;
+	char *bind;
+	// the port asked for, and the one the server listens on (they differ when 0 was asked for)
+	uint32_t port;
+	uint32_t bound;
+	// the target, resolved once so that opening a tunnel never blocks the event loop
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	char *target;
+	unsigned char active;
+	struct remote_forward *next;
+} remote_forward;
+
+typedef struct forward {
+	connection *conn;
+	event_loop *loop;
+	local_forward *listeners;
+	remote_forward *remotes;
+	tunnel *tunnels;
+	// where the names "direct-tcpip" channels ask for are resolved, NULL to resolve them on the loop
+	worker_inbox *resolver;
+	// remote forwards the server has accepted and "tcpip-forward" requests it has not answered yet
+	int remotes_active;
+	int pending;
+} forward;
+
+/**
+ * @brief Initialize port forwarding on a connection, channels the server opens for remote forwards are accepted from now on
+ * @param fwd The forwarding state to initialize
+ * @param conn The connection
+ * @param loop The event loop the forwarded sockets are polled by
+ */
+void forward_init(forward *, connection *, event_loop *);
+
+/**
+ * @brief Resolve the targets of "direct-tcpip" channels on worker threads instead of the loop
+ * @param fwd The forwarding state
+ * @param in The inbox of the loop the forwarded sockets are polled by, NULL to resolve on the loop
+ */
+void forward_set_resolver(forward *, worker_inbox *);
+
+/**
+ * @brief Listen on a local port and forward every connection to it through a "direct-tcpip" channel
+ * @param fwd The forwarding state
+ * @param bind The local address to listen on, NULL for localhost and "*" for every interface
+ * @param port The local port
+ * @param host The host the server connects to
+ * @param host_port The port the server connects to
+ * @return 0 on success, -1 on error
+ */
+int forward_local(forward *, const char *, const char *, const char *, uint32_t);
+
+/**
+ * @brief Ask the server to listen on a port and forward every connection to it back to a local target
+ * @param fwd The forwarding state
+ * @param bind The address the server listens on, NULL for its loopback interface
+ * @param port The port the server listens on, 0 lets the server choose
+ * @param host The host connections are forwarded to
+ * @param host_port The port connections are forwarded to
+ * @return 0 if the request was sent, -1 on error
+ */
+int forward_remote(forward *, const char *, uint32_t, const char *, const char *);
+
+/**
+ * @brief Connect a "direct-tcpip" channel the client opened to the host and port it names (the server side of -L)
+ * @note Called from the server's accept callback. The channel is confirmed while the connection is under way, and a name
+ * that is not a numeric address is resolved on the resolver (forward_set_resolver) so the loop never waits on DNS
+ * @param fwd The forwarding state
+ * @param ch The channel
+ * @param data The channel type specific data
+ * @param len The length of the type specific data
+ * @return 0 if the channel is accepted, an SSH_OPEN_* reason to refuse it
+ */
+int forward_direct(forward *, channel *, const char *, size_t);
+
+/**
+ * @brief Forward connections until the connection fails or there is nothing left to forward
+ * @param fwd The forwarding state
+ * @return 0 once nothing is forwarded anymore, -1 on error
+ */
+int forward_run(forward *);
+
+/**
+ * @brief Close the listeners and every tunnel
+ * @param fwd The forwarding state
+ */
+void forward_free(forward *);
@@ -0,0 +1,737 @@
+#include "kex.h"
+
+// supported methods, most preferred first
+char *kex_algos[] = {
+	"ecdh-sha2-nistp256",
+	// "ecdh-sha2-nistp384",
+	// "ecdh-sha2-nistp521",
+	// "diffie-hellman-group-exchange-sha256",
+	// "diffie-hellman-group14-sha256",
+};
+
+char *hostkey_algos[] = {
+	"ecdsa-sha2-nistp256",
+	// "ecdsa-sha2-nistp384",
+	// "ecdsa-sha2-nistp521",
+};
+
+char *enc_algos[] = {
+	"aes128-ctr",
+	// "chacha20-poly1305@openssh.com"
+};
+
+char *mac_algos[] = {
+	"hmac-sha2-256",
+};
+
+// "none" stays last so it can be offered on its own
+char *comp_algos[] = {
+	"zlib@openssh.com",
+	"none",
+};
+
+// a precomputed ephemeral key, the private scalar and the encoded public point
+struct kex_ephemeral {
+	mpz_t x;
+	char q[KEX_POINT_LEN];
+};
+
+// ring of ready keys, consumed from head
+static struct kex_ephemeral *keys = NULL;
+static int keys_size = 0;
+static int keys_head = 0;
+static int keys_count = 0;
+static unsigned char keys_running = 0;
+static pthread_t keys_thread;
+static pthread_mutex_t keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t keys_cond = PTHREAD_COND_INITIALIZER;
+
+// write v as a big-endian number of exactly len bytes
+void _kex_export(const mpz_t v, char *out, size_t len) {
+	size_t n = (mpz_sizeinbase(v, 2) + 7) / 8;
+	memset(out, 0, len);
+	if (mpz_sgn(v) != 0 && n <= len)
+		mpz_export(out + len - n, NULL, 1, 1, 0, 0, v);
+}
+
+// generate a private scalar x and the uncompressed encoding of xG
+void _kex_make_key(mpz_t x, char *q) {
+	unsigned char buf[32];
+	mpz_t n;
+	mpz_init(n);
+	EC_order(n);
+	do {
+		randbytes(buf, sizeof(buf));
+		mpz_import(x, sizeof(buf), 1, 1, 0, 0, buf);
+	} while (mpz_cmp(x, n) >= 0 || mpz_cmp_ui(x, 0) == 0);
+	memset(buf, 0, sizeof(buf));
+	mpz_clear(n);
+	EC_point Q;
+	EC_init_generator(&Q);
+	EC_mul(&Q, &Q, x);
+	q[0] = 0x04;
+	_kex_export(Q.x, q + 1, 32);
+	_kex_export(Q.y, q + 33, 32);
+	EC_clear(&Q);
+}
+
+int _kex_pool_take(mpz_t x, char *q) {
+	pthread_mutex_lock(&keys_lock);
+	if (keys_count == 0) {
+		pthread_mutex_unlock(&keys_lock);
+		return -1;
+	}
+	// swap the entry out instead of copying it so the secret only ever exists once
+	struct kex_ephemeral *entry = &keys[keys_head];
+	mpz_swap(x, entry->x);
+	memcpy(q, entry->q, KEX_POINT_LEN);
+	_mpz_wipe(entry->x);
+	keys_head = (keys_head + 1) % keys_size;
+	keys_count--;
+	pthread_cond_signal(&keys_cond);
+	pthread_mutex_unlock(&keys_lock);
+	return 0;
+}
+
+void *_kex_pool_worker(void *arg) {
+	(void)arg;
+	mpz_t x;
+	char q[KEX_POINT_LEN];
+	mpz_init(x);
+	pthread_mutex_lock(&keys_lock);
+	while (keys_running) {
+		// sleep until an exchange consumes an entry
+		if (keys_count == keys_size) {
+			pthread_cond_wait(&keys_cond, &keys_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&keys_lock);
+		_kex_make_key(x, q);
+		pthread_mutex_lock(&keys_lock);
+		struct kex_ephemeral *entry = &keys[(keys_head + keys_count) % keys_size];
+		mpz_swap(x, entry->x);
+		memcpy(entry->q, q, KEX_POINT_LEN);
+		keys_count++;
+		_mpz_wipe(x);
+	}
+	pthread_mutex_unlock(&keys_lock);
+	mpz_clear(x);
+	return NULL;
+}
+
+int kex_pool_init(int size, int background) {
+	if (keys != NULL || size <= 0)
+		return -1;
+	// the curve is set up once here, before the worker reads it
+	ECDSA_init();
+	keys = malloc(size * sizeof(struct kex_ephemeral));
+	if (keys == NULL)
+		return -1;
+	for (int i = 0; i < size; i++)
+		mpz_init(keys[i].x);
+	keys_size = size;
+	keys_head = 0;
+	keys_count = 0;
+	if (background) {
+		keys_running = 1;
+		if (pthread_create(&keys_thread, NULL, _kex_pool_worker, NULL) != 0) {
+			// without a thread to refill it, exchanges make their keys inline as if there were no pool
+			keys_running = 0;
+			for (int i = 0; i < size; i++)
+				mpz_clear(keys[i].x);
+			free(keys);
+			keys = NULL;
+			keys_size = 0;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void kex_pool_free() {
+	if (keys == NULL)
+		return;
+	if (keys_running) {
+		pthread_mutex_lock(&keys_lock);
+		keys_running = 0;
+		pthread_cond_signal(&keys_cond);
+		pthread_mutex_unlock(&keys_lock);
+		pthread_join(keys_thread, NULL);
+	}
+	for (int i = 0; i < keys_size; i++) {
+		_mpz_wipe(keys[i].x);
+		mpz_clear(keys[i].x);
+	}
+	free(keys);
+	keys = NULL;
+	keys_size = keys_head = keys_count = 0;
+}
+
+int has_name(const char *list, uint32_t len, const char *name) {
+	size_t name_len = strlen(name);
+	for (uint32_t i = 0; i + name_len <= len;) {
+		if (memcmp(list + i, name, name_len) == 0 && (i + name_len == len || list[i + name_len] == ','))
+			return 1;
+		while (i < len && list[i] != ',')
+			i++;
+		i++;
+	}
+	return 0;
+}
+
+// check whether the first entry of a name-list is name
+int _kex_first_is(const char *list, uint32_t len, const char *name) {
+	size_t name_len = strlen(name);
+	return name_len <= len && memcmp(list, name, name_len) == 0 && (name_len == len || list[name_len] == ',');
+}
+
+// write a name-list of n names
+char *_kex_put_list(char *p, char **names, size_t n) {
+	char *start = p + 4;
+	char *q = start;
+	for (size_t i = 0; i < n; i++) {
+		if (i != 0)
+			*q++ = ',';
+		size_t len = strlen(names[i]);
+		memcpy(q, names[i], len);
+		q += len;
+	}
+	buf_put_u32(p, q - start);
+	return q;
+}
+
+void _kex_hash_string(sha256_ctx *ctx, const char *data, uint32_t len) {
+	uint32_t n = htonl(len);
+	sha256_update(ctx, &n, 4);
+	sha256_update(ctx, data, len);
+}
+
+// write the shared secret as an mpint: no leading zero bytes, and a zero byte in front if the top bit is set
+int _kex_put_mpint(const mpz_t v, char *out) {
+	char raw[32];
+	_kex_export(v, raw, sizeof(raw));
+	int i = 0;
+	while (i < (int)sizeof(raw) && raw[i] == 0)
+		i++;
+	int len = sizeof(raw) - i;
+	int pad = len && (raw[i] & 0x80);
+	buf_put_u32(out, len + pad);
+	out[4] = 0;
+	memcpy(out + 4 + pad, raw + i, len);
+	memset(raw, 0, sizeof(raw));
+	return 4 + pad + len;
+}
+
+int kex_init(kex *k, transport *t, const char *ident_c, const char *ident_s, size_t ident_s_len, const int compression) {
+	memset(k, 0, sizeof(kex));
+	ECDSA_init();
+	k->ident_c_len = strlen(ident_c);
+	k->ident_c = malloc(k->ident_c_len);
+	k->ident_s_len = ident_s_len;
+	k->ident_s = malloc(ident_s_len);
+	if (k->ident_c == NULL || k->ident_s == NULL) {
+		free(k->ident_c);
+		free(k->ident_s);
+		return -1;
+	}
+	memcpy(k->ident_c, ident_c, k->ident_c_len);
+	memcpy(k->ident_s, ident_s, ident_s_len);
+	mpz_init(k->x);
+	k->t = t;
+	k->compression = compression;
+	k->guess = 1;
+	k->rekey_bytes = KEX_REKEY_BYTES;
+	k->rekey_seconds = KEX_REKEY_SECONDS;
+	return 0;
+}
+
+int kex_init_server(kex *k, transport *t, const char *ident_s, const char *ident_c, size_t ident_c_len, ECDSA_keypair *hostkey) {
+	// our string goes in both places first, the client's replaces it below
+	if (kex_init(k, t, ident_s, ident_s, strlen(ident_s), 0))
+		return -1;
+	free(k->ident_c);
+	k->ident_c_len = ident_c_len;
+	k->ident_c = malloc(ident_c_len);
+	// the host key blob is the algorithm, the curve and the point, and it is what the client checks the signature with
+	k->hostkey_len = 4 + 19 + 4 + 8 + 4 + KEX_POINT_LEN;
+	k->hostkey = malloc(k->hostkey_len);
+	if (k->ident_c == NULL || k->hostkey == NULL) {
+		kex_free(k);
+		return -1;
+	}
+	memcpy(k->ident_c, ident_c, ident_c_len);
+	char point[KEX_POINT_LEN];
+	point[0] = 0x04;
+	_kex_export(hostkey->pubkey->x, point + 1, 32);
+	_kex_export(hostkey->pubkey->y, point + 33, 32);
+	char *p = buf_put_string(k->hostkey, hostkey_algos[0], 19);
+	p = buf_put_string(p, "nistp256", 8);
+	buf_put_string(p, point, KEX_POINT_LEN);
+	k->hostkeypair = hostkey;
+	k->guess = 0;
+	return 0;
+}
+
+void kex_set_limits(kex *k, uint64_t bytes, uint32_t seconds) {
+	k->rekey_bytes = bytes;
+	k->rekey_seconds = seconds;
+}
+
+void kex_set_offload(kex *k, kex_offload_cb cb, void *arg) {
+	k->offload = cb;
+	k->offload_arg = arg;
+}
+
+int _kex_send_ecdh(kex *k) {
+	char buf[1 + 4 + KEX_POINT_LEN];
+	buf[0] = SSH_MSG_KEX_ECDH_INIT;
+	buf_put_string(buf + 1, k->q, KEX_POINT_LEN);
+	if (send_packet(k->t, buf, sizeof(buf)))
+		return -1;
+	k->sent_ecdh = 1;
+	return 0;
+}
+
+int kex_start(kex *k) {
+	if (k->state != KEX_IDLE)
+		return 0;
+	// a limit was reached before the timer fired
+	if (k->timer != NULL) {
+		event_timer_cancel(k->timer);
+		k->timer = NULL;
+	}
+	// the expensive fixed-base multiply was normally done ahead of time
+	if (keys == NULL || _kex_pool_take(k->x, k->q))
+		_kex_make_key(k->x, k->q);
+
+	char buf[1024];
+	char *p = buf;
+	*p++ = SSH_MSG_KEXINIT;
+	randbytes((unsigned char *)p, 16);
+	p += 16;
+	p = _kex_put_list(p, kex_algos, sizeof(kex_algos) / sizeof(char *));
+	p = _kex_put_list(p, hostkey_algos, sizeof(hostkey_algos) / sizeof(char *));
+	for (int i = 0; i < 2; i++)
+		p = _kex_put_list(p, enc_algos, sizeof(enc_algos) / sizeof(char *));
+	for (int i = 0; i < 2; i++)
+		p = _kex_put_list(p, mac_algos, sizeof(mac_algos) / sizeof(char *));
+	// without compression only "none" is offered
+	size_t skip = k->compression ? 0 : sizeof(comp_algos) / sizeof(char *) - 1;
+	for (int i = 0; i < 2; i++)
+		p = _kex_put_list(p, comp_algos + skip, sizeof(comp_algos) / sizeof(char *) - skip);
+	// no languages
+	p = buf_put_u32(p, 0);
+	p = buf_put_u32(p, 0);
+	// first_kex_packet_follows, when the server is likely to agree ECDH_INIT goes out without waiting for its KEXINIT
+	*p++ = k->guess;
+	p = buf_put_u32(p, 0);
+	// the exchange hash takes both payloads in client, server order
+	char **init = k->hostkeypair != NULL ? &k->init_s : &k->init_c;
+	int *init_len = k->hostkeypair != NULL ? &k->init_s_len : &k->init_c_len;
+	free(*init);
+	*init_len = p - buf;
+	*init = malloc(*init_len);
+	if (*init == NULL)
+		return -1;
+	memcpy(*init, buf, *init_len);
+
+	k->state = KEX_STARTED;
+	k->got_init = 0;
+	k->sent_ecdh = 0;
+	transport_hold(k->t, 1);
+	if (send_packet(k->t, buf, *init_len) || (k->guess && _kex_send_ecdh(k)))
+		return -1;
+	return transport_flush(k->t);
+}
+
+// pick the compression of one direction: ours if the server has it, otherwise none
+int _kex_choose_comp(kex *k, const char *list, uint32_t len, unsigned char *zlib) {
+	*zlib = k->compression && has_name(list, len, "zlib@openssh.com");
+	return *zlib || has_name(list, len, "none") ? 0 : -1;
+}
+
+int _kex_recv_init(kex *k, const char *payload, int len) {
+	if (k->got_init)
+		return -1;
+	// the peer started this exchange, answer with our KEXINIT first
+	if (k->state == KEX_IDLE && kex_start(k))
+		return -1;
+	if (k->state != KEX_STARTED)
+		return -1;
+	const char *p = payload + 17;
+	int left = len - 17;
+	if (left < 0)
+		return -1;
+	const char *lists[10];
+	uint32_t lens[10];
+	for (int i = 0; i < 10; i++)
+		if (buf_get_string(&p, &left, &lists[i], &lens[i]))
+			return -1;
+	if (left < 1)
+		return -1;
+	unsigned char follows = *p;
+	// there is only one choice for everything but compression
+	if (!has_name(lists[0], lens[0], kex_algos[0]) || !has_name(lists[1], lens[1], hostkey_algos[0]))
+		return -1;
+	for (int i = 2; i < 6; i++)
+		if (!has_name(lists[i], lens[i], i < 4 ? enc_algos[0] : mac_algos[0]))
+			return -1;
+	if (_kex_choose_comp(k, lists[6], lens[6], &k->compress_ctos) || _kex_choose_comp(k, lists[7], lens[7], &k->compress_stoc))
+		return -1;
+	char **init = k->hostkeypair != NULL ? &k->init_c : &k->init_s;
+	int *init_len = k->hostkeypair != NULL ? &k->init_c_len : &k->init_s_len;
+	free(*init);
+	*init = malloc(len);
+	if (*init == NULL)
+		return -1;
+	memcpy(*init, payload, len);
+	*init_len = len;
+	k->got_init = 1;
+	// a guess is right when both sides list the same key exchange and host key algorithm first (RFC 4253 section 7)
+	int agree = _kex_first_is(lists[0], lens[0], kex_algos[0]) && _kex_first_is(lists[1], lens[1], hostkey_algos[0]);
+	if (follows && !agree)
+		k->ignore_next = 1;
+	// the server only answers the client's ECDH_INIT
+	if (k->hostkeypair != NULL)
+		return 0;
+	// the server drops an ECDH_INIT sent on a wrong guess, so it goes out again, and the next exchange waits for KEXINIT
+	if (k->sent_ecdh && !agree)
+		k->sent_ecdh = 0;
+	k->guess = agree;
+	if (!k->sent_ecdh) {
+		if (_kex_send_ecdh(k))
+			return -1;
+		return transport_flush(k->t);
+	}
+	return 0;
+}
+
+// derive one key as HASH(K || H || letter || session_id)
+void _kex_derive(kex *k, const char *K, int K_len, const uint8_t *H, char letter, uint8_t *out) {
+	sha256_ctx ctx;
+	sha256_init(&ctx);
+	sha256_update(&ctx, K, K_len);
+	sha256_update(&ctx, H, 32);
+	sha256_update(&ctx, &letter, 1);
+	sha256_update(&ctx, k->session_id, 32);
+	sha256_final(&ctx, out);
+}
+
+int _kex_sign(kex *, const char *, int);
+
+int kex_reply_verify(kex *k, const char *payload, int len) {
+	if (k->hostkeypair != NULL)
+		return _kex_sign(k, payload, len);
+	const char *p = payload + 1, *hostkey, *q_s, *sig;
+	int left = len - 1;
+	uint32_t hostkey_len, q_s_len, sig_len;
+	if (buf_get_string(&p, &left, &hostkey, &hostkey_len) || buf_get_string(&p, &left, &q_s, &q_s_len) ||
+	    buf_get_string(&p, &left, &sig, &sig_len))
+		return -1;
+	// the host key blob is the algorithm, the curve and the point
+	const char *name, *curve, *point;
+	uint32_t name_len, curve_len, point_len;
+	const char *hp = hostkey;
+	int hleft = hostkey_len;
+	if (buf_get_string(&hp, &hleft, &name, &name_len) || buf_get_string(&hp, &hleft, &curve, &curve_len) ||
+	    buf_get_string(&hp, &hleft, &point, &point_len) || point_len != KEX_POINT_LEN || point[0] != 0x04)
+		return -1;
+	// the server must keep its host key across exchanges
+	if (k->hostkey != NULL && (hostkey_len != k->hostkey_len || memcmp(hostkey, k->hostkey, hostkey_len))) {
+		fprintf(stderr, "Host key changed during key exchange\n");
+		return -1;
+	}
+	// the signature blob is the algorithm and a string holding r and s as mpints
+	const char *sp = sig, *rs, *r, *s;
+	int sleft = sig_len;
+	uint32_t rs_len, r_len, s_len;
+	if (buf_get_string(&sp, &sleft, &name, &name_len))
+		return -1;
+	const char *blob = sp;
+	if (buf_get_string(&sp, &sleft, &rs, &rs_len))
+		return -1;
+	int rsleft = rs_len;
+	if (buf_get_string(&rs, &rsleft, &r, &r_len) || buf_get_string(&rs, &rsleft, &s, &s_len))
+		return -1;
+	// a point that is not on the curve would leak the private key through the shared secret
+	if (q_s_len != KEX_POINT_LEN || q_s[0] != 0x04)
+		return -1;
+	EC_point Q;
+	EC_init(&Q);
+	EC_parse_point(q_s, q_s_len, &Q);
+	if (!EC_on_curve(&Q)) {
+		EC_clear(&Q);
+		return -1;
+	}
+	// the one multiply left on the data path
+	EC_mul(&Q, &Q, k->x);
+	_mpz_wipe(k->x);
+	if (Q.inf) {
+		EC_clear(&Q);
+		return -1;
+	}
+	char K[4 + 33];
+	int K_len = _kex_put_mpint(Q.x, K);
+	_mpz_wipe(Q.x);
+	EC_clear(&Q);
+
+	// H = hash(V_C || V_S || I_C || I_S || K_S || Q_C || Q_S || K)
+	uint8_t H[32];
+	sha256_ctx ctx;
+	sha256_init(&ctx);
+	_kex_hash_string(&ctx, k->ident_c, k->ident_c_len);
+	_kex_hash_string(&ctx, k->ident_s, k->ident_s_len);
+	_kex_hash_string(&ctx, k->init_c, k->init_c_len);
+	_kex_hash_string(&ctx, k->init_s, k->init_s_len);
+	_kex_hash_string(&ctx, hostkey, hostkey_len);
+	_kex_hash_string(&ctx, k->q, KEX_POINT_LEN);
+	_kex_hash_string(&ctx, q_s, q_s_len);
+	sha256_update(&ctx, K, K_len);
+	sha256_final(&ctx, H);
+
+	ECDSA_keypair keypair;
+	EC_point pub;
+	EC_init(&pub);
+	EC_parse_point(point, point_len, &pub);
+	keypair.pubkey = &pub;
+	int bad = ECDSA_verify(&keypair, (const char *)H, 32, blob);
+	EC_clear(&pub);
+	if (bad) {
+		memset(K, 0, sizeof(K));
+		fprintf(stderr, "Signature verification failed\n");
+		return -1;
+	}
+	if (k->hostkey == NULL) {
+		k->hostkey = malloc(hostkey_len);
+		if (k->hostkey == NULL)
+			return -1;
+		memcpy(k->hostkey, hostkey, hostkey_len);
+		k->hostkey_len = hostkey_len;
+		// the first exchange hash identifies the session for good
+		memcpy(k->session_id, H, 32);
+	}
+
+	_kex_derive(k, K, K_len, H, 'A', k->tx_iv);
+	_kex_derive(k, K, K_len, H, 'B', k->rx_iv);
+	_kex_derive(k, K, K_len, H, 'C', k->tx_key);
+	_kex_derive(k, K, K_len, H, 'D', k->rx_key);
+	_kex_derive(k, K, K_len, H, 'E', k->tx_mac);
+	_kex_derive(k, K, K_len, H, 'F', k->rx_mac);
+	memset(K, 0, sizeof(K));
+	return 0;
+}
+
+// the server side of kex_reply_verify: the shared secret, the exchange hash and its signature, kept for kex_reply_finish
+int _kex_sign(kex *k, const char *payload, int len) {
+	const char *p = payload + 1, *q_c;
+	int left = len - 1;
+	uint32_t q_c_len;
+	// a point that is not on the curve would leak our ephemeral key through the shared secret
+	if (buf_get_string(&p, &left, &q_c, &q_c_len) || q_c_len != KEX_POINT_LEN || q_c[0] != 0x04)
+		return -1;
+	EC_point Q;
+	EC_init(&Q);
+	EC_parse_point(q_c, q_c_len, &Q);
+	if (!EC_on_curve(&Q)) {
+		EC_clear(&Q);
+		return -1;
+	}
+	EC_mul(&Q, &Q, k->x);
+	_mpz_wipe(k->x);
+	if (Q.inf) {
+		EC_clear(&Q);
+		return -1;
+	}
+	char K[4 + 33];
+	int K_len = _kex_put_mpint(Q.x, K);
+	_mpz_wipe(Q.x);
+	EC_clear(&Q);
+
+	uint8_t H[32];
+	sha256_ctx ctx;
+	sha256_init(&ctx);
+	_kex_hash_string(&ctx, k->ident_c, k->ident_c_len);
+	_kex_hash_string(&ctx, k->ident_s, k->ident_s_len);
+	_kex_hash_string(&ctx, k->init_c, k->init_c_len);
+	_kex_hash_string(&ctx, k->init_s, k->init_s_len);
+	_kex_hash_string(&ctx, k->hostkey, k->hostkey_len);
+	_kex_hash_string(&ctx, q_c, q_c_len);
+	_kex_hash_string(&ctx, k->q, KEX_POINT_LEN);
+	sha256_update(&ctx, K, K_len);
+	sha256_final(&ctx, H);
+	if (k->count == 0)
+		memcpy(k->session_id, H, 32);
+
+	// the signature blob is the algorithm and the string holding r and s that ECDSA_sign makes
+	free(k->sig);
+	ECDSA_sign(k->hostkeypair, (const char *)H, 32, &k->sig, &k->sig_len);
+	if (k->sig == NULL) {
+		memset(K, 0, sizeof(K));
+		return -1;
+	}
+
+	// the letters of the client's directions are the other way round
+	_kex_derive(k, K, K_len, H, 'A', k->rx_iv);
+	_kex_derive(k, K, K_len, H, 'B', k->tx_iv);
+	_kex_derive(k, K, K_len, H, 'C', k->rx_key);
+	_kex_derive(k, K, K_len, H, 'D', k->tx_key);
+	_kex_derive(k, K, K_len, H, 'E', k->rx_mac);
+	_kex_derive(k, K, K_len, H, 'F', k->tx_mac);
+	memset(K, 0, sizeof(K));
+	return 0;
+}
+
+int _kex_recv_ecdh_init(kex *k, const char *payload, int len) {
+	if (k->state != KEX_STARTED || !k->got_init)
+		return -1;
+	if (k->offload != NULL)
+		return k->offload(k, payload, len, k->offload_arg);
+	if (_kex_sign(k, payload, len))
+		return -1;
+	return kex_reply_finish(k);
+}
+
+// ECDH_REPLY carries our host key, Q_S and the signature _kex_sign made
+int _kex_send_reply(kex *k) {
+	int reply_len = 1 + 4 + k->hostkey_len + 4 + KEX_POINT_LEN + 4 + 4 + 19 + k->sig_len;
+	char *reply = packet_alloc(reply_len);
+	if (reply == NULL)
+		return -1;
+	char *r = reply;
+	*r++ = SSH_MSG_KEX_ECDH_REPLY;
+	r = buf_put_string(r, k->hostkey, k->hostkey_len);
+	r = buf_put_string(r, k->q, KEX_POINT_LEN);
+	r = buf_put_u32(r, 4 + 19 + k->sig_len);
+	r = buf_put_string(r, hostkey_algos[0], 19);
+	memcpy(r, k->sig, k->sig_len);
+	free(k->sig);
+	k->sig = NULL;
+	return send_packet_buf(k->t, reply, reply_len);
+}
+
+int kex_reply_finish(kex *k) {
+	if (k->hostkeypair != NULL && (k->sig == NULL || _kex_send_reply(k)))
+		return -1;
+	// our direction switches right after NEWKEYS, and what was held goes out under the new keys
+	char msg = SSH_MSG_NEWKEYS;
+	if (send_packet(k->t, &msg, 1))
+		return -1;
+	cipher_init(&k->t->tx_cipher, k->tx_key, k->tx_iv, k->tx_mac);
+	memset(k->tx_iv, 0, sizeof(k->tx_iv));
+	memset(k->tx_key, 0, sizeof(k->tx_key));
+	memset(k->tx_mac, 0, sizeof(k->tx_mac));
+	k->state = KEX_NEWKEYS;
+	k->tx_bytes = k->t->tx_bytes;
+	k->tx_seq = k->t->tx_cipher.seq;
+	if (transport_hold(k->t, 0))
+		return -1;
+	return transport_flush(k->t);
+}
+
+int _kex_recv_reply(kex *k, const char *payload, int len) {
+	if (k->hostkeypair != NULL || k->state != KEX_STARTED || !k->got_init || !k->sent_ecdh)
+		return -1;
+	if (k->offload != NULL)
+		return k->offload(k, payload, len, k->offload_arg);
+	if (kex_reply_verify(k, payload, len))
+		return -1;
+	return kex_reply_finish(k);
+}
+
+void _kex_timer(event_loop *loop, void *arg) {
+	(void)loop;
+	kex *k = arg;
+	k->timer = NULL;
+	kex_start(k);
+}
+
+int _kex_recv_newkeys(kex *k) {
+	if (k->state != KEX_NEWKEYS)
+		return -1;
+	cipher_init(&k->t->rx_cipher, k->rx_key, k->rx_iv, k->rx_mac);
+	memset(k->rx_key, 0, sizeof(k->rx_key));
+	memset(k->rx_iv, 0, sizeof(k->rx_iv));
+	memset(k->rx_mac, 0, sizeof(k->rx_mac));
+	k->rx_bytes = k->t->rx_bytes;
+	k->rx_seq = k->t->rx_cipher.seq;
+	k->state = KEX_IDLE;
+	k->got_init = 0;
+	k->sent_ecdh = 0;
+	k->count++;
+	free(k->init_c);
+	free(k->init_s);
+	k->init_c = k->init_s = NULL;
+	if (k->rekey_seconds)
+		k->timer = event_timer_add(k->t->loop, (uint64_t)k->rekey_seconds * 1000, _kex_timer, k);
+	return 0;
+}
+
+int kex_dispatch(kex *k, const char *payload, int len) {
+	if (len < 1)
+		return -1;
+	const char type = payload[0];
+	// the packet the peer sent on a wrong guess
+	if (k->ignore_next && type >= SSH_MSG_KEX_ECDH_INIT && type <= SSH_MSG_KEX_LAST) {
+		k->ignore_next = 0;
+		return 0;
+	}
+	switch (type) {
+	case SSH_MSG_KEXINIT:
+		return _kex_recv_init(k, payload, len);
+	case SSH_MSG_KEX_ECDH_INIT:
+		return k->hostkeypair != NULL ? _kex_recv_ecdh_init(k, payload, len) : -1;
+	case SSH_MSG_KEX_ECDH_REPLY:
+		return _kex_recv_reply(k, payload, len);
+	case SSH_MSG_NEWKEYS:
+		return _kex_recv_newkeys(k);
+	}
+	return -1;
+}
+
+int kex_run(kex *k) {
+	if (kex_start(k))
+		return -1;
+	while (k->state != KEX_IDLE) {
+		char *payload;
+		int len = recv_packet(k->t, &payload);
+		if (len < 1)
+			return -1;
+		if (payload[0] == SSH_MSG_IGNORE || payload[0] == SSH_MSG_DEBUG)
+			continue;
+		if (kex_dispatch(k, payload, len))
+			return -1;
+	}
+	return 0;
+}
+
+int kex_due(kex *k) {
+	if (k->state != KEX_IDLE || k->count == 0)
+		return 0;
+	transport *t = k->t;
+	if (k->rekey_bytes && (t->tx_bytes - k->tx_bytes >= k->rekey_bytes || t->rx_bytes - k->rx_bytes >= k->rekey_bytes))
+		return 1;
+	return (uint32_t)(t->tx_cipher.seq - k->tx_seq) >= KEX_REKEY_PACKETS || (uint32_t)(t->rx_cipher.seq - k->rx_seq) >= KEX_REKEY_PACKETS;
+}
+
+void kex_free(kex *k) {
+	// never initialized
+	if (k->t == NULL)
+		return;
+	if (k->timer != NULL)
+		event_timer_cancel(k->timer);
+	_mpz_wipe(k->x);
+	mpz_clear(k->x);
+	memset(k->rx_key, 0, sizeof(k->rx_key));
+	memset(k->rx_iv, 0, sizeof(k->rx_iv));
+	memset(k->rx_mac, 0, sizeof(k->rx_mac));
+	memset(k->tx_key, 0, sizeof(k->tx_key));
+	memset(k->tx_iv, 0, sizeof(k->tx_iv));
+	memset(k->tx_mac, 0, sizeof(k->tx_mac));
+	free(k->ident_c);
+	free(k->ident_s);
+	free(k->init_c);
+	free(k->init_s);
+	free(k->hostkey);
+	free(k->sig);
+	memset(k, 0, sizeof(kex));
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "ecdsa.h"
+#include "network.h"
+#include <pthread.h>
+#include <time.h>
+
+// bytes sent or received under one set of keys before new ones are exchanged (OpenSSH's default for aes128-ctr)
+#define KEX_REKEY_BYTES (1ULL << 30)
+// seconds one set of keys is used for at most
+#define KEX_REKEY_SECONDS 3600
+// packets sent or received under one set of keys, well before the sequence number wraps (RFC 4344 section 3.1)
+#define KEX_REKEY_PACKETS (1U << 31)
+// ephemeral keys computed ahead of the exchanges that use them
+#define KEX_POOL_SIZE 4
+// length of an uncompressed nistp256 point
+#define KEX_POINT_LEN 65
+
+enum kex_state {
+	// keys are in use and no exchange is running
+	KEX_IDLE = 0,
+	// our KEXINIT was sent, upper layer packets are held until our NEWKEYS is out
+	KEX_STARTED = 1,
+	// our NEWKEYS was sent, the peer's switches the receive direction
+	KEX_NEWKEYS = 2,
+};
+
+struct kex;
+
+// hands the server's ECDH_REPLY (the client's ECDH_INIT on the server side) to another thread, which calls kex_reply_verify,
+// after which kex_reply_finish runs on the loop
+typedef int (*kex_offload_cb)(struct kex *, const char *, int, void *);
+
+typedef struct kex {
+	transport *t;
+	unsigned char state;
+	// the server side signs the exchange hash with this key instead of checking the peer's, NULL for the client side
+	ECDSA_keypair *hostkeypair;
+	// identification strings without CR LF
+	char *ident_c;
+	char *ident_s;
+	size_t ident_c_len;
+	size_t ident_s_len;
+	// both KEXINIT payloads, kept until the exchange hash is computed
+	char *init_c;
+	char *init_s;
+	int init_c_len;
+	int init_s_len;
+	// our ephemeral key for this exchange and its encoded public point (Q_C on the client side, Q_S on the server side)
+	mpz_t x;
+	char q[KEX_POINT_LEN];
+	// the peer's KEXINIT has arrived and (client side) our ECDH_INIT was sent
+	unsigned char got_init;
+	unsigned char sent_ecdh;
+	// whether the server is expected to prefer the same algorithms as we do, so ECDH_INIT can follow KEXINIT at once
+	unsigned char guess;
+	// the peer guessed wrong and the next key exchange packet it sends is to be ignored
+	unsigned char ignore_next;
+	// keys for the receive direction, switched to when the peer's NEWKEYS arrives
+	uint8_t rx_key[32];
+	uint8_t rx_iv[32];
+	uint8_t rx_mac[32];
+	// keys for the send direction between kex_reply_verify and kex_reply_finish
+	uint8_t tx_key[32];
+	uint8_t tx_iv[32];
+	uint8_t tx_mac[32];
+	// the hash of the first exchange and the host key it was signed with, which later exchanges must present again
+	// (the server side's own key blob from the start)
+	uint8_t session_id[32];
+	char *hostkey;
+	uint32_t hostkey_len;
+	// the server side's signature of the exchange hash between kex_reply_verify and kex_reply_finish
+	char *sig;
+	int sig_len;
+	// zlib level offered, 0 for none, and the directions compression was agreed on
+	int compression;
+	unsigned char compress_ctos;
+	unsigned char compress_stoc;
+	// transport counters when the current keys took effect
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint32_t tx_seq;
+	uint32_t rx_seq;
+	// limits after which new keys are exchanged, 0 for none
+	uint64_t rekey_bytes;
+	uint32_t rekey_seconds;
+	event_timer *timer;
+	// number of finished exchanges
+	int count;
+	// NULL to check the reply on the loop
+	kex_offload_cb offload;
+	void *offload_arg;
+} kex;
+
+/**
+ * @brief Check whether a comma separated name-list contains a name
+ * @param list The name-list
+ * @param len The length of the name-list
+ * @param name The name
+ * @return 1 if the name is in the list, 0 otherwise
+ */
+int has_name(const char *, uint32_t, const char *);
+
+/**
+ * @brief Set up the pool of precomputed ephemeral keys
+ * @note Each entry holds a private scalar x and the encoded public point xG, so an exchange only needs the shared secret multiply
+ * @param size The number of keys to keep ready
+ * @param background 1 to keep the pool filled from a background thread, 0 to compute keys when an exchange needs them
+ * @return 0 on success, -1 on error, in which case there is no pool and exchanges make their keys inline
+ */
+int kex_pool_init(int, int);
+
+/**
+ * @brief Stop the background thread and wipe every unused key
+ */
+void kex_pool_free();
+
+/**
+ * @brief Initialize key exchange state for a transport that has exchanged identification strings
+ * @param k The key exchange state to initialize
+ * @param t The transport
+ * @param ident_c Our identification string without CR LF
+ * @param ident_s The server's identification string without CR LF
+ * @param ident_s_len The length of the server's identification string
+ * @param compression The zlib level to offer, 0 to offer no compression
+ * @return 0 on success, -1 on error
+ */
+int kex_init(kex *, transport *, const char *, const char *, size_t, const int);
+
+/**
+ * @brief Initialize key exchange state for the server side of a transport that has exchanged identification strings
+ * @note The server never guesses, so its KEXINIT is not followed by anything. The host key signs every exchange hash and must
+ * stay valid until the state is freed
+ * @param k The key exchange state to initialize
+ * @param t The transport
+ * @param ident_s Our identification string without CR LF
+ * @param ident_c The client's identification string without CR LF
+ * @param ident_c_len The length of the client's identification string
+ * @param hostkey The host keypair
+ * @return 0 on success, -1 on error
+ */
+int kex_init_server(kex *, transport *, const char *, const char *, size_t, ECDSA_keypair *);
+
+/**
+ * @brief Set when keys are exchanged again
+ * @param k The key exchange state
+ * @param bytes Bytes sent or received under one set of keys, 0 for no limit
+ * @param seconds Seconds one set of keys is used for, 0 for no limit
+ */
+void kex_set_limits(kex *, uint64_t, uint32_t);
+
+/**
+ * @brief Check replies (sign the exchange on the server side) on another thread instead of the loop
+ * @note The shared secret and the host key signature cost three point multiplies on the client side and one multiply and a
+ * signature on the server side, which would hold up every other connection on the loop. The callback must leave the payload
+ * in place (and stop reading the transport) until kex_reply_finish has run
+ * @param k The key exchange state
+ * @param cb The callback, NULL to check replies on the loop again
+ * @param arg Passed to the callback
+ */
+void kex_set_offload(kex *, kex_offload_cb, void *);
+
+/**
+ * @brief Check the server's ECDH_REPLY (sign the exchange for the client's ECDH_INIT on the server side) and derive the new
+ * keys, touching nothing but the key exchange state
+ * @param k The key exchange state
+ * @param payload The packet payload
+ * @param len The length of the payload
+ * @return 0 on success, -1 on error
+ */
+int kex_reply_verify(kex *, const char *, int);
+
+/**
+ * @brief Send NEWKEYS (after ECDH_REPLY on the server side) and switch the send direction to the keys kex_reply_verify derived
+ * @param k The key exchange state
+ * @return 0 on success, -1 on error
+ */
+int kex_reply_finish(kex *);
+
+/**
+ * @brief Send KEXINIT (and on the client side ECDH_INIT if the server is expected to agree) unless an exchange is running
+ * @note Upper layer packets are held from here until the new keys are in use
+ * @param k The key exchange state
+ * @return 0 on success, -1 on error
+ */
+int kex_start(kex *);
+
+/**
+ * @brief Handle a key exchange packet (KEXINIT, NEWKEYS or messages 30 to 49)
+ * @param k The key exchange state
+ * @param payload The packet payload
+ * @param len The length of the payload
+ * @return 0 on success, -1 on error
+ */
+int kex_dispatch(kex *, const char *, int);
+
+/**
+ * @brief Run the first key exchange to completion
+ * @param k The key exchange state
+ * @return 0 on success, -1 on error
+ */
+int kex_run(kex *);
+
+/**
+ * @brief Check whether the current keys have reached a byte or packet limit
+ * @param k The key exchange state
+ * @return 1 if new keys should be exchanged, 0 otherwise
+ */
+int kex_due(kex *);
+
+/**
+ * @brief Free key exchange state (does nothing if it was never initialized)
+ * @param k The key exchange state to free
+ */
+void kex_free(kex *);
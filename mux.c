@@ -0,0 +1,418 @@
+#include "mux.h"
+
+void _mux_session_free(mux_session *sess) {
+	mux *mx = sess->mux;
+	if (sess->prev != NULL)
+		sess->prev->next = sess->next;
+	else
+		mx->sessions = sess->next;
+	if (sess->next != NULL)
+		sess->next->prev = sess->prev;
+	for (int i = 0; i < 3; i++) {
+		if (sess->fds[i] < 0)
+			continue;
+		if (sess->polled[i])
+			event_del(mx->loop, sess->fds[i]);
+		if (sess->flags[i] >= 0)
+			fcntl(sess->fds[i], F_SETFL, sess->flags[i]);
+		close(sess->fds[i]);
+	}
+	event_del(mx->loop, sess->sock);
+	close(sess->sock);
+	free(sess->out[0].buf);
+	free(sess->out[1].buf);
+	free(sess);
+}
+
+// the client went away or a descriptor failed, the command is ended with its channel
+void _mux_abort(mux_session *sess) {
+	sess->stdin_eof = 1;
+	sess->out[0].len = sess->out[1].len = 0;
+	sess->exit_status = 255;
+	if (sess->ch != NULL)
+		channel_close(sess->ch);
+}
+
+// read standard input straight into packet buffers while the channel has window for it
+void _mux_pump(mux_session *sess) {
+	while (!sess->stdin_eof && sess->ch != NULL) {
+		size_t room;
+		char *buf = channel_data_alloc(sess->ch, &room);
+		if (buf == NULL)
+			return;
+		ssize_t n = read(sess->fds[0], buf, room);
+		channel_data_send(sess->ch, buf, n > 0 ? n : 0);
+		if (n > 0)
+			continue;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+		sess->stdin_eof = 1;
+		channel_eof(sess->ch);
+	}
+}
+
+// write as much of data as the descriptor takes, -1 if it failed
+ssize_t _mux_write(int fd, const char *data, size_t len) {
+	size_t written = 0;
+	while (written < len) {
+		ssize_t n = write(fd, data + written, len - written);
+		if (n > 0) {
+			written += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+		return -1;
+	}
+	return written;
+}
+
+// the window is given back once both outputs have caught up
+void _mux_hold(mux_session *sess) {
+	if (sess->ch != NULL)
+		channel_hold_window(sess->ch, sess->out[0].len || sess->out[1].len);
+}
+
+// once the channel is closed and the output written the client gets the exit status and the session ends
+void _mux_finish(mux_session *sess) {
+	if (sess->ch != NULL || sess->out[0].len || sess->out[1].len)
+		return;
+	uint32_t status = htonl(sess->exit_status);
+	send(sess->sock, &status, sizeof(status), MSG_NOSIGNAL);
+	_mux_session_free(sess);
+}
+
+void _mux_output(mux_session *sess, int i, const char *data, size_t len) {
+	mux_output *o = &sess->out[i];
+	// straight from the decrypted packet to the descriptor unless earlier data is still waiting
+	if (o->len == 0) {
+		ssize_t n = _mux_write(sess->fds[i + 1], data, len);
+		if (n < 0) {
+			_mux_abort(sess);
+			return;
+		}
+		data += n;
+		len -= n;
+	}
+	if (len == 0)
+		return;
+	if (o->off && o->off + o->len + len > o->size) {
+		memmove(o->buf, o->buf + o->off, o->len);
+		o->off = 0;
+	}
+	if (o->off + o->len + len > o->size) {
+		size_t size = o->size ? o->size : 16384;
+		while (size < o->len + len)
+			size *= 2;
+		char *tmp = realloc(o->buf, size);
+		if (tmp == NULL) {
+			_mux_abort(sess);
+			return;
+		}
+		o->buf = tmp;
+		o->size = size;
+	}
+	memcpy(o->buf + o->off + o->len, data, len);
+	o->len += len;
+	_mux_hold(sess);
+}
+
+void _mux_flush(mux_session *sess, int i) {
+	mux_output *o = &sess->out[i];
+	if (o->len == 0)
+		return;
+	ssize_t n = _mux_write(sess->fds[i + 1], o->buf + o->off, o->len);
+	if (n < 0) {
+		_mux_abort(sess);
+		return;
+	}
+	o->off += n;
+	o->len -= n;
+	if (o->len == 0)
+		o->off = 0;
+	_mux_hold(sess);
+}
+
+void _mux_fd_handler(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)loop;
+	mux_session *sess = arg;
+	if (fd == sess->fds[0] && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		_mux_pump(sess);
+	for (int i = 0; i < 2; i++)
+		if (fd == sess->fds[i + 1] && (events & (EPOLLOUT | EPOLLERR)))
+			_mux_flush(sess, i);
+	_mux_finish(sess);
+}
+
+void _mux_channel(channel *ch, int event, const char *data, size_t len, void *arg) {
+	mux_session *sess = arg;
+	switch (event) {
+	case CHANNEL_EV_OPEN:
+	case CHANNEL_EV_WRITABLE:
+		_mux_pump(sess);
+		break;
+	case CHANNEL_EV_DATA:
+	case CHANNEL_EV_EXTENDED_DATA:
+		_mux_output(sess, event == CHANNEL_EV_EXTENDED_DATA, data, len);
+		break;
+	case CHANNEL_EV_EXIT_STATUS:
+		sess->exit_status = ntohl(*(uint32_t *)data);
+		break;
+	case CHANNEL_EV_FAILURE:
+		fprintf(stderr, "Server refused to start the session for a client\n");
+		channel_close(ch);
+		break;
+	case CHANNEL_EV_EOF:
+		channel_close(ch);
+		break;
+	case CHANNEL_EV_OPEN_FAILURE:
+	case CHANNEL_EV_CLOSE:
+		sess->ch = NULL;
+		_mux_finish(sess);
+		break;
+	}
+}
+
+// take the request and the descriptors, then open the channel
+int _mux_start(mux_session *sess) {
+	char *req = malloc(MUX_COMMAND_MAX + 2);
+	if (req == NULL)
+		return -1;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	struct iovec iov = {req, MUX_COMMAND_MAX + 1};
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	ssize_t n = recvmsg(sess->sock, &msg, MSG_CMSG_CLOEXEC);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(sess->fds, CMSG_DATA(cmsg), (count < 3 ? count : 3) * sizeof(int));
+		for (int i = 3; i < count; i++)
+			close(((int *)CMSG_DATA(cmsg))[i]);
+		if (count < 3) {
+			for (int i = 0; i < count; i++) {
+				close(sess->fds[i]);
+				sess->fds[i] = -1;
+			}
+			free(req);
+			return -1;
+		}
+	} else {
+		free(req);
+		return -1;
+	}
+	if (n < 1 || n > MUX_COMMAND_MAX || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || (req[0] != MUX_SHELL && req[0] != MUX_EXEC)) {
+		free(req);
+		return -1;
+	}
+	req[n] = 0;
+	for (int i = 0; i < 3; i++) {
+		sess->flags[i] = fcntl(sess->fds[i], F_GETFL);
+		fcntl(sess->fds[i], F_SETFL, sess->flags[i] | O_NONBLOCK);
+		sess->polled[i] = event_add(sess->mux->loop, sess->fds[i], i == 0 ? EPOLLIN : EPOLLOUT, _mux_fd_handler, sess) == 0;
+	}
+	sess->ch = channel_open(sess->mux->conn, "session", NULL, 0, _mux_channel, sess);
+	// the request goes out right behind the open, so the command starts a round trip after the client connected
+	int ret = sess->ch == NULL ? -1 : req[0] == MUX_EXEC ? channel_exec(sess->ch, req + 1, 1) : channel_request(sess->ch, "shell", 1, NULL, 0);
+	free(req);
+	return ret;
+}
+
+void _mux_sock_handler(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)loop;
+	(void)fd;
+	mux_session *sess = arg;
+	if (sess->fds[0] < 0) {
+		if (!(events & EPOLLIN))
+			return;
+		if (_mux_start(sess)) {
+			if (sess->ch == NULL) {
+				_mux_session_free(sess);
+				return;
+			}
+			_mux_abort(sess);
+		}
+		return;
+	}
+	// the client died, nobody is left to read the output
+	if (events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+		_mux_abort(sess);
+		_mux_finish(sess);
+	}
+}
+
+void _mux_accept(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)events;
+	mux *mx = arg;
+	for (;;) {
+		int s = accept(fd, NULL, NULL);
+		if (s < 0 && errno == EINTR)
+			continue;
+		if (s < 0)
+			return;
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+		mux_session *sess = calloc(1, sizeof(mux_session));
+		if (sess == NULL) {
+			close(s);
+			continue;
+		}
+		sess->mux = mx;
+		sess->sock = s;
+		sess->fds[0] = sess->fds[1] = sess->fds[2] = -1;
+		sess->flags[0] = sess->flags[1] = sess->flags[2] = -1;
+		sess->exit_status = 255;
+		sess->next = mx->sessions;
+		if (mx->sessions != NULL)
+			mx->sessions->prev = sess;
+		mx->sessions = sess;
+		if (event_add(loop, s, EPOLLIN | EPOLLRDHUP, _mux_sock_handler, sess))
+			_mux_session_free(sess);
+	}
+}
+
+int _mux_address(const char *path, struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+		return -1;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int mux_listen(mux *mx, connection *conn, event_loop *loop, const char *path) {
+	memset(mx, 0, sizeof(mux));
+	mx->conn = conn;
+	mx->loop = loop;
+	mx->fd = -1;
+	struct sockaddr_un addr;
+	if (_mux_address(path, &addr)) {
+		fprintf(stderr, "ControlPath too long: %s\n", path);
+		return -1;
+	}
+	// message boundaries keep the request and its descriptors together
+	int s = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (s < 0)
+		return -1;
+	// only our own user may hand us commands
+	mode_t mask = umask(0177);
+	int ret = bind(s, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret && errno == EADDRINUSE) {
+		// a master that died leaves its socket behind, nobody answers on it
+		int probe = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+		if (probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) && errno == ECONNREFUSED && unlink(path) == 0)
+			ret = bind(s, (struct sockaddr *)&addr, sizeof(addr));
+		if (probe >= 0)
+			close(probe);
+	}
+	umask(mask);
+	if (ret || listen(s, SOMAXCONN)) {
+		fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+		close(s);
+		return -1;
+	}
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	mx->path = strdup(path);
+	if (mx->path == NULL || event_add(loop, s, EPOLLIN, _mux_accept, mx)) {
+		free(mx->path);
+		mx->path = NULL;
+		unlink(path);
+		close(s);
+		return -1;
+	}
+	mx->fd = s;
+	return 0;
+}
+
+int mux_run(mux *mx) {
+	while (mx->fd >= 0)
+		if (connection_step(mx->conn))
+			return -1;
+	return 0;
+}
+
+void mux_free(mux *mx) {
+	if (mx->fd >= 0) {
+		event_del(mx->loop, mx->fd);
+		close(mx->fd);
+		unlink(mx->path);
+		mx->fd = -1;
+	}
+	free(mx->path);
+	mx->path = NULL;
+	// the channels stay with the connection, they just stop calling back
+	while (mx->sessions != NULL) {
+		if (mx->sessions->ch != NULL)
+			mx->sessions->ch->cb = NULL;
+		_mux_session_free(mx->sessions);
+	}
+}
+
+int mux_client(const char *path, const char *command) {
+	struct sockaddr_un addr;
+	if (_mux_address(path, &addr))
+		return -1;
+	int s = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (s < 0)
+		return -1;
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(s);
+		return -1;
+	}
+	size_t command_len = command != NULL ? strlen(command) : 0;
+	if (command_len > MUX_COMMAND_MAX - 1) {
+		close(s);
+		return -1;
+	}
+	char *req = malloc(command_len + 1);
+	if (req == NULL) {
+		close(s);
+		return -1;
+	}
+	req[0] = command != NULL ? MUX_EXEC : MUX_SHELL;
+	memcpy(req + 1, command, command_len);
+	// our standard input, output and error go along, the master reads and writes them itself
+	int fds[3] = {0, 1, 2};
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct iovec iov = {req, command_len + 1};
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	ssize_t n = sendmsg(s, &msg, MSG_NOSIGNAL);
+	free(req);
+	if (n < 0) {
+		close(s);
+		return -1;
+	}
+	// the exit status comes back once the command is done
+	uint32_t status;
+	do
+		n = recv(s, &status, sizeof(status), 0);
+	while (n < 0 && errno == EINTR);
+	close(s);
+	if (n != sizeof(status)) {
+		fprintf(stderr, "Control master closed the session\n");
+		return 255;
+	}
+	return ntohl(status) & 0xff;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "channel.h"
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// longest command a client may send
+#define MUX_COMMAND_MAX 65536
+
+enum mux_request {
+	// run a shell, the message is just the request type
+	MUX_SHELL = 1,
+	// run the command that follows the request type
+	MUX_EXEC = 2,
+};
+
+// what channel data a client's output descriptor has not taken yet
+typedef struct mux_output {
+	char *buf;
+	size_t len;
+	size_t off;
+	size_t size;
+} mux_output;
+
+struct mux;
+
+// one client process, its standard input, output and error run as a session channel
+typedef struct mux_session {
+	struct mux *mux;
+	channel *ch;
+	// the control connection, the exit status goes back over it and it closing early ends the session
+	int sock;
+	// the client's own standard input, output and error, passed over the control connection
+	int fds[3];
+	// their file status flags, restored before they are closed since the client shares them, -1 until saved
+	int flags[3];
+	// descriptors epoll cannot watch (regular files) are always ready
+	unsigned char polled[3];
+	// output and error, the channel's window is held while either has data waiting
+	mux_output out[2];
+	int exit_status;
+	unsigned char stdin_eof;
+	unsigned char remote_eof;
+	struct mux_session *prev;
+	struct mux_session *next;
+} mux_session;
+
+typedef struct mux {
+	connection *conn;
+	event_loop *loop;
+	// the listening control socket, -1 once closed
+	int fd;
+	char *path;
+	mux_session *sessions;
+} mux;
+
+/**
+ * @brief Accept client processes on a Unix socket and run each one as a new channel on the connection
+ * @note Clients pass their standard input, output and error, which are read and written directly, so data is not
+ * copied through a socket between the client and the master
+ * @param mx The master state to initialize
+ * @param conn The authenticated connection
+ * @param loop The event loop the sockets and descriptors are polled by
+ * @param path Where to create the socket, a stale one left by a master that is gone is replaced
+ * @return 0 on success, -1 on error
+ */
+int mux_listen(mux *, connection *, event_loop *, const char *);
+
+/**
+ * @brief Serve clients until the connection fails
+ * @param mx The master state
+ * @return -1 once the connection is gone
+ */
+int mux_run(mux *);
+
+/**
+ * @brief Close the socket, remove it and end every session
+ * @param mx The master state
+ */
+void mux_free(mux *);
+
+/**
+ * @brief Run a command (or a shell) through a master, passing it our standard input, output and error
+ * @param path The master's socket
+ * @param command The command, NULL for a shell
+ * @return The command's exit status, -1 if no master is listening (nothing was sent, so the caller can connect itself)
+ */
+int mux_client(const char *, const char *);
@@ -1,91 +1,901 @@
 #include "network.h"
 
-// does not free pointer
-char *_make_packet(const char *buf, const int len) {
+int _send_packet(transport *, char *, int);
+int _send_packets(transport *, const struct iovec *, const int);
+
+char *packet_alloc(size_t len) {
+	char *buf = pool_alloc(PACKET_HEADROOM + len + PACKET_TAILROOM);
+	if (buf == NULL)
+		return NULL;
+	return buf + PACKET_HEADROOM;
+}
+
+void packet_free(char *payload) {
+	if (payload != NULL)
+		pool_free(payload - PACKET_HEADROOM);
+}
+
+int buf_get_u32(const char **p, int *len, uint32_t *out) {
+	if (*len < 4)
+		return -1;
+	*out = ntohl(*(uint32_t *)*p);
+	*p += 4;
+	*len -= 4;
+	return 0;
+}
+
+int buf_get_string(const char **p, int *len, const char **str, uint32_t *str_len) {
+	if (buf_get_u32(p, len, str_len) || *str_len > (uint32_t)*len)
+		return -1;
+	*str = *p;
+	*p += *str_len;
+	*len -= *str_len;
+	return 0;
+}
+
+char *buf_put_u32(char *p, uint32_t v) {
+	*(uint32_t *)p = htonl(v);
+	return p + 4;
+}
+
+char *buf_put_string(char *p, const char *str, size_t len) {
+	p = buf_put_u32(p, len);
+	memcpy(p, str, len);
+	return p + len;
+}
+
+// write the header in front of the payload and the padding after it, returns the length on the wire
+int _frame_packet(char *payload, const int len) {
 	// calculate padding length
 	int padlen = 16 - (len + 5) % 16;
 	if (padlen < 4)
 		padlen += 16;
-	// add random length to padding
-	padlen += randint(0, (236 - padlen) / 8) * 8;
-	// allocate memory for packet
-	char *packet = malloc(len + padlen + 5);
+	// add random length to padding, in whole cipher blocks
+	padlen += randint(0, (236 - padlen) / 16) * 16;
+	char *packet = payload - 5;
 	// write packet length
-	*(int *)packet = htonl(len + padlen + 1);
+	*(uint32_t *)packet = htonl(len + padlen + 1);
 	// write padding length
 	packet[4] = padlen;
-	// write payload
-	memcpy(packet + 5, buf, len);
 	// write padding
-	randbytes(packet + 5 + len, padlen);
-	// return packet
-	return packet;
+	randbytes((unsigned char *)payload + len, padlen);
+	return len + padlen + 5;
 }
 
-void send_packet(const int s, const char *buf, const int len) {
-	unsigned char *packet = _make_packet(buf, len);
-	int res;
-	while (1) {
-		send(s, packet, len + 5 + packet[4], 0);
-		if (res != -1 || errno != EAGAIN || errno != EWOULDBLOCK)
-			break;
-		usleep(1000);
+int recv_ring_init(recv_ring *ring, size_t size) {
+	ring->buf = aligned_alloc(POOL_ALIGN, size);
+	if (ring->buf == NULL)
+		return -1;
+	ring->size = size;
+	ring->start = 0;
+	ring->end = 0;
+	ring->decrypted = 0;
+	ring->lookahead = 1;
+	return 0;
+}
+
+void recv_ring_free(recv_ring *ring) {
+	free(ring->buf);
+	ring->buf = NULL;
+}
+
+// move the partial packet at start to the front of the buffer
+void _recv_ring_compact(recv_ring *ring) {
+	memmove(ring->buf, ring->buf + ring->start, ring->end - ring->start);
+	ring->end -= ring->start;
+	ring->start = 0;
+}
+
+// make room at the end of the buffer and return how much there is
+size_t _recv_ring_reserve(recv_ring *ring) {
+	// only compact when there is not enough room for a full packet (a partial packet is rarely large)
+	if (ring->start == ring->end)
+		ring->start = ring->end = 0;
+	else if (ring->size - ring->end < MAX_PACKET_SIZE)
+		_recv_ring_compact(ring);
+	return ring->size - ring->end;
+}
+
+ssize_t recv_ring_fill(recv_ring *ring, const int s) {
+	_recv_ring_reserve(ring);
+	ssize_t len = recv(s, ring->buf + ring->end, ring->size - ring->end, 0);
+	if (len > 0)
+		ring->end += len;
+	return len;
+}
+
+// compare two MACs in constant time
+int _mac_equal(const unsigned char *a, const unsigned char *b) {
+	unsigned char diff = 0;
+	for (int i = 0; i < MAC_LEN; i++)
+		diff |= a[i] ^ b[i];
+	return diff == 0;
+}
+
+// MAC of the sequence number followed by the unencrypted packet
+void _packet_mac(cipher_state *cs, const char *packet, size_t len, unsigned char *mac) {
+	sha256_ctx work;
+	uint32_t seq = htonl(cs->seq);
+	hmac_sha256_begin(&cs->mac, &work);
+	sha256_update(&work, &seq, 4);
+	sha256_update(&work, packet, len);
+	hmac_sha256_end(&cs->mac, &work, mac);
+}
+
+void cipher_init(cipher_state *cs, const uint8_t *key, const uint8_t *iv, const uint8_t *mackey) {
+	uint64_t ctr[2];
+	memcpy(ctr, iv, 16);
+	// the threads may still be computing keystream of the old keys, and packets queued on a batch still need them
+	aes_prefetch_stop(&cs->aes);
+	if (cs->mb != NULL)
+		aes_mb_flush(cs->mb);
+	aes_init(&cs->aes, key, ctr);
+	hmac_sha256_init(&cs->mac, mackey, 32);
+	cs->enabled = 1;
+	if (cs->prefetch)
+		aes_prefetch_start(&cs->aes);
+}
+
+int recv_ring_next(recv_ring *ring, cipher_state *cs, char **payload) {
+	size_t avail = ring->end - ring->start;
+	char *packet = ring->buf + ring->start;
+	// the length is only readable once the first cipher block is in
+	size_t block = cs->enabled ? 16 : 4;
+	size_t maclen = cs->enabled ? MAC_LEN : 0;
+	if (avail < block)
+		return RECV_AGAIN;
+	if (cs->enabled && ring->decrypted == 0) {
+		aes_crypt(&cs->aes, packet, 16, packet);
+		ring->decrypted = 16;
+	}
+	uint32_t datalen = ntohl(*(uint32_t *)packet);
+	// bounded before anything is added to it, a length near 2^32 would otherwise wrap past every check below
+	if (datalen < 5 || datalen > MAX_PACKET_SIZE - 4)
+		return RECV_ERROR;
+	size_t len = (size_t)datalen + 4, next = len + maclen;
+	if (len % (block < 8 ? 8 : block) != 0)
+		return RECV_ERROR;
+	if (avail < next)
+		return RECV_AGAIN;
+	size_t ahead = 0;
+	if (cs->enabled) {
+		// decrypt the rest of the packet in place and check the MAC that follows it, together with the first block of the
+		// next packet if it is in already, unless the keys change after this one
+		struct iovec run[2] = {{packet + ring->decrypted, len - ring->decrypted}, {packet + next, 16}};
+		if (ring->lookahead && packet[5] != SSH_MSG_NEWKEYS && avail >= next + 16) {
+			aes_crypt_vec(&cs->aes, run, 2);
+			ahead = 16;
+		} else if (run[0].iov_len) {
+			aes_crypt(&cs->aes, run[0].iov_base, run[0].iov_len, run[0].iov_base);
+		}
+		unsigned char mac[MAC_LEN];
+		_packet_mac(cs, packet, len, mac);
+		if (!_mac_equal(mac, (unsigned char *)packet + len))
+			return RECV_ERROR;
 	}
-	free(packet);
+	ring->start += next;
+	ring->decrypted = ahead;
+	cs->seq++;
+	int padlen = (unsigned char)packet[4];
+	// RFC 4253 requires at least 4 bytes of padding
+	if (padlen < 4 || (uint32_t)padlen + 1 > datalen)
+		return RECV_ERROR;
+	*payload = packet + 5;
+	return datalen - padlen - 1;
 }
 
-int recv_packet(const int s, char *buf) {
-	// receive first 4 bytes
-	int len;
-	while (1) {
-		len = recv(s, buf, 4, 0);
-		if (len != -1 || errno != EAGAIN || errno != EWOULDBLOCK)
+// uncork the socket so a partial segment leaves now, then cork it again for the next batch
+void _transport_push(transport *t) {
+	int off = 0, on = 1;
+	if (t->mode != TRANSPORT_BULK)
+		return;
+	setsockopt(t->s, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+	setsockopt(t->s, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+void _transport_deadline(event_loop *loop, void *arg) {
+	(void)loop;
+	transport *t = arg;
+	t->flush_timer = NULL;
+	transport_flush(t);
+	if (t->sendq_len == 0)
+		_transport_push(t);
+}
+
+int transport_push(transport *t) {
+	if (transport_flush(t))
+		return -1;
+	// whatever is still queued is pushed once the socket takes it
+	if (t->sendq_len == 0)
+		_transport_push(t);
+	return 0;
+}
+
+int transport_hold(transport *t, const int hold) {
+	if (hold || !t->holding) {
+		t->holding = hold != 0;
+		return 0;
+	}
+	// everything held goes out in order under the new keys and is written at once, packets a drain callback sends then
+	// go out behind them
+	struct iovec *held = t->held;
+	int held_len = t->held_len;
+	for (int i = 0; i < held_len; i++)
+		t->sendq_bytes -= held[i].iov_len;
+	t->held = NULL;
+	t->held_len = t->held_size = 0;
+	t->holding = 0;
+	int ret = _send_packets(t, held, held_len);
+	free(held);
+	return ret;
+}
+
+int transport_compress(transport *t, const int level) { return compress_init(&t->tx_comp, level); }
+
+int transport_decompress(transport *t) {
+	if (decompress_init(&t->rx_comp))
+		return -1;
+	// the type of a compressed packet cannot be read before it is inflated
+	t->rx.lookahead = 0;
+	return 0;
+}
+
+void transport_set_drain(transport *t, size_t low, transport_cb cb, void *arg) {
+	t->drain_low = low;
+	t->drain_cb = cb;
+	t->drain_arg = arg;
+}
+
+void transport_set_recv(transport *t, transport_cb cb, void *arg) {
+	t->recv_cb = cb;
+	t->recv_arg = arg;
+}
+
+int transport_set_mode(transport *t, const int mode) {
+	int nodelay = mode == TRANSPORT_INTERACTIVE;
+	int cork = mode == TRANSPORT_BULK;
+	if (t->flush_timer != NULL) {
+		event_timer_cancel(t->flush_timer);
+		t->flush_timer = NULL;
+	}
+	// uncork before leaving bulk mode so nothing is held back
+	if (!cork && setsockopt(t->s, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) && errno != EOPNOTSUPP)
+		return -1;
+	// not every socket is TCP, those have no Nagle or cork to control
+	if (setsockopt(t->s, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) && errno != EOPNOTSUPP)
+		return -1;
+	if (cork && setsockopt(t->s, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) && errno != EOPNOTSUPP)
+		return -1;
+	t->mode = mode;
+	return transport_flush(t);
+}
+
+void transport_set_prefetch(transport *t, const int on) {
+	cipher_state *dirs[2] = {&t->tx_cipher, &t->rx_cipher};
+	for (int i = 0; i < 2; i++) {
+		dirs[i]->prefetch = on != 0;
+		if (!on)
+			aes_prefetch_stop(&dirs[i]->aes);
+		else if (dirs[i]->enabled)
+			aes_prefetch_start(&dirs[i]->aes);
+	}
+}
+
+// queue a buffer for sending without writing anything yet, the queue owns buf from here on
+int _sendq_add(transport *t, char *buf, char *data, size_t len) {
+	if (t->sendq_head + t->sendq_len == t->sendq_size) {
+		// slide the queue down before growing (the kernel only ever sees copies of the iovecs)
+		if (t->sendq_head > 0) {
+			memmove(t->sendq_iov, t->sendq_iov + t->sendq_head, t->sendq_len * sizeof(struct iovec));
+			memmove(t->sendq_buf, t->sendq_buf + t->sendq_head, t->sendq_len * sizeof(char *));
+			t->sendq_head = 0;
+		} else {
+			int size = t->sendq_size ? t->sendq_size * 2 : 64;
+			struct iovec *iov = realloc(t->sendq_iov, size * sizeof(struct iovec));
+			if (iov == NULL)
+				return -1;
+			t->sendq_iov = iov;
+			char **bufs = realloc(t->sendq_buf, size * sizeof(char *));
+			if (bufs == NULL)
+				return -1;
+			t->sendq_buf = bufs;
+			t->sendq_size = size;
+		}
+	}
+	int i = t->sendq_head + t->sendq_len++;
+	t->sendq_iov[i].iov_base = data;
+	t->sendq_iov[i].iov_len = len;
+	t->sendq_buf[i] = buf;
+	t->sendq_bytes += len;
+	return 0;
+}
+
+// write the queue, in bulk mode only once enough is queued or the deadline has passed
+int _sendq_kick(transport *t) {
+	if (t->mode == TRANSPORT_BULK && t->sendq_bytes < TRANSPORT_BATCH_SIZE) {
+		// wait for more packets, but not longer than the deadline
+		if (t->flush_timer == NULL)
+			t->flush_timer = event_timer_add(t->loop, TRANSPORT_FLUSH_MS, _transport_deadline, t);
+		if (t->flush_timer != NULL)
+			return 0;
+	}
+	return transport_flush(t);
+}
+
+// queue a buffer for sending, the queue owns buf from here on
+int _sendq_push(transport *t, char *buf, char *data, size_t len) {
+	if (_sendq_add(t, buf, data, len))
+		return -1;
+	return _sendq_kick(t);
+}
+
+// nothing may be written while packets on the queue wait for the batch to encrypt them
+void _transport_seal(transport *t) {
+	aes_mb *mb = t->tx_cipher.mb;
+	if (mb != NULL && mb->jobs_len)
+		aes_mb_flush(mb);
+}
+
+// have the batch write the queue once it has encrypted what was added to it
+int _transport_defer(transport *t) {
+	transport_batch *b = t->batch;
+	if (t->batched)
+		return 0;
+	if (b->waiting_len == b->waiting_size) {
+		int size = b->waiting_size ? b->waiting_size * 2 : 64;
+		transport **waiting = realloc(b->waiting, size * sizeof(transport *));
+		// write it now instead, which encrypts the batch first
+		if (waiting == NULL)
+			return _sendq_kick(t);
+		b->waiting = waiting;
+		b->waiting_size = size;
+	}
+	b->waiting[b->waiting_len++] = t;
+	t->batched = 1;
+	return 0;
+}
+
+// take a transport off the waiting list of its batch
+void _transport_unbatch(transport *t) {
+	if (!t->batched)
+		return;
+	transport_batch *b = t->batch;
+	for (int i = 0; i < b->waiting_len; i++)
+		if (b->waiting[i] == t)
+			b->waiting[i] = NULL;
+	t->batched = 0;
+}
+
+void transport_batch_init(transport_batch *b) {
+	memset(b, 0, sizeof(transport_batch));
+	aes_mb_init(&b->mb);
+}
+
+void transport_batch_run(transport_batch *b) {
+	aes_mb_flush(&b->mb);
+	// a drain callback may send on any transport meanwhile, those added again are written further on in this loop
+	for (int i = 0; i < b->waiting_len; i++) {
+		transport *t = b->waiting[i];
+		if (t == NULL)
+			continue;
+		t->batched = 0;
+		_sendq_kick(t);
+	}
+	b->waiting_len = 0;
+}
+
+void transport_batch_free(transport_batch *b) {
+	aes_mb_flush(&b->mb);
+	free(b->waiting);
+	memset(b, 0, sizeof(transport_batch));
+}
+
+int transport_set_batch(transport *t, transport_batch *b) {
+	// what was queued on the old batch is encrypted and written first
+	_transport_seal(t);
+	int ret = t->batched ? _sendq_kick(t) : 0;
+	_transport_unbatch(t);
+	t->batch = b;
+	t->tx_cipher.mb = b != NULL ? &b->mb : NULL;
+	return ret;
+}
+
+// drop len sent bytes from the front of the queue
+void _sendq_consume(transport *t, size_t len) {
+	t->sendq_bytes -= len;
+	t->tx_bytes += len;
+	while (len) {
+		struct iovec *iov = &t->sendq_iov[t->sendq_head];
+		if (len < iov->iov_len) {
+			iov->iov_base = (char *)iov->iov_base + len;
+			iov->iov_len -= len;
 			break;
-		usleep(1000);
+		}
+		len -= iov->iov_len;
+		pool_free(t->sendq_buf[t->sendq_head]);
+		t->sendq_head++;
+		t->sendq_len--;
 	}
-	if (len != 4)
+	if (t->sendq_len == 0)
+		t->sendq_head = 0;
+	if (t->drain_cb != NULL && !t->draining && t->sendq_bytes <= t->drain_low) {
+		t->draining = 1;
+		t->drain_cb(t, t->drain_arg);
+		t->draining = 0;
+	}
+}
+
+// keep a packet until the key exchange in progress is over, it counts as queued so schedulers stop refilling
+int _transport_hold(transport *t, char *payload, int len) {
+	if (t->held_len == t->held_size) {
+		int size = t->held_size ? t->held_size * 2 : 64;
+		struct iovec *tmp = realloc(t->held, size * sizeof(struct iovec));
+		if (tmp == NULL) {
+			packet_free(payload);
+			return -1;
+		}
+		t->held = tmp;
+		t->held_size = size;
+	}
+	t->held[t->held_len].iov_base = payload;
+	t->held[t->held_len++].iov_len = len;
+	t->sendq_bytes += len;
+	return 0;
+}
+
+// compress, frame and MAC a payload, which is replaced if it was compressed, and return the length to encrypt
+int _seal_packet(transport *t, char **payload, int len) {
+	cipher_state *cs = &t->tx_cipher;
+	if (t->tx_comp.enabled) {
+		char *out = packet_alloc(COMPRESS_BOUND(len));
+		int n = out != NULL ? compress_packet(&t->tx_comp, *payload, len, out) : -1;
+		packet_free(*payload);
+		*payload = NULL;
+		if (n < 0) {
+			packet_free(out);
+			return -1;
+		}
+		*payload = out;
+		len = n;
+	}
+	char *packet = *payload - 5;
+	int total = _frame_packet(*payload, len);
+	// the MAC goes into the tailroom, then the packet is encrypted where it was built
+	if (cs->enabled)
+		_packet_mac(cs, packet, total, (unsigned char *)packet + total);
+	cs->seq++;
+	return total;
+}
+
+// compress, frame, encrypt and queue a payload
+int _send_packet(transport *t, char *payload, int len) {
+	cipher_state *cs = &t->tx_cipher;
+	int total = _seal_packet(t, &payload, len);
+	if (total < 0)
 		return -1;
-	int datalen = ntohl(*(int *)buf);
-	// receive rest of packet
-	while (1) {
-		len = recv(s, buf, datalen, 0);
-		if (len != -1 || errno != EAGAIN || errno != EWOULDBLOCK)
+	char *packet = payload - 5;
+	if (cs->enabled && cs->mb != NULL) {
+		aes_mb_submit(cs->mb, &cs->aes, packet, total);
+		if (_sendq_add(t, payload - PACKET_HEADROOM, packet, total + MAC_LEN))
+			return -1;
+		return _transport_defer(t);
+	}
+	if (cs->enabled) {
+		aes_crypt(&cs->aes, packet, total, packet);
+		total += MAC_LEN;
+	}
+	return _sendq_push(t, payload - PACKET_HEADROOM, packet, total);
+}
+
+// seal and queue packets, encrypting up to TRANSPORT_SEAL_BATCH of them with one run of the keystream, and write once at the end
+int _send_packets(transport *t, const struct iovec *pkts, const int n) {
+	cipher_state *cs = &t->tx_cipher;
+	struct iovec sealed[TRANSPORT_SEAL_BATCH];
+	int ret = 0;
+	for (int i = 0; i < n;) {
+		int count = 0;
+		for (; i < n && count < TRANSPORT_SEAL_BATCH; i++) {
+			char *payload = pkts[i].iov_base;
+			if (ret) {
+				packet_free(payload);
+				continue;
+			}
+			int total = _seal_packet(t, &payload, pkts[i].iov_len);
+			if (total < 0) {
+				ret = -1;
+				continue;
+			}
+			sealed[count].iov_base = payload - 5;
+			sealed[count++].iov_len = total;
+		}
+		if (cs->enabled && cs->mb != NULL) {
+			for (int j = 0; j < count; j++)
+				aes_mb_submit(cs->mb, &cs->aes, sealed[j].iov_base, sealed[j].iov_len);
+		} else if (cs->enabled) {
+			aes_crypt_vec(&cs->aes, sealed, count);
+		}
+		for (int j = 0; j < count; j++) {
+			char *packet = sealed[j].iov_base;
+			if (_sendq_add(t, packet + 5 - PACKET_HEADROOM, packet, sealed[j].iov_len + (cs->enabled ? MAC_LEN : 0)) && ret == 0)
+				ret = -1;
+		}
+	}
+	if ((cs->enabled && cs->mb != NULL ? _transport_defer(t) : _sendq_kick(t)))
+		ret = -1;
+	return ret;
+}
+
+// after KEXINIT only transport layer messages (1 to 4 and 20 to 49) may be sent until NEWKEYS
+int _transport_holds(transport *t, unsigned char type) {
+	return t->holding && type > SSH_MSG_TRANSPORT_GENERIC_MAX && (type < SSH_MSG_KEX_FIRST || type > SSH_MSG_KEX_LAST);
+}
+
+int send_packet_buf(transport *t, char *payload, int len) {
+	if (_transport_holds(t, payload[0]))
+		return _transport_hold(t, payload, len);
+	return _send_packet(t, payload, len);
+}
+
+int send_packets_buf(transport *t, struct iovec *pkts, const int n) {
+	if (!t->holding)
+		return _send_packets(t, pkts, n);
+	// while keys are being exchanged each packet is held or sent on its own, as send_packet_buf would
+	int ret = 0;
+	for (int i = 0; i < n; i++) {
+		if (ret == 0)
+			ret = send_packet_buf(t, pkts[i].iov_base, pkts[i].iov_len);
+		else
+			packet_free(pkts[i].iov_base);
+	}
+	return ret;
+}
+
+int send_packet(transport *t, const char *buf, const int len) {
+	char *payload = packet_alloc(len);
+	if (payload == NULL)
+		return -1;
+	memcpy(payload, buf, len);
+	return send_packet_buf(t, payload, len);
+}
+
+void _transport_event(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)loop;
+	(void)fd;
+	transport *t = arg;
+	if (events & (EPOLLOUT | EPOLLERR)) {
+		t->writable = 1;
+		// a backlog that drained here would otherwise sit corked behind the deadline that already ran
+		if (t->sendq_len && t->flush_timer == NULL && transport_flush(t) == 0 && t->sendq_len == 0)
+			_transport_push(t);
+	}
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		t->readable = 1;
+		if (t->recv_cb != NULL)
+			t->recv_cb(t, t->recv_arg);
+	}
+}
+
+int _transport_setup(transport *t, event_loop *loop, const int s) {
+	memset(t, 0, sizeof(transport));
+	if (recv_ring_init(&t->rx, RECV_RING_SIZE))
+		return -1;
+	t->s = s;
+	t->loop = loop;
+	// assume ready until the socket says otherwise
+	t->readable = 1;
+	t->writable = 1;
+	return 0;
+}
+
+int transport_init(transport *t, event_loop *loop, const int s) {
+	if (_transport_setup(t, loop, s))
+		return -1;
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	transport_set_mode(t, TRANSPORT_INTERACTIVE);
+	if (event_add(loop, s, EPOLLIN | EPOLLOUT, _transport_event, t)) {
+		recv_ring_free(&t->rx);
+		return -1;
+	}
+	return 0;
+}
+
+void _uring_recv_done(uring *io, const struct io_uring_cqe *cqe, void *arg) {
+	(void)io;
+	transport *t = arg;
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		t->rx_armed = 0;
+	if (cqe->res > 0) {
+		int i = (t->rx_bufs_head + t->rx_bufs_count++) % URING_BUFS;
+		t->rx_bufs[i].bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		t->rx_bufs[i].len = cqe->res;
+	} else if (cqe->res != -ENOBUFS) {
+		// EOF or error, running out of provided buffers only means the receive has to be rearmed
+		t->closed = 1;
+	}
+	if (t->recv_cb != NULL)
+		t->recv_cb(t, t->recv_arg);
+}
+
+void _uring_arm_recv(transport *t) {
+	struct io_uring_sqe *sqe = uring_sqe(t->io, &t->rx_req);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = t->s;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	t->rx_armed = 1;
+}
+
+// hand the queued packets to the kernel in one sendmsg, the iovecs are copied so the queue can keep growing
+void _uring_flush(transport *t) {
+	if (t->tx_busy || t->sendq_len == 0)
+		return;
+	_transport_seal(t);
+	int count = t->sendq_len < URING_IOV ? t->sendq_len : URING_IOV;
+	memcpy(t->tx_iov, t->sendq_iov + t->sendq_head, count * sizeof(struct iovec));
+	memset(&t->tx_msg, 0, sizeof(struct msghdr));
+	t->tx_msg.msg_iov = t->tx_iov;
+	t->tx_msg.msg_iovlen = count;
+	struct io_uring_sqe *sqe = uring_sqe(t->io, &t->tx_req);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = t->s;
+	sqe->addr = (uint64_t)(uintptr_t)&t->tx_msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	t->tx_busy = 1;
+}
+
+void _uring_send_done(uring *io, const struct io_uring_cqe *cqe, void *arg) {
+	(void)io;
+	transport *t = arg;
+	t->tx_busy = 0;
+	if (cqe->res > 0)
+		_sendq_consume(t, cqe->res);
+	else if (cqe->res != -EAGAIN && cqe->res != -EINTR) {
+		t->closed = 1;
+		return;
+	}
+	_uring_flush(t);
+}
+
+int transport_init_uring(transport *t, event_loop *loop, uring *io, const int s) {
+	if (_transport_setup(t, loop, s))
+		return -1;
+	// the fallback send and recv calls must not block the loop either
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	t->io = io;
+	t->rx_req.cb = _uring_recv_done;
+	t->rx_req.arg = t;
+	t->tx_req.cb = _uring_send_done;
+	t->tx_req.arg = t;
+	transport_set_mode(t, TRANSPORT_INTERACTIVE);
+	_uring_arm_recv(t);
+	return 0;
+}
+
+// move received provided buffers into rx and give them back to the kernel
+int _uring_take(transport *t) {
+	int moved = 0;
+	while (t->rx_bufs_count) {
+		size_t space = _recv_ring_reserve(&t->rx);
+		if (space == 0)
 			break;
-		usleep(1000);
+		uint16_t bid = t->rx_bufs[t->rx_bufs_head].bid;
+		size_t len = t->rx_bufs[t->rx_bufs_head].len - t->rx_buf_off;
+		if (len > space)
+			len = space;
+		memcpy(t->rx.buf + t->rx.end, uring_buf(t->io, bid) + t->rx_buf_off, len);
+		t->rx.end += len;
+		t->rx_bytes += len;
+		t->rx_buf_off += len;
+		moved = 1;
+		if (t->rx_buf_off == t->rx_bufs[t->rx_bufs_head].len) {
+			uring_buf_recycle(t->io, bid);
+			t->rx_bufs_head = (t->rx_bufs_head + 1) % URING_BUFS;
+			t->rx_bufs_count--;
+			t->rx_buf_off = 0;
+		}
+	}
+	return moved;
+}
+
+void transport_free(transport *t) {
+	if (t->io != NULL) {
+		// the kernel still references this transport until its requests complete
+		if (t->rx_armed) {
+			struct io_uring_sqe *sqe = uring_sqe(t->io, NULL);
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (uint64_t)(uintptr_t)&t->rx_req;
+		}
+		while (t->rx_armed || t->tx_busy)
+			if (uring_wait(t->io) < 0)
+				break;
+		while (t->rx_bufs_count) {
+			uring_buf_recycle(t->io, t->rx_bufs[t->rx_bufs_head].bid);
+			t->rx_bufs_head = (t->rx_bufs_head + 1) % URING_BUFS;
+			t->rx_bufs_count--;
+		}
+	} else {
+		event_del(t->loop, t->s);
 	}
-	if (len != datalen)
+	if (t->flush_timer != NULL)
+		event_timer_cancel(t->flush_timer);
+	t->drain_cb = NULL;
+	recv_ring_free(&t->rx);
+	compress_free(&t->tx_comp);
+	compress_free(&t->rx_comp);
+	aes_prefetch_stop(&t->tx_cipher.aes);
+	aes_prefetch_stop(&t->rx_cipher.aes);
+	// the batch must not touch the queue once it is freed
+	_transport_seal(t);
+	_transport_unbatch(t);
+	while (t->sendq_len)
+		_sendq_consume(t, t->sendq_iov[t->sendq_head].iov_len);
+	free(t->sendq_iov);
+	free(t->sendq_buf);
+	t->sendq_iov = NULL;
+	t->sendq_buf = NULL;
+	for (int i = 0; i < t->held_len; i++)
+		packet_free(t->held[i].iov_base);
+	free(t->held);
+	t->held = NULL;
+	t->held_len = t->held_size = 0;
+}
+
+int transport_flush(transport *t) {
+	// everything queued so far goes out now, the deadline is rearmed by the next packet
+	if (t->flush_timer != NULL) {
+		event_timer_cancel(t->flush_timer);
+		t->flush_timer = NULL;
+	}
+	if (t->io != NULL) {
+		if (t->closed)
+			return -1;
+		_uring_flush(t);
+		return 0;
+	}
+	// write as many queued packets as the socket takes with one sendmsg
+	while (t->writable && t->sendq_len) {
+		// a drain callback may have queued packets on the batch since the last write
+		_transport_seal(t);
+		struct msghdr msg = {0};
+		msg.msg_iov = t->sendq_iov + t->sendq_head;
+		msg.msg_iovlen = t->sendq_len < UIO_MAXIOV ? t->sendq_len : UIO_MAXIOV;
+		ssize_t len = sendmsg(t->s, &msg, 0);
+		if (len > 0)
+			_sendq_consume(t, len);
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			t->writable = 0;
+		else if (errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+int transport_write(transport *t, const char *data, size_t len) {
+	char *buf = pool_alloc(len);
+	if (buf == NULL)
 		return -1;
-	int paddinglen = *(unsigned char *)buf;
-	// move payload to beginning of buffer
-	memmove(buf, buf + 1, datalen - paddinglen - 1);
-	// return length of payload
-	return datalen - paddinglen - 1;
+	memcpy(buf, data, len);
+	return _sendq_push(t, buf, buf, len);
 }
 
+int transport_drain(transport *t) {
+	while (t->sendq_len) {
+		if (transport_flush(t))
+			return -1;
+		if (t->sendq_len && (t->io != NULL || !t->writable) && event_loop_run_once(t->loop, -1) < 0)
+			return -1;
+	}
+	_transport_push(t);
+	return 0;
+}
+
+// pull in more data, running the event loop until the socket is readable unless wait is 0
+int _recv_more(transport *t, const int wait) {
+	while (t->io != NULL) {
+		if (_uring_take(t))
+			return 0;
+		if (t->closed)
+			return -1;
+		if (!t->rx_armed)
+			_uring_arm_recv(t);
+		if (!wait)
+			return RECV_AGAIN;
+		if (event_loop_run_once(t->loop, -1) < 0)
+			return -1;
+	}
+	while (1) {
+		if (!t->readable) {
+			if (!wait)
+				return RECV_AGAIN;
+			if (event_loop_run_once(t->loop, -1) < 0)
+				return -1;
+			continue;
+		}
+		ssize_t len = recv_ring_fill(&t->rx, t->s);
+		if (len > 0) {
+			t->rx_bytes += len;
+			// a short read drained the socket, the next arrival triggers a new edge
+			if (t->rx.end < t->rx.size)
+				t->readable = 0;
+			return 0;
+		}
+		if (len == 0)
+			return -1;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			t->readable = 0;
+		else if (errno != EINTR)
+			return -1;
+	}
+}
+
+int _recv_ident(transport *t, char **line, const int wait) {
+	recv_ring *ring = &t->rx;
+	size_t scanned = ring->start;
+	while (1) {
+		char *nl = memchr(ring->buf + scanned, '\n', ring->end - scanned);
+		if (nl == NULL) {
+			// the identification string is at most 255 characters, other lines are bounded by the buffer
+			if (ring->end - ring->start >= ring->size / 2)
+				return -1;
+			scanned = ring->end - ring->start;
+			_recv_ring_compact(ring);
+			int ret = _recv_more(t, wait);
+			if (ret)
+				return ret;
+			continue;
+		}
+		char *begin = ring->buf + ring->start;
+		size_t len = nl - begin;
+		ring->start += len + 1;
+		scanned = ring->start;
+		if (len >= 4 && memcmp(begin, "SSH-", 4) == 0) {
+			if (begin[len - 1] == '\r')
+				len--;
+			*line = begin;
+			return len;
+		}
+	}
+}
+
+int _recv_packet(transport *t, char **payload, const int wait) {
+	while (1) {
+		int len = recv_ring_next(&t->rx, &t->rx_cipher, payload);
+		if (len >= 0 && t->rx_comp.enabled)
+			return decompress_packet(&t->rx_comp, *payload, len, payload);
+		if (len != RECV_AGAIN)
+			return len;
+		int ret = _recv_more(t, wait);
+		if (ret)
+			return ret;
+	}
+}
+
+int recv_ident(transport *t, char **line) { return _recv_ident(t, line, 1); }
+
+int recv_ident_nowait(transport *t, char **line) { return _recv_ident(t, line, 0); }
+
+int recv_packet(transport *t, char **payload) { return _recv_packet(t, payload, 1); }
+
+int recv_packet_nowait(transport *t, char **payload) { return _recv_packet(t, payload, 0); }
+
 void send_packet_chacha(const int s, const char *buf) { send(s, buf, 35000, 0); }
 
 int recv_packet_chacha(const int s, char *buf) { return recv(s, buf, 35000, 0); }
 
-void send_packet_aes(aes_ctx *ctx, const int s, const char *buf, const int len) {}
-
-int recv_packet_aes(aes_ctx *ctx, const int s, char *buf) {
-	// read the first 16 bytes
-	int len = recv(s, buf, 16, 0);
-	if (len != 16)
-		return -1;
-	// decrypt the first 16 bytes
-	aes_decrypt_finalize(ctx, buf, 16, buf, &len);
-	// get the length of the packet
-	int datalen = ntohl(*(int *)buf);
-	// read the rest of the packet (12 bytes already read)
-	len = recv(s, buf + 16, datalen - 12, 0);
-	if (len != datalen - 12)
-		return -1;
-	// decrypt the rest of the packet
-	aes_decrypt_finalize(ctx, buf + 16, datalen - 12, buf + 16, &len);
-	int padlen = (unsigned char)buf[4];
-	// move payload to beginning of buffer
-	memmove(buf, buf + 5, datalen - 1 - padlen);
-	// return length of payload
-	return datalen - 1 - padlen;
+int send_packet_aes(transport *t, const char *buf, const int len) {
+	if (!t->tx_cipher.enabled)
+		return -1;
+	char *payload = packet_alloc(len);
+	if (payload == NULL)
+		return -1;
+	memcpy(payload, buf, len);
+	return send_packet_buf(t, payload, len);
+}
+
+int recv_packet_aes(transport *t, char **payload) {
+	if (!t->rx_cipher.enabled)
+		return -1;
+	return recv_packet(t, payload);
 }
@@ -1,17 +1,490 @@
+#pragma once
+
 #include "aes.h"
+#include "compress.h"
+#include "event.h"
+#include "pool.h"
+#include "uring.h"
 #include "random.h"
+#include "sha.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-void send_packet(const int, const char *, const int);
-int recv_packet(const int, char *);
+// maximum size of a packet we accept (RFC 4253 section 6.1 requires at least 35000)
+#define MAX_PACKET_SIZE 35000
+// size of the receive buffer, large enough to pick up several packets per recv
+#define RECV_RING_SIZE (1 << 17)
+// room in front of a payload for the packet length and padding length
+#define PACKET_HEADROOM 5
+// room after a payload for the padding and the MAC
+#define PACKET_TAILROOM (255 + 64)
+// length of the hmac-sha2-256 MAC appended to each packet
+#define MAC_LEN 32
+// maximum number of queued packets handed to the kernel in one io_uring sendmsg
+#define URING_IOV 64
+
+// bytes queued in bulk mode before they are written without waiting for the deadline
+#define TRANSPORT_BATCH_SIZE (1 << 16)
+// longest time a packet waits in the queue in bulk mode
+#define TRANSPORT_FLUSH_MS 2
+// packets encrypted with one run of the keystream by send_packets_buf
+#define TRANSPORT_SEAL_BATCH 32
+
+// message numbers the transport layer may send while a key exchange is in progress (RFC 4253 section 7.1)
+#define SSH_MSG_TRANSPORT_GENERIC_MAX 4
+#define SSH_MSG_KEX_FIRST 20
+#define SSH_MSG_KEX_LAST 49
+
+enum ssh_transport_msg {
+	SSH_MSG_DISCONNECT = 1,
+	SSH_MSG_IGNORE = 2,
+	SSH_MSG_UNIMPLEMENTED = 3,
+	SSH_MSG_DEBUG = 4,
+	SSH_MSG_SERVICE_REQUEST = 5,
+	SSH_MSG_SERVICE_ACCEPT = 6,
+	SSH_MSG_EXT_INFO = 7,
+	SSH_MSG_KEXINIT = 20,
+	SSH_MSG_NEWKEYS = 21,
+	SSH_MSG_KEX_ECDH_INIT = 30,
+	SSH_MSG_KEX_ECDH_REPLY = 31,
+};
+
+enum transport_mode {
+	// Nagle is disabled and every packet is written as soon as it is queued
+	TRANSPORT_INTERACTIVE = 0,
+	// packets are batched into large writes and the socket is corked so only full segments leave
+	TRANSPORT_BULK = 1,
+};
+
+enum recv_result {
+	RECV_ERROR = -1,
+	RECV_AGAIN = -2,
+};
+
+typedef struct recv_ring {
+	char *buf;
+	size_t size;
+	// first byte of the next (possibly partial) packet
+	size_t start;
+	// end of the received data
+	size_t end;
+	// number of bytes after start that have already been decrypted
+	size_t decrypted;
+	// whether the type of a packet is readable once it is decrypted, the first block of the next packet is only decrypted
+	// with the current one when the current one is not NEWKEYS
+	unsigned char lookahead;
+} recv_ring;
+
+typedef struct cipher_state {
+	aes_ctx aes;
+	hmac_sha256_ctx mac;
+	// sequence number of the next packet, counted from the first packet of the connection
+	uint32_t seq;
+	// set once NEWKEYS has taken effect in this direction
+	unsigned char enabled;
+	// compute the keystream ahead on the AES prefetch threads once keys are in use
+	unsigned char prefetch;
+	// where packets wait to be encrypted together with those of other transports, NULL to encrypt each as it is sent
+	aes_mb *mb;
+} cipher_state;
+
+struct transport;
+
+typedef void (*transport_cb)(struct transport *, void *);
+
+// the packets many transports on one loop send in an iteration, encrypted together and then written, see transport_set_batch
+typedef struct transport_batch {
+	aes_mb mb;
+	// transports whose queue is written once the batch is encrypted, NULL where one was freed meanwhile
+	struct transport **waiting;
+	int waiting_len;
+	int waiting_size;
+} transport_batch;
+
+typedef struct transport {
+	int s;
+	event_loop *loop;
+	recv_ring rx;
+	cipher_state tx_cipher;
+	cipher_state rx_cipher;
+	// zlib@openssh.com, applied to payloads before they are encrypted and after they are decrypted
+	compress_state tx_comp;
+	compress_state rx_comp;
+	// packets of the upper layers kept back while keys are being exchanged
+	struct iovec *held;
+	int held_len;
+	int held_size;
+	unsigned char holding;
+	// packets waiting for the socket, sendq_buf holds what to free once an entry is written
+	struct iovec *sendq_iov;
+	char **sendq_buf;
+	int sendq_head;
+	int sendq_len;
+	int sendq_size;
+	size_t sendq_bytes;
+	// bytes moved through the socket, for throughput estimates
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	// the batch the packets of this transport are encrypted with, and whether it is on the batch's waiting list
+	transport_batch *batch;
+	unsigned char batched;
+	// send scheduling, the timer flushes a partial batch in bulk mode
+	unsigned char mode;
+	event_timer *flush_timer;
+	// called when the queue drains below drain_low so a scheduler can refill it
+	transport_cb drain_cb;
+	void *drain_arg;
+	size_t drain_low;
+	unsigned char draining;
+	// called when data arrives, for callers that receive without blocking
+	transport_cb recv_cb;
+	void *recv_arg;
+	// readiness as last reported by the event loop
+	unsigned char readable;
+	unsigned char writable;
+	// io_uring backend, NULL when the socket is driven through epoll
+	uring *io;
+	uring_req rx_req;
+	uring_req tx_req;
+	// provided buffers the kernel filled that have not been moved into rx yet
+	struct {
+		uint16_t bid;
+		uint32_t len;
+	} rx_bufs[URING_BUFS];
+	int rx_bufs_head;
+	int rx_bufs_count;
+	uint32_t rx_buf_off;
+	// snapshot of the queue head handed to the kernel
+	struct iovec tx_iov[URING_IOV];
+	struct msghdr tx_msg;
+	unsigned char rx_armed;
+	unsigned char tx_busy;
+	unsigned char closed;
+} transport;
+
+/**
+ * @brief Read a big-endian uint32 from a packet
+ * @param p The read position, advanced past the value
+ * @param len The bytes left to read, reduced accordingly
+ * @param out Set to the value
+ * @return 0 on success, -1 if the packet is too short
+ */
+int buf_get_u32(const char **, int *, uint32_t *);
+
+/**
+ * @brief Read an SSH string from a packet without copying it
+ * @param p The read position, advanced past the string
+ * @param len The bytes left to read, reduced accordingly
+ * @param str Set to the start of the string
+ * @param str_len Set to the length of the string
+ * @return 0 on success, -1 if the packet is too short
+ */
+int buf_get_string(const char **, int *, const char **, uint32_t *);
+
+/**
+ * @brief Write a big-endian uint32
+ * @param p Where to write
+ * @param v The value
+ * @return The position after the value
+ */
+char *buf_put_u32(char *, uint32_t);
+
+/**
+ * @brief Write an SSH string (length followed by the bytes)
+ * @param p Where to write
+ * @param str The bytes
+ * @param len The number of bytes
+ * @return The position after the string
+ */
+char *buf_put_string(char *, const char *, size_t);
+
+/**
+ * @brief Initialize a receive buffer
+ * @param ring The receive buffer to initialize
+ * @param size The capacity of the buffer (at least 2 * MAX_PACKET_SIZE)
+ * @return 0 on success, -1 on error
+ */
+int recv_ring_init(recv_ring *, size_t);
+
+/**
+ * @brief Free a receive buffer
+ * @param ring The receive buffer to free
+ */
+void recv_ring_free(recv_ring *);
+
+/**
+ * @brief Read as much as the socket has available into the buffer with a single recv
+ * @param ring The receive buffer
+ * @param s The socket
+ * @return Number of bytes read, 0 on EOF, -1 on error (errno is set)
+ */
+ssize_t recv_ring_fill(recv_ring *, const int);
+
+/**
+ * @brief Frame the next complete packet in the buffer, decrypting and verifying it in place
+ * @note The returned payload points into the buffer and stays valid until the next call that reads into it
+ * @param ring The receive buffer
+ * @param cs The receive cipher state, its sequence number is advanced for every packet
+ * @param payload Set to the start of the payload
+ * @return Length of the payload, RECV_AGAIN if no complete packet is buffered, RECV_ERROR on a malformed packet or bad MAC
+ */
+int recv_ring_next(recv_ring *, cipher_state *, char **);
+
+/**
+ * @brief Switch one direction to aes128-ctr and hmac-sha2-256, keeping its sequence number
+ * @param cs The cipher state of the direction
+ * @param key The 16 byte encryption key
+ * @param iv The 16 byte IV
+ * @param mackey The 32 byte MAC key
+ */
+void cipher_init(cipher_state *, const uint8_t *, const uint8_t *, const uint8_t *);
+
+/**
+ * @brief Initialize a transport and register its socket with the event loop
+ * @note The socket is switched to non-blocking mode
+ * @param t The transport to initialize
+ * @param loop The event loop that drives the socket
+ * @param s The connected socket
+ * @return 0 on success, -1 on error
+ */
+int transport_init(transport *, event_loop *, const int);
+
+/**
+ * @brief Initialize a transport that does its socket I/O through io_uring
+ * @note Receives use a multishot recv into the ring's provided buffers, and queued packets are sent together with one sendmsg
+ * @param t The transport to initialize
+ * @param loop The event loop the ring is attached to
+ * @param io The ring
+ * @param s The connected socket
+ * @return 0 on success, -1 on error
+ */
+int transport_init_uring(transport *, event_loop *, uring *, const int);
+
+/**
+ * @brief Choose how queued packets are written
+ * @note Switching to TRANSPORT_INTERACTIVE writes out everything that is waiting
+ * @param t The transport
+ * @param mode TRANSPORT_INTERACTIVE or TRANSPORT_BULK
+ * @return 0 on success, -1 on error
+ */
+int transport_set_mode(transport *, const int);
+
+/**
+ * @brief Have the AES prefetch threads compute the keystream of both directions ahead of the packets
+ * @note Takes effect for the current keys and every set exchanged later. Without running prefetch threads (aes_prefetch_init)
+ * the keystream is computed along with the packets as before
+ * @param t The transport
+ * @param on 1 to prefetch, 0 to stop
+ */
+void transport_set_prefetch(transport *, const int);
+
+/**
+ * @brief Initialize an empty batch
+ * @param b The batch to initialize
+ */
+void transport_batch_init(transport_batch *);
+
+/**
+ * @brief Encrypt every packet queued on the batch, then write the queues of the transports they belong to
+ * @note Meant to run once per iteration of the loop the transports are on, before it waits (event_prepare_add)
+ * @param b The batch
+ */
+void transport_batch_run(transport_batch *);
+
+/**
+ * @brief Free a batch (every transport on it must have been freed or moved off it)
+ * @param b The batch to free
+ */
+void transport_batch_free(transport_batch *);
+
+/**
+ * @brief Encrypt the packets of a transport together with those of the other transports on a batch
+ * @note Encrypted packets are queued as before but only written by transport_batch_run, or by anything else that writes the
+ * queue, which encrypts the batch first. Thousands of connections sending a short packet each then fill the lanes of one
+ * kernel (aes_mb_flush) instead of leaving one mostly idle per packet
+ * @param t The transport
+ * @param b The batch, NULL to encrypt every packet as it is sent again
+ * @return 0 on success, -1 on error
+ */
+int transport_set_batch(transport *, transport_batch *);
+
+/**
+ * @brief Hold back packets other than transport layer messages while keys are being exchanged
+ * @note Held packets count as queued, releasing them frames them under the keys in use by then
+ * @param t The transport
+ * @param hold 1 once KEXINIT was sent, 0 once NEWKEYS was sent and the new keys are in use
+ * @return 0 on success, -1 on error
+ */
+int transport_hold(transport *, const int);
+
+/**
+ * @brief Compress every packet sent from now on (delayed compression starts once authentication succeeded)
+ * @param t The transport
+ * @param level The zlib level (1 to 9)
+ * @return 0 on success, -1 on error
+ */
+int transport_compress(transport *, const int);
+
+/**
+ * @brief Decompress every packet received from now on
+ * @param t The transport
+ * @return 0 on success, -1 on error
+ */
+int transport_decompress(transport *);
+
+/**
+ * @brief Register a callback for when the send queue drains
+ * @note The callback is not re-entered while it queues more packets itself
+ * @param t The transport
+ * @param low Call once no more than this many bytes are waiting
+ * @param cb The callback, NULL to remove it
+ * @param arg Passed to the callback
+ */
+void transport_set_drain(transport *, size_t, transport_cb, void *);
+
+/**
+ * @brief Register a callback for when data arrives on the socket
+ * @note The callback is the last thing the transport does for the event, so it may free the transport
+ * @param t The transport
+ * @param cb The callback, NULL to remove it
+ * @param arg Passed to the callback
+ */
+void transport_set_recv(transport *, transport_cb, void *);
+
+/**
+ * @brief Write everything queued and let partial segments leave at once, even in bulk mode
+ * @param t The transport
+ * @return 0 on success, -1 on error
+ */
+int transport_push(transport *);
+
+/**
+ * @brief Unregister and free a transport (the socket is not closed)
+ * @param t The transport to free
+ */
+void transport_free(transport *);
+
+/**
+ * @brief Allocate a buffer to build a packet payload in
+ * @note Room for the header is reserved in front and room for padding and the MAC after, so the packet is framed without copying
+ * @param len The maximum length of the payload
+ * @return The start of the payload, NULL on error
+ */
+char *packet_alloc(size_t);
+
+/**
+ * @brief Free a buffer from packet_alloc that was not sent
+ * @param payload The start of the payload
+ */
+void packet_free(char *);
+
+/**
+ * @brief Frame a payload built in a packet_alloc buffer in place and queue it
+ * @note The packet is encrypted in place and the MAC written after it once keys are in use (a compressed payload is built in a new
+ * buffer first), the transport takes ownership of the buffer
+ * @param t The transport
+ * @param payload The start of the payload
+ * @param len The length of the payload
+ * @return 0 on success, -1 on error
+ */
+int send_packet_buf(transport *, char *, int);
+
+/**
+ * @brief Frame and queue several payloads built in packet_alloc buffers, like send_packet_buf on each in turn
+ * @note The packets are MACed one after the other, then encrypted TRANSPORT_SEAL_BATCH at a time with aes_crypt_vec, so the
+ * counter blocks of short packets share kernel calls. The queue is written once at the end, the transport takes ownership of
+ * every buffer, even on error
+ * @param t The transport
+ * @param pkts The payloads (iov_base) and their lengths (iov_len)
+ * @param n The number of payloads
+ * @return 0 on success, -1 on error
+ */
+int send_packets_buf(transport *, struct iovec *, const int);
+
+/**
+ * @brief Queue raw bytes and write as much as the socket accepts without blocking
+ * @param t The transport
+ * @param data The bytes to send
+ * @param len The number of bytes
+ * @return 0 on success, -1 on error
+ */
+int transport_write(transport *, const char *, size_t);
+
+/**
+ * @brief Write queued bytes until the socket would block
+ * @note In bulk mode the last partial segment may stay corked, transport_drain pushes it out
+ * @param t The transport
+ * @return 0 on success, -1 on error
+ */
+int transport_flush(transport *);
+
+/**
+ * @brief Run the event loop until every queued byte has been written and pushed to the network
+ * @param t The transport
+ * @return 0 on success, -1 on error
+ */
+int transport_drain(transport *);
+
+/**
+ * @brief Receive the identification string of the peer
+ * @note Lines sent before the identification string are skipped, and anything after it is kept for recv_packet
+ * @param t The transport
+ * @param line Set to the start of the line (without CR LF)
+ * @return Length of the line, -1 on error
+ */
+int recv_ident(transport *, char **);
+
+/**
+ * @brief Like recv_ident, but return instead of running the event loop when more data is needed
+ * @param t The transport
+ * @param line Set to the start of the line (without CR LF)
+ * @return Length of the line, RECV_AGAIN if it has not fully arrived, -1 on error
+ */
+int recv_ident_nowait(transport *, char **);
+
+/**
+ * @brief Like recv_packet, but return instead of running the event loop when more data is needed
+ * @note The payload stays valid until the next call, so a caller may leave it in place while it is processed elsewhere
+ * @param t The transport
+ * @param payload Set to the decrypted payload
+ * @return Length of the payload, RECV_AGAIN if no whole packet has arrived, -1 on error
+ */
+int recv_packet_nowait(transport *, char **);
+
+/**
+ * @brief Copy a payload into a packet buffer and send it, or hold it while keys are being exchanged
+ * @param t The transport
+ * @param buf The payload
+ * @param len Length of the payload
+ * @return 0 on success, -1 on error
+ */
+int send_packet(transport *, const char *, const int);
+
+int recv_packet(transport *, char **);
 void send_packet_chacha(const int, const char *);
 int recv_packet_chacha(const int, char *);
-void send_packet_aes(aes_ctx *, const int, const char *, const int);
-int recv_packet_aes(aes_ctx *, const int, char *);
+
+/**
+ * @brief Encrypt and queue a packet, failing if no keys are in use yet
+ * @param t The transport
+ * @param buf The payload
+ * @param len The length of the payload
+ * @return 0 on success, -1 on error
+ */
+int send_packet_aes(transport *, const char *, const int);
+
+/**
+ * @brief Receive, decrypt and verify a packet, failing if no keys are in use yet
+ * @param t The transport
+ * @param payload Set to the start of the payload
+ * @return Length of the payload, -1 on error
+ */
+int recv_packet_aes(transport *, char **);
@@ -0,0 +1,185 @@
+#include "parallel.h"
+
+void _parallel_fail(parallel_result *result, const char *msg) {
+	if (result->error[0] == 0)
+		snprintf(result->error, sizeof(result->error), "%s", msg);
+}
+
+// open a session per stream, round robin over the connections
+parallel_stream *_parallel_open(connection **conns, int nconns, int *streams, int requests, parallel_result *result) {
+	memset(result, 0, sizeof(parallel_result));
+	if (*streams < nconns)
+		*streams = nconns;
+	if (*streams > PARALLEL_STREAMS_MAX)
+		*streams = PARALLEL_STREAMS_MAX;
+	parallel_stream *st = calloc(*streams, sizeof(parallel_stream));
+	if (st == NULL) {
+		_parallel_fail(result, strerror(errno));
+		return NULL;
+	}
+	for (int i = 0; i < *streams; i++) {
+		if (sftp_init(&st[i].sftp, conns[i % nconns], requests)) {
+			_parallel_fail(result, st[i].sftp.error);
+			return st;
+		}
+	}
+	return st;
+}
+
+// cut the file into chunk aligned ranges of about the same size
+void _parallel_split(parallel_stream *st, int streams, uint64_t size) {
+	uint64_t per = (size / streams + SFTP_CHUNK - 1) / SFTP_CHUNK * SFTP_CHUNK;
+	for (int i = 0; i < streams; i++) {
+		st[i].offset = per * i < size ? per * i : size;
+		st[i].len = size - st[i].offset < per ? size - st[i].offset : per;
+	}
+}
+
+void *_parallel_drive(void *arg) {
+	parallel_worker *w = arg;
+	for (int i = w->first; i < w->n; i += w->step)
+		while (w->streams[i].started && sftp_busy(&w->streams[i].sftp))
+			if (sftp_step(&w->streams[i].sftp))
+				break;
+	// closing the files here lets the connections do it side by side as well
+	for (int i = w->first; i < w->n; i += w->step)
+		if (w->streams[i].started)
+			sftp_finish(&w->streams[i].sftp);
+	return NULL;
+}
+
+void *_parallel_thread(void *arg) {
+	_parallel_drive(arg);
+	pool_trim();
+	return NULL;
+}
+
+// run the started streams to completion and add up what they moved
+int _parallel_run(parallel_stream *st, int nconns, int streams, parallel_result *result, struct timespec *start) {
+	// stream i belongs to worker i % nconns, connections beyond the number of streams have nothing to do
+	parallel_worker workers[PARALLEL_STREAMS_MAX];
+	int nworkers = nconns < streams ? nconns : streams;
+	for (int i = 0; i < nworkers; i++) {
+		workers[i].streams = st;
+		workers[i].first = i;
+		workers[i].step = nconns;
+		workers[i].n = streams;
+	}
+	if (nworkers == 1) {
+		_parallel_drive(&workers[0]);
+	} else {
+		int spawned = 0;
+		while (spawned < nworkers && pthread_create(&workers[spawned].thread, NULL, _parallel_thread, &workers[spawned]) == 0)
+			spawned++;
+		// a connection without a thread is driven by this one
+		for (int i = spawned; i < nworkers; i++)
+			_parallel_drive(&workers[i]);
+		for (int i = 0; i < spawned; i++)
+			pthread_join(workers[i].thread, NULL);
+	}
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	result->seconds = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+	for (int i = 0; i < streams; i++) {
+		if (!st[i].started)
+			continue;
+		result->bytes += st[i].sftp.transferred;
+		if (st[i].sftp.failed)
+			_parallel_fail(result, st[i].sftp.error);
+	}
+	return result->error[0] ? -1 : 0;
+}
+
+void _parallel_close(parallel_stream *st, int streams) {
+	if (st == NULL)
+		return;
+	for (int i = 0; i < streams; i++)
+		sftp_free(&st[i].sftp);
+	free(st);
+}
+
+int parallel_get(connection **conns, int nconns, int streams, int requests, const char *remote, const char *local, parallel_result *result) {
+	parallel_stream *st = _parallel_open(conns, nconns, &streams, requests, result);
+	if (result->error[0]) {
+		_parallel_close(st, streams);
+		return -1;
+	}
+	uint64_t size;
+	if (sftp_stat(&st[0].sftp, remote, &size)) {
+		_parallel_fail(result, st[0].sftp.error);
+		_parallel_close(st, streams);
+		return -1;
+	}
+	// the file gets its final size up front, every range is written in place
+	int fd = open(local, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 || ftruncate(fd, size)) {
+		_parallel_fail(result, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		_parallel_close(st, streams);
+		return -1;
+	}
+	_parallel_split(st, streams, size);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < streams; i++) {
+		if (st[i].len == 0)
+			continue;
+		st[i].started = sftp_get_range(&st[i].sftp, remote, fd, st[i].offset, st[i].len) == 0;
+		if (!st[i].started)
+			_parallel_fail(result, st[i].sftp.error);
+	}
+	int ret = _parallel_run(st, nconns, streams, result, &start);
+	if (close(fd) && ret == 0) {
+		_parallel_fail(result, strerror(errno));
+		ret = -1;
+	}
+	_parallel_close(st, streams);
+	return ret;
+}
+
+int parallel_put(connection **conns, int nconns, int streams, int requests, const char *local, const char *remote, parallel_result *result) {
+	memset(result, 0, sizeof(parallel_result));
+	struct stat sb;
+	int fd = open(local, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb)) {
+		_parallel_fail(result, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	uint64_t size = sb.st_size;
+	void *map = NULL;
+	if (size) {
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			_parallel_fail(result, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		// every range is read front to back, so readahead works per stream
+		madvise(map, size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	parallel_stream *st = _parallel_open(conns, nconns, &streams, requests, result);
+	int ret = -1;
+	if (result->error[0] == 0 && sftp_create(&st[0].sftp, remote, sb.st_mode & 0777))
+		_parallel_fail(result, st[0].sftp.error);
+	if (result->error[0] == 0) {
+		_parallel_split(st, streams, size);
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i = 0; i < streams; i++) {
+			if (st[i].len == 0)
+				continue;
+			st[i].started = sftp_put_range(&st[i].sftp, map, remote, st[i].offset, st[i].len) == 0;
+			if (!st[i].started)
+				_parallel_fail(result, st[i].sftp.error);
+		}
+		ret = _parallel_run(st, nconns, streams, result, &start);
+	}
+	_parallel_close(st, streams);
+	if (map != NULL)
+		munmap(map, size);
+	return ret;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "sftp.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+// largest number of ranges a file is split into
+#define PARALLEL_STREAMS_MAX 64
+
+// one byte range of the file and the sftp session moving it
+typedef struct parallel_stream {
+	sftp sftp;
+	uint64_t offset;
+	uint64_t len;
+	unsigned char started;
+} parallel_stream;
+
+// drives the streams of one connection, on a thread of its own when there are several connections
+typedef struct parallel_worker {
+	parallel_stream *streams;
+	int first;
+	int step;
+	int n;
+	pthread_t thread;
+} parallel_worker;
+
+typedef struct parallel_result {
+	// bytes moved by all streams together and the wall clock time it took
+	uint64_t bytes;
+	double seconds;
+	// why the transfer failed
+	char error[256];
+} parallel_result;
+
+/**
+ * @brief Download a file as byte ranges moved side by side, each over its own sftp session
+ * @note Stream i runs on connection i % nconns. With several connections each is driven by its own thread, so the
+ * transfer gets one core for the cipher and one TCP flow per connection, ranges land in the local file with positional writes
+ * @param conns The authenticated connections
+ * @param nconns The number of connections
+ * @param streams The number of ranges, at least one per connection
+ * @param requests The requests each stream keeps in flight, SFTP_REQUESTS_DEFAULT if 0
+ * @param remote The path on the server
+ * @param local The local path, created or truncated
+ * @param result Set to the bytes moved and the time it took, or why it failed
+ * @return 0 on success, -1 on error
+ */
+int parallel_get(connection **, int, int, int, const char *, const char *, parallel_result *);
+
+/**
+ * @brief Upload a file as byte ranges moved side by side, each over its own sftp session
+ * @note Connections and streams are used as by parallel_get, every stream sends from one shared mapping of the file
+ * @param conns The authenticated connections
+ * @param nconns The number of connections
+ * @param streams The number of ranges, at least one per connection
+ * @param requests The requests each stream keeps in flight, SFTP_REQUESTS_DEFAULT if 0
+ * @param local The local path
+ * @param remote The path on the server, created or truncated
+ * @param result Set to the bytes moved and the time it took, or why it failed
+ * @return 0 on success, -1 on error
+ */
+int parallel_put(connection **, int, int, int, const char *, const char *, parallel_result *);
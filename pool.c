@@ -0,0 +1,100 @@
+#include "pool.h"
+
+// sizes of the buffers handed out per class (without the header)
+const size_t pool_class_size[POOL_CLASSES] = {256, 1024, 4096, 16384, 40960};
+
+// sits in the cache line in front of every buffer
+typedef struct pool_header {
+	// size class, or POOL_CLASSES for oversized buffers
+	uint32_t cls;
+	// next free buffer while on a free list
+	struct pool_header *next;
+} pool_header;
+
+typedef struct pool_cache {
+	pool_header *free[POOL_CLASSES];
+	pool_stats stats;
+} pool_cache;
+
+// each thread recycles through its own free lists without locking
+static _Thread_local pool_cache cache;
+
+int _pool_class(size_t size) {
+	for (int i = 0; i < POOL_CLASSES; i++)
+		if (size <= pool_class_size[i])
+			return i;
+	return POOL_CLASSES;
+}
+
+void *pool_alloc(size_t size) {
+	int cls = _pool_class(size);
+	pool_header *h;
+	if (cls < POOL_CLASSES && cache.free[cls] != NULL) {
+		h = cache.free[cls];
+		cache.free[cls] = h->next;
+		cache.stats.cached[cls]--;
+		cache.stats.hits++;
+		return (char *)h + POOL_ALIGN;
+	}
+	if (cls == POOL_CLASSES)
+		cache.stats.oversize++;
+	else
+		cache.stats.misses++;
+	size_t alloc = cls < POOL_CLASSES ? pool_class_size[cls] : (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	h = aligned_alloc(POOL_ALIGN, POOL_ALIGN + alloc);
+	if (h == NULL)
+		return NULL;
+	h->cls = cls;
+	h->next = NULL;
+	return (char *)h + POOL_ALIGN;
+}
+
+void pool_free(void *ptr) {
+	if (ptr == NULL)
+		return;
+	pool_header *h = (pool_header *)((char *)ptr - POOL_ALIGN);
+	if (h->cls == POOL_CLASSES || cache.stats.cached[h->cls] >= POOL_CACHE_MAX) {
+		cache.stats.releases += h->cls != POOL_CLASSES;
+		free(h);
+		return;
+	}
+	h->next = cache.free[h->cls];
+	cache.free[h->cls] = h;
+	cache.stats.cached[h->cls]++;
+}
+
+size_t pool_size(const void *ptr) {
+	const pool_header *h = (const pool_header *)((const char *)ptr - POOL_ALIGN);
+	return h->cls < POOL_CLASSES ? pool_class_size[h->cls] : 0;
+}
+
+void pool_reserve(size_t size, int count) {
+	int cls = _pool_class(size);
+	if (cls == POOL_CLASSES)
+		return;
+	// allocate everything first so the buffers do not just cycle through the free list
+	void *bufs[POOL_CACHE_MAX];
+	int n = 0;
+	while (n < count && n < POOL_CACHE_MAX && cache.stats.cached[cls] + n < POOL_CACHE_MAX) {
+		pool_header *h = aligned_alloc(POOL_ALIGN, POOL_ALIGN + pool_class_size[cls]);
+		if (h == NULL)
+			break;
+		h->cls = cls;
+		bufs[n++] = (char *)h + POOL_ALIGN;
+	}
+	for (int i = 0; i < n; i++)
+		pool_free(bufs[i]);
+}
+
+void pool_trim() {
+	for (int i = 0; i < POOL_CLASSES; i++) {
+		while (cache.free[i] != NULL) {
+			pool_header *h = cache.free[i];
+			cache.free[i] = h->next;
+			free(h);
+		}
+		cache.stats.cached[i] = 0;
+	}
+}
+
+void pool_get_stats(pool_stats *stats) { memcpy(stats, &cache.stats, sizeof(pool_stats)); }
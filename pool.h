@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// buffers are aligned to (and their headers padded to) a cache line
+#define POOL_ALIGN 64
+// number of size classes, the largest fits a maximum size packet with its header and padding
+#define POOL_CLASSES 5
+// maximum number of free buffers each thread keeps per size class
+#define POOL_CACHE_MAX 64
+
+typedef struct pool_stats {
+	// allocations served from the free list
+	uint64_t hits;
+	// allocations that had to go to malloc
+	uint64_t misses;
+	// allocations larger than the largest size class
+	uint64_t oversize;
+	// buffers released to the system because the free list was full
+	uint64_t releases;
+	// free buffers currently cached per size class
+	uint32_t cached[POOL_CLASSES];
+} pool_stats;
+
+/**
+ * @brief Allocate a cache-line-aligned buffer from the calling thread's pool
+ * @param size The minimum size of the buffer
+ * @return The buffer, NULL on error
+ */
+void *pool_alloc(size_t);
+
+/**
+ * @brief Return a buffer to the calling thread's pool
+ * @note Buffers may be freed on a different thread than they were allocated on
+ * @param ptr The buffer (NULL is ignored)
+ */
+void pool_free(void *);
+
+/**
+ * @brief Return the usable size of a buffer
+ * @param ptr The buffer
+ * @return The size of the buffer's size class
+ */
+size_t pool_size(const void *);
+
+/**
+ * @brief Preallocate buffers so the steady state never reaches malloc
+ * @param size The size of the buffers
+ * @param count The number of buffers to cache
+ */
+void pool_reserve(size_t, int);
+
+/**
+ * @brief Release every buffer cached by the calling thread (call before the thread exits)
+ */
+void pool_trim();
+
+/**
+ * @brief Get the calling thread's pool counters
+ * @param stats The object to store the counters in
+ */
+void pool_get_stats(pool_stats *);
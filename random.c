@@ -1,17 +1,128 @@
 #include "random.h"
-#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+extern void __chacha_block(uint32_t state[16], char block[64]);
+
+// number of chacha blocks generated per refill (the first 32 bytes become the next key)
+#define RANDOM_BLOCKS 16
+// number of bytes handed out before mixing in fresh entropy from the kernel
+#define RANDOM_RESEED_BYTES (1 << 20)
+
+typedef struct random_state {
+	uint32_t state[16];
+	unsigned char buf[RANDOM_BLOCKS * 64];
+	// unread bytes at the end of buf
+	size_t available;
+	// bytes handed out since the last reseed
+	size_t served;
+	// value of fork_generation when this state was seeded
+	unsigned int generation;
+	unsigned char seeded;
+} random_state;
+
+// every thread gets its own generator so there is no locking on the hot path
+static _Thread_local random_state rng;
+// bumped in the child after fork so copied generator states are never reused
+static volatile unsigned int fork_generation = 0;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+void _random_atfork_child() { fork_generation++; }
+
+void _random_register_atfork() { pthread_atfork(NULL, NULL, _random_atfork_child); }
+
+// fill buf with entropy from the kernel
+void _random_entropy(unsigned char *buf, size_t len) {
+	size_t got = 0;
+	while (got < len) {
+		ssize_t res = getrandom(buf + got, len - got, 0);
+		if (res > 0) {
+			got += res;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		// kernels without getrandom still have urandom
+		int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			abort();
+		while (got < len) {
+			res = read(fd, buf + got, len - got);
+			if (res <= 0 && errno != EINTR)
+				abort();
+			if (res > 0)
+				got += res;
+		}
+		close(fd);
+	}
+}
+
+// generate a buffer of keystream, then immediately replace the key with the start of it
+void _random_refill(random_state *r) {
+	memset(r->buf, 0, sizeof(r->buf));
+	for (int i = 0; i < RANDOM_BLOCKS; i++) {
+		__chacha_block(r->state, (char *)r->buf + i * 64);
+		r->state[12]++;
+	}
+	memcpy(r->state + 4, r->buf, 32);
+	memset(r->buf, 0, 32);
+	r->state[12] = 0;
+	r->available = sizeof(r->buf) - 32;
+}
+
+void _random_reseed(random_state *r) {
+	pthread_once(&atfork_once, _random_register_atfork);
+	unsigned char seed[32];
+	_random_entropy(seed, sizeof(seed));
+	if (!r->seeded) {
+		memcpy(r->state, "expand 32-byte k", 16);
+		memset(r->state + 4, 0, 48);
+		r->seeded = 1;
+	}
+	// mix the fresh entropy into the current key instead of replacing it
+	for (int i = 0; i < 8; i++) {
+		uint32_t word;
+		memcpy(&word, seed + i * 4, 4);
+		r->state[4 + i] ^= word;
+	}
+	memset(seed, 0, sizeof(seed));
+	r->generation = fork_generation;
+	r->served = 0;
+	_random_refill(r);
+}
 
 void randbytes(unsigned char *buf, size_t len) {
-	FILE *fp = fopen("/dev/urandom", "r");
-	fread(buf, 1, len, fp);
-	fclose(fp);
+	random_state *r = &rng;
+	if (!r->seeded || r->generation != fork_generation || r->served >= RANDOM_RESEED_BYTES)
+		_random_reseed(r);
+	r->served += len;
+	while (len) {
+		if (r->available == 0)
+			_random_refill(r);
+		size_t n = len < r->available ? len : r->available;
+		unsigned char *src = r->buf + sizeof(r->buf) - r->available;
+		memcpy(buf, src, n);
+		// wipe what was handed out so it cannot be recovered from this state later
+		memset(src, 0, n);
+		r->available -= n;
+		buf += n;
+		len -= n;
+	}
 }
 
 int randint(int min, int max) {
+	if (min >= max)
+		return min;
 	unsigned int buf;
 	int ans;
 	do {
-		randbytes(&buf, 4);
+		randbytes((unsigned char *)&buf, 4);
 		ans = min + (buf & ((1 << (32 - __builtin_clz(max - min))) - 1));
 	} while (ans > max);
 	return ans;
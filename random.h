@@ -4,6 +4,7 @@
 
 /**
  * @brief Generate a random buffer of the given size.
+ * @note Output comes from a per-thread ChaCha20 generator with fast key erasure, reseeded from getrandom() periodically and after fork.
  * @param buf The buffer to fill.
  * @param len The size of the buffer.
  */
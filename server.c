@@ -0,0 +1,807 @@
+#include "server.h"
+
+// the same string the client sends
+#define SERVER_VERSION "SSH-2.0-PZSSH_0.1"
+
+void _server_step(server_conn *);
+
+void _session_close_fd(server_session *sess, int i) {
+	if (sess->fds[i] < 0)
+		return;
+	event_del(&sess->sl->loop, sess->fds[i]);
+	close(sess->fds[i]);
+	sess->fds[i] = -1;
+}
+
+void _session_free(server_session *sess) {
+	server_loop *sl = sess->sl;
+	if (sess->prev != NULL)
+		sess->prev->next = sess->next;
+	else
+		sl->sessions = sess->next;
+	if (sess->next != NULL)
+		sess->next->prev = sess->prev;
+	for (int i = 0; i < 3; i++)
+		_session_close_fd(sess, i);
+	if (sess->pidfd >= 0) {
+		event_del(&sl->loop, sess->pidfd);
+		close(sess->pidfd);
+	}
+	free(sess->in);
+	free(sess);
+}
+
+// the channel is gone, the session stays until its command has been reaped
+void _session_detach(server_session *sess) {
+	sess->ch = NULL;
+	sess->sc = NULL;
+	for (int i = 0; i < 3; i++)
+		_session_close_fd(sess, i);
+	if (sess->pidfd < 0) {
+		_session_free(sess);
+		return;
+	}
+	// the client went away, hang up on the command like a terminal would
+	kill(sess->pid, SIGHUP);
+}
+
+// once the command has exited and all of its output was sent, report its status and close the channel
+void _session_check(server_session *sess) {
+	channel *ch = sess->ch;
+	if (ch == NULL || ch->close_pending || sess->status < 0 || !sess->out_eof[0] || !sess->out_eof[1])
+		return;
+	uint32_t status = htonl(sess->status);
+	channel_eof(ch);
+	channel_request(ch, "exit-status", 0, (const char *)&status, 4);
+	channel_close(ch);
+}
+
+// read the command's stdout straight into packet buffers, and its stderr into extended data, while the channel has window
+void _session_pump(server_session *sess, int i) {
+	char err[CHANNEL_PACKET_MAX];
+	while (sess->ch != NULL && sess->fds[i] >= 0) {
+		size_t room;
+		char *buf;
+		if (i == 1) {
+			buf = channel_data_alloc(sess->ch, &room);
+		} else {
+			room = channel_writable(sess->ch);
+			if (room > sizeof(err))
+				room = sizeof(err);
+			buf = room ? err : NULL;
+		}
+		// CHANNEL_EV_WRITABLE brings us back here, until then the pipe fills up and the command blocks
+		if (buf == NULL)
+			return;
+		ssize_t n = read(sess->fds[i], buf, room);
+		if (i == 1)
+			channel_data_send(sess->ch, buf, n > 0 ? n : 0);
+		else if (n > 0)
+			channel_write_stderr(sess->ch, buf, n);
+		if (n > 0)
+			continue;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+		sess->out_eof[i - 1] = 1;
+		_session_close_fd(sess, i);
+		_session_check(sess);
+	}
+}
+
+// write what the command's stdin did not take yet, and close it once the channel's EOF is reached
+void _session_flush(server_session *sess) {
+	if (sess->fds[0] < 0)
+		return;
+	while (sess->in_len) {
+		ssize_t n = write(sess->fds[0], sess->in + sess->in_off, sess->in_len);
+		if (n > 0) {
+			sess->in_off += n;
+			sess->in_len -= n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+		// the command stopped reading, whatever it did not take is dropped
+		sess->in_len = 0;
+		_session_close_fd(sess, 0);
+		break;
+	}
+	sess->in_off = 0;
+	if (sess->ch != NULL)
+		channel_hold_window(sess->ch, 0);
+	if (sess->in_eof)
+		_session_close_fd(sess, 0);
+}
+
+// keep channel data until stdin takes it, the client is not granted more window meanwhile
+int _session_buffer(server_session *sess, const char *data, size_t len) {
+	if (sess->in_off && sess->in_off + sess->in_len + len > sess->in_size) {
+		memmove(sess->in, sess->in + sess->in_off, sess->in_len);
+		sess->in_off = 0;
+	}
+	if (sess->in_off + sess->in_len + len > sess->in_size) {
+		size_t size = sess->in_size ? sess->in_size : 16384;
+		while (size < sess->in_len + len)
+			size *= 2;
+		char *tmp = realloc(sess->in, size);
+		if (tmp == NULL)
+			return -1;
+		sess->in = tmp;
+		sess->in_size = size;
+	}
+	memcpy(sess->in + sess->in_off + sess->in_len, data, len);
+	sess->in_len += len;
+	channel_hold_window(sess->ch, 1);
+	return 0;
+}
+
+void _session_stdin(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)loop;
+	(void)fd;
+	(void)events;
+	_session_flush(arg);
+}
+
+void _session_stdout(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)loop;
+	(void)fd;
+	(void)events;
+	_session_pump(arg, 1);
+}
+
+void _session_stderr(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)loop;
+	(void)fd;
+	(void)events;
+	_session_pump(arg, 2);
+}
+
+void _session_exited(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)events;
+	server_session *sess = arg;
+	int status;
+	pid_t pid = waitpid(sess->pid, &status, WNOHANG);
+	if (pid == 0)
+		return;
+	event_del(loop, fd);
+	close(fd);
+	sess->pidfd = -1;
+	// a command killed by a signal reports 128 plus its number, as shells do
+	if (pid < 0)
+		sess->status = 255;
+	else
+		sess->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	if (sess->ch == NULL) {
+		_session_free(sess);
+		return;
+	}
+	_session_check(sess);
+}
+
+// run a program with pipes for stdin, stdout and stderr, watched through a pidfd so the loop learns of its exit
+int _session_spawn(server_session *sess, const char *path, char *const argv[]) {
+	if (sess->pid != 0)
+		return -1;
+	int p[3][2], made;
+	for (made = 0; made < 3; made++)
+		if (pipe2(p[made], O_CLOEXEC))
+			break;
+	if (made < 3) {
+		for (int i = 0; i < made; i++) {
+			close(p[i][0]);
+			close(p[i][1]);
+		}
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		// only async-signal-safe calls until exec, another thread may have held a lock at the fork
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		signal(SIGPIPE, SIG_DFL);
+		dup2(p[0][0], 0);
+		dup2(p[1][1], 1);
+		dup2(p[2][1], 2);
+		execv(path, argv);
+		_exit(127);
+	}
+	close(p[0][0]);
+	close(p[1][1]);
+	close(p[2][1]);
+	int fds[3] = {p[0][1], p[1][0], p[2][0]};
+	int pidfd = pid > 0 ? syscall(SYS_pidfd_open, pid, 0) : -1;
+	if (pidfd < 0) {
+		if (pid > 0) {
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+		}
+		for (int i = 0; i < 3; i++)
+			close(fds[i]);
+		return -1;
+	}
+	sess->pid = pid;
+	sess->pidfd = pidfd;
+	for (int i = 0; i < 3; i++) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+		sess->fds[i] = fds[i];
+	}
+	event_loop *loop = &sess->sl->loop;
+	if (event_add(loop, fds[0], EPOLLOUT, _session_stdin, sess) || event_add(loop, fds[1], EPOLLIN, _session_stdout, sess) ||
+	    event_add(loop, fds[2], EPOLLIN, _session_stderr, sess) || event_add(loop, pidfd, EPOLLIN, _session_exited, sess)) {
+		for (int i = 0; i < 3; i++)
+			_session_close_fd(sess, i);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		event_del(loop, pidfd);
+		close(pidfd);
+		sess->pidfd = -1;
+		return -1;
+	}
+	// data the client sent ahead of the request
+	_session_flush(sess);
+	return 0;
+}
+
+// "exec", "shell" and "subsystem" start the session's one command, everything else (pty-req, env, ...) is refused
+void _session_request(server_session *sess, const char *data, size_t len) {
+	const char *type, *p = data;
+	int left = len;
+	uint32_t type_len;
+	if (buf_get_string(&p, &left, &type, &type_len) || left < 1)
+		return;
+	p++;
+	left--;
+	const char *arg;
+	uint32_t arg_len;
+	char *copy = NULL;
+	const char *path = "/bin/sh";
+	char *argv[4] = {"sh", NULL, NULL, NULL};
+	if (type_len == 4 && memcmp(type, "exec", 4) == 0) {
+		if (buf_get_string(&p, &left, &arg, &arg_len) || memchr(arg, 0, arg_len) != NULL || (copy = malloc(arg_len + 1)) == NULL)
+			return;
+		memcpy(copy, arg, arg_len);
+		copy[arg_len] = 0;
+		argv[1] = "-c";
+		argv[2] = copy;
+	} else if (type_len == 9 && memcmp(type, "subsystem", 9) == 0) {
+		if (buf_get_string(&p, &left, &arg, &arg_len) || arg_len != 4 || memcmp(arg, "sftp", 4))
+			return;
+		path = sess->sl->srv->sftp_server;
+		argv[0] = (char *)path;
+	} else if (type_len != 5 || memcmp(type, "shell", 5)) {
+		return;
+	}
+	int ok = _session_spawn(sess, path, argv) == 0;
+	free(copy);
+	channel_reply(sess->ch, ok);
+}
+
+void _session_channel(channel *ch, int event, const char *data, size_t len, void *arg) {
+	(void)ch;
+	server_session *sess = arg;
+	switch (event) {
+	case CHANNEL_EV_REQUEST:
+		_session_request(sess, data, len);
+		break;
+	case CHANNEL_EV_DATA:
+		// the command stopped reading
+		if (sess->pid != 0 && sess->fds[0] < 0)
+			break;
+		if (sess->in_len == 0 && sess->fds[0] >= 0) {
+			ssize_t n = write(sess->fds[0], data, len);
+			if (n < 0 && errno != EAGAIN && errno != EINTR) {
+				_session_close_fd(sess, 0);
+				break;
+			}
+			if (n > 0) {
+				data += n;
+				len -= n;
+			}
+		}
+		if (len && _session_buffer(sess, data, len))
+			_session_close_fd(sess, 0);
+		break;
+	case CHANNEL_EV_EOF:
+		sess->in_eof = 1;
+		_session_flush(sess);
+		break;
+	case CHANNEL_EV_WRITABLE:
+		_session_pump(sess, 1);
+		_session_pump(sess, 2);
+		break;
+	case CHANNEL_EV_CLOSE:
+		_session_detach(sess);
+		break;
+	}
+}
+
+// channels the client opens: sessions, and "direct-tcpip" for its local forwards
+int _server_open(connection *conn, channel *ch, const char *type, size_t type_len, const char *data, size_t len, void *arg) {
+	(void)conn;
+	server_conn *sc = arg;
+	if (type_len == 12 && memcmp(type, "direct-tcpip", 12) == 0)
+		return forward_direct(&sc->fwd, ch, data, len);
+	if (type_len != 7 || memcmp(type, "session", 7))
+		return SSH_OPEN_UNKNOWN_CHANNEL_TYPE;
+	server_session *sess = calloc(1, sizeof(server_session));
+	if (sess == NULL)
+		return SSH_OPEN_RESOURCE_SHORTAGE;
+	server_loop *sl = sc->sl;
+	sess->sl = sl;
+	sess->sc = sc;
+	sess->ch = ch;
+	sess->pidfd = -1;
+	sess->fds[0] = sess->fds[1] = sess->fds[2] = -1;
+	sess->status = -1;
+	sess->next = sl->sessions;
+	if (sl->sessions != NULL)
+		sl->sessions->prev = sess;
+	sl->sessions = sess;
+	ch->cb = _session_channel;
+	ch->arg = sess;
+	return 0;
+}
+
+void _server_close(server_conn *sc) {
+	server_loop *sl = sc->sl;
+	// a pool thread is using the state, _server_signed frees it
+	if (sc->busy) {
+		sc->closing = 1;
+		return;
+	}
+	if (sc->login_timer != NULL)
+		event_timer_cancel(sc->login_timer);
+	// the channels go with the connection, their commands are hung up on
+	server_session *next;
+	for (server_session *sess = sl->sessions; sess != NULL; sess = next) {
+		next = sess->next;
+		if (sess->sc == sc)
+			_session_detach(sess);
+	}
+	if (sc->conn.t != NULL) {
+		forward_free(&sc->fwd);
+		connection_free(&sc->conn);
+	}
+	kex_free(&sc->kex);
+	transport_free(&sc->t);
+	close(sc->s);
+	if (sc->prev != NULL)
+		sc->prev->next = sc->next;
+	else
+		sl->conns = sc->next;
+	if (sc->next != NULL)
+		sc->next->prev = sc->prev;
+	free(sc);
+}
+
+void _server_login_timeout(event_loop *loop, void *arg) {
+	(void)loop;
+	server_conn *sc = arg;
+	sc->login_timer = NULL;
+	_server_close(sc);
+}
+
+// compare without stopping at the first difference, so the time taken does not tell how much of a guess was right
+int _server_password_ok(const char *expected, const char *given, uint32_t given_len) {
+	size_t len = strlen(expected);
+	unsigned char diff = len != given_len;
+	for (uint32_t i = 0; i < given_len; i++)
+		diff |= (unsigned char)given[i] ^ (unsigned char)expected[i < len ? i : 0];
+	return diff == 0;
+}
+
+int _server_userauth(server_conn *sc, const char *pkt, int len) {
+	server *srv = sc->sl->srv;
+	const char *p = pkt + 1, *user, *service, *method;
+	int left = len - 1;
+	uint32_t user_len, service_len, method_len;
+	if (buf_get_string(&p, &left, &user, &user_len) || buf_get_string(&p, &left, &service, &service_len) ||
+	    buf_get_string(&p, &left, &method, &method_len))
+		return -1;
+	if (service_len != 14 || memcmp(service, "ssh-connection", 14))
+		return -1;
+	int ok = 0;
+	if (method_len == 4 && memcmp(method, "none", 4) == 0) {
+		ok = srv->allow_none;
+	} else {
+		if (method_len == 8 && memcmp(method, "password", 8) == 0) {
+			const char *password;
+			uint32_t password_len;
+			if (left < 1)
+				return -1;
+			p++;
+			left--;
+			if (buf_get_string(&p, &left, &password, &password_len))
+				return -1;
+			ok = srv->password != NULL && _server_password_ok(srv->password, password, password_len);
+		}
+		// asking with "none" first is what clients do to learn the methods, it does not count
+		if (!ok && ++sc->auth_tries >= SERVER_AUTH_TRIES)
+			return -1;
+	}
+	if (ok) {
+		char msg = SSH_MSG_USERAUTH_SUCCESS;
+		if (send_packet(&sc->t, &msg, 1))
+			return -1;
+		sc->state = SERVER_OPEN;
+		if (sc->login_timer != NULL)
+			event_timer_cancel(sc->login_timer);
+		sc->login_timer = NULL;
+		return 0;
+	}
+	const char *methods = srv->password != NULL ? "password" : "";
+	char buf[32], *q = buf;
+	*q++ = SSH_MSG_USERAUTH_FAILURE;
+	q = buf_put_string(q, methods, strlen(methods));
+	// no partial success
+	*q++ = 0;
+	return send_packet(&sc->t, buf, q - buf);
+}
+
+int _server_auth(server_conn *sc, const char *pkt, int len) {
+	switch (pkt[0]) {
+	case SSH_MSG_SERVICE_REQUEST: {
+		const char *p = pkt + 1, *name;
+		int left = len - 1;
+		uint32_t name_len;
+		if (buf_get_string(&p, &left, &name, &name_len) || name_len != 12 || memcmp(name, "ssh-userauth", 12))
+			return -1;
+		char buf[32], *q = buf;
+		*q++ = SSH_MSG_SERVICE_ACCEPT;
+		q = buf_put_string(q, "ssh-userauth", 12);
+		return send_packet(&sc->t, buf, q - buf);
+	}
+	case SSH_MSG_USERAUTH_REQUEST:
+		return _server_userauth(sc, pkt, len);
+	}
+	// the client may exchange keys again before authentication is over
+	if (pkt[0] >= SSH_MSG_KEXINIT && pkt[0] <= SSH_MSG_KEX_LAST)
+		return kex_dispatch(&sc->kex, pkt, len);
+	return -1;
+}
+
+void _server_sign(void *arg) {
+	server_conn *sc = arg;
+	sc->kex_result = kex_reply_verify(&sc->kex, sc->kex_pkt, sc->kex_pkt_len);
+}
+
+void _server_signed(void *arg) {
+	server_conn *sc = arg;
+	sc->busy = 0;
+	if (sc->closing || sc->kex_result || kex_reply_finish(&sc->kex)) {
+		_server_close(sc);
+		return;
+	}
+	// packets that arrived behind ECDH_INIT are still in the receive buffer
+	_server_step(sc);
+}
+
+// ECDH_INIT stays where it is in the receive buffer, nothing more is read until the pool is done with it
+int _server_offload(kex *k, const char *payload, int len, void *arg) {
+	server_conn *sc = arg;
+	sc->kex_pkt = payload;
+	sc->kex_pkt_len = len;
+	if (worker_submit(&sc->sl->inbox, _server_sign, _server_signed, sc))
+		return kex_reply_verify(k, payload, len) ? -1 : kex_reply_finish(k);
+	sc->busy = 1;
+	return 0;
+}
+
+// the identification strings are exchanged, our KEXINIT goes out and the client's is expected
+int _server_ident(server_conn *sc, const char *ident, int len) {
+	server *srv = sc->sl->srv;
+	if (kex_init_server(&sc->kex, &sc->t, SERVER_VERSION, ident, len, srv->hostkey))
+		return -1;
+	if (srv->crypto.threads != NULL)
+		kex_set_offload(&sc->kex, _server_offload, sc);
+	connection_init(&sc->conn, &sc->t);
+	connection_set_kex(&sc->conn, &sc->kex);
+	connection_set_window(&sc->conn, srv->window, srv->maxpacket);
+	forward_init(&sc->fwd, &sc->conn, &sc->sl->loop);
+	if (srv->crypto.threads != NULL)
+		forward_set_resolver(&sc->fwd, &sc->sl->inbox);
+	connection_set_accept(&sc->conn, _server_open, sc);
+	sc->state = SERVER_KEX;
+	return kex_start(&sc->kex);
+}
+
+// handle whatever has arrived, until the socket runs dry or the pool takes over
+void _server_step(server_conn *sc) {
+	while (!sc->busy) {
+		char *pkt;
+		int len;
+		if (sc->state == SERVER_IDENT) {
+			len = recv_ident_nowait(&sc->t, &pkt);
+			if (len == RECV_AGAIN)
+				break;
+			if (len < 0 || _server_ident(sc, pkt, len)) {
+				_server_close(sc);
+				return;
+			}
+			continue;
+		}
+		len = recv_packet_nowait(&sc->t, &pkt);
+		if (len == RECV_AGAIN)
+			break;
+		if (len < 1) {
+			_server_close(sc);
+			return;
+		}
+		if (pkt[0] == SSH_MSG_IGNORE || pkt[0] == SSH_MSG_DEBUG)
+			continue;
+		int ret;
+		if (sc->state == SERVER_KEX) {
+			ret = kex_dispatch(&sc->kex, pkt, len);
+			if (ret == 0 && sc->kex.count > 0)
+				sc->state = SERVER_AUTH;
+		} else if (sc->state == SERVER_AUTH) {
+			ret = _server_auth(sc, pkt, len);
+		} else {
+			ret = connection_dispatch(&sc->conn, pkt, len);
+			if (ret == 0 && kex_due(&sc->kex))
+				ret = kex_start(&sc->kex);
+		}
+		if (ret) {
+			_server_close(sc);
+			return;
+		}
+	}
+	if (transport_flush(&sc->t))
+		_server_close(sc);
+}
+
+void _server_readable(transport *t, void *arg) {
+	(void)t;
+	_server_step(arg);
+}
+
+void _server_accept(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)events;
+	server_loop *sl = arg;
+	for (;;) {
+		int s = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (s < 0 && errno == EINTR)
+			continue;
+		// out of descriptors the rest wait in the backlog until the next connection wakes us
+		if (s < 0)
+			return;
+		server_conn *sc = calloc(1, sizeof(server_conn));
+		if (sc == NULL) {
+			close(s);
+			continue;
+		}
+		sc->sl = sl;
+		sc->s = s;
+		if (transport_init(&sc->t, loop, s)) {
+			free(sc);
+			close(s);
+			continue;
+		}
+		transport_set_batch(&sc->t, &sl->batch);
+		sc->next = sl->conns;
+		if (sl->conns != NULL)
+			sl->conns->prev = sc;
+		sl->conns = sc;
+		transport_set_recv(&sc->t, _server_readable, sc);
+		sc->login_timer = event_timer_add(loop, SERVER_LOGIN_TIMEOUT * 1000, _server_login_timeout, sc);
+		if (transport_write(&sc->t, SERVER_VERSION "\r\n", strlen(SERVER_VERSION) + 2)) {
+			_server_close(sc);
+			continue;
+		}
+		_server_step(sc);
+	}
+}
+
+void _server_wake(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)events;
+	(void)arg;
+	uint64_t count;
+	while (read(fd, &count, sizeof(count)) > 0)
+		;
+	event_loop_stop(loop);
+}
+
+// encrypt what every connection of the loop sent in this iteration together, before the loop waits again
+void _server_seal(event_loop *loop, void *arg) {
+	(void)loop;
+	server_loop *sl = arg;
+	transport_batch_run(&sl->batch);
+}
+
+void *_server_loop_main(void *arg) {
+	server_loop *sl = arg;
+	event_loop_run(&sl->loop);
+	// the thread's cached packet buffers would be lost with it
+	pool_trim();
+	return NULL;
+}
+
+void server_init(server *srv, ECDSA_keypair *hostkey) {
+	memset(srv, 0, sizeof(server));
+	srv->hostkey = hostkey;
+	srv->sftp_server = SERVER_SFTP_DEFAULT;
+	srv->window = CHANNEL_WINDOW_DEFAULT;
+	srv->maxpacket = CHANNEL_PACKET_MAX;
+	srv->crypto_threads = -1;
+}
+
+void server_set_auth(server *srv, const char *password, const int allow_none) {
+	srv->password = password;
+	srv->allow_none = allow_none != 0;
+}
+
+void server_set_sftp(server *srv, const char *path) { srv->sftp_server = path; }
+
+void server_set_window(server *srv, uint32_t window, uint32_t maxpacket) {
+	srv->window = window;
+	srv->maxpacket = maxpacket;
+}
+
+void server_set_crypto(server *srv, int threads) { srv->crypto_threads = threads; }
+
+// a listening socket of one loop, the kernel hashes each new connection to one of the sockets bound with SO_REUSEPORT
+int _server_socket(const struct sockaddr *addr, socklen_t addr_len, int cpu) {
+	int s = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (s < 0)
+		return -1;
+	int one = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (addr->sa_family == AF_INET6)
+		setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+#ifdef SO_INCOMING_CPU
+	// prefer the listener whose loop runs on the core that took the connection's packets
+	setsockopt(s, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+#endif
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) || bind(s, addr, addr_len) || listen(s, SOMAXCONN)) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+int server_listen(server *srv, const char *addr, const char *port, int loops) {
+	struct addrinfo hints = {0}, *res;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(addr, port, &hints, &res)) {
+		fprintf(stderr, "Could not resolve %s\n", addr);
+		return -1;
+	}
+	// the first loop's socket decides the port, so port 0 gives every loop the same one
+	struct sockaddr_storage bound;
+	socklen_t bound_len = res->ai_addrlen;
+	memcpy(&bound, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+	// one loop per CPU the process may run on, loops beyond that share them in turn
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	if (sched_getaffinity(0, sizeof(cpus), &cpus))
+		CPU_SET(0, &cpus);
+	if (loops <= 0)
+		loops = CPU_COUNT(&cpus);
+	// the crypto threads are pinned to the CPUs no loop is on, or left to the scheduler if the loops have them all
+	cpu_set_t spare = cpus;
+	for (int i = 0, cpu = -1; i < loops && i < CPU_COUNT(&cpus); i++) {
+		do
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		while (!CPU_ISSET(cpu, &cpus));
+		CPU_CLR(cpu, &spare);
+	}
+	if (srv->crypto_threads >= 0 && worker_pool_init(&srv->crypto, srv->crypto_threads, CPU_COUNT(&spare) ? &spare : NULL)) {
+		fprintf(stderr, "Could not start the crypto threads\n");
+		return -1;
+	}
+	srv->loops = calloc(loops, sizeof(server_loop));
+	if (srv->loops == NULL)
+		return -1;
+	int cpu = -1;
+	for (int i = 0; i < loops; i++) {
+		server_loop *sl = &srv->loops[i];
+		sl->srv = srv;
+		sl->fd = sl->wake = -1;
+		do
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		while (!CPU_ISSET(cpu, &cpus));
+		sl->cpu = cpu;
+		if (event_loop_init(&sl->loop))
+			return -1;
+		srv->loops_len++;
+		transport_batch_init(&sl->batch);
+		if (event_prepare_add(&sl->loop, _server_seal, sl))
+			return -1;
+		if (srv->crypto.threads != NULL && worker_inbox_init(&sl->inbox, &srv->crypto, &sl->loop, cpu))
+			return -1;
+		sl->fd = _server_socket((struct sockaddr *)&bound, bound_len, cpu);
+		if (sl->fd < 0 || (sl->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+		    event_add(&sl->loop, sl->fd, EPOLLIN, _server_accept, sl) || event_add(&sl->loop, sl->wake, EPOLLIN, _server_wake, sl)) {
+			fprintf(stderr, "Could not listen on %s port %s: %s\n", addr, port, strerror(errno));
+			return -1;
+		}
+		if (i == 0)
+			getsockname(sl->fd, (struct sockaddr *)&bound, &bound_len);
+	}
+	return 0;
+}
+
+int server_run(server *srv) {
+	if (srv->loops_len == 0)
+		return -1;
+	// every loop stays on its core, next to the listener the kernel prefers for that core
+	int started = 1;
+	for (; started < srv->loops_len; started++) {
+		server_loop *sl = &srv->loops[started];
+		cpu_set_t cpu;
+		CPU_ZERO(&cpu);
+		CPU_SET(sl->cpu, &cpu);
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+		int err = pthread_create(&sl->thread, &attr, _server_loop_main, sl);
+		pthread_attr_destroy(&attr);
+		if (err)
+			break;
+	}
+	// the first loop runs on the calling thread
+	int ret = started == srv->loops_len ? 0 : -1;
+	if (ret == 0) {
+		cpu_set_t cpu;
+		CPU_ZERO(&cpu);
+		CPU_SET(srv->loops[0].cpu, &cpu);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu);
+		event_loop_run(&srv->loops[0].loop);
+	}
+	server_stop(srv);
+	for (int i = 1; i < started; i++)
+		pthread_join(srv->loops[i].thread, NULL);
+	return ret;
+}
+
+void server_stop(server *srv) {
+	uint64_t one = 1;
+	for (int i = 0; i < srv->loops_len; i++) {
+		if (srv->loops[i].wake >= 0) {
+			ssize_t n = write(srv->loops[i].wake, &one, sizeof(one));
+			(void)n;
+		}
+	}
+}
+
+void server_free(server *srv) {
+	// once the threads are gone nothing touches a connection that was busy, and it can be freed like the others
+	worker_pool_free(&srv->crypto);
+	for (int i = 0; i < srv->loops_len; i++) {
+		server_loop *sl = &srv->loops[i];
+		while (sl->conns != NULL) {
+			sl->conns->busy = 0;
+			_server_close(sl->conns);
+		}
+		// commands still running are hung up on and left to exit on their own
+		while (sl->sessions != NULL) {
+			server_session *sess = sl->sessions;
+			if (sess->pidfd >= 0)
+				kill(sess->pid, SIGHUP);
+			_session_free(sess);
+		}
+		if (sl->fd >= 0) {
+			event_del(&sl->loop, sl->fd);
+			close(sl->fd);
+		}
+		if (sl->wake >= 0) {
+			event_del(&sl->loop, sl->wake);
+			close(sl->wake);
+		}
+		worker_inbox_free(&sl->inbox);
+		transport_batch_free(&sl->batch);
+		event_loop_free(&sl->loop);
+	}
+	free(srv->loops);
+	srv->loops = NULL;
+	srv->loops_len = 0;
+	pool_trim();
+}
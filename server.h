@@ -0,0 +1,193 @@
+#pragma once
+
+#include "channel.h"
+#include "forward.h"
+#include "kex.h"
+#include "worker.h"
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+// port and address listened on unless configured otherwise
+#define SERVER_PORT_DEFAULT "2222"
+#define SERVER_BIND_DEFAULT "127.0.0.1"
+// seconds a client has from connecting until it is authenticated
+#define SERVER_LOGIN_TIMEOUT 120
+// failed authentication attempts before the client is disconnected
+#define SERVER_AUTH_TRIES 6
+// ephemeral keys and signing nonces kept ready off the loops, enough for a burst of handshakes
+#define SERVER_POOL_SIZE 64
+// run for the "sftp" subsystem unless configured otherwise
+#define SERVER_SFTP_DEFAULT "/usr/lib/openssh/sftp-server"
+
+enum server_state {
+	SERVER_IDENT = 0,
+	SERVER_KEX = 1,
+	SERVER_AUTH = 2,
+	SERVER_OPEN = 3,
+};
+
+struct server;
+struct server_loop;
+struct server_conn;
+
+// a session channel and the command it runs, left behind without its channel until the command has been reaped
+typedef struct server_session {
+	struct server_loop *sl;
+	struct server_conn *sc;
+	channel *ch;
+	pid_t pid;
+	// readable once the command has exited, -1 before it runs and once it was reaped
+	int pidfd;
+	// the command's stdin, stdout and stderr, -1 once closed
+	int fds[3];
+	// channel data stdin did not take yet, the channel's window is held while there is any
+	char *in;
+	size_t in_len;
+	size_t in_off;
+	size_t in_size;
+	// exit status, -1 while the command runs
+	int status;
+	// the channel reached EOF, stdin is closed once the buffer is written
+	unsigned char in_eof;
+	// stdout and stderr reached EOF
+	unsigned char out_eof[2];
+	struct server_session *prev;
+	struct server_session *next;
+} server_session;
+
+typedef struct server_conn {
+	struct server_loop *sl;
+	int s;
+	transport t;
+	kex kex;
+	connection conn;
+	forward fwd;
+	int state;
+	event_timer *login_timer;
+	int auth_tries;
+	// a pool thread is signing the key exchange, nothing else may touch the state meanwhile
+	unsigned char busy;
+	// closed while busy, freed once the pool thread is done
+	unsigned char closing;
+	// the ECDH_INIT handed to the pool, left in the receive buffer until the thread is done with it
+	const char *kex_pkt;
+	int kex_pkt_len;
+	int kex_result;
+	struct server_conn *prev;
+	struct server_conn *next;
+} server_conn;
+
+// one core's share of the server: its own listening socket, loop and connections, nothing is shared with the other loops
+typedef struct server_loop {
+	struct server *srv;
+	event_loop loop;
+	pthread_t thread;
+	int cpu;
+	// bound to the same address as the listeners of the other loops with SO_REUSEPORT, the kernel spreads connections
+	int fd;
+	// written by server_stop
+	int wake;
+	// where the pool threads hand back the handshakes of this loop's connections
+	worker_inbox inbox;
+	// the packets every connection of the loop sends in an iteration, encrypted together before the loop waits
+	transport_batch batch;
+	server_conn *conns;
+	server_session *sessions;
+} server_loop;
+
+typedef struct server {
+	ECDSA_keypair *hostkey;
+	// accepted for every user, NULL to accept no password
+	const char *password;
+	// whether "none" authenticates, only meant for loopback benchmarks
+	unsigned char allow_none;
+	const char *sftp_server;
+	uint32_t window;
+	uint32_t maxpacket;
+	// threads for the handshake math of every loop, -1 to do it on the loops
+	int crypto_threads;
+	worker_pool crypto;
+	server_loop *loops;
+	int loops_len;
+} server;
+
+/**
+ * @brief Initialize a server
+ * @param srv The server to initialize
+ * @param hostkey The host keypair, which signs every key exchange and must outlive the server
+ */
+void server_init(server *, ECDSA_keypair *);
+
+/**
+ * @brief Choose how clients authenticate
+ * @note Commands run as the user the server runs as, whatever user name the client gives
+ * @param srv The server
+ * @param password The password accepted, NULL to accept none
+ * @param allow_none 1 to let clients in without authenticating
+ */
+void server_set_auth(server *, const char *, const int);
+
+/**
+ * @brief Set the program run for the "sftp" subsystem
+ * @param srv The server
+ * @param path The path of the program
+ */
+void server_set_sftp(server *, const char *);
+
+/**
+ * @brief Set the receive window and maximum packet size of the channels clients open
+ * @param srv The server
+ * @param window The initial receive window in bytes
+ * @param maxpacket The largest data packet a client may send
+ */
+void server_set_window(server *, uint32_t, uint32_t);
+
+/**
+ * @brief Move the point multiply and signature of every key exchange off the loops onto a shared pool of threads
+ * @note A loop that did them itself would stall its established sessions for every new connection. The pool threads steal
+ * work from each other, so a burst of handshakes on one loop is spread over every core, and the results come back to the
+ * loop that owns the connection. They are pinned to the CPUs no loop is pinned to, so they do not compete with the loops for
+ * their cores, or left to the scheduler when the loops take every CPU. Takes effect at server_listen
+ * @param srv The server
+ * @param threads The number of threads, 0 for one per CPU left over by the loops (or per CPU the process may run on if there
+ * are none), -1 to sign on the loops
+ */
+void server_set_crypto(server *, int);
+
+/**
+ * @brief Open a listening socket and an event loop per core
+ * @note Every loop accepts, exchanges keys with and serves its own connections on its own thread, which is pinned to its
+ * core, so the server scales with the cores without any locking between connections. The packets the connections of a loop
+ * send are encrypted together once per iteration (transport_set_batch)
+ * @param srv The server
+ * @param addr The address to listen on
+ * @param port The port to listen on
+ * @param loops The number of loops, 0 for one per CPU the process may run on
+ * @return 0 on success, -1 on error
+ */
+int server_listen(server *, const char *, const char *, int);
+
+/**
+ * @brief Serve clients until server_stop is called
+ * @param srv The server
+ * @return 0 on success, -1 on error
+ */
+int server_run(server *);
+
+/**
+ * @brief Make server_run return (async-signal-safe)
+ * @param srv The server
+ */
+void server_stop(server *);
+
+/**
+ * @brief Close every connection and listener and free the server
+ * @param srv The server to free
+ */
+void server_free(server *);
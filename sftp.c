@@ -0,0 +1,643 @@
+#include "sftp.h"
+
+// messages for status codes the server sent without one
+const char *_sftp_messages[] = {
+	"Success",
+	"End of file",
+	"No such file",
+	"Permission denied",
+	"Failure",
+	"Bad message",
+	"No connection",
+	"Connection lost",
+	"Operation unsupported",
+};
+
+// record why the operation failed, the first reason is kept
+void _sftp_fail(sftp *s, const char *msg, size_t len) {
+	if (s->failed)
+		return;
+	s->failed = 1;
+	if (len >= sizeof(s->error))
+		len = sizeof(s->error) - 1;
+	memcpy(s->error, msg, len);
+	s->error[len] = 0;
+}
+
+void _sftp_fail_errno(sftp *s) {
+	const char *msg = strerror(errno);
+	_sftp_fail(s, msg, strlen(msg));
+}
+
+// give up on a session whose packet stream can no longer be trusted
+void _sftp_abort(sftp *s, const char *msg) {
+	_sftp_fail(s, msg, strlen(msg));
+	s->closed = 1;
+	if (s->ch != NULL)
+		channel_close(s->ch);
+}
+
+// start an sftp packet in buf, its length is filled in by _sftp_send
+char *_sftp_begin(char *buf, const char type, const uint32_t id) {
+	buf[4] = type;
+	return buf_put_u32(buf + 5, id);
+}
+
+char *_sftp_put_u64(char *p, uint64_t v) {
+	p = buf_put_u32(p, v >> 32);
+	return buf_put_u32(p, v);
+}
+
+int _sftp_get_u64(const char **p, int *len, uint64_t *out) {
+	uint32_t hi, lo;
+	if (buf_get_u32(p, len, &hi) || buf_get_u32(p, len, &lo))
+		return -1;
+	*out = (uint64_t)hi << 32 | lo;
+	return 0;
+}
+
+// finish the packet started at buf and send it with data_len bytes of data appended
+int _sftp_send(sftp *s, char *buf, char *end, const char *data, size_t data_len) {
+	if (s->ch == NULL)
+		return -1;
+	buf_put_u32(buf, end - buf - 4 + data_len);
+	struct iovec iov[2] = {{buf, end - buf}, {(void *)data, data_len}};
+	return channel_writev(s->ch, iov, data_len ? 2 : 1);
+}
+
+int sftp_step(sftp *s) {
+	if (s->closed || connection_step(s->conn)) {
+		s->closed = 1;
+		_sftp_fail(s, "Connection closed", 17);
+		return -1;
+	}
+	return 0;
+}
+
+// parse a STATUS body, record the message of an error and return the code (-1 if malformed)
+int _sftp_status(sftp *s, const char *p, int len) {
+	uint32_t code;
+	const char *msg;
+	uint32_t msg_len;
+	if (buf_get_u32(&p, &len, &code))
+		return -1;
+	if (code == SSH_FX_OK || code == SSH_FX_EOF)
+		return code;
+	if (buf_get_string(&p, &len, &msg, &msg_len) || msg_len == 0) {
+		msg = code < sizeof(_sftp_messages) / sizeof(char *) ? _sftp_messages[code] : "Failure";
+		msg_len = strlen(msg);
+	}
+	_sftp_fail(s, msg, msg_len);
+	return code;
+}
+
+// write a piece of received data, pieces that continue each other in the file are written together
+void _sftp_flush_file(sftp *s) {
+	struct iovec *iov = s->iov;
+	int cnt = s->iov_cnt;
+	while (cnt && !s->failed) {
+		ssize_t n = pwritev(s->fd, iov, cnt, s->iov_offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			_sftp_fail_errno(s);
+			break;
+		}
+		s->iov_offset += n;
+		while (cnt && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	s->iov_cnt = 0;
+	s->iov_len = 0;
+}
+
+void _sftp_write(sftp *s, const char *data, size_t len, uint64_t offset) {
+	// after an error the replies still in flight are only drained
+	if (s->failed)
+		return;
+	if (s->iov_cnt && (offset != s->iov_offset + s->iov_len || s->iov_cnt == SFTP_IOV_MAX))
+		_sftp_flush_file(s);
+	if (s->iov_cnt == 0) {
+		s->iov_offset = offset;
+		s->iov_len = 0;
+	}
+	s->iov[s->iov_cnt].iov_base = (void *)data;
+	s->iov[s->iov_cnt].iov_len = len;
+	s->iov_cnt++;
+	s->iov_len += len;
+}
+
+// send a READ or WRITE on a transfer slot, reads are collected in the batch
+int _sftp_submit(sftp *s, int slot, uint64_t offset, uint32_t len) {
+	sftp_request *req = &s->reqs[slot];
+	uint32_t id = req->id + s->requests;
+	if (id & SFTP_CONTROL)
+		id = slot;
+	req->id = id;
+	req->offset = offset;
+	req->len = len;
+	if (s->writing) {
+		char buf[32 + SFTP_HANDLE_MAX];
+		char *p = _sftp_begin(buf, SSH_FXP_WRITE, id);
+		p = buf_put_string(p, s->handle, s->handle_len);
+		p = _sftp_put_u64(p, offset);
+		p = buf_put_u32(p, len);
+		return _sftp_send(s, buf, p, s->map + offset, len);
+	}
+	char *buf = s->batch + s->batch_len;
+	char *p = _sftp_begin(buf, SSH_FXP_READ, id);
+	p = buf_put_string(p, s->handle, s->handle_len);
+	p = _sftp_put_u64(p, offset);
+	p = buf_put_u32(p, len);
+	buf_put_u32(buf, p - buf - 4);
+	s->batch_len = p - s->batch;
+	return 0;
+}
+
+void _sftp_release(sftp *s, sftp_request *req) {
+	req->len = 0;
+	s->free_slots[s->free_len++] = req - s->reqs;
+}
+
+// put every free slot to work, reads issued together go out in a single channel packet
+void _sftp_fill(sftp *s) {
+	while (s->free_len && !s->failed && !s->eof && (!s->size_known || s->offset < s->size)) {
+		uint32_t len = SFTP_CHUNK;
+		if (s->size_known && s->size - s->offset < len)
+			len = s->size - s->offset;
+		if (_sftp_submit(s, s->free_slots[s->free_len - 1], s->offset, len)) {
+			_sftp_abort(s, "Connection closed");
+			break;
+		}
+		s->free_len--;
+		s->offset += len;
+	}
+	if (s->batch_len && !s->closed && channel_write(s->ch, s->batch, s->batch_len))
+		_sftp_abort(s, "Connection closed");
+	s->batch_len = 0;
+}
+
+sftp_request *_sftp_request(sftp *s, uint32_t id) {
+	sftp_request *req = &s->reqs[id % s->requests];
+	if (req->id != id || req->len == 0)
+		return NULL;
+	return req;
+}
+
+// the data of a READ reply has been received
+void _sftp_data_done(sftp *s) {
+	sftp_request *req = s->data_req;
+	s->data_req = NULL;
+	s->transferred += s->data_len;
+	// a short read asks again for the rest, an empty one means the file ended early
+	if (s->data_len && s->data_len < req->len && !s->failed) {
+		if (_sftp_submit(s, req - s->reqs, req->offset + s->data_len, req->len - s->data_len))
+			_sftp_abort(s, "Connection closed");
+		return;
+	}
+	if (s->data_len == 0)
+		s->eof = 1;
+	_sftp_release(s, req);
+}
+
+// handle a whole packet other than a READ reply, p starts at the type
+void _sftp_packet(sftp *s, const char *p, int len) {
+	char type = *p++;
+	len--;
+	uint32_t id;
+	if (buf_get_u32(&p, &len, &id)) {
+		_sftp_abort(s, "Bad sftp packet");
+		return;
+	}
+	if (type == SSH_FXP_VERSION) {
+		s->version = id;
+		s->replied = 1;
+		return;
+	}
+	if (id & SFTP_CONTROL) {
+		if (id != s->control_id || s->replied) {
+			_sftp_abort(s, "Unexpected sftp reply");
+			return;
+		}
+		char *tmp = realloc(s->reply, len + 1);
+		if (tmp == NULL) {
+			_sftp_abort(s, "Out of memory");
+			return;
+		}
+		s->reply = tmp;
+		s->reply[0] = type;
+		memcpy(s->reply + 1, p, len);
+		s->reply_len = len + 1;
+		s->replied = 1;
+		return;
+	}
+	sftp_request *req = _sftp_request(s, id);
+	if (req == NULL || type != SSH_FXP_STATUS) {
+		_sftp_abort(s, "Unexpected sftp reply");
+		return;
+	}
+	int code = _sftp_status(s, p, len);
+	if (code == SSH_FX_OK && s->writing) {
+		s->transferred += req->len;
+	} else if (code == SSH_FX_EOF && !s->writing) {
+		s->eof = 1;
+	} else if (code == SSH_FX_OK || code == SSH_FX_EOF) {
+		_sftp_fail(s, _sftp_messages[code], strlen(_sftp_messages[code]));
+	} else if (code < 0) {
+		_sftp_abort(s, "Bad sftp packet");
+		return;
+	}
+	_sftp_release(s, req);
+}
+
+// feed channel data through the packet parser, the data of READ replies goes straight to the file
+void _sftp_input(sftp *s, const char *data, size_t len) {
+	while (len > 0 && !s->closed) {
+		if (s->data_left) {
+			uint32_t n = len < s->data_left ? len : s->data_left;
+			_sftp_write(s, data, n, s->data_req->offset + (s->data_len - s->data_left));
+			s->data_left -= n;
+			data += n;
+			len -= n;
+			if (s->data_left == 0)
+				_sftp_data_done(s);
+			continue;
+		}
+		// gather the length and type, then the header of a READ reply or the whole of any other packet
+		size_t want = 5;
+		uint32_t plen = 0;
+		if (s->in_len >= 5) {
+			const char *p = s->in;
+			int left = s->in_len;
+			buf_get_u32(&p, &left, &plen);
+			if (s->in[4] == SSH_FXP_DATA && plen >= 9) {
+				want = 13;
+			} else if (s->in[4] != SSH_FXP_DATA && plen >= 5 && plen <= SFTP_PACKET_MAX) {
+				want = 4 + plen;
+			} else {
+				_sftp_abort(s, "Bad sftp packet");
+				break;
+			}
+		}
+		size_t n = want - s->in_len;
+		if (n > len)
+			n = len;
+		memcpy(s->in + s->in_len, data, n);
+		s->in_len += n;
+		data += n;
+		len -= n;
+		if (s->in_len < want || want == 5)
+			continue;
+		s->in_len = 0;
+		if (want != 13 || s->in[4] != SSH_FXP_DATA) {
+			_sftp_packet(s, s->in + 4, plen);
+			continue;
+		}
+		const char *p = s->in + 5;
+		int left = 8;
+		uint32_t id, data_len;
+		buf_get_u32(&p, &left, &id);
+		buf_get_u32(&p, &left, &data_len);
+		sftp_request *req = _sftp_request(s, id);
+		if (req == NULL || s->writing || data_len != plen - 9 || data_len > req->len) {
+			_sftp_abort(s, "Unexpected sftp reply");
+			break;
+		}
+		s->data_req = req;
+		s->data_len = data_len;
+		s->data_left = data_len;
+		if (data_len == 0)
+			_sftp_data_done(s);
+	}
+	_sftp_flush_file(s);
+	// replace the requests that completed in this chunk of data in one go
+	if (s->active && !s->closed)
+		_sftp_fill(s);
+}
+
+void _sftp_handler(channel *ch, int event, const char *data, size_t len, void *arg) {
+	sftp *s = arg;
+	switch (event) {
+	case CHANNEL_EV_DATA:
+		_sftp_input(s, data, len);
+		break;
+	case CHANNEL_EV_FAILURE:
+		_sftp_abort(s, "Subsystem request failed");
+		break;
+	case CHANNEL_EV_EOF:
+		s->closed = 1;
+		channel_close(ch);
+		break;
+	case CHANNEL_EV_OPEN_FAILURE:
+	case CHANNEL_EV_CLOSE:
+		s->ch = NULL;
+		s->closed = 1;
+		break;
+	}
+}
+
+// take the next control request id
+uint32_t _sftp_control_id(sftp *s) {
+	s->control_id = SFTP_CONTROL | (s->control_id + 1);
+	s->replied = 0;
+	return s->control_id;
+}
+
+// send a control request and wait for its reply, left in s->reply starting with the type
+int _sftp_control(sftp *s, char *buf, char *end) {
+	if (_sftp_send(s, buf, end, NULL, 0)) {
+		_sftp_fail(s, "Connection closed", 17);
+		return -1;
+	}
+	while (!s->replied)
+		if (sftp_step(s))
+			return -1;
+	return 0;
+}
+
+// wait for a control request answered by a STATUS
+int _sftp_control_status(sftp *s, char *buf, char *end) {
+	if (_sftp_control(s, buf, end))
+		return -1;
+	if (s->reply[0] != SSH_FXP_STATUS) {
+		_sftp_fail(s, "Unexpected sftp reply", 21);
+		return -1;
+	}
+	return _sftp_status(s, s->reply + 1, s->reply_len - 1) == SSH_FX_OK ? 0 : -1;
+}
+
+// open a remote file and keep its handle for the transfer, mode is -1 to leave the permissions to the server
+int _sftp_open(sftp *s, const char *path, const uint32_t flags, const int mode) {
+	size_t path_len = strlen(path);
+	char *buf = malloc(path_len + 32);
+	if (buf == NULL) {
+		_sftp_fail_errno(s);
+		return -1;
+	}
+	char *p = _sftp_begin(buf, SSH_FXP_OPEN, _sftp_control_id(s));
+	p = buf_put_string(p, path, path_len);
+	p = buf_put_u32(p, flags);
+	p = buf_put_u32(p, mode < 0 ? 0 : SSH_FILEXFER_ATTR_PERMISSIONS);
+	if (mode >= 0)
+		p = buf_put_u32(p, mode);
+	int ret = _sftp_control(s, buf, p);
+	free(buf);
+	if (ret)
+		return -1;
+	if (s->reply[0] == SSH_FXP_STATUS) {
+		_sftp_status(s, s->reply + 1, s->reply_len - 1);
+		_sftp_fail(s, "Unexpected sftp reply", 21);
+		return -1;
+	}
+	const char *q = s->reply + 1;
+	int left = s->reply_len - 1;
+	const char *handle;
+	if (s->reply[0] != SSH_FXP_HANDLE || buf_get_string(&q, &left, &handle, &s->handle_len) || s->handle_len > SFTP_HANDLE_MAX) {
+		_sftp_fail(s, "Unexpected sftp reply", 21);
+		return -1;
+	}
+	memcpy(s->handle, handle, s->handle_len);
+	return 0;
+}
+
+// take the size from an ATTRS reply, returns -1 if the server did not include it
+int _sftp_reply_size(sftp *s, uint64_t *size) {
+	if (s->reply[0] != SSH_FXP_ATTRS)
+		return -1;
+	const char *q = s->reply + 1;
+	int left = s->reply_len - 1;
+	uint32_t flags;
+	if (buf_get_u32(&q, &left, &flags) || !(flags & SSH_FILEXFER_ATTR_SIZE) || _sftp_get_u64(&q, &left, size))
+		return -1;
+	return 0;
+}
+
+// learn the size of the open file, failing this the file is read until EOF
+int _sftp_fstat(sftp *s, uint64_t *size) {
+	char buf[16 + SFTP_HANDLE_MAX];
+	char *p = _sftp_begin(buf, SSH_FXP_FSTAT, _sftp_control_id(s));
+	p = buf_put_string(p, s->handle, s->handle_len);
+	if (_sftp_control(s, buf, p))
+		return -1;
+	return _sftp_reply_size(s, size);
+}
+
+int _sftp_close(sftp *s) {
+	char buf[16 + SFTP_HANDLE_MAX];
+	char *p = _sftp_begin(buf, SSH_FXP_CLOSE, _sftp_control_id(s));
+	p = buf_put_string(p, s->handle, s->handle_len);
+	return _sftp_control_status(s, buf, p);
+}
+
+// start keeping every slot busy over [offset, end), or until EOF if the end is not known
+void _sftp_start(sftp *s, uint64_t offset, uint64_t end, const int size_known) {
+	s->offset = offset;
+	s->size = end;
+	s->size_known = size_known;
+	s->transferred = 0;
+	s->eof = 0;
+	s->active = 1;
+	_sftp_fill(s);
+}
+
+int sftp_busy(sftp *s) {
+	return s->active && !s->closed && s->free_len < s->requests;
+}
+
+int sftp_finish(sftp *s) {
+	s->active = 0;
+	if (s->free_len < s->requests)
+		_sftp_fail(s, "Connection closed", 17);
+	if (!s->closed)
+		_sftp_close(s);
+	return s->failed ? -1 : 0;
+}
+
+int sftp_init(sftp *s, connection *conn, int requests) {
+	memset(s, 0, sizeof(sftp));
+	s->conn = conn;
+	s->fd = -1;
+	if (requests <= 0)
+		requests = SFTP_REQUESTS_DEFAULT;
+	if (requests > SFTP_REQUESTS_MAX)
+		requests = SFTP_REQUESTS_MAX;
+	s->requests = requests;
+	s->in = malloc(4 + SFTP_PACKET_MAX);
+	s->reqs = calloc(requests, sizeof(sftp_request));
+	s->free_slots = malloc(requests * sizeof(int));
+	s->batch = malloc(requests * (32 + SFTP_HANDLE_MAX));
+	if (s->in == NULL || s->reqs == NULL || s->free_slots == NULL || s->batch == NULL) {
+		_sftp_fail_errno(s);
+		return -1;
+	}
+	for (int i = 0; i < requests; i++) {
+		// the first request on a slot gets the slot's index as its id
+		s->reqs[i].id = (uint32_t)i - requests;
+		s->free_slots[i] = requests - 1 - i;
+	}
+	s->free_len = requests;
+	s->ch = channel_open(conn, "session", NULL, 0, _sftp_handler, s);
+	if (s->ch == NULL) {
+		_sftp_fail(s, "Could not open channel", 22);
+		return -1;
+	}
+	// the subsystem request and INIT follow the open without waiting for it
+	char buf[16];
+	buf_put_string(buf, "sftp", 4);
+	if (channel_request(s->ch, "subsystem", 1, buf, 8)) {
+		_sftp_abort(s, "Subsystem request failed");
+		return -1;
+	}
+	char *p = _sftp_begin(buf, SSH_FXP_INIT, SFTP_VERSION);
+	if (_sftp_send(s, buf, p, NULL, 0)) {
+		_sftp_abort(s, "Connection closed");
+		return -1;
+	}
+	while (!s->replied)
+		if (sftp_step(s))
+			return -1;
+	if (s->version < SFTP_VERSION) {
+		_sftp_abort(s, "Unsupported sftp version");
+		return -1;
+	}
+	return 0;
+}
+
+int sftp_stat(sftp *s, const char *path, uint64_t *size) {
+	s->failed = 0;
+	size_t path_len = strlen(path);
+	char *buf = malloc(path_len + 16);
+	if (buf == NULL) {
+		_sftp_fail_errno(s);
+		return -1;
+	}
+	char *p = _sftp_begin(buf, SSH_FXP_STAT, _sftp_control_id(s));
+	p = buf_put_string(p, path, path_len);
+	int ret = _sftp_control(s, buf, p);
+	free(buf);
+	if (ret)
+		return -1;
+	if (s->reply[0] == SSH_FXP_STATUS)
+		_sftp_status(s, s->reply + 1, s->reply_len - 1);
+	if (_sftp_reply_size(s, size)) {
+		_sftp_fail(s, "Unexpected sftp reply", 21);
+		return -1;
+	}
+	return 0;
+}
+
+int sftp_create(sftp *s, const char *remote, const int mode) {
+	s->failed = 0;
+	if (_sftp_open(s, remote, SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC, mode))
+		return -1;
+	return _sftp_close(s);
+}
+
+int sftp_get(sftp *s, const char *remote, const char *local) {
+	s->failed = 0;
+	if (_sftp_open(s, remote, SSH_FXF_READ, -1))
+		return -1;
+	// with a known size the whole file is asked for up front instead of reading until EOF
+	uint64_t size = 0;
+	int size_known = _sftp_fstat(s, &size) == 0;
+	if (s->closed)
+		return -1;
+	s->writing = 0;
+	s->fd = open(local, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (s->fd < 0) {
+		_sftp_fail_errno(s);
+	} else {
+		_sftp_start(s, 0, size, size_known);
+		while (sftp_busy(s))
+			if (sftp_step(s))
+				break;
+		if (close(s->fd))
+			_sftp_fail_errno(s);
+		s->fd = -1;
+	}
+	return sftp_finish(s);
+}
+
+int sftp_get_range(sftp *s, const char *remote, int fd, uint64_t offset, uint64_t len) {
+	s->failed = 0;
+	if (_sftp_open(s, remote, SSH_FXF_READ, -1))
+		return -1;
+	s->writing = 0;
+	s->fd = fd;
+	_sftp_start(s, offset, offset + len, 1);
+	return 0;
+}
+
+int sftp_put(sftp *s, const char *local, const char *remote) {
+	s->failed = 0;
+	struct stat st;
+	int fd = open(local, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		_sftp_fail_errno(s);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	uint64_t size = st.st_size;
+	void *map = NULL;
+	if (size) {
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			_sftp_fail_errno(s);
+			close(fd);
+			return -1;
+		}
+		// the kernel reads far ahead of the transfer and drops pages behind it
+		madvise(map, size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	int ret = -1;
+	if (_sftp_open(s, remote, SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC, st.st_mode & 0777) == 0) {
+		s->writing = 1;
+		s->map = map;
+		_sftp_start(s, 0, size, 1);
+		while (sftp_busy(s))
+			if (sftp_step(s))
+				break;
+		ret = sftp_finish(s);
+		s->map = NULL;
+	}
+	if (map != NULL)
+		munmap(map, size);
+	return ret;
+}
+
+int sftp_put_range(sftp *s, const char *map, const char *remote, uint64_t offset, uint64_t len) {
+	s->failed = 0;
+	if (_sftp_open(s, remote, SSH_FXF_WRITE, -1))
+		return -1;
+	s->writing = 1;
+	s->map = map;
+	_sftp_start(s, offset, offset + len, 1);
+	return 0;
+}
+
+void sftp_free(sftp *s) {
+	// wait for the server's close so no event arrives for a freed session
+	if (s->ch != NULL && channel_close(s->ch) == 0)
+		while (s->ch != NULL)
+			if (connection_step(s->conn))
+				break;
+	free(s->in);
+	free(s->reqs);
+	free(s->free_slots);
+	free(s->batch);
+	free(s->reply);
+	s->in = NULL;
+	s->reqs = NULL;
+	s->free_slots = NULL;
+	s->batch = NULL;
+	s->reply = NULL;
+}
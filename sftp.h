@@ -0,0 +1,214 @@
+#pragma once
+
+#include "channel.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// protocol version we speak (draft-ietf-secsh-filexfer-02, what OpenSSH implements)
+#define SFTP_VERSION 3
+// requests kept in flight during a transfer unless configured otherwise
+#define SFTP_REQUESTS_DEFAULT 64
+#define SFTP_REQUESTS_MAX 4096
+// bytes asked for by each READ and carried by each WRITE (the size every server accepts)
+#define SFTP_CHUNK 32768
+// largest sftp packet we accept other than the data of a READ reply
+#define SFTP_PACKET_MAX (64 << 10)
+// largest handle a server may return
+#define SFTP_HANDLE_MAX 256
+// file-contiguous pieces of received data collected before they are written with one pwritev
+#define SFTP_IOV_MAX 64
+// request ids with this bit set are used for open, close and stat, the others identify transfer slots
+#define SFTP_CONTROL 0x80000000u
+
+enum sftp_msg {
+	SSH_FXP_INIT = 1,
+	SSH_FXP_VERSION = 2,
+	SSH_FXP_OPEN = 3,
+	SSH_FXP_CLOSE = 4,
+	SSH_FXP_READ = 5,
+	SSH_FXP_WRITE = 6,
+	SSH_FXP_LSTAT = 7,
+	SSH_FXP_FSTAT = 8,
+	SSH_FXP_STAT = 17,
+	SSH_FXP_STATUS = 101,
+	SSH_FXP_HANDLE = 102,
+	SSH_FXP_DATA = 103,
+	SSH_FXP_NAME = 104,
+	SSH_FXP_ATTRS = 105,
+};
+
+enum sftp_status {
+	SSH_FX_OK = 0,
+	SSH_FX_EOF = 1,
+	SSH_FX_NO_SUCH_FILE = 2,
+	SSH_FX_PERMISSION_DENIED = 3,
+	SSH_FX_FAILURE = 4,
+	SSH_FX_BAD_MESSAGE = 5,
+	SSH_FX_NO_CONNECTION = 6,
+	SSH_FX_CONNECTION_LOST = 7,
+	SSH_FX_OP_UNSUPPORTED = 8,
+};
+
+// open flags
+#define SSH_FXF_READ 0x01
+#define SSH_FXF_WRITE 0x02
+#define SSH_FXF_APPEND 0x04
+#define SSH_FXF_CREAT 0x08
+#define SSH_FXF_TRUNC 0x10
+#define SSH_FXF_EXCL 0x20
+
+// attribute flags
+#define SSH_FILEXFER_ATTR_SIZE 0x01
+#define SSH_FILEXFER_ATTR_UIDGID 0x02
+#define SSH_FILEXFER_ATTR_PERMISSIONS 0x04
+#define SSH_FILEXFER_ATTR_ACMODTIME 0x08
+
+// one READ or WRITE in flight
+typedef struct sftp_request {
+	uint32_t id;
+	uint64_t offset;
+	uint32_t len;
+} sftp_request;
+
+typedef struct sftp {
+	connection *conn;
+	channel *ch;
+	uint32_t version;
+	// the sftp packet being received, only the header of a READ reply
+	char *in;
+	size_t in_len;
+	// data of a READ reply still to come, it goes to the file without being buffered
+	sftp_request *data_req;
+	uint32_t data_len;
+	uint32_t data_left;
+	// received data waiting for pwritev, contiguous in the file from iov_offset
+	struct iovec iov[SFTP_IOV_MAX];
+	int iov_cnt;
+	uint64_t iov_offset;
+	size_t iov_len;
+	// reply to the outstanding control request
+	uint32_t control_id;
+	char *reply;
+	int reply_len;
+	unsigned char replied;
+	// transfer slots, a slot's next request id is its last one plus the number of slots
+	sftp_request *reqs;
+	int requests;
+	int *free_slots;
+	int free_len;
+	// requests of a download are batched into one channel write
+	char *batch;
+	size_t batch_len;
+	// the transfer in progress
+	char handle[SFTP_HANDLE_MAX];
+	uint32_t handle_len;
+	int fd;
+	const char *map;
+	uint64_t offset;
+	uint64_t size;
+	uint64_t transferred;
+	unsigned char active;
+	unsigned char writing;
+	unsigned char size_known;
+	unsigned char eof;
+	unsigned char closed;
+	unsigned char failed;
+	// why the last operation failed
+	char error[256];
+} sftp;
+
+/**
+ * @brief Start the sftp subsystem on a new channel and wait for the server's version
+ * @param sftp The sftp session to initialize
+ * @param conn The connection
+ * @param requests The number of READ or WRITE requests kept in flight, SFTP_REQUESTS_DEFAULT if 0
+ * @return 0 on success, -1 on error (sftp->error says why)
+ */
+int sftp_init(sftp *, connection *, int);
+
+/**
+ * @brief Download a file, replies are written at their offsets in whatever order they arrive
+ * @param sftp The sftp session
+ * @param remote The path on the server
+ * @param local The local path, created or truncated
+ * @return 0 on success, -1 on error (sftp->error says why)
+ */
+int sftp_get(sftp *, const char *, const char *);
+
+/**
+ * @brief Upload a file, it is mapped and sent straight from the page cache
+ * @param sftp The sftp session
+ * @param local The local path
+ * @param remote The path on the server, created or truncated
+ * @return 0 on success, -1 on error (sftp->error says why)
+ */
+int sftp_put(sftp *, const char *, const char *);
+
+/**
+ * @brief Get the size of a remote file
+ * @param sftp The sftp session
+ * @param path The path on the server
+ * @param size Set to the size of the file
+ * @return 0 on success, -1 on error (sftp->error says why)
+ */
+int sftp_stat(sftp *, const char *, uint64_t *);
+
+/**
+ * @brief Create a remote file or truncate it to nothing
+ * @param sftp The sftp session
+ * @param remote The path on the server
+ * @param mode The permissions of a new file
+ * @return 0 on success, -1 on error (sftp->error says why)
+ */
+int sftp_create(sftp *, const char *, const int);
+
+/**
+ * @brief Start downloading a byte range of a remote file into the same range of a local one
+ * @note The transfer runs while the connection does, it is done once sftp_busy returns 0 and sftp_finish collects the result
+ * @param sftp The sftp session
+ * @param remote The path on the server
+ * @param fd The local file, written with positional writes only so several ranges may share it
+ * @param offset The start of the range
+ * @param len The length of the range
+ * @return 0 if the transfer started, -1 on error (sftp->error says why)
+ */
+int sftp_get_range(sftp *, const char *, int, uint64_t, uint64_t);
+
+/**
+ * @brief Start uploading a byte range of a mapped file into the same range of an existing remote file
+ * @note The transfer runs while the connection does, it is done once sftp_busy returns 0 and sftp_finish collects the result
+ * @param sftp The sftp session
+ * @param map The mapped local file, it must stay mapped until sftp_finish
+ * @param remote The path on the server
+ * @param offset The start of the range
+ * @param len The length of the range
+ * @return 0 if the transfer started, -1 on error (sftp->error says why)
+ */
+int sftp_put_range(sftp *, const char *, const char *, uint64_t, uint64_t);
+
+/**
+ * @brief Check whether a started transfer still has requests in flight
+ * @param sftp The sftp session
+ * @return 1 while the transfer runs, 0 once it is complete or has failed
+ */
+int sftp_busy(sftp *);
+
+/**
+ * @brief Receive and handle one packet on the session's connection
+ * @param sftp The sftp session
+ * @return 0 on success, -1 once the connection or the session is gone
+ */
+int sftp_step(sftp *);
+
+/**
+ * @brief Close the remote file of a finished transfer
+ * @param sftp The sftp session
+ * @return 0 if the whole range was transferred, -1 on error (sftp->error says why)
+ */
+int sftp_finish(sftp *);
+
+/**
+ * @brief Close the subsystem channel and free the session
+ * @param sftp The sftp session
+ */
+void sftp_free(sftp *);
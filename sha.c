@@ -105,16 +105,14 @@ void sha256_update(sha256_ctx *ctx, const void *data, size_t len) {
 }
 
 void sha256_final(struct sha256_ctx *ctx, unsigned char *digest) {
+	// Pad the buffer with zeros after the terminating bit
+	memset(ctx->buf + ctx->buflen, 0, 64 - ctx->buflen);
+	ctx->buf[ctx->buflen] = 0x80;
 	// If there is not enough space for the length, digest the block
 	if (ctx->buflen >= 56) {
-		memset(ctx->buf + ctx->buflen, 0, 64 - ctx->buflen);
-		ctx->buf[ctx->buflen] = 0x80;
 		sha256_digest_block(ctx->state, ctx->buf);
 		memset(ctx->buf, 0, 56);
 	}
-	// Pad the buffer with zeros
-	memset(ctx->buf + ctx->buflen, 0, 56 - ctx->buflen);
-	ctx->buf[ctx->buflen] = 0x80;
 	// Append the length of the message
 	ctx->count = __bswap_64(ctx->count << 3);
 	memcpy(ctx->buf + 56, &ctx->count, 8);
@@ -137,3 +135,39 @@ void sha256_digest(const void *data, size_t len, unsigned char *result) {
 	sha256_update(&ctx, data, len);
 	sha256_final(&ctx, result);
 }
+
+void hmac_sha256_init(hmac_sha256_ctx *ctx, const void *key, size_t len) {
+	uint8_t pad[64] = {0};
+	// Keys longer than a block are hashed first
+	if (len > 64)
+		sha256_digest(key, len, pad);
+	else
+		memcpy(pad, key, len);
+	// Hash the inner and outer pads once so each MAC only digests the message
+	for (int i = 0; i < 64; i++)
+		pad[i] ^= 0x36;
+	sha256_init(&ctx->inner);
+	sha256_update(&ctx->inner, pad, 64);
+	for (int i = 0; i < 64; i++)
+		pad[i] ^= 0x36 ^ 0x5c;
+	sha256_init(&ctx->outer);
+	sha256_update(&ctx->outer, pad, 64);
+	memset(pad, 0, 64);
+}
+
+void hmac_sha256_begin(const hmac_sha256_ctx *ctx, sha256_ctx *work) { *work = ctx->inner; }
+
+void hmac_sha256_end(const hmac_sha256_ctx *ctx, sha256_ctx *work, unsigned char *mac) {
+	unsigned char inner[32];
+	sha256_final(work, inner);
+	*work = ctx->outer;
+	sha256_update(work, inner, 32);
+	sha256_final(work, mac);
+}
+
+void hmac_sha256(const hmac_sha256_ctx *ctx, const void *data, size_t len, unsigned char *mac) {
+	sha256_ctx work;
+	hmac_sha256_begin(ctx, &work);
+	sha256_update(&work, data, len);
+	hmac_sha256_end(ctx, &work, mac);
+}
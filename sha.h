@@ -11,6 +11,12 @@ typedef struct sha256_ctx {
 	uint8_t buflen;
 } sha256_ctx;
 
+typedef struct hmac_sha256_ctx {
+	// state after the inner and outer padded keys
+	sha256_ctx inner;
+	sha256_ctx outer;
+} hmac_sha256_ctx;
+
 /**
  * @brief Initialize a SHA256 context
  * @param ctx SHA256 context to initialize
@@ -39,3 +45,35 @@ void sha256_final(struct sha256_ctx *ctx, unsigned char *digest);
  * @param digest Buffer to store digest in
  */
 void sha256_digest(const void *data, size_t len, unsigned char *digest);
+
+/**
+ * @brief Initialize an HMAC-SHA256 key
+ * @param ctx HMAC context to initialize
+ * @param key Key to use
+ * @param len Length of key
+ */
+void hmac_sha256_init(hmac_sha256_ctx *ctx, const void *key, size_t len);
+
+/**
+ * @brief Start a MAC, the message is then fed to work with sha256_update
+ * @param ctx HMAC key
+ * @param work SHA256 context to hash the message in
+ */
+void hmac_sha256_begin(const hmac_sha256_ctx *ctx, sha256_ctx *work);
+
+/**
+ * @brief Finish a MAC started with hmac_sha256_begin
+ * @param ctx HMAC key
+ * @param work SHA256 context the message was hashed in
+ * @param mac Buffer to store the 32 byte MAC in
+ */
+void hmac_sha256_end(const hmac_sha256_ctx *ctx, sha256_ctx *work, unsigned char *mac);
+
+/**
+ * @brief Calculate an HMAC-SHA256 MAC
+ * @param ctx HMAC key
+ * @param data Data to calculate the MAC of
+ * @param len Length of data
+ * @param mac Buffer to store the 32 byte MAC in
+ */
+void hmac_sha256(const hmac_sha256_ctx *ctx, const void *data, size_t len, unsigned char *mac);
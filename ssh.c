@@ -1,321 +1,747 @@
 #include "aes.h"
+#include "autotune.h"
+#include "channel.h"
 #include "chacha.h"
 #include "ec.h"
 #include "ecdsa.h"
+#include "exec.h"
+#include "fanout.h"
+#include "forward.h"
+#include "kex.h"
+#include "mux.h"
 #include "network.h"
+#include "parallel.h"
 #include "random.h"
+#include "sftp.h"
 #include "sha.h"
+#include <netdb.h>
 #include <signal.h>
+#include <stdio.h>
+#include <time.h>
 
 void handler() {
 	fprintf(stderr, "Connection closed by or unable to connect to remote host\n");
 	exit(1);
 }
 
-// supported methods
-char *kex_algos[] = {
-	"ecdh-sha2-nistp256",
-	// "ecdh-sha2-nistp384",
-	// "ecdh-sha2-nistp521",
-	// "diffie-hellman-group-exchange-sha256",
-	// "diffie-hellman-group14-sha256",
-};
-
-char *hostkey_algos[] = {
-	"ecdsa-sha2-nistp256",
-	// "ecdsa-sha2-nistp384",
-	// "ecdsa-sha2-nistp521",
-};
-
-char *enc_algos[] = {
-	"aes128-ctr",
-	// "chacha20-poly1305@openssh.com"
-};
-
-char *mac_algos[] = {
-	"hmac-sha2-256",
-};
-
-char *comp_algos[] = {
-	"none",
-	// "zlib",
-};
+void timeout_handler(event_loop *loop, void *arg) {
+	(void)loop;
+	(void)arg;
+	fprintf(stderr, "Timed out waiting for key exchange\n");
+	exit(1);
+}
 
-int main(int argc, char **argv) {
-	char buf[35000];
+// zlib level asked for with -C or -Z, 0 offers no compression
+int compression_level = 0;
+// limits of one set of keys given with -r
+uint64_t rekey_bytes = KEX_REKEY_BYTES;
+uint32_t rekey_seconds = KEX_REKEY_SECONDS;
+// threads computing AES keystream ahead of the packets given with -H, 0 computes it along with them
+int prefetch_threads = 0;
+
+// a file copied over sftp
+typedef struct transfer {
+	char *src;
+	char *dst;
+	unsigned char put;
+} transfer;
+
+// a port forwarded with -L or -R, [bind:]port:host:hostport
+typedef struct forward_spec {
+	char *bind;
+	char *port;
+	char *host;
+	char *host_port;
+	unsigned char remote;
+} forward_spec;
+
+// one authenticated connection to the server
+typedef struct client {
+	event_loop loop;
+#ifdef USE_IO_URING
+	uring io;
+#endif
+	transport t;
+	kex kex;
+	connection conn;
+	int s;
+} client;
+
+typedef struct session {
+	channel *ch;
+	char *command;
+	int exit_status;
+	unsigned char stdin_polled;
+	unsigned char stdin_eof;
+} session;
+
+void usage() {
+	fprintf(stderr, "usage: ssh [-p port] [-l user] [-W window | -B budget] [-P maxpacket] [-Q requests] [-k streams] [-K connections]\n"
+		"           [-C | -Z level] [-r bytes[:seconds]] [-L [bind:]port:host:hostport] [-R [bind:]port:host:hostport] [-N]\n"
+		"           [-M] [-S ctl_path] [-H threads] [user@]host\n"
+		"           [command | -e command... | -g remote:local... | -u local:remote...]\n"
+		"       ssh -h hosts_file [-j parallel] [-t timeout] [-A] [-p port] [-l user] command\n");
+	exit(255);
+}
+
+// write all of data to a (blocking) file descriptor
+void write_all(int fd, const char *data, size_t len) {
+	while (len) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		data += n;
+		len -= n;
+	}
+}
+
+// forward standard input while the channel has room for it
+void stdin_pump(session *sess) {
+	char data[CHANNEL_PACKET_MAX];
+	while (!sess->stdin_eof) {
+		size_t room = channel_writable(sess->ch);
+		if (room == 0)
+			return;
+		if (room > sizeof(data))
+			room = sizeof(data);
+		ssize_t n = read(0, data, room);
+		if (n > 0) {
+			channel_write(sess->ch, data, n);
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+		sess->stdin_eof = 1;
+		channel_eof(sess->ch);
+	}
+}
+
+void stdin_handler(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)loop;
+	(void)fd;
+	(void)events;
+	stdin_pump(arg);
+}
+
+void session_handler(channel *ch, int event, const char *data, size_t len, void *arg) {
+	session *sess = arg;
+	switch (event) {
+	case CHANNEL_EV_OPEN:
+		if (sess->command != NULL)
+			channel_exec(ch, sess->command, 1);
+		else
+			channel_request(ch, "shell", 1, NULL, 0);
+		stdin_pump(sess);
+		break;
+	case CHANNEL_EV_OPEN_FAILURE:
+		fprintf(stderr, "Server refused to open a session\n");
+		break;
+	case CHANNEL_EV_FAILURE:
+		fprintf(stderr, "Server refused to start the %s\n", sess->command != NULL ? "command" : "shell");
+		channel_close(ch);
+		break;
+	case CHANNEL_EV_DATA:
+		write_all(1, data, len);
+		break;
+	case CHANNEL_EV_EXTENDED_DATA:
+		write_all(2, data, len);
+		break;
+	case CHANNEL_EV_EXIT_STATUS:
+		sess->exit_status = ntohl(*(uint32_t *)data);
+		break;
+	case CHANNEL_EV_EOF:
+		// the command has no more output, close once it has reported its status
+		channel_close(ch);
+		break;
+	case CHANNEL_EV_WRITABLE:
+		stdin_pump(sess);
+		break;
+	}
+}
+
+// split [bind:]port:host:hostport in place
+int parse_forward(char *arg, forward_spec *spec) {
+	char *fields[4];
+	int n = 0;
+	for (char *p = arg; n < 4; p++) {
+		fields[n++] = p;
+		p = strchr(p, ':');
+		if (p == NULL)
+			break;
+		*p = 0;
+	}
+	if (n < 3)
+		return -1;
+	spec->bind = n == 4 ? fields[0] : NULL;
+	spec->port = fields[n - 3];
+	spec->host = fields[n - 2];
+	spec->host_port = fields[n - 1];
+	return 0;
+}
+
+// the password that was accepted, tried first on further connections to the same server
+char *saved_password = NULL;
+
+// authenticate with "none" and fall back to a password prompt
+int userauth(transport *t, const char *user, const char *host) {
+	char buf[1024];
+	char *pkt;
 	int len;
-	int hlen = 0;
-	char tmp[128];
+	// the last password typed in, kept until it is known whether it worked
+	char typed[256] = {0};
 
-	// register signal handlers
-	signal(SIGPIPE, handler);
+	// request the user authentication service
+	buf[0] = SSH_MSG_SERVICE_REQUEST;
+	len = buf_put_string(buf + 1, "ssh-userauth", 12) - buf;
+	if (send_packet(t, buf, len))
+		return -1;
+	do
+		len = recv_packet(t, &pkt);
+	while (len > 0 && (pkt[0] == SSH_MSG_EXT_INFO || pkt[0] == SSH_MSG_IGNORE || pkt[0] == SSH_MSG_DEBUG));
+	if (len < 1 || pkt[0] != SSH_MSG_SERVICE_ACCEPT) {
+		fprintf(stderr, "Expected packet type: SSH_MSG_SERVICE_ACCEPT\n");
+		return -1;
+	}
 
-	// establish connection to server
-	int s = socket(AF_INET, SOCK_STREAM, 0);
-	struct sockaddr_in addr = {0};
-	addr.sin_family = AF_INET;
-	inet_pton(AF_INET, argc == 2 ? argv[1] : "127.0.0.1", &addr.sin_addr);
-	addr.sin_port = htons(argc == 3 ? strtol(argv[2], NULL, 10) : 22);
-	connect(s, (struct sockaddr *)&addr, sizeof(addr));
+	// "none" either succeeds or tells us which methods to try
+	char *p = buf;
+	*p++ = SSH_MSG_USERAUTH_REQUEST;
+	p = buf_put_string(p, user, strlen(user));
+	p = buf_put_string(p, "ssh-connection", 14);
+	p = buf_put_string(p, "none", 4);
+	if (send_packet(t, buf, p - buf))
+		return -1;
+	for (int tries = 0;;) {
+		len = recv_packet(t, &pkt);
+		if (len < 1)
+			break;
+		if (pkt[0] == SSH_MSG_USERAUTH_SUCCESS) {
+			if (saved_password == NULL && typed[0])
+				saved_password = strdup(typed);
+			memset(typed, 0, sizeof(typed));
+			return 0;
+		}
+		if (pkt[0] == SSH_MSG_USERAUTH_BANNER) {
+			const char *q = pkt + 1, *msg;
+			int left = len - 1;
+			uint32_t msg_len;
+			if (buf_get_string(&q, &left, &msg, &msg_len) == 0)
+				write_all(2, msg, msg_len);
+			continue;
+		}
+		if (pkt[0] != SSH_MSG_USERAUTH_FAILURE) {
+			if (pkt[0] == SSH_MSG_IGNORE || pkt[0] == SSH_MSG_DEBUG)
+				continue;
+			fprintf(stderr, "Unexpected packet during authentication\n");
+			break;
+		}
+		const char *q = pkt + 1, *methods;
+		int left = len - 1;
+		uint32_t methods_len;
+		if (buf_get_string(&q, &left, &methods, &methods_len) || !has_name(methods, methods_len, "password") || tries++ == 3) {
+			fprintf(stderr, "Permission denied\n");
+			break;
+		}
+		char *password = saved_password;
+		if (password == NULL || tries > 1) {
+			char prompt[300];
+			snprintf(prompt, sizeof(prompt), "%s@%s's password: ", user, host);
+			password = getpass(prompt);
+			if (password == NULL)
+				break;
+			snprintf(typed, sizeof(typed), "%s", password);
+			memset(password, 0, strlen(password));
+			password = typed;
+		}
+		p = buf;
+		*p++ = SSH_MSG_USERAUTH_REQUEST;
+		p = buf_put_string(p, user, strlen(user));
+		p = buf_put_string(p, "ssh-connection", 14);
+		p = buf_put_string(p, "password", 8);
+		*p++ = 0;
+		p = buf_put_string(p, password, strnlen(password, sizeof(buf) - (p - buf) - 4));
+		int ret = send_packet(t, buf, p - buf);
+		memset(buf, 0, sizeof(buf));
+		if (ret)
+			break;
+	}
+	memset(typed, 0, sizeof(typed));
+	return -1;
+}
+
+// exchange keys and authenticate on a connected transport
+int _client_handshake(client *cl, const char *host, const char *user) {
+	char *pkt;
+	int len;
+
+	// give up if the key exchange does not finish in time
+	event_timer *kex_timer = event_timer_add(&cl->loop, 30000, timeout_handler, NULL);
 
 	// send and receive identification string
-	char *identification = "SSH-2.0-PZSSH_0.1\r\n";
-	send(s, identification, strlen(identification), 0);
-	len = recv(s, buf, sizeof(buf), 0);
-
-	// set the socket to non blocking
-	fcntl(s, F_SETFL, O_NONBLOCK);
-
-	// initialize exchange hash
-	sha256_ctx Hctx;
-	sha256_init(&Hctx);
-	*(int *)tmp = htonl(strlen(identification) - 2);
-	sha256_update(&Hctx, tmp, 4);
-	sha256_update(&Hctx, identification, strlen(identification) - 2);
-	*(int *)tmp = htonl(len - 2);
-	sha256_update(&Hctx, tmp, 4);
-	sha256_update(&Hctx, buf, len - 2);
-
-	// send key exchange init
-	// first byte is packet type
-	buf[0] = 0x14;
-	// next 16 bytes are cookie
-	randbytes(buf + 1, 16);
-	// next 4 bytes are length of kex_algos
-	// ignore for now
-	// copy in kex_algos
-	len = 1 + 16;
-	char *p = buf + 1 + 16 + 4;
-	for (int i = 0; i < sizeof(kex_algos) / sizeof(char *); i++) {
-		if (i != 0)
-			*p++ = ',';
-		strcpy(p, kex_algos[i]);
-		p += strlen(kex_algos[i]);
+	char *identification = "SSH-2.0-PZSSH_0.1";
+	transport_write(&cl->t, identification, strlen(identification));
+	transport_write(&cl->t, "\r\n", 2);
+	len = recv_ident(&cl->t, &pkt);
+	if (len < 0) {
+		fprintf(stderr, "Expected identification string\n");
+		return -1;
 	}
-	// copy in length of kex_algos
-	*(int *)(buf + len) = htonl(p - (buf + len) - 4);
-	len = p - buf;
-	// next 4 bytes are length of hostkey_algos
-	// ignore for now
-	// copy in hostkey_algos
-	p = buf + len + 4;
-	for (int i = 0; i < sizeof(hostkey_algos) / sizeof(char *); i++) {
-		if (i != 0)
-			*p++ = ',';
-		strcpy(p, hostkey_algos[i]);
-		p += strlen(hostkey_algos[i]);
+
+	// keys are exchanged here and again whenever a limit of the current ones is reached
+	if (kex_init(&cl->kex, &cl->t, identification, pkt, len, compression_level))
+		return -1;
+	kex_set_limits(&cl->kex, rekey_bytes, rekey_seconds);
+	if (prefetch_threads)
+		transport_set_prefetch(&cl->t, 1);
+	if (kex_run(&cl->kex)) {
+		fprintf(stderr, "Key exchange failed\n");
+		return -1;
 	}
-	// copy in length of hostkey_algos
-	*(int *)(buf + len) = htonl(p - (buf + len) - 4);
-	len = p - buf;
-	// do the following twice (once for c->s and once for s->c)
-	for (int x = 0; x < 2; x++) {
-		// next 4 bytes are length of enc_algos
-		// ignore for now
-		// copy in enc_algos
-		p = buf + len + 4;
-		for (int i = 0; i < sizeof(enc_algos) / sizeof(char *); i++) {
-			if (i != 0)
-				*p++ = ',';
-			strcpy(p, enc_algos[i]);
-			p += strlen(enc_algos[i]);
+	event_timer_cancel(kex_timer);
+
+	if (userauth(&cl->t, user, host))
+		return -1;
+	// delayed compression starts with the first packet after USERAUTH_SUCCESS in both directions
+	if (cl->kex.compress_ctos && transport_compress(&cl->t, compression_level))
+		return -1;
+	if (cl->kex.compress_stoc && transport_decompress(&cl->t))
+		return -1;
+	return 0;
+}
+
+void client_free(client *cl) {
+	kex_free(&cl->kex);
+	transport_free(&cl->t);
+#ifdef USE_IO_URING
+	if (cl->t.io != NULL)
+		uring_free(&cl->io);
+#endif
+	event_loop_free(&cl->loop);
+	close(cl->s);
+}
+
+// print what a finished copy moved and how fast
+void report_transfer(transfer *tr, uint64_t bytes, double secs) {
+	fprintf(stderr, "%s -> %s: %llu bytes in %.2fs (%.1f MB/s)\n", tr->src, tr->dst, (unsigned long long)bytes, secs, secs > 0 ? bytes / secs / 1e6 : 0);
+}
+
+// connect, exchange keys and authenticate, the transport is ready for the connection layer on success
+int client_connect(client *cl, const char *host, const char *port, const char *user) {
+	// establish connection to server
+	struct addrinfo hints = {0}, *res;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res)) {
+		fprintf(stderr, "Could not resolve hostname %s\n", host);
+		return -1;
+	}
+	int s = -1;
+	for (struct addrinfo *ai = res; ai != NULL && s < 0; ai = ai->ai_next) {
+		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s >= 0 && connect(s, ai->ai_addr, ai->ai_addrlen)) {
+			close(s);
+			s = -1;
 		}
-		// copy in length of enc_algos
-		*(int *)(buf + len) = htonl(p - (buf + len) - 4);
-		len = p - buf;
 	}
-	// do the following twice (once for c->s and once for s->c)
-	for (int x = 0; x < 2; x++) {
-		// next 4 bytes are length of mac_algos
-		// ignore for now
-		// copy in mac_algos
-		p = buf + len + 4;
-		for (int i = 0; i < sizeof(mac_algos) / sizeof(char *); i++) {
-			if (i != 0)
-				*p++ = ',';
-			strcpy(p, mac_algos[i]);
-			p += strlen(mac_algos[i]);
+	freeaddrinfo(res);
+	if (s < 0) {
+		fprintf(stderr, "Unable to connect to %s port %s\n", host, port);
+		return -1;
+	}
+	cl->s = s;
+
+	// the event loop owns the socket from here on
+	event_loop_init(&cl->loop);
+#ifdef USE_IO_URING
+	// fall back to epoll if the kernel does not support io_uring
+	if (uring_init(&cl->io, &cl->loop) == 0)
+		transport_init_uring(&cl->t, &cl->loop, &cl->io, s);
+	else
+#endif
+		transport_init(&cl->t, &cl->loop, s);
+	memset(&cl->kex, 0, sizeof(kex));
+	if (_client_handshake(cl, host, user)) {
+		client_free(cl);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	// parse options
+	char *port = "22";
+	char *user = getenv("USER");
+	uint32_t window = CHANNEL_WINDOW_DEFAULT;
+	uint32_t maxpacket = CHANNEL_PACKET_MAX;
+	// windows follow the measured bandwidth-delay product unless a fixed size is given
+	size_t budget = AUTOTUNE_BUDGET_DEFAULT;
+	// commands given with -e run side by side on their own channels
+	exec_job *jobs = NULL;
+	int jobs_len = 0;
+	// files copied with -g and -u over one sftp session
+	transfer *transfers = NULL;
+	int transfers_len = 0;
+	int requests = SFTP_REQUESTS_DEFAULT;
+	// with -k or -K each file is split into ranges over that many channels and connections
+	int streams = 1;
+	int nclients = 1;
+	// ports forwarded while the rest runs, or on their own with -N
+	forward_spec *forwards = NULL;
+	int forwards_len = 0;
+	int no_command = 0;
+	// with -M the connection is kept open for other invocations, which find it through -S
+	int master = 0;
+	char *control_path = NULL;
+	// with -h the command runs on every host in the file, that many at a time
+	char *hosts_file = NULL;
+	int parallel = FANOUT_PARALLEL_DEFAULT;
+	uint32_t timeout = FANOUT_TIMEOUT_DEFAULT;
+	int ask_password = 0;
+	char *colon;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:l:W:B:P:e:g:u:Q:k:K:L:R:NCZ:r:MS:h:j:t:AH:")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = optarg;
+			break;
+		case 'l':
+			user = optarg;
+			break;
+		case 'W':
+			window = strtoul(optarg, NULL, 10);
+			budget = 0;
+			break;
+		case 'B':
+			budget = strtoull(optarg, NULL, 10);
+			break;
+		case 'P':
+			maxpacket = strtoul(optarg, NULL, 10);
+			break;
+		case 'e':
+			jobs = realloc(jobs, (jobs_len + 1) * sizeof(exec_job));
+			memset(&jobs[jobs_len], 0, sizeof(exec_job));
+			jobs[jobs_len++].command = optarg;
+			break;
+		case 'g':
+		case 'u':
+			colon = strchr(optarg, ':');
+			if (colon == NULL)
+				usage();
+			*colon = 0;
+			transfers = realloc(transfers, (transfers_len + 1) * sizeof(transfer));
+			transfers[transfers_len].src = optarg;
+			transfers[transfers_len].dst = colon + 1;
+			transfers[transfers_len++].put = opt == 'u';
+			break;
+		case 'Q':
+			requests = atoi(optarg);
+			break;
+		case 'k':
+			streams = atoi(optarg);
+			break;
+		case 'K':
+			nclients = atoi(optarg);
+			break;
+		case 'L':
+		case 'R':
+			forwards = realloc(forwards, (forwards_len + 1) * sizeof(forward_spec));
+			if (parse_forward(optarg, &forwards[forwards_len]))
+				usage();
+			forwards[forwards_len++].remote = opt == 'R';
+			break;
+		case 'N':
+			no_command = 1;
+			break;
+		case 'M':
+			master = 1;
+			break;
+		case 'S':
+			control_path = optarg;
+			break;
+		case 'h':
+			hosts_file = optarg;
+			break;
+		case 'j':
+			parallel = atoi(optarg);
+			break;
+		case 't':
+			timeout = strtoul(optarg, NULL, 10);
+			break;
+		case 'A':
+			ask_password = 1;
+			break;
+		case 'C':
+			compression_level = COMPRESS_LEVEL_DEFAULT;
+			break;
+		case 'Z':
+			compression_level = atoi(optarg);
+			if (compression_level < 1 || compression_level > 9)
+				usage();
+			break;
+		case 'H':
+			prefetch_threads = atoi(optarg);
+			if (prefetch_threads < 1)
+				usage();
+			break;
+		case 'r':
+			// bytes[:seconds], 0 for no limit of that kind
+			rekey_bytes = strtoull(optarg, &colon, 10);
+			if (*colon == ':')
+				rekey_seconds = strtoul(colon + 1, NULL, 10);
+			break;
+		default:
+			usage();
 		}
-		// copy in length of mac_algos
-		*(int *)(buf + len) = htonl(p - (buf + len) - 4);
-		len = p - buf;
 	}
-	// do the following twice (once for c->s and once for s->c)
-	for (int x = 0; x < 2; x++) {
-		// next 4 bytes are length of comp_algos
-		// ignore for now
-		// copy in comp_algos
-		p = buf + len + 4;
-		for (int i = 0; i < sizeof(comp_algos) / sizeof(char *); i++) {
-			if (i != 0)
-				*p++ = ',';
-			strcpy(p, comp_algos[i]);
-			p += strlen(comp_algos[i]);
+	if (hosts_file != NULL && (optind >= argc || parallel < 1 || jobs_len || transfers_len || forwards_len || no_command || master))
+		usage();
+	char *host = NULL;
+	if (hosts_file == NULL) {
+		if (optind >= argc)
+			usage();
+		host = argv[optind++];
+		char *at = strrchr(host, '@');
+		if (at != NULL) {
+			*at = 0;
+			user = host;
+			host = at + 1;
 		}
-		// copy in length of comp_algos
-		*(int *)(buf + len) = htonl(p - (buf + len) - 4);
-		len = p - buf;
+		if (user == NULL)
+			usage();
 	}
-	// next 8 bytes are zero for languages
-	memset(buf + len, 0, 8);
-	len += 8;
-	// next 1 byte is boolean for first_kex_packet_follows
-	buf[len++] = 0;
-	// next 4 bytes are 0 by spec
-	memset(buf + len, 0, 4);
-	len += 4;
-	// send packet
-	send_packet(s, buf, len);
-	// add the packet to the exchange hash
-	*(int *)tmp = htonl(len);
-	sha256_update(&Hctx, tmp, 4);
-	sha256_update(&Hctx, buf, len);
-
-	// receive key exchange init
-	len = recv_packet(s, buf);
-	// if the packet type is wrong, exit
-	if (buf[0] != 0x14) {
-		fprintf(stderr, "Expected packet type: SSH_MSG_KEXINIT");
-		return 1;
+	if (streams < 1 || nclients < 1 || nclients > PARALLEL_STREAMS_MAX)
+		usage();
+	if (streams < nclients)
+		streams = nclients;
+	// the rest of the arguments make up the command
+	char *command = NULL;
+	if ((optind < argc || jobs_len) && transfers_len)
+		usage();
+	if (optind < argc && jobs_len)
+		usage();
+	if (no_command && (optind < argc || jobs_len || transfers_len || forwards_len == 0))
+		usage();
+	if (master && (control_path == NULL || optind < argc || jobs_len || transfers_len))
+		usage();
+	if (optind < argc) {
+		size_t command_len = 0;
+		for (int i = optind; i < argc; i++)
+			command_len += strlen(argv[i]) + 1;
+		command = calloc(1, command_len);
+		for (int i = optind; i < argc; i++) {
+			if (i != optind)
+				strcat(command, " ");
+			strcat(command, argv[i]);
+		}
 	}
-	// add the packet to the exchange hash
-	*(int *)tmp = htonl(len);
-	sha256_update(&Hctx, tmp, 4);
-	sha256_update(&Hctx, buf, len);
-
-	// start dh kex
-	// get the buffer ready
-	buf[0] = 0x1e;
-	// next 4 bytes are length of the key
-	// ignore for now
-	len = 5;
-	// generate client private key
-	char x[32];
-	mpz_t mpz_x, n;
-	mpz_inits(mpz_x, n, NULL);
-	EC_init_curve("nistp256");
-	EC_order(n);
-	do {
-		randbytes(x, sizeof(x));
-		mpz_import(mpz_x, sizeof(x), 1, 1, 0, 0, x);
-	} while (mpz_cmp(mpz_x, n) >= 0 || mpz_cmp_ui(mpz_x, 0) == 0);
-	// generate client public key
-	EC_point Q;
-	EC_init_generator(&Q);
-	EC_mul(&Q, &Q, mpz_x);
-	// store client public key
-	len += EC_serialize_point(&Q, buf + len);
-	EC_clear(&Q);
-	mpz_clear(n);
-	// copy in length of key
-	*(int *)(buf + 1) = htonl(len - 5);
-	send_packet(s, buf, len);
-	// store e for adding to the exchange hash
-	memcpy(tmp + 8, buf + 5, len - 5);
-	*(int *)(tmp + 4) = htonl(len - 5);
-
-	// receive server dh kex reply
-	len = recv_packet(s, buf);
-	// if the packet type is wrong, exit
-	if (buf[0] != 0x1f) {
-		fprintf(stderr, "Expected packet type: SSH_MSG_KEXDH_REPLY");
-		return 1;
+
+	// one process and one event loop for all the hosts, instead of a process and a blocking handshake each
+	if (hosts_file != NULL) {
+		signal(SIGPIPE, SIG_IGN);
+		if (kex_pool_init(parallel, 1))
+			fprintf(stderr, "Could not start the key exchange pool\n");
+		char password[256] = {0};
+		if (ask_password) {
+			char *typed = getpass("Password: ");
+			if (typed != NULL) {
+				snprintf(password, sizeof(password), "%s", typed);
+				memset(typed, 0, strlen(typed));
+			}
+		}
+		int exit_status = 255;
+		fanout fo;
+		if (fanout_init(&fo, command, parallel, timeout) == 0) {
+			if (fanout_load(&fo, hosts_file, port, user)) {
+				fprintf(stderr, "Could not read hosts from %s\n", hosts_file);
+			} else {
+				if (password[0])
+					fanout_set_password(&fo, password);
+				fanout_set_window(&fo, window, maxpacket);
+				exit_status = fanout_run(&fo);
+			}
+			fanout_free(&fo);
+		}
+		memset(password, 0, sizeof(password));
+		kex_pool_free();
+		free(command);
+		return exit_status;
 	}
-	// add the server host key to the exchange hash
-	int hostkey_len = ntohl(*(int *)(buf + 1));
-	sha256_update(&Hctx, buf + 1, hostkey_len + 4);
-	// add e to the exchange hash
-	sha256_update(&Hctx, tmp + 4, ntohl(*(int *)(tmp + 4)) + 4);
-	// get the server host key
-	EC_init(&Q);
-	p = buf + 5 + hostkey_len - 65;
-	EC_parse_point(p, 65, &Q);
-	p += 65;
-	// get the server dh public key
-	EC_point f;
-	EC_init(&f);
-	EC_parse_point(p + 4, ntohl(*(int *)p), &f);
-	// add f to the exchange hash
-	*(int *)tmp = htonl(ntohl(*(int *)p));
-	sha256_update(&Hctx, tmp, 4);
-	sha256_update(&Hctx, p + 4, ntohl(*(int *)p));
-	p += 4 + ntohl(*(int *)p);
-	// calculate K
-	EC_mul(&f, &f, mpz_x);
-	mpz_clear(mpz_x);
-	// add K to the exchange hash
-	char K[33];
-	int Klen = (mpz_sizeinbase(f.x, 2) + 8) / 8;
-	mpz_export(K + Klen - 32, NULL, 1, 1, 0, 0, f.x);
-	EC_clear(&f);
-	*(int *)tmp = htonl(Klen);
-	sha256_update(&Hctx, tmp, 4);
-	sha256_update(&Hctx, K, Klen);
-	// finalize the exchange hash
-	unsigned char H[32];
-	sha256_final(&Hctx, H);
-	// get the signature
-	int sig_len = ntohl(*(int *)p);
-	p += 4;
-	p += ntohl(*(int *)p) + 4;
-	// load the host key
-	ECDSA_keypair keypair;
-	ECDSA_init(&keypair);
-	keypair.pubkey = &Q;
-	if (ECDSA_verify(&keypair, H, 32, p)) {
-		fprintf(stderr, "Signature verification failed\n");
-		return 1;
+
+	// a command or shell runs as a channel of a master's connection if one is listening
+	if (control_path != NULL && !master && !jobs_len && !transfers_len && !forwards_len && !no_command) {
+		int status = mux_client(control_path, command);
+		if (status >= 0) {
+			free(command);
+			free(jobs);
+			free(transfers);
+			free(forwards);
+			return status;
+		}
 	}
-	EC_clear(&Q);
-
-	// send new keys
-	buf[0] = 0x15;
-	send_packet(s, buf, 1);
-
-	// receive new keys
-	len = recv_packet(s, buf);
-	// if the packet type is wrong, exit
-	if (buf[0] != 0x15) {
-		fprintf(stderr, "Expected packet type: SSH_MSG_NEWKEYS");
-		return 1;
+
+	// register signal handlers, a master outlives the pipes of its clients
+	signal(SIGPIPE, master ? SIG_IGN : handler);
+	// ephemeral keys for the key exchanges are computed ahead of them on a thread of their own
+	if (kex_pool_init(KEX_POOL_SIZE, 1))
+		fprintf(stderr, "Could not start the key exchange pool\n");
+	// one stream of a fast link is bound by one core's AES rate unless other cores compute its keystream
+	if (prefetch_threads && aes_prefetch_init(prefetch_threads) != AES_SUCCESS)
+		fprintf(stderr, "Could not start the keystream threads\n");
+
+	client cl;
+	if (client_connect(&cl, host, port, user)) {
+		aes_prefetch_free();
+		kex_pool_free();
+		return 255;
 	}
-	// generate new keys
-	sha256_init(&Hctx);
-	*(int *)tmp = htonl(Klen);
-	memcpy(tmp + 4, K, Klen);
-	memcpy(tmp + Klen + 4, H, 32);
-	memcpy(tmp + Klen + 37, H, 32);
-	char ivctos[32];
-	char ivstoc[32];
-	char kctos[32];
-	char kstoc[32];
-	char mctos[32];
-	char mstoc[32];
-	tmp[Klen + 36] = 'A';
-	sha256_digest(tmp, Klen + 69, ivctos);
-	tmp[Klen + 36] = 'B';
-	sha256_digest(tmp, Klen + 69, ivstoc);
-	tmp[Klen + 36] = 'C';
-	sha256_digest(tmp, Klen + 69, kctos);
-	tmp[Klen + 36] = 'D';
-	sha256_digest(tmp, Klen + 69, kstoc);
-	tmp[Klen + 36] = 'E';
-	sha256_digest(tmp, Klen + 69, mctos);
-	tmp[Klen + 36] = 'F';
-	sha256_digest(tmp, Klen + 69, mstoc);
-
-	// initialize ciphers (macs are not implemented yet)
-	// client to server
-	aes_ctx c2s;
-	aes_init(&c2s, kctos, (uint64_t *)ivctos);
-	// server to client
-	aes_ctx s2c;
-	aes_init(&s2c, kstoc, (uint64_t *)ivstoc);
-
-	len = recv_packet_aes(&s2c, s, buf);
-
-	for (int i = 0; i < len; i++)
-		putchar(buf[i]);
 
-	return 0;
+	// open a session and run the command (or a shell) in it
+	connection_init(&cl.conn, &cl.t);
+	connection_set_kex(&cl.conn, &cl.kex);
+	connection_set_window(&cl.conn, window, maxpacket);
+	autotune tuner = {0};
+	if (budget)
+		autotune_init(&tuner, &cl.conn, budget);
+	forward fwd;
+	forward_init(&fwd, &cl.conn, &cl.loop);
+	for (int i = 0; i < forwards_len; i++) {
+		forward_spec *f = &forwards[i];
+		int ret = f->remote ? forward_remote(&fwd, f->bind, atoi(f->port), f->host, f->host_port)
+				    : forward_local(&fwd, f->bind, f->port, f->host, atoi(f->host_port));
+		if (ret)
+			fprintf(stderr, "Could not forward port %s to %s:%s\n", f->port, f->host, f->host_port);
+	}
+	int exit_status = 255;
+	if (master) {
+		// serve other invocations (and the tunnels) until the connection goes away
+		mux mx;
+		if (mux_listen(&mx, &cl.conn, &cl.loop, control_path) == 0) {
+			mux_run(&mx);
+			fprintf(stderr, "Connection to %s closed\n", host);
+		}
+		mux_free(&mx);
+	} else if (no_command) {
+		// nothing but the tunnels, until the connection goes away
+		if (forward_run(&fwd) == 0)
+			exit_status = 0;
+		else
+			fprintf(stderr, "Connection to %s closed\n", host);
+	} else if (transfers_len && streams == 1 && nclients == 1) {
+		// copy the files one after the other, each with the pipeline kept full
+		transport_set_mode(&cl.t, TRANSPORT_BULK);
+		sftp sf;
+		if (sftp_init(&sf, &cl.conn, requests)) {
+			fprintf(stderr, "sftp: %s\n", sf.error);
+		} else {
+			exit_status = 0;
+			for (int i = 0; i < transfers_len; i++) {
+				transfer *tr = &transfers[i];
+				struct timespec start, end;
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				int ret = tr->put ? sftp_put(&sf, tr->src, tr->dst) : sftp_get(&sf, tr->src, tr->dst);
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				if (ret) {
+					fprintf(stderr, "%s: %s\n", tr->src, sf.error);
+					exit_status = 1;
+					continue;
+				}
+				report_transfer(tr, sf.transferred, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+			}
+		}
+		sftp_free(&sf);
+	} else if (transfers_len) {
+		// split each file into ranges moved side by side over several channels and connections
+		transport_set_mode(&cl.t, TRANSPORT_BULK);
+		client *extra = calloc(nclients - 1, sizeof(client));
+		autotune *tuners = calloc(nclients - 1, sizeof(autotune));
+		connection **conns = calloc(nclients, sizeof(connection *));
+		int connected = 0;
+		conns[0] = &cl.conn;
+		while (connected < nclients - 1 && client_connect(&extra[connected], host, port, user) == 0) {
+			client *c = &extra[connected];
+			connection_init(&c->conn, &c->t);
+			connection_set_kex(&c->conn, &c->kex);
+			connection_set_window(&c->conn, window, maxpacket);
+			transport_set_mode(&c->t, TRANSPORT_BULK);
+			if (budget)
+				autotune_init(&tuners[connected], &c->conn, budget);
+			conns[++connected] = &c->conn;
+		}
+		if (connected < nclients - 1)
+			fprintf(stderr, "Using %d of %d connections\n", connected + 1, nclients);
+		exit_status = 0;
+		for (int i = 0; i < transfers_len; i++) {
+			transfer *tr = &transfers[i];
+			parallel_result result;
+			int ret = tr->put ? parallel_put(conns, connected + 1, streams, requests, tr->src, tr->dst, &result)
+					  : parallel_get(conns, connected + 1, streams, requests, tr->src, tr->dst, &result);
+			if (ret) {
+				fprintf(stderr, "%s: %s\n", tr->src, result.error);
+				exit_status = 1;
+				continue;
+			}
+			report_transfer(tr, result.bytes, result.seconds);
+		}
+		for (int i = 0; i < connected; i++) {
+			autotune_free(&tuners[i]);
+			connection_free(&extra[i].conn);
+			client_free(&extra[i]);
+		}
+		free(extra);
+		free(tuners);
+		free(conns);
+	} else if (jobs_len) {
+		// print the output of each command in order, the status is that of the first one to fail
+		if (exec_run(&cl.conn, jobs, jobs_len) == 0)
+			exit_status = 0;
+		else
+			fprintf(stderr, "Connection to %s closed\n", host);
+		for (int i = 0; i < jobs_len; i++) {
+			write_all(1, jobs[i].out, jobs[i].out_len);
+			write_all(2, jobs[i].err, jobs[i].err_len);
+			if (exit_status == 0 && jobs[i].status != 0)
+				exit_status = jobs[i].status < 0 ? 255 : jobs[i].status;
+			exec_job_free(&jobs[i]);
+		}
+	} else {
+		session sess = {0};
+		sess.command = command;
+		sess.exit_status = 255;
+		int stdin_flags = fcntl(0, F_GETFL);
+		if (event_add(&cl.loop, 0, EPOLLIN, stdin_handler, &sess) == 0) {
+			fcntl(0, F_SETFL, stdin_flags | O_NONBLOCK);
+			sess.stdin_polled = 1;
+		}
+		sess.ch = channel_open(&cl.conn, "session", NULL, 0, session_handler, &sess);
+		// a command fed from a pipe or file is a transfer, anything typed is latency bound
+		if (sess.ch != NULL && command != NULL && !isatty(0)) {
+			transport_set_mode(&cl.t, TRANSPORT_BULK);
+		} else if (sess.ch != NULL) {
+			channel_set_priority(sess.ch, CHANNEL_PRIORITY_INTERACTIVE);
+		}
+		if (sess.ch == NULL || connection_run(&cl.conn))
+			fprintf(stderr, "Connection to %s closed\n", host);
+		if (sess.stdin_polled) {
+			event_del(&cl.loop, 0);
+			fcntl(0, F_SETFL, stdin_flags);
+		}
+		exit_status = sess.exit_status;
+	}
+
+	forward_free(&fwd);
+	autotune_free(&tuner);
+	connection_free(&cl.conn);
+	client_free(&cl);
+	aes_prefetch_free();
+	kex_pool_free();
+	free(command);
+	free(jobs);
+	free(transfers);
+	free(forwards);
+
+	return exit_status;
 }
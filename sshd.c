@@ -0,0 +1,122 @@
+#include "server.h"
+
+// the server server_run is serving, for the signal handler
+server *running = NULL;
+
+void stop_handler(int sig) {
+	(void)sig;
+	if (running != NULL)
+		server_stop(running);
+}
+
+void usage() {
+	fprintf(stderr, "usage: sshd -h hostkey (-P password_file | -n) [-b address] [-p port] [-w loops] [-s sftp_server] [-W window] [-c crypto_threads]\n");
+	exit(255);
+}
+
+// the password is the first line of the file
+int read_password(const char *path, char *password, size_t size) {
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	char *line = fgets(password, size, fp);
+	fclose(fp);
+	if (line == NULL)
+		return -1;
+	password[strcspn(password, "\r\n")] = 0;
+	return password[0] ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+	char *hostkey = NULL;
+	char *addr = SERVER_BIND_DEFAULT;
+	char *port = SERVER_PORT_DEFAULT;
+	char *password_file = NULL;
+	char *sftp_server = SERVER_SFTP_DEFAULT;
+	// -n lets anyone in, which is only meant for loopback benchmarks
+	int allow_none = 0;
+	int loops = 0;
+	// handshakes are signed on a pool with a thread per CPU, -1 signs them on the loops
+	int crypto = 0;
+	uint32_t window = CHANNEL_WINDOW_DEFAULT;
+	int opt;
+	while ((opt = getopt(argc, argv, "h:b:p:w:P:ns:W:c:")) != -1) {
+		switch (opt) {
+		case 'h':
+			hostkey = optarg;
+			break;
+		case 'b':
+			addr = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'w':
+			loops = atoi(optarg);
+			break;
+		case 'P':
+			password_file = optarg;
+			break;
+		case 'n':
+			allow_none = 1;
+			break;
+		case 's':
+			sftp_server = optarg;
+			break;
+		case 'W':
+			window = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			crypto = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (hostkey == NULL || optind != argc || loops < 0 || (password_file == NULL) == !allow_none)
+		usage();
+	char password[256] = {0};
+	if (password_file != NULL && read_password(password_file, password, sizeof(password))) {
+		fprintf(stderr, "Could not read a password from %s\n", password_file);
+		return 1;
+	}
+
+	// the private key is in the named file and the public point next to it
+	char *pubkey = malloc(strlen(hostkey) + 5);
+	if (pubkey == NULL)
+		return 1;
+	sprintf(pubkey, "%s.pub", hostkey);
+	ECDSA_init();
+	ECDSA_keypair keypair;
+	ECDSA_init_keypair(&keypair);
+	ECDSA_load_keypair(hostkey, pubkey, &keypair);
+	free(pubkey);
+
+	signal(SIGPIPE, SIG_IGN);
+	// ephemeral keys and signing nonces are made on their own threads, a handshake on a loop is left with one multiply, and
+	// without the threads the loops make them inline, which is slower but still works
+	if (kex_pool_init(SERVER_POOL_SIZE, 1))
+		fprintf(stderr, "Could not start the key exchange pool\n");
+	if (ECDSA_pool_init(SERVER_POOL_SIZE, 1))
+		fprintf(stderr, "Could not start the signing pool\n");
+	server srv;
+	server_init(&srv, &keypair);
+	server_set_auth(&srv, password_file != NULL ? password : NULL, allow_none);
+	server_set_sftp(&srv, sftp_server);
+	server_set_window(&srv, window, CHANNEL_PACKET_MAX);
+	server_set_crypto(&srv, crypto);
+	int ret = server_listen(&srv, addr, port, loops);
+	if (ret == 0) {
+		running = &srv;
+		signal(SIGINT, stop_handler);
+		signal(SIGTERM, stop_handler);
+		ret = server_run(&srv);
+		running = NULL;
+	}
+	server_free(&srv);
+	ECDSA_pool_free();
+	kex_pool_free();
+	ECDSA_free_keypair(&keypair);
+	memset(password, 0, sizeof(password));
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,170 @@
+#include "uring.h"
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int _uring_setup(unsigned entries, struct io_uring_params *p) { return syscall(__NR_io_uring_setup, entries, p); }
+
+int _uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) { return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0); }
+
+int _uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) { return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args); }
+
+void _uring_event(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)loop;
+	(void)events;
+	uring *ring = arg;
+	uint64_t count;
+	// reset the eventfd, the completions themselves are in the ring
+	while (read(fd, &count, sizeof(count)) > 0)
+		;
+	uring_reap(ring);
+}
+
+void _uring_prepare(event_loop *loop, void *arg) {
+	(void)loop;
+	uring_submit(arg);
+}
+
+int uring_init(uring *ring, event_loop *loop) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(uring));
+	ring->fd = _uring_setup(URING_ENTRIES, &p);
+	if (ring->fd < 0)
+		return -1;
+	ring->efd = -1;
+	// map the submission and completion rings
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+		goto fail;
+	ring->sq_head = (void *)((char *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (void *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (void *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (void *)((char *)ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (void *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (void *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (void *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (void *)((char *)ring->cq_ring + p.cq_off.cqes);
+	// register the provided buffers the kernel picks from for receives
+	ring->br_size = (URING_BUFS * sizeof(struct io_uring_buf) + 4095) & ~(size_t)4095;
+	ring->br = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->bufs = mmap(NULL, URING_BUFS * URING_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->br == MAP_FAILED || ring->bufs == MAP_FAILED)
+		goto fail;
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+	ring->br_tail = 0;
+	for (uint16_t i = 0; i < URING_BUFS; i++)
+		uring_buf_recycle(ring, i);
+	// completions wake the event loop through an eventfd
+	ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->efd < 0 || _uring_register(ring->fd, IORING_REGISTER_EVENTFD, &ring->efd, 1) < 0)
+		goto fail;
+	ring->loop = loop;
+	if (event_add(loop, ring->efd, EPOLLIN, _uring_event, ring) || event_prepare_add(loop, _uring_prepare, ring))
+		goto fail;
+	return 0;
+fail:
+	uring_free(ring);
+	return -1;
+}
+
+void uring_free(uring *ring) {
+	if (ring->loop != NULL) {
+		event_del(ring->loop, ring->efd);
+		event_prepare_del(ring->loop, _uring_prepare, ring);
+	}
+	if (ring->efd >= 0)
+		close(ring->efd);
+	if (ring->bufs != NULL && ring->bufs != MAP_FAILED)
+		munmap(ring->bufs, URING_BUFS * URING_BUF_SIZE);
+	if (ring->br != NULL && ring->br != MAP_FAILED)
+		munmap(ring->br, ring->br_size);
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	memset(ring, 0, sizeof(uring));
+	ring->fd = ring->efd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(uring *ring, uring_req *req) {
+	unsigned tail = *ring->sq_tail;
+	// the queue is full, push what we have to the kernel first
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == *ring->sq_mask + 1)
+		uring_submit(ring);
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->user_data = (uint64_t)(uintptr_t)req;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->sq_pending++;
+	return sqe;
+}
+
+int uring_submit(uring *ring) {
+	if (ring->sq_pending == 0)
+		return 0;
+	int res;
+	do
+		res = _uring_enter(ring->fd, ring->sq_pending, 0, 0);
+	while (res < 0 && errno == EINTR);
+	if (res < 0)
+		return -1;
+	ring->sq_pending -= res;
+	return res;
+}
+
+int uring_wait(uring *ring) {
+	int res;
+	do
+		res = _uring_enter(ring->fd, ring->sq_pending, 1, IORING_ENTER_GETEVENTS);
+	while (res < 0 && errno == EINTR);
+	if (res < 0)
+		return -1;
+	ring->sq_pending -= res;
+	return uring_reap(ring);
+}
+
+int uring_reap(uring *ring) {
+	int dispatched = 0;
+	unsigned head = *ring->cq_head;
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		// copy the entry out so the slot can be released before running the callback
+		struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+		__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+		uring_req *req = (uring_req *)(uintptr_t)cqe.user_data;
+		if (req != NULL && req->cb != NULL)
+			req->cb(ring, &cqe, req->arg);
+		dispatched++;
+		head = *ring->cq_head;
+	}
+	return dispatched;
+}
+
+char *uring_buf(uring *ring, uint16_t bid) { return ring->bufs + (size_t)bid * URING_BUF_SIZE; }
+
+void uring_buf_recycle(uring *ring, uint16_t bid) {
+	struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (URING_BUFS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)uring_buf(ring, bid);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	// the tail shares memory with the first entry's reserved field
+	__atomic_store_n(&ring->br->tail, ++ring->br_tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "event.h"
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// number of entries in the submission queue
+#define URING_ENTRIES 256
+// number of provided receive buffers (power of 2) and their size
+#define URING_BUFS 64
+#define URING_BUF_SIZE (1 << 16)
+// buffer group the provided receive buffers are registered as
+#define URING_BGID 0
+
+struct uring;
+
+typedef void (*uring_cb)(struct uring *, const struct io_uring_cqe *, void *);
+
+// completion target, the address of this struct is used as the user_data of a request
+typedef struct uring_req {
+	uring_cb cb;
+	void *arg;
+} uring_req;
+
+typedef struct uring {
+	int fd;
+	// eventfd signalled on completions, this is how the event loop wakes up for the ring
+	int efd;
+	event_loop *loop;
+	// submission queue
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_pending;
+	// completion queue
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	// mappings
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	// provided buffer ring the kernel receives into
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	char *bufs;
+	uint16_t br_tail;
+} uring;
+
+/**
+ * @brief Set up an io_uring and attach it to an event loop
+ * @note Queued requests are submitted together once per event loop iteration
+ * @param ring The ring to initialize
+ * @param loop The event loop that reaps completions
+ * @return 0 on success, -1 if io_uring is unavailable
+ */
+int uring_init(uring *, event_loop *);
+
+/**
+ * @brief Tear down an io_uring
+ * @param ring The ring to free
+ */
+void uring_free(uring *);
+
+/**
+ * @brief Get a zeroed submission queue entry
+ * @note The entry is submitted with the next uring_submit (at the latest when the event loop waits)
+ * @param ring The ring
+ * @param req The completion target
+ * @return The entry
+ */
+struct io_uring_sqe *uring_sqe(uring *, uring_req *);
+
+/**
+ * @brief Submit every queued entry with a single io_uring_enter
+ * @param ring The ring
+ * @return Number of entries submitted, -1 on error
+ */
+int uring_submit(uring *);
+
+/**
+ * @brief Submit queued entries and block until at least one completion has been dispatched
+ * @param ring The ring
+ * @return Number of completions dispatched, -1 on error
+ */
+int uring_wait(uring *);
+
+/**
+ * @brief Dispatch every available completion
+ * @param ring The ring
+ * @return Number of completions dispatched
+ */
+int uring_reap(uring *);
+
+/**
+ * @brief Return a provided receive buffer
+ * @param ring The ring
+ * @param bid The buffer id from the completion
+ * @return The buffer
+ */
+char *uring_buf(uring *, uint16_t);
+
+/**
+ * @brief Hand a provided receive buffer back to the kernel
+ * @param ring The ring
+ * @param bid The buffer id
+ */
+void uring_buf_recycle(uring *, uint16_t);
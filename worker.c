@@ -0,0 +1,280 @@
+#include "worker.h"
+
+// the NUMA node a CPU belongs to, from the nodeN entry sysfs keeps in the CPU's directory
+int _worker_node(int cpu) {
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return -1;
+	int node = -1;
+	struct dirent *ent;
+	while (node < 0 && (ent = readdir(dir)) != NULL)
+		if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9')
+			node = atoi(ent->d_name + 4);
+	closedir(dir);
+	return node;
+}
+
+worker_job *_worker_take(worker_thread *th) {
+	// thieves look at every queue, most are empty and need not be locked to tell
+	if (__atomic_load_n(&th->head, __ATOMIC_RELAXED) == NULL)
+		return NULL;
+	pthread_mutex_lock(&th->lock);
+	worker_job *job = th->head;
+	if (job != NULL) {
+		__atomic_store_n(&th->head, job->next, __ATOMIC_RELAXED);
+		if (th->head == NULL)
+			th->tail = NULL;
+		__atomic_sub_fetch(&th->pool->queued, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&th->lock);
+	return job;
+}
+
+// push onto the inbox of the loop that submitted the job, racing other threads only through the compare and swap
+void _worker_deliver(worker_job *job) {
+	worker_inbox *in = job->inbox;
+	worker_job *head = __atomic_load_n(&in->finished, __ATOMIC_RELAXED);
+	do
+		job->next = head;
+	while (!__atomic_compare_exchange_n(&in->finished, &head, job, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	// only the first completion since the loop last looked needs to wake it
+	if (head == NULL) {
+		uint64_t one = 1;
+		ssize_t n = write(in->efd, &one, sizeof(one));
+		(void)n;
+	}
+}
+
+void *_worker_main(void *arg) {
+	worker_thread *th = arg;
+	worker_pool *wp = th->pool;
+	for (;;) {
+		worker_job *job = NULL;
+		for (int i = 0; i < wp->threads_len && job == NULL; i++)
+			job = _worker_take(&wp->threads[th->order[i]]);
+		if (job != NULL) {
+			job->work(job->arg);
+			_worker_deliver(job);
+			continue;
+		}
+		// announce the sleep before looking at the count, so a submitter either sees a sleeper or we see its job
+		pthread_mutex_lock(&wp->idle_lock);
+		__atomic_add_fetch(&wp->sleepers, 1, __ATOMIC_SEQ_CST);
+		while (wp->running && __atomic_load_n(&wp->queued, __ATOMIC_SEQ_CST) == 0)
+			pthread_cond_wait(&wp->idle_cond, &wp->idle_lock);
+		__atomic_sub_fetch(&wp->sleepers, 1, __ATOMIC_SEQ_CST);
+		int running = wp->running;
+		pthread_mutex_unlock(&wp->idle_lock);
+		if (!running)
+			break;
+	}
+	return NULL;
+}
+
+// wake the threads and wait for the first started of them to return
+void _worker_stop(worker_pool *wp, int started) {
+	pthread_mutex_lock(&wp->idle_lock);
+	wp->running = 0;
+	pthread_cond_broadcast(&wp->idle_cond);
+	pthread_mutex_unlock(&wp->idle_lock);
+	for (int i = 0; i < started; i++)
+		pthread_join(wp->threads[i].thread, NULL);
+}
+
+// free the queues and whatever is still on them
+void _worker_release(worker_pool *wp) {
+	for (int i = 0; i < wp->threads_len; i++) {
+		worker_thread *th = &wp->threads[i];
+		while (th->head != NULL) {
+			worker_job *job = th->head;
+			th->head = job->next;
+			free(job);
+		}
+		pthread_mutex_destroy(&th->lock);
+		free(th->order);
+	}
+	pthread_mutex_destroy(&wp->idle_lock);
+	pthread_cond_destroy(&wp->idle_cond);
+	free(wp->threads);
+	memset(wp, 0, sizeof(worker_pool));
+}
+
+int worker_pool_init(worker_pool *wp, int threads, const cpu_set_t *cpus) {
+	memset(wp, 0, sizeof(worker_pool));
+	if (cpus != NULL && CPU_COUNT(cpus) == 0)
+		cpus = NULL;
+	if (threads <= 0 && cpus != NULL)
+		threads = CPU_COUNT(cpus);
+	if (threads <= 0) {
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		threads = sched_getaffinity(0, sizeof(allowed), &allowed) ? 1 : CPU_COUNT(&allowed);
+	}
+	wp->threads = aligned_alloc(POOL_ALIGN, threads * sizeof(worker_thread));
+	if (wp->threads == NULL)
+		return -1;
+	memset(wp->threads, 0, threads * sizeof(worker_thread));
+	pthread_mutex_init(&wp->idle_lock, NULL);
+	pthread_cond_init(&wp->idle_cond, NULL);
+	wp->threads_len = threads;
+	// threads beyond the CPUs share them in turn
+	int cpu = -1, ok = 1;
+	for (int i = 0; i < threads; i++) {
+		worker_thread *th = &wp->threads[i];
+		th->pool = wp;
+		th->cpu = th->node = -1;
+		if (cpus != NULL) {
+			do
+				cpu = (cpu + 1) % CPU_SETSIZE;
+			while (!CPU_ISSET(cpu, cpus));
+			th->cpu = cpu;
+			th->node = _worker_node(cpu);
+		}
+		pthread_mutex_init(&th->lock, NULL);
+		th->order = malloc(threads * sizeof(int));
+		ok &= th->order != NULL;
+	}
+	if (!ok) {
+		_worker_release(wp);
+		return -1;
+	}
+	// steal from the threads on the same node before reaching across to another one
+	for (int i = 0; i < threads; i++) {
+		worker_thread *th = &wp->threads[i];
+		int n = 0;
+		for (int pass = 0; pass < 2; pass++) {
+			for (int j = 0; j < threads; j++) {
+				int other = (i + j) % threads;
+				if ((wp->threads[other].node == th->node) == (pass == 0))
+					th->order[n++] = other;
+			}
+		}
+	}
+	wp->running = 1;
+	for (int i = 0; i < threads; i++) {
+		worker_thread *th = &wp->threads[i];
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (th->cpu >= 0) {
+			cpu_set_t one;
+			CPU_ZERO(&one);
+			CPU_SET(th->cpu, &one);
+			pthread_attr_setaffinity_np(&attr, sizeof(one), &one);
+		}
+		int err = pthread_create(&th->thread, &attr, _worker_main, th);
+		pthread_attr_destroy(&attr);
+		if (err) {
+			_worker_stop(wp, i);
+			_worker_release(wp);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void worker_pool_free(worker_pool *wp) {
+	if (wp->threads == NULL)
+		return;
+	_worker_stop(wp, wp->threads_len);
+	_worker_release(wp);
+}
+
+// run done for every job that has finished, in the order they were finished
+void _worker_complete(event_loop *loop, int fd, uint32_t events, void *arg) {
+	(void)loop;
+	(void)fd;
+	(void)events;
+	worker_inbox *in = arg;
+	uint64_t count;
+	while (read(in->efd, &count, sizeof(count)) > 0)
+		;
+	worker_job *job = __atomic_exchange_n(&in->finished, NULL, __ATOMIC_ACQUIRE), *ordered = NULL;
+	while (job != NULL) {
+		worker_job *next = job->next;
+		job->next = ordered;
+		ordered = job;
+		job = next;
+	}
+	while (ordered != NULL) {
+		job = ordered;
+		ordered = job->next;
+		in->pending--;
+		if (job->done != NULL)
+			job->done(job->arg);
+		free(job);
+	}
+}
+
+int worker_inbox_init(worker_inbox *in, worker_pool *wp, event_loop *loop, int cpu) {
+	memset(in, 0, sizeof(worker_inbox));
+	if (wp->threads_len == 0)
+		return -1;
+	// the least shared thread on the loop's node, or on any node if none is on it
+	int node = cpu >= 0 ? _worker_node(cpu) : -1, home = -1;
+	for (int pass = 0; pass < 2 && home < 0; pass++) {
+		for (int i = 0; i < wp->threads_len; i++) {
+			if (pass == 0 && (node < 0 || wp->threads[i].node != node))
+				continue;
+			if (home < 0 || wp->threads[i].homes < wp->threads[home].homes)
+				home = i;
+		}
+	}
+	in->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (in->efd < 0)
+		return -1;
+	if (event_add(loop, in->efd, EPOLLIN, _worker_complete, in)) {
+		close(in->efd);
+		return -1;
+	}
+	in->pool = wp;
+	in->loop = loop;
+	in->home = home;
+	wp->threads[home].homes++;
+	return 0;
+}
+
+int worker_submit(worker_inbox *in, worker_fn work, worker_fn done, void *arg) {
+	worker_pool *wp = in->pool;
+	worker_job *job = malloc(sizeof(worker_job));
+	if (job == NULL)
+		return -1;
+	job->work = work;
+	job->done = done;
+	job->arg = arg;
+	job->inbox = in;
+	job->next = NULL;
+	worker_thread *th = &wp->threads[in->home];
+	pthread_mutex_lock(&th->lock);
+	if (th->tail != NULL)
+		th->tail->next = job;
+	else
+		__atomic_store_n(&th->head, job, __ATOMIC_RELAXED);
+	th->tail = job;
+	__atomic_add_fetch(&wp->queued, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&th->lock);
+	in->pending++;
+	// any thread will do, the one woken steals the job if it is not the home thread
+	if (__atomic_load_n(&wp->sleepers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&wp->idle_lock);
+		pthread_cond_signal(&wp->idle_cond);
+		pthread_mutex_unlock(&wp->idle_lock);
+	}
+	return 0;
+}
+
+void worker_inbox_free(worker_inbox *in) {
+	// never initialized
+	if (in->loop == NULL)
+		return;
+	event_del(in->loop, in->efd);
+	close(in->efd);
+	worker_job *job = __atomic_exchange_n(&in->finished, NULL, __ATOMIC_ACQUIRE);
+	while (job != NULL) {
+		worker_job *next = job->next;
+		free(job);
+		job = next;
+	}
+	memset(in, 0, sizeof(worker_inbox));
+}
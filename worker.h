@@ -0,0 +1,117 @@
+#pragma once
+
+#include "event.h"
+#include "pool.h"
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+typedef void (*worker_fn)(void *);
+
+struct worker_inbox;
+struct worker_pool;
+
+typedef struct worker_job {
+	// runs on a worker thread
+	worker_fn work;
+	// runs on the loop that submitted the job once work has returned
+	worker_fn done;
+	void *arg;
+	struct worker_inbox *inbox;
+	struct worker_job *next;
+} worker_job;
+
+// the jobs queued on one worker thread, which the other threads steal from once their own queue is empty, on a cache line of
+// its own so the queue locks do not bounce between cores
+typedef struct worker_thread {
+	struct worker_pool *pool;
+	pthread_t thread;
+	// the CPU the thread is pinned to, -1 if it is not
+	int cpu;
+	// NUMA node of the CPU, -1 if unknown or the thread is not pinned
+	int node;
+	pthread_mutex_t lock;
+	// taken from head, by the owner and by thieves alike
+	worker_job *head;
+	worker_job *tail;
+	// inboxes that queue their jobs here first
+	int homes;
+	// the queues looked at for work, this thread's own first, then the others on its node, then the rest
+	int *order;
+} __attribute__((aligned(POOL_ALIGN))) worker_thread;
+
+// where the finished jobs of one loop arrive, the worker threads push them without taking a lock
+typedef struct worker_inbox {
+	struct worker_pool *pool;
+	event_loop *loop;
+	// finished jobs, newest first
+	worker_job *finished;
+	// written by the thread that finished the first job since the loop last looked
+	int efd;
+	// the thread this loop's jobs are queued on, one on the loop's own node if there is one
+	int home;
+	// jobs submitted whose done has not run yet
+	int pending;
+} worker_inbox;
+
+// threads for blocking or expensive work, shared by every loop that has an inbox on it
+typedef struct worker_pool {
+	worker_thread *threads;
+	int threads_len;
+	// jobs queued on any thread, idle threads sleep while it is 0
+	int queued;
+	int sleepers;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	unsigned char running;
+} worker_pool;
+
+/**
+ * @brief Start a work-stealing pool of threads that run blocking or expensive work off the event loops
+ * @note Threads pinned to the CPUs of pinned loops would take their time slices from the loops, so pass only the CPUs nothing
+ * else is pinned to, or NULL to let the scheduler place the threads
+ * @param wp The pool to initialize
+ * @param threads The number of threads, 0 for one per CPU in cpus (or per CPU the process may run on if cpus is NULL)
+ * @param cpus The CPUs the threads are pinned to in turn, NULL to leave them unpinned
+ * @return 0 on success, -1 on error
+ */
+int worker_pool_init(worker_pool *, int, const cpu_set_t *);
+
+/**
+ * @brief Stop the threads once the work they are running returns and free the pool (does nothing if it was never initialized)
+ * @note Jobs that have not started are dropped without calling done. Must be called before the inboxes are freed
+ * @param wp The pool to free
+ */
+void worker_pool_free(worker_pool *);
+
+/**
+ * @brief Set up delivery of finished jobs to a loop
+ * @note The jobs of the loop are queued on a thread on the same NUMA node as cpu, so they are picked up where the memory they
+ * touch was allocated, and only go to another node when every thread on this one is busy
+ * @param in The inbox to initialize
+ * @param wp The pool
+ * @param loop The loop done is called on
+ * @param cpu The CPU the loop runs on, -1 if it is not pinned
+ * @return 0 on success, -1 on error
+ */
+int worker_inbox_init(worker_inbox *, worker_pool *, event_loop *, int);
+
+/**
+ * @brief Run work on a worker thread, then done on the inbox's loop
+ * @param in The inbox of the submitting loop
+ * @param work Called on a worker thread, must only touch what arg owns
+ * @param done Called on the loop once work has returned, may be NULL
+ * @param arg Passed to both
+ * @return 0 on success, -1 on error
+ */
+int worker_submit(worker_inbox *, worker_fn, worker_fn, void *);
+
+/**
+ * @brief Free an inbox, dropping finished jobs without calling done (does nothing if it was never initialized)
+ * @param in The inbox to free
+ */
+void worker_inbox_free(worker_inbox *);